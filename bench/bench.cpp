@@ -0,0 +1,767 @@
+#include <benchmark/benchmark.h>
+#include <mpi.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "Bittree_BittreeAmr.h"
+#include "Bittree_DistributedTree.h"
+#include "Bittree_Generators.h"
+
+using namespace bittree;
+
+// Microbenchmarks for the hot paths of BitArray, FastBitArray, MortonTree
+// and BittreeAmr. Sizes run from 10^3 to 10^BITTREE_BENCH_MAXEXP blocks
+// (default 6, set it to 8 for the full range). Run through `make bench`,
+// which launches BENCH_NP ranks so refine_reduce sees real communication.
+
+namespace {
+
+  const unsigned seed = 20221015;
+  const unsigned nsamples = 4096;
+
+  /** Bit array of length len with a given density of 1s */
+  std::shared_ptr<FastBitArray> random_bits(unsigned len, double density) {
+    std::mt19937 rng(seed);
+    std::bernoulli_distribution coin(density);
+    FastBitArray::Builder b(len);
+    for(unsigned i=0; i < len; i++)
+      b.write<1>(coin(rng) ? 1u : 0u);
+    return b.finish();
+  }
+
+  enum Pattern { UNIFORM = 0, SHELL = 1 };
+
+  /** Tree of at most nblocks blocks on a cube of top-level blocks sized so
+    * that uniform refinement reaches the target after two levels. Cached,
+    * since the big ones take a while to build. */
+  std::shared_ptr<BittreeAmr> make_tree(unsigned nblocks, int pattern=UNIFORM) {
+    static std::map<std::pair<unsigned,int>, std::shared_ptr<BittreeAmr>> cache;
+    auto key = std::make_pair(nblocks, pattern);
+    auto it = cache.find(key);
+    if(it != cache.end()) return it->second;
+
+    const unsigned per_top = 1u + (1u<<BTDIM) + (1u<<(2*BTDIM));
+    double ntop = std::max(1.0, double(nblocks) / per_top);
+    GeneratorParams p;
+    for(unsigned d=0; d < BTDIM; d++)
+      p.top[d] = unsigned(std::max(1l, std::lround(std::pow(ntop, 1.0/BTDIM))));
+    p.target_blocks = nblocks;
+    p.seed = seed;
+    std::shared_ptr<MortonTree> tree;
+    if(pattern == SHELL) {
+      const double center[3] = {0.5, 0.5, 0.5};
+      tree = generate_shell(p, center, 0.3, 0.01);
+    }
+    else
+      tree = generate_uniform(p);
+    auto amr = std::make_shared<BittreeAmr>(tree);
+    cache[key] = amr;
+    return amr;
+  }
+
+  void BM_BitArray_count(benchmark::State& state) {
+    unsigned len = unsigned(state.range(0));
+    BitArray a(len);
+    auto fast = random_bits(len, 0.5);
+    for(unsigned i=0; i < len; i++) a.set(i, fast->get(i));
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<unsigned> pick(0, len);
+    std::vector<unsigned> ix(2*nsamples);
+    for(auto& x : ix) x = pick(rng);
+    unsigned i = 0;
+    for(auto _ : state) {
+      unsigned a0 = ix[2*i], a1 = ix[2*i+1];
+      benchmark::DoNotOptimize(a.count(std::min(a0,a1), std::max(a0,a1)));
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  void BM_BitArray_find(benchmark::State& state) {
+    unsigned len = unsigned(state.range(0));
+    BitArray a(len);
+    auto fast = random_bits(len, 0.5);
+    for(unsigned i=0; i < len; i++) a.set(i, fast->get(i));
+    IdType pop = a.count();
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<IdType> pick(0, pop-1);
+    std::vector<IdType> nth(nsamples);
+    for(auto& x : nth) x = pick(rng);
+    unsigned i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(a.find(0, nth[i]));
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  void BM_BitArray_count_xor(benchmark::State& state) {
+    unsigned len = unsigned(state.range(0));
+    auto a = random_bits(len, 0.5);
+    auto b = random_bits(len, 0.25);
+    for(auto _ : state)
+      benchmark::DoNotOptimize(BitArray::count_xor(*a, *b, 0, len));
+    state.SetBytesProcessed(state.iterations() * 2 * int64_t(a->word_count()) *
+                            int64_t(sizeof(BitArray::WType)));
+  }
+
+  void BM_FastBitArray_rank(benchmark::State& state) {
+    unsigned len = unsigned(state.range(0));
+    auto a = random_bits(len, 0.5);
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<unsigned> pick(0, len);
+    std::vector<unsigned> ix(nsamples);
+    for(auto& x : ix) x = pick(rng);
+    unsigned i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(a->count(0, ix[i]));
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  void BM_FastBitArray_select(benchmark::State& state) {
+    unsigned len = unsigned(state.range(0));
+    auto a = random_bits(len, 0.5);
+    IdType pop = a->count(0, len);
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<IdType> pick(0, pop-1);
+    std::vector<IdType> nth(nsamples);
+    for(auto& x : nth) x = pick(rng);
+    unsigned i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(a->find(0, nth[i]));
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  void BM_identify(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    unsigned lev = tree->levels()-1;
+    std::mt19937 rng(seed);
+    std::vector<unsigned> coords(BTDIM*nsamples);
+    for(unsigned i=0; i < nsamples; i++)
+      for(unsigned d=0; d < BTDIM; d++)
+        coords[BTDIM*i+d] = std::uniform_int_distribution<unsigned>(
+            0, (tree->top_size(d)<<lev) - 1)(rng);
+    unsigned i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(tree->identify(lev, &coords[BTDIM*i]));
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  void BM_locate(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<IdType> pick(tree->level_id0(0), tree->id_upper_bound()-1);
+    std::vector<IdType> ids(nsamples);
+    for(auto& x : ids) x = pick(rng);
+    unsigned i = 0;
+    for(auto _ : state) {
+      benchmark::DoNotOptimize(tree->locate(ids[i]));
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  void BM_bitid_list(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    std::vector<IdType> out(tree->blocks());
+    for(auto _ : state) {
+      tree->bitid_list(0, tree->blocks(), out.data());
+      benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(tree->blocks()));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Visit every leaf in Morton order */
+  void BM_for_each_leaf(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    for(auto _ : state) {
+      unsigned sum = 0;
+      for_each_leaf(tree->leaf_range(), [&](const MortonTree::Block& b) {
+        sum += b.coord[0];
+      });
+      benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(tree->leaves()));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** The same, split over threads when built with --openmp */
+  void BM_parallel_for_each_leaf(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    std::vector<unsigned> level(tree->id_upper_bound());
+    for(auto _ : state) {
+      parallel_for_each_leaf(tree->leaf_range(), [&](const MortonTree::Block& b) {
+        level[b.id] = b.level;
+      });
+      benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(tree->leaves()));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** List the leaves of every level */
+  void BM_level_leaves(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    std::vector<IdType> out(tree->blocks());
+    for(auto _ : state) {
+      for(unsigned lev=0; lev < tree->levels(); lev++)
+        tree->level_leaves(lev, out.data());
+      benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(tree->blocks()));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Tree of at most nblocks blocks grown from a single top-level block,
+    * so the sibling order decides the whole curve. Cached. */
+  std::shared_ptr<MortonTree> make_curve_tree(unsigned nblocks, int pattern, Curve curve) {
+    static std::map<std::pair<unsigned,int>, std::shared_ptr<MortonTree>> cache;
+    auto key = std::make_pair(nblocks, 2*pattern + int(curve));
+    auto it = cache.find(key);
+    if(it != cache.end()) return it->second;
+
+    GeneratorParams p;
+    p.target_blocks = nblocks;
+    p.seed = seed;
+    p.curve = curve;
+    std::shared_ptr<MortonTree> tree;
+    if(pattern == SHELL) {
+      const double center[3] = {0.5, 0.5, 0.5};
+      tree = generate_shell(p, center, 0.3, 0.01);
+    }
+    else
+      tree = generate_uniform(p);
+    cache[key] = tree;
+    return tree;
+  }
+
+  /** Faces between leaves of different parts when the leaves are cut into
+    * nparts equal runs along the curve. Each face is counted once: from
+    * the finer side, or from the lower side between equal levels. */
+  unsigned cut_faces(const MortonTree& tree, unsigned nparts) {
+    std::vector<unsigned> part(tree.id_upper_bound());
+    const std::uint64_t nleaves = tree.leaves();
+    std::uint64_t k = 0;
+    for_each_leaf(tree.leaf_range(), [&](const MortonTree::Block& b) {
+      part[b.id] = unsigned(k++ * nparts / nleaves);
+    });
+    unsigned cut = 0;
+    for_each_leaf(tree.leaf_range(), [&](const MortonTree::Block& b) {
+      for(unsigned d=0; d < BTDIM; d++) {
+        unsigned x[BTDIM];
+        std::copy(b.coord, b.coord+BTDIM, x);
+        for(unsigned side=0; side < 2; side++) {
+          if(side == 0 && b.coord[d] == 0u) continue;
+          x[d] = side == 0 ? b.coord[d]-1u : b.coord[d]+1u;
+          if(!tree.inside(b.level, x)) continue;
+          MortonTree::Block nb = tree.identify(b.level, x);
+          if(nb.is_parent || (nb.level == b.level && side == 0)) continue;
+          cut += part[nb.id] != part[b.id] ? 1u : 0u;
+        }
+      }
+    });
+    return cut;
+  }
+
+  /** Surface of a 64-way partition cut from Morton and Hilbert order; the
+    * cut_faces counter is what a halo exchange pays for every step */
+  void BM_partition_surface(benchmark::State& state) {
+    const Curve curve = state.range(2) ? Curve::hilbert : Curve::morton;
+    auto tree = make_curve_tree(unsigned(state.range(0)), int(state.range(1)), curve);
+    const unsigned nparts = 64;
+    unsigned cut = 0;
+    for(auto _ : state)
+      benchmark::DoNotOptimize(cut = cut_faces(*tree, nparts));
+    state.SetItemsProcessed(state.iterations() * int64_t(tree->leaves()));
+    state.counters["blocks"] = double(tree->blocks());
+    state.counters["cut_faces"] = cut;
+    state.counters["cut_per_part"] = double(cut) / nparts;
+  }
+
+  /** Morton partition of a tree into nparts equal runs of blocks */
+  std::vector<IdType> even_partition(const MortonTree& tree, unsigned nparts) {
+    std::vector<IdType> part(nparts+1u);
+    for(unsigned r=0; r <= nparts; r++)
+      part[r] = IdType(std::uint64_t(tree.blocks()) * r / nparts);
+    return part;
+  }
+
+  /** Halo setup the way callers did it before halo_graph: identify
+    * across every face, edge and corner of each local leaf, search finer
+    * regions child by child, then group the remote leaves by rank */
+  std::size_t halo_by_identify(const MortonTree& tree, const std::vector<IdType>& part, int rank) {
+    const unsigned ndir = BTDIM==1 ? 3u : BTDIM==2 ? 9u : 27u;
+    auto owner = [&part](IdType mort) {
+      return int(std::upper_bound(part.begin(), part.end(), mort) - part.begin()) - 1;
+    };
+    std::vector<std::pair<int, std::pair<IdType,IdType>>> found;
+    std::function<void(IdType, const MortonTree::Block&, unsigned, unsigned, const unsigned*)> add =
+        [&](IdType id, const MortonTree::Block& nb, unsigned lev, unsigned dir, const unsigned* x) {
+      if(!nb.is_parent) {
+        if(owner(nb.mort) != rank) found.push_back({owner(nb.mort), {id, nb.id}});
+        return;
+      }
+      for(unsigned k=0; k < MortonTree::nkids; k++) {
+        unsigned y[BTDIM], pow3 = 1u;
+        bool adjacent = true;
+        for(unsigned d=0; d < BTDIM; d++, pow3 *= 3u) {
+          const unsigned s = dir/pow3 % 3u, bit = k>>d & 1u;
+          adjacent = adjacent && !(s == 0u && bit == 0u) && !(s == 2u && bit == 1u);
+          y[d] = 2u*x[d] + bit;
+        }
+        if(adjacent) add(id, tree.identify(lev+1u, y), lev+1u, dir, y);
+      }
+    };
+    for_each_leaf(tree.leaf_range(part[size_t(rank)], part[size_t(rank)+1u]),
+                  [&](const MortonTree::Block& b) {
+      for(unsigned dir=0; dir < ndir; dir++) {
+        unsigned x[BTDIM], pow3 = 1u;
+        for(unsigned d=0; d < BTDIM; d++, pow3 *= 3u)
+          x[d] = b.coord[d] + dir/pow3 % 3u - 1u;
+        if(dir == ndir/2u || !tree.inside(b.level, x)) continue;
+        add(b.id, tree.identify(b.level, x), b.level, dir, x);
+      }
+    });
+    std::sort(found.begin(), found.end());
+    return found.size();
+  }
+
+  /** Guard-cell graph of one rank in the middle of a 64-way partition,
+    * by halo_graph (one sweep) or by identify per neighbor */
+  template<bool sweep>
+  void BM_halo(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    const std::vector<IdType> part = even_partition(*tree, 64u);
+    const int rank = 31;
+    std::size_t edges = 0;
+    for(auto _ : state) {
+      if(sweep) edges = tree->halo_graph(part, rank).edges.size();
+      else edges = halo_by_identify(*tree, part, rank);
+      benchmark::DoNotOptimize(edges);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(part[32] - part[31]));
+    state.counters["blocks"] = double(tree->blocks());
+    state.counters["edges"] = double(edges);
+  }
+
+  /** Coarse-fine faces of the middle 1/64 of a tree: computed on a fresh
+    * copy of the tree (the sweep after a regrid), or looked up again (what
+    * every later step pays) */
+  template<bool cached>
+  void BM_coarse_fine_faces(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    const std::vector<IdType> part = even_partition(*tree, 64u);
+    std::vector<char> image(tree->image_size());
+    tree->write_image(image.data());
+    std::size_t faces = 0;
+    for(auto _ : state) {
+      if(!cached) {
+        state.PauseTiming();
+        tree = MortonTree::from_image(std::shared_ptr<void>(), image.data(), image.size());
+        state.ResumeTiming();
+      }
+      faces = tree->coarse_fine_faces(part[31], part[32])->size();
+      benchmark::DoNotOptimize(faces);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(part[32] - part[31]));
+    state.counters["blocks"] = double(tree->blocks());
+    state.counters["faces"] = double(faces);
+  }
+
+  /** Leaves of 2^20 particles in the unit domain, half uniform and half
+    * in a small ball, by one locate_points call or by scaling each point
+    * and calling identify on the finest level */
+  template<bool batch>
+  void BM_locate_points(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    const unsigned n = 1u << 20, lmax = tree->levels() - 1u;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> ball(0.8, 0.01);
+    std::vector<double> xyz(BTDIM*n);
+    for(unsigned i=0; i < n; i++)
+      for(unsigned d=0; d < BTDIM; d++)
+        xyz[BTDIM*i+d] = i % 2u ? ball(rng) : unit(rng);
+    double lo[BTDIM], hi[BTDIM];
+    std::fill(lo, lo+BTDIM, 0.0);
+    std::fill(hi, hi+BTDIM, 1.0);
+    std::vector<IdType> out(n);
+    for(auto _ : state) {
+      if(batch) tree->locate_points(lo, hi, xyz.data(), n, out.data());
+      else
+        for(unsigned i=0; i < n; i++) {
+          unsigned c[BTDIM];
+          for(unsigned d=0; d < BTDIM; d++) {
+            const double cells = double(tree->top_size(d) << lmax);
+            c[d] = unsigned(std::min(std::max(xyz[BTDIM*i+d]*cells, 0.0), cells - 1.0));
+          }
+          out[i] = tree->identify(lmax, c).id;
+        }
+      benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(n));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Leaves intersecting a box over the middle half of the domain in every
+    * dimension, on the finest level: listed or counted by query_box, or
+    * found by identify on every cell of the box */
+  template<int mode>
+  void BM_query_box(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    const unsigned lev = tree->levels() - 1u;
+    unsigned lo[BTDIM], hi[BTDIM];
+    for(unsigned d=0; d < BTDIM; d++) {
+      const unsigned n = tree->top_size(d) << lev;
+      lo[d] = n/4u;
+      hi[d] = n - n/4u - 1u;
+    }
+    std::vector<IdType> out(tree->leaves());
+    IdType found = 0;
+    for(auto _ : state) {
+      if(mode == 0) found = tree->query_box(lev, lo, hi, out.data());
+      else if(mode == 1) found = tree->query_box(lev, lo, hi, nullptr);
+      else {
+        found = 0;
+        unsigned x[BTDIM];
+        std::copy(lo, lo+BTDIM, x);
+        while(true) {
+          const IdType id = tree->identify(lev, x).id;
+          if(found == 0 || out[found-1u] != id) out[found++] = id;
+          unsigned d = 0u;
+          while(d < BTDIM && x[d] == hi[d]) { x[d] = lo[d]; d++; }
+          if(d == BTDIM) break;
+          x[d]++;
+        }
+      }
+      benchmark::DoNotOptimize(found);
+    }
+    state.counters["blocks"] = double(tree->blocks());
+    state.counters["found"] = double(found);
+  }
+
+  /** Structural hash of a tree, what verify_consistent pays per rank, or
+    * the image check_identical serializes and broadcasts instead */
+  template<bool image>
+  void BM_tree_hash(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    std::vector<char> buf(image ? tree->image_size() : 0u);
+    for(auto _ : state) {
+      if(image) tree->write_image(buf.data());
+      else benchmark::DoNotOptimize(tree->hash());
+    }
+    state.SetBytesProcessed(state.iterations() *
+                            int64_t(tree->bits_->word_count() * sizeof(BitArray::WType)));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Per-level counts and coverage of a tree */
+  void BM_tree_stats(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    for(auto _ : state) {
+      TreeStats s = tree->stats();
+      benchmark::DoNotOptimize(s.leaves);
+    }
+    state.counters["blocks"] = double(tree->blocks());
+    state.counters["levels"] = double(tree->levels());
+  }
+
+  /** Leaf topology written to a file: the columnar block file, the VTK
+    * grid, or the text of print_slice over every slice it would take to
+    * cover the domain (skipped beyond 10^4 blocks) */
+  template<int mode>
+  void BM_export(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    if(mode == 2 && tree->blocks() > 10000u) {
+      state.SkipWithError("print_slice is too slow for this size");
+      return;
+    }
+    const std::string path = "bittree_bench_export.bin";
+    double lo[BTDIM], hi[BTDIM];
+    std::fill(lo, lo+BTDIM, 0.0);
+    std::fill(hi, hi+BTDIM, 1.0);
+    for(auto _ : state) {
+      if(mode == 0) tree->export_blocks(path);
+      else if(mode == 1) tree->export_vtk(path, lo, hi);
+      else {
+        const unsigned nslice = BTDIM == 3 ? tree->top_size(BTDIM-1) << (tree->levels()-1) : 1u;
+        std::size_t len = 0u;
+        for(unsigned k=0; k < nslice; k++) len += tree->print_slice(0, k).size();
+        benchmark::DoNotOptimize(len);
+      }
+    }
+    std::remove(path.c_str());
+    state.SetItemsProcessed(state.iterations() * int64_t(tree->leaves()));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Snapshot written to a tree history after refining 1% of the leaves:
+    * the encoded delta, or with the chain broken, a full keyframe */
+  template<bool keyframe>
+  void BM_history_snapshot(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)), int(state.range(1)))->getTree();
+    auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+    delta->fill(false);
+    IdType n = 0u;
+    for(const MortonTree::Block& b : tree->leaf_range())
+      if(n++ % 100u == 0u) delta->set(b.id, true);
+    auto refined = tree->refine(delta);
+    const std::string path = "bittree_bench_history.bin";
+    std::uint64_t bytes = 0u;
+    for(auto _ : state) {
+      state.PauseTiming();
+      TreeHistoryWriter history(path, 1000u);
+      history.snapshot(*tree);
+      state.ResumeTiming();
+      if(!keyframe) history.record(*tree, *delta, *refined);
+      bytes = history.snapshot(*refined);
+    }
+    std::remove(path.c_str());
+    state.counters["bytes"] = double(bytes);
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Top-level grid of about n blocks with no power-of-two sides */
+  void odd_domain(unsigned n, unsigned domain[BTDIM]) {
+    unsigned side = unsigned(std::lround(std::pow(double(n), 1.0/BTDIM)));
+    for(unsigned d=0; d < BTDIM; d++)
+      domain[d] = (side + d) | 1u;
+  }
+
+  template<bool tables>
+  void BM_top_coord_to_mort(benchmark::State& state) {
+    unsigned domain[BTDIM];
+    odd_domain(unsigned(state.range(0)), domain);
+    TopGridT<BTDIM> grid(domain);
+    std::mt19937 rng(seed);
+    std::vector<unsigned> coords(BTDIM*nsamples);
+    for(unsigned i=0; i < nsamples; i++)
+      for(unsigned d=0; d < BTDIM; d++)
+        coords[BTDIM*i+d] = std::uniform_int_distribution<unsigned>(0, domain[d]-1)(rng);
+    unsigned i = 0;
+    for(auto _ : state) {
+      const unsigned* x = &coords[BTDIM*i];
+      benchmark::DoNotOptimize(tables ? grid.coord_to_mort(x) : rect_coord_to_mort(domain, x));
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["boxes"] = grid.box_count();
+  }
+
+  template<bool tables>
+  void BM_top_mort_to_coord(benchmark::State& state) {
+    unsigned domain[BTDIM];
+    odd_domain(unsigned(state.range(0)), domain);
+    TopGridT<BTDIM> grid(domain);
+    unsigned n = 1;
+    for(unsigned d=0; d < BTDIM; d++) n *= domain[d];
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<unsigned> pick(0, n-1);
+    std::vector<unsigned> morts(nsamples);
+    for(auto& m : morts) m = pick(rng);
+    unsigned i = 0;
+    unsigned x[BTDIM];
+    for(auto _ : state) {
+      if(tables) grid.mort_to_coord(morts[i], x);
+      else rect_mort_to_coord(domain, morts[i], x);
+      benchmark::DoNotOptimize(x);
+      i = (i+1) % nsamples;
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  /** Refine 1% of the finest blocks */
+  void BM_refine(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)))->getTree();
+    auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+    delta->fill(false);
+    unsigned lev = tree->levels()-1;
+    for(IdType id=tree->level_id0(lev); id < tree->level_id1(lev); id += 100)
+      delta->set(id, true);
+    for(auto _ : state)
+      benchmark::DoNotOptimize(tree->refine(delta));
+    state.SetItemsProcessed(state.iterations() * int64_t(tree->blocks()));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Remap of a registered per-block payload, as done by refine_update,
+    * with the delta of BM_refine */
+  void BM_block_remap(benchmark::State& state) {
+    auto tree = make_tree(unsigned(state.range(0)))->getTree();
+    auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+    delta->fill(false);
+    unsigned lev = tree->levels()-1;
+    for(IdType id=tree->level_id0(lev); id < tree->level_id1(lev); id += 100)
+      delta->set(id, true);
+    struct Payload { double w[3]; };
+    BlockData<Payload> data;
+    data.resize(tree->id_upper_bound());
+    for(auto _ : state) {
+      data.stage(block_remap<BTDIM>(*tree, delta));
+      benchmark::DoNotOptimize(data.updated().data());
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(sizeof(Payload)) * int64_t(tree->blocks()));
+    state.counters["blocks"] = double(tree->blocks());
+  }
+
+  /** Collective: every rank runs the same fixed number of iterations and
+    * the slowest rank's time is reported. */
+  void BM_refine_reduce(benchmark::State& state) {
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, nranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+    auto amr = make_tree(unsigned(state.range(0)));
+    auto tree = amr->getTree();
+    unsigned lev = tree->levels()-1;
+    for(auto _ : state) {
+      amr->refine_init();
+      for(IdType id=tree->level_id0(lev)+IdType(rank); id < tree->level_id1(lev); id += 997)
+        amr->refine_mark(id, true);
+      MPI_Barrier(comm);
+      double t0 = MPI_Wtime();
+      amr->refine_reduce(comm);
+      double t = MPI_Wtime() - t0;
+      MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, comm);
+      state.SetIterationTime(t);
+    }
+    amr->refine_init(); // leave the cached tree unrefined
+    state.SetBytesProcessed(state.iterations() *
+        int64_t(sizeof(BitArray::WType)) * int64_t((tree->id_upper_bound()+31)/32));
+    state.counters["blocks"] = double(tree->blocks());
+    state.counters["ranks"] = nranks;
+  }
+
+  /** Collective: refinement of the marks of BM_refine_reduce on a tree
+    * partitioned across the ranks, with the marks sent only to the ranks
+    * holding their subtrees. The tree is rebuilt, untimed, before every
+    * iteration. bytes_per_rank is the largest rank's footprint after the
+    * refinement, replicated_bytes that of the refined tree. */
+  void BM_distributed_refine(benchmark::State& state) {
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, nranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+    auto tree = make_tree(unsigned(state.range(0)))->getTree();
+    unsigned lev = tree->levels()-1;
+    // the levels up to the cut are on every rank and a deeper cut splits
+    // the halo into more runs, so cut as high as gives every rank a block
+    unsigned cut = 0u;
+    while(cut+1u < lev && tree->level_blocks(cut) < IdType(nranks)) cut++;
+    std::vector<IdType> marks;
+    auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+    delta->fill(false);
+    for(int r=0; r < nranks; r++) {
+      for(IdType id=tree->level_id0(lev)+IdType(r); id < tree->level_id1(lev); id += 997) {
+        delta->set(id, true);
+        if(r == rank) marks.push_back(id);
+      }
+    }
+    std::uint64_t bytes = 0u;
+    for(auto _ : state) {
+      DistributedTree dt(*tree, cut, comm);
+      MPI_Barrier(comm);
+      double t0 = MPI_Wtime();
+      dt.refine(marks);
+      double t = MPI_Wtime() - t0;
+      MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, comm);
+      state.SetIterationTime(t);
+      bytes = dt.memory_bytes();
+      MPI_Allreduce(MPI_IN_PLACE, &bytes, 1, MPI_UINT64_T, MPI_MAX, comm);
+    }
+    state.counters["blocks"] = double(tree->blocks());
+    state.counters["ranks"] = nranks;
+    state.counters["bytes_per_rank"] = double(bytes);
+    state.counters["replicated_bytes"] = double(tree->refine(delta)->memory_bytes().total());
+  }
+
+}
+
+/** Register the benchmarks for sizes 10^3 .. 10^maxexp. The collective
+  * ones come first and run on every rank. The others are registered only
+  * where all is set, on rank 0, so they are timed while the other ranks
+  * sleep. */
+void register_benchmarks(bool all) {
+  int maxexp = 6;
+  if(const char* env = std::getenv("BITTREE_BENCH_MAXEXP"))
+    maxexp = std::max(3, std::min(8, std::atoi(env)));
+  std::vector<int64_t> sizes;
+  for(int e=3; e <= maxexp; e++) sizes.push_back(int64_t(std::pow(10.0, e)));
+
+  for(int64_t n : sizes)
+    benchmark::RegisterBenchmark("refine_reduce", BM_refine_reduce)
+        ->Arg(n)->Iterations(20)->UseManualTime();
+  for(int64_t n : sizes)
+    benchmark::RegisterBenchmark("distributed_refine", BM_distributed_refine)
+        ->Arg(n)->Iterations(20)->UseManualTime();
+  if(!all) return;
+
+  typedef void (*Fn)(benchmark::State&);
+  const std::vector<std::pair<const char*, Fn>> local = {
+    {"BitArray_count", BM_BitArray_count},
+    {"BitArray_find", BM_BitArray_find},
+    {"BitArray_count_xor", BM_BitArray_count_xor},
+    {"FastBitArray_rank", BM_FastBitArray_rank},
+    {"FastBitArray_select", BM_FastBitArray_select},
+    {"refine", BM_refine},
+    {"block_remap", BM_block_remap},
+    {"rect_coord_to_mort", BM_top_coord_to_mort<false>},
+    {"TopGrid_coord_to_mort", BM_top_coord_to_mort<true>},
+    {"rect_mort_to_coord", BM_top_mort_to_coord<false>},
+    {"TopGrid_mort_to_coord", BM_top_mort_to_coord<true>}};
+  for(const auto& b : local)
+    for(int64_t n : sizes)
+      benchmark::RegisterBenchmark(b.first, b.second)->Arg(n);
+
+  // tree queries, on a uniform tree and on a thin refined shell
+  const std::vector<std::pair<const char*, Fn>> queries = {
+    {"identify", BM_identify},
+    {"locate", BM_locate},
+    {"bitid_list", BM_bitid_list},
+    {"for_each_leaf", BM_for_each_leaf},
+    {"parallel_for_each_leaf", BM_parallel_for_each_leaf},
+    {"level_leaves", BM_level_leaves},
+    {"halo_graph", BM_halo<true>},
+    {"halo_by_identify", BM_halo<false>},
+    {"coarse_fine_faces", BM_coarse_fine_faces<false>},
+    {"coarse_fine_faces_cached", BM_coarse_fine_faces<true>},
+    {"locate_points", BM_locate_points<true>},
+    {"locate_points_by_identify", BM_locate_points<false>},
+    {"query_box", BM_query_box<0>},
+    {"query_box_count", BM_query_box<1>},
+    {"query_box_by_identify", BM_query_box<2>},
+    {"tree_hash", BM_tree_hash<false>},
+    {"write_image", BM_tree_hash<true>},
+    {"tree_stats", BM_tree_stats},
+    {"export_blocks", BM_export<0>},
+    {"export_vtk", BM_export<1>},
+    {"export_by_print_slice", BM_export<2>},
+    {"history_delta", BM_history_snapshot<false>},
+    {"history_keyframe", BM_history_snapshot<true>}};
+  for(const auto& b : queries)
+    for(int pattern : {UNIFORM, SHELL})
+      for(int64_t n : sizes)
+        benchmark::RegisterBenchmark(b.first, b.second)
+            ->Args({n, pattern})->ArgNames({"blocks", "shell"});
+  for(int pattern : {UNIFORM, SHELL})
+    for(int hilbert : {0, 1})
+      for(int64_t n : sizes)
+        benchmark::RegisterBenchmark("partition_surface", BM_partition_surface)
+            ->Args({n, pattern, hilbert})->ArgNames({"blocks", "shell", "hilbert"})
+            ->Unit(benchmark::kMillisecond);
+}
@@ -0,0 +1,64 @@
+#include <benchmark/benchmark.h>
+#include <mpi.h>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+void register_benchmarks(bool all);
+
+namespace {
+  /** Swallows all output. Used on every rank but 0 so that only one
+   *  rank prints and writes the JSON file. */
+  class NullReporter : public benchmark::BenchmarkReporter {
+  public:
+    bool ReportContext(const Context&) override { return true; }
+    void ReportRuns(const std::vector<Run>&) override {}
+  };
+
+  /** Drop --benchmark_out* so that only rank 0 writes the output file */
+  void strip_out_flags(int& argc, char* argv[]) {
+    int n = 0;
+    for(int i=0; i < argc; i++)
+      if(std::strncmp(argv[i], "--benchmark_out", 15) != 0)
+        argv[n++] = argv[i];
+    argc = n;
+  }
+
+  /** Barrier that sleeps instead of spinning, so ranks that are done do
+   *  not compete with rank 0 for the node */
+  void sleeping_barrier(MPI_Comm comm) {
+    MPI_Request req;
+    MPI_Ibarrier(comm, &req);
+    int done = 0;
+    while(!done) {
+      MPI_Test(&req, &done, MPI_STATUS_IGNORE);
+      if(!done) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+        MPI_Init(&argc, &argv);
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+        if(rank != 0) strip_out_flags(argc, argv);
+        ::benchmark::Initialize(&argc, argv);
+        // only rank 0 runs the non-collective benchmarks
+        register_benchmarks(rank == 0);
+
+        if(rank == 0) {
+          ::benchmark::RunSpecifiedBenchmarks();
+        }
+        else {
+          NullReporter display;
+          ::benchmark::RunSpecifiedBenchmarks(&display);
+        }
+        sleeping_barrier(MPI_COMM_WORLD);
+        ::benchmark::Shutdown();
+
+        MPI_Finalize();
+
+        return 0;
+}
@@ -20,6 +20,9 @@
 # To make the test, cd into the build directory and run `make` or `make all`. Then, the test can be run with
 # `make test` and the code coverage report can be generated with `make coverage`.
 #
+# The benchmark suite is set up the same way, `python setup.py bench -d 2`, and
+# run with `make bench` (needs Google Benchmark and an MPI launcher, see Makefile.site).
+#
 # To get a summary of all the command line options, run `python setup.py --help`.
 
 import argparse, sys, os, shutil
@@ -34,6 +37,9 @@ def main():
     parser.add_argument('--debug',action="store_true",help='Set up in debug mode.')
     parser.add_argument('--coverage','-c',action="store_true",help='Enable code coverage.')
     parser.add_argument('--prefix',type=str,help='Where to install library.')
+    parser.add_argument('--instrument',action="store_true",help='Collect refinement timers and counters (BITTREE_INSTRUMENT).')
+    parser.add_argument('--openmp',action="store_true",help='Build with OpenMP (threaded leaf traversals).')
+    parser.add_argument('--id64',action="store_true",help='Use 64-bit block ids and Morton indices (BITTREE_ID64).')
     args = parser.parse_args()
 
     print("Bittree setup")
@@ -98,6 +104,11 @@ def main():
         else:
             f.write("CODECOVERAGE = false\n")
 
+        if args.openmp:
+            f.write("OPENMP = true\n")
+        else:
+            f.write("OPENMP = false\n")
+
         f.write("BTDIM = {}\n".format(args.dim))
 
         f.write("\n")
@@ -119,6 +130,10 @@ def main():
         f.write("#ifndef BITTREE_CONSTANTS_H__\n#define BITTREE_CONSTANTS_H__\n\n")
 
         f.write("#define BTDIM       {}\n".format(args.dim))
+        if args.instrument:
+            f.write("#define BITTREE_INSTRUMENT\n")
+        if args.id64:
+            f.write("#define BITTREE_ID64\n")
 
         f.write("#endif\n")
 
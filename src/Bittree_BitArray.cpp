@@ -18,13 +18,22 @@
 namespace bittree {
 
   /** Constructor. Makes one extra word */
-  BitArray::BitArray(unsigned len)
+  BitArray::BitArray(IdType len)
     : len_(len),
-      wbuf_( (len+bitw)>>logw ) {
+      wown_( (len+bitw)>>logw ),
+      wbuf_(wown_.data()) {
+  }
+
+  /** Constructor over external storage of word_alloc() words, which is
+   *  neither copied nor freed. storage is held to keep it alive. */
+  BitArray::BitArray(IdType len, WType* words, std::shared_ptr<void> storage)
+    : len_(len),
+      storage_(storage),
+      wbuf_(words) {
   }
 
   /**< get value of bit ix */
-  bool BitArray::get(unsigned ix) const {
+  bool BitArray::get(IdType ix) const {
     // wbuf_ is our array of words.
     // Some tricks:
     //   a>>b == a/pow(2,b) and
@@ -45,7 +54,7 @@ namespace bittree {
   }
 
   /**< set value of bit ix */
-  bool BitArray::set(unsigned ix, bool x) {
+  bool BitArray::set(IdType ix, bool x) {
     // w0 means old word value, w1 is new word value
     WType w0 = wbuf_[ix>>logw];
     WType z = x ? WType(0) : ones;
@@ -69,20 +78,29 @@ namespace bittree {
     return w1 != w0;
   }
 
+  /**< set value of bit ix, safe against concurrent set_atomic calls on
+   *   the same word. Returns true if the bit changed. */
+  bool BitArray::set_atomic(IdType ix, bool x) {
+    WType m = one<<(ix&(bitw-1));
+    WType w0 = x ? bitatomic_or(&wbuf_[ix>>logw], m)
+                 : bitatomic_and(&wbuf_[ix>>logw], WType(~m));
+    return ((w0 & m) != 0) != x;
+  }
+
   /** count 1's in whole array */
-  unsigned BitArray::count() const {
+  IdType BitArray::count() const {
     return count(0, len_);
   }
 
   /** count 1's in interval [ix0,ix1)
    * \todo add protection in case of out of bounds */
-  unsigned BitArray::count(unsigned ix0, unsigned ix1) const {
+  IdType BitArray::count(IdType ix0, IdType ix1) const {
     if(ix1 <= ix0) return 0;
-    unsigned iw0 = ix0 >> logw;
-    unsigned iw1 = (std::min(ix1, len_)-1) >> logw;
+    IdType iw0 = ix0 >> logw;
+    IdType iw1 = (std::min(ix1, len_)-1) >> logw;
     WType m = ones << (ix0 & (bitw-1));
-    unsigned pop = 0;
-    for(unsigned iw=iw0; iw <= iw1; iw++) {
+    IdType pop = 0;
+    for(IdType iw=iw0; iw <= iw1; iw++) {
       if(iw == iw1)
         m &= ones >> (bitw-1-((std::min(ix1,len_)-1)&(bitw-1)));
       pop += static_cast<unsigned>(bitpop(wbuf_[iw] & m));
@@ -92,18 +110,18 @@ namespace bittree {
   }
 
   /** count 1's in either a or b */
-  unsigned BitArray::count_xor(const BitArray& a, const BitArray& b,
-                               unsigned ix0, unsigned ix1) {
+  IdType BitArray::count_xor(const BitArray& a, const BitArray& b,
+                             IdType ix0, IdType ix1) {
     if(ix1 <= ix0) return 0;
-    unsigned a_ix1 = std::min(ix1, a.len_);
-    unsigned b_ix1 = std::min(ix1, b.len_);
-    unsigned a_iw1 = (a_ix1 + bitw-1) >> logw;
-    unsigned b_iw1 = (b_ix1 + bitw-1) >> logw;
-    unsigned iw0 = ix0 >> logw;
-    unsigned iw1 = std::max(a_iw1, b_iw1);
+    IdType a_ix1 = std::min(ix1, a.len_);
+    IdType b_ix1 = std::min(ix1, b.len_);
+    IdType a_iw1 = (a_ix1 + bitw-1) >> logw;
+    IdType b_iw1 = (b_ix1 + bitw-1) >> logw;
+    IdType iw0 = ix0 >> logw;
+    IdType iw1 = std::max(a_iw1, b_iw1);
     WType m = ones << (ix0 & (bitw-1));
-    unsigned pop = 0;
-    for(unsigned iw=iw0; iw < iw1; iw++) {
+    IdType pop = 0;
+    for(IdType iw=iw0; iw < iw1; iw++) {
       WType aw = iw < a_iw1 ? a.wbuf_[iw] : WType(0);
       aw &= ones >> (iw+1 < a_iw1 ? 0 : bitw-1-((a_ix1-1)&(bitw-1)));
       WType bw = iw < b_iw1 ? b.wbuf_[iw] : WType(0);
@@ -114,14 +132,32 @@ namespace bittree {
     return pop;
   }
 
-  unsigned BitArray::find(unsigned ix0, unsigned nth) const {
-    unsigned iw = ix0 >> logw;
+  /** count 1's in both a and b */
+  IdType BitArray::count_and(const BitArray& a, const BitArray& b,
+                             IdType ix0, IdType ix1) {
+    ix1 = std::min(ix1, std::min(a.len_, b.len_));
+    if(ix1 <= ix0) return 0;
+    IdType iw0 = ix0 >> logw;
+    IdType iw1 = (ix1-1) >> logw;
+    WType m = ones << (ix0 & (bitw-1));
+    IdType pop = 0;
+    for(IdType iw=iw0; iw <= iw1; iw++) {
+      if(iw == iw1)
+        m &= ones >> (bitw-1-((ix1-1)&(bitw-1)));
+      pop += static_cast<unsigned>(bitpop(m & a.wbuf_[iw] & b.wbuf_[iw]));
+      m = ones;
+    }
+    return pop;
+  }
+
+  IdType BitArray::find(IdType ix0, IdType nth) const {
+    IdType iw = ix0 >> logw;
     WType m = ones << (ix0&(bitw-1));
     while(true) {
       if(iw >= len_>>logw)
         m &= ones >> (bitw-1-((len_-1)&(bitw-1)));
       WType w = m & wbuf_[iw];
-      unsigned pop = static_cast<unsigned>(bitpop(w));
+      IdType pop = static_cast<unsigned>(bitpop(w));
       if(pop > nth) {
         while(nth--)
           w &= w - 1;
@@ -133,6 +169,30 @@ namespace bittree {
     }
   }
 
+  /** Write the index of every bit equal to x in [ix0,ix1) to out, in
+   *  increasing order, and return how many there were. Words are scanned
+   *  with ctz, so the cost is one step per word plus one per index. */
+  IdType BitArray::list(bool x, IdType ix0, IdType ix1, IdType* out) const {
+    ix1 = std::min(ix1, len_);
+    if(ix1 <= ix0) return 0;
+    IdType iw0 = ix0 >> logw;
+    IdType iw1 = (ix1-1) >> logw;
+    WType z = x ? WType(0) : ones;
+    WType m = ones << (ix0 & (bitw-1));
+    IdType n = 0;
+    for(IdType iw=iw0; iw <= iw1; iw++) {
+      if(iw == iw1)
+        m &= ones >> (bitw-1-((ix1-1)&(bitw-1)));
+      WType w = m & (z ^ wbuf_[iw]);
+      while(w) {
+        out[n++] = (iw<<logw) + static_cast<unsigned>(bitffs(w)) - 1u;
+        w &= w - 1;
+      }
+      m = ones;
+    }
+    return n;
+  }
+
   /** Fill whole Bit Array */
   void BitArray::fill(bool x) {
     fill(x, 0, len_);
@@ -140,12 +200,12 @@ namespace bittree {
 
   /** Fill part of Bit Array
    * \todo bounds check*/
-  void BitArray::fill(bool x, unsigned ix0, unsigned ix1) {
+  void BitArray::fill(bool x, IdType ix0, IdType ix1) {
     if(ix0 >= ix1) return;
-    unsigned iw0 = ix0 >> logw, iw1 = (ix1-1) >> logw;
+    IdType iw0 = ix0 >> logw, iw1 = (ix1-1) >> logw;
     WType z = x ? WType(0) : ones;
     WType m = ones << (ix0 & (bitw-1));
-    for(unsigned iw=iw0; iw <= iw1; iw++) {
+    for(IdType iw=iw0; iw <= iw1; iw++) {
       if(iw == iw1)
         m &= ones >> (bitw-1-((ix1-1)&(bitw-1)));
       wbuf_[iw] = z ^ ((z ^ wbuf_[iw]) | m);
@@ -154,7 +214,7 @@ namespace bittree {
   }
 
   /** Constructor */
-  BitArray::Reader::Reader(std::shared_ptr<const BitArray> host, unsigned ix0):
+  BitArray::Reader::Reader(std::shared_ptr<const BitArray> host, IdType ix0):
     a_(host),
     w_(host->wbuf_[0]),
     ix_(0) {
@@ -169,7 +229,7 @@ namespace bittree {
       ans = (w_>>(ix_&(bitw-1u))) & ((one<<n)-1u);
     else {
       ans = w_>>(ix_&(bitw-1u));
-      w_ = ((ix_+n)&~(bitw-1u)) < a_->len_ ? a_->wbuf_[(ix_>>logw)+1] : WType(0);
+      w_ = ((ix_+n)&~IdType(bitw-1u)) < a_->len_ ? a_->wbuf_[(ix_>>logw)+1] : WType(0);
       ans |= (w_ & ((one<<((ix_+n)&(bitw-1u)))-1u)) << (bitw-(ix_&(bitw-1u)));
     }
     ix_ += n;
@@ -177,13 +237,13 @@ namespace bittree {
   }
  
   /** Search for ix in array */
-  void BitArray::Reader::seek(unsigned ix) {
+  void BitArray::Reader::seek(IdType ix) {
     w_ = a_->wbuf_[ix>>logw] ;
     ix_ = ix;
   }
 
   /** Constructor */
-  BitArray::Writer::Writer(std::shared_ptr<BitArray> host, unsigned ix0)
+  BitArray::Writer::Writer(std::shared_ptr<BitArray> host, IdType ix0)
    :a_(host),
     w_(host->wbuf_[0]),
     ix_(0) {
@@ -191,7 +251,7 @@ namespace bittree {
   }
 
   /** Search for ix in array */
-  void BitArray::Writer::seek(unsigned ix) {
+  void BitArray::Writer::seek(IdType ix) {
     w_ = a_->wbuf_[ix>>logw] ;
     ix_ = ix;
   }
@@ -227,16 +287,24 @@ namespace bittree {
 
   /** Constructor for FastBitArray.
     */
-  FastBitArray::FastBitArray(unsigned len):
+  FastBitArray::FastBitArray(IdType len):
     BitArray(len),
-    chks_(len>>logc) {
+    chks_own_(len>>logc),
+    chks_(chks_own_.data()) {
+  }
+
+  /** Constructor over external words and checkpoints (see BitArray) */
+  FastBitArray::FastBitArray(IdType len, WType* words, IdType* chks,
+                             std::shared_ptr<void> storage):
+    BitArray(len, words, storage),
+    chks_(chks) {
   }
 
-  FastBitArray::Builder::Builder(unsigned len):
+  FastBitArray::Builder::Builder(IdType len):
     a_(std::make_shared<FastBitArray>(len)),
     w_(BitArray::Writer(a_, 0)),
     chkpop_(0),
-    pchk_(a_->chks_.data()) {
+    pchk_(a_->chks_) {
   }
 
   /** Wraps BitArray::Writer::write<n>, but also tracks cumulative
@@ -247,7 +315,7 @@ namespace bittree {
     */
   template<unsigned n>
   void FastBitArray::Builder::write(WType x) {
-    unsigned ix = w_.index();
+    IdType ix = w_.index();
     // NOTE: ix&(bitc-1u) = ix mod bitc
     // So this checks if the current index is within n bits
     //   of a checkpoint (where ix mod bitc = 0, ix/bitc = k).
@@ -274,33 +342,35 @@ namespace bittree {
   /** A theoretically faster algorithm for count making use of the cached cumulative pops
     * \todo Performance testing
     */
-  unsigned FastBitArray::count(unsigned ix0, unsigned ix1) const {
+  IdType FastBitArray::count(IdType ix0, IdType ix1) const {
+    // Like BitArray::count, bits past the end count as 0
+    ix1 = std::min(ix1, len_);
     // If ix0 and ix1 are separated by over bitc bits, can use the chks_ array
     // to shorten the length to count.
     if(ix1>>logc > ix0>>logc) {
       // pop0 = total count up to next multiple of bitc (inclusive)
       // pop1 = total count up to previous multiple of bitc (exclusive)
-      unsigned pop0 = ix0 == 0 ? 0 : chks_[((ix0+bitc-1u)>>logc)-1];
-      unsigned pop1 = chks_[(ix1>>logc)-1];
+      IdType pop0 = ix0 == 0 ? 0 : chks_[((ix0+bitc-1u)>>logc)-1];
+      IdType pop1 = chks_[(ix1>>logc)-1];
       // (ix0+bitc-1u) & ~(bitc-1u) = the next multiple of bitc (inclusive)
       // ix1 & ~(bitc-1u) = the prevoius multiple of bitc (exclusive)
       return
-        BitArray::count(ix0, (ix0+bitc-1u) & ~(bitc-1u)) +
+        BitArray::count(ix0, (ix0+bitc-1u) & ~IdType(bitc-1u)) +
         (pop1 - pop0) +
-        BitArray::count(ix1 & ~(bitc-1u), ix1);
+        BitArray::count(ix1 & ~IdType(bitc-1u), ix1);
     }
     else
       return BitArray::count(ix0, ix1);
   }
 
-  unsigned FastBitArray::find(unsigned ix0, unsigned nth) const {
-    unsigned pop0 = count(0, ix0);
-    unsigned a = (ix0+bitc-1u)>>logc;
-    unsigned b = len_>>logc;
+  IdType FastBitArray::find(IdType ix0, IdType nth) const {
+    IdType pop0 = count(0, ix0);
+    IdType a = (ix0+bitc-1u)>>logc;
+    IdType b = len_>>logc;
     if(a <= b && (a==0 ? 0 : chks_[a-1]) - pop0 <= nth) {
       // binary search of interval [a,b] (both inclusive)
       while(a + 10 < b) {
-        unsigned x = (a+b)>>1;
+        IdType x = (a+b)>>1;
         if(pop0 + nth < chks_[x-1]) // x cant be 0
           b = x-1;
         else
@@ -44,33 +44,44 @@ namespace bittree {
     static const WType ones = ~WType(0);  /**< Maximum length string of binary 1s cast as WType */
 
     // Static Functions
-    static unsigned count_xor(const BitArray& a, const BitArray& b,
-                              unsigned ix0, unsigned ix1);
+    static IdType count_xor(const BitArray& a, const BitArray& b,
+                            IdType ix0, IdType ix1);
+    static IdType count_and(const BitArray& a, const BitArray& b,
+                            IdType ix0, IdType ix1);
 
   public:
     // Constructor
-    BitArray(unsigned len);
+    BitArray(IdType len);
+    BitArray(IdType len, WType* words, std::shared_ptr<void> storage);
     virtual ~BitArray() = default;
+    BitArray(const BitArray&) = delete;
+    BitArray& operator=(const BitArray&) = delete;
 
     // Getters and setters
-    unsigned length() const { return len_; }
-    unsigned word_count() const { return (len_+bitw-1u)>>logw; }
-    WType* word_buf() { return wbuf_.data(); }
+    IdType length() const { return len_; }
+    IdType word_count() const { return (len_+bitw-1u)>>logw; }
+    IdType word_alloc() const { return (len_+bitw)>>logw; }
+    WType* word_buf() { return wbuf_; }
+    const WType* word_buf() const { return wbuf_; }
     
-    bool get(unsigned ix) const;
-    bool set(unsigned ix, bool x);
+    bool get(IdType ix) const;
+    bool set(IdType ix, bool x);
+    bool set_atomic(IdType ix, bool x);
     void fill(bool x);
-    void fill(bool x, unsigned ix0, unsigned ix1);
+    void fill(bool x, IdType ix0, IdType ix1);
     
-    virtual unsigned count(unsigned ix0, unsigned ix1) const;
-    unsigned count() const;
-    virtual unsigned find(unsigned ix0, unsigned nth) const;
+    virtual IdType count(IdType ix0, IdType ix1) const;
+    IdType count() const;
+    virtual IdType find(IdType ix0, IdType nth) const;
+    IdType list(bool x, IdType ix0, IdType ix1, IdType* out) const;
     
 
   protected:
     // Private members
-    unsigned           len_;  /**< Length of Bit Array. Access with length() */
-    std::vector<WType> wbuf_; /**< Word buffer of type WType. Access with word_buf() */
+    IdType             len_;  /**< Length of Bit Array. Access with length() */
+    std::vector<WType> wown_; /**< Owned word storage, empty if storage_ is used */
+    std::shared_ptr<void> storage_; /**< Keeps external word storage (e.g. a mapped file) alive */
+    WType*             wbuf_; /**< Word buffer of type WType. Access with word_buf() */
 
   public:
 
@@ -78,32 +89,32 @@ namespace bittree {
      *  Note: reading off the end is safe and returns 0 bits   */
     class Reader {
     public:
-      Reader(std::shared_ptr<const BitArray> host, unsigned ix0=0);
-      unsigned index() const { return ix_; }  /**< Return current index */
+      Reader(std::shared_ptr<const BitArray> host, IdType ix0=0);
+      IdType index() const { return ix_; }  /**< Return current index */
       template<unsigned n>
       WType read();
-      void seek(unsigned ix);
+      void seek(IdType ix);
     protected:
       std::shared_ptr<const BitArray> a_; /**< Bitarray the Reader is reading*/
       WType w_;                           /**< Current word of Reader */
-      unsigned ix_;                       /**< Current index of Reader */
+      IdType ix_;                         /**< Current index of Reader */
     };
 
     /** Class for writing the bit array.
      *  Note: writing off the end is undefined! */
     class Writer {
     public:
-      Writer(std::shared_ptr<BitArray> host, unsigned ix0=0);
+      Writer(std::shared_ptr<BitArray> host, IdType ix0=0);
       ~Writer();
-      unsigned index() const { return ix_; }  /**< Return current index */
+      IdType index() const { return ix_; }  /**< Return current index */
       template<unsigned n>
       void write(WType x);
-      void seek(unsigned ix);
+      void seek(IdType ix);
       void flush();
     protected:
       std::shared_ptr<BitArray> a_; /**< Bitarray the Writer is writing on*/
       WType w_;                     /**< Current word of Writer */
-      unsigned ix_;                 /**< Current index of Writer */
+      IdType ix_;                   /**< Current index of Writer */
     };
   };
 
@@ -116,28 +127,35 @@ namespace bittree {
     static const unsigned bitc = 1u<<logc;
 
   public:
-    FastBitArray(unsigned len);
+    FastBitArray(IdType len);
+    FastBitArray(IdType len, WType* words, IdType* chks,
+                 std::shared_ptr<void> storage);
+
+    /** Number of rank checkpoints stored for an array of length len */
+    static IdType chk_count(IdType len) { return len>>logc; }
+    const IdType* chk_buf() const { return chks_; }
 
     class Builder {
     public:
-      Builder(unsigned len);
-      unsigned index() const { return w_.index(); }
+      Builder(IdType len);
+      IdType index() const { return w_.index(); }
       template<unsigned n>
       void write(BitArray::WType x);
       std::shared_ptr<FastBitArray> finish();
     private:
       std::shared_ptr<FastBitArray> a_;
       BitArray::Writer w_;
-      unsigned chkpop_; //cumulative 1-bits written so far
-      unsigned* pchk_; //pointer into chks_
+      IdType chkpop_; //cumulative 1-bits written so far
+      IdType* pchk_; //pointer into chks_
     };
 
-    unsigned count(unsigned ix0, unsigned ix1) const override;
-    unsigned find(unsigned ix0, unsigned nth) const override;
+    IdType count(IdType ix0, IdType ix1) const override;
+    IdType find(IdType ix0, IdType nth) const override;
 
   protected:
     //chks_.size() = len_>>logc; chks_[i] = count(id0,id0+(bitc<<i) )
-    std::vector<unsigned> chks_;
+    std::vector<IdType> chks_own_; //!< Owned checkpoint storage
+    IdType* chks_;
   };
 }
 #endif
@@ -19,9 +19,17 @@
 
 #include "Bittree_Prelude.h"
 
+#include <cstdint>
+
+#if defined(__BMI2__)
+# include <immintrin.h>
+#endif
 #if defined(__IBMCPP__)
 # include "builtins.h"
 #endif
+#if !defined(__GNUC__)
+# include <atomic>
+#endif
 
 namespace bittree {
 
@@ -93,6 +101,50 @@ namespace bittree {
   }
 #endif
 
+#if defined(__GNUC__)
+  /** Atomically OR m into *p, returning the previous value. */
+  template<class X>
+  inline X bitatomic_or(X* p, X m) {
+    return __atomic_fetch_or(p, m, __ATOMIC_RELAXED);
+  }
+  /** Atomically AND m into *p, returning the previous value. */
+  template<class X>
+  inline X bitatomic_and(X* p, X m) {
+    return __atomic_fetch_and(p, m, __ATOMIC_RELAXED);
+  }
+  /** Load *p with acquire ordering. */
+  template<class X>
+  inline X bitatomic_load(const X* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  }
+  /** Store x to *p with release ordering. */
+  template<class X>
+  inline void bitatomic_store(X* p, X x) {
+    __atomic_store_n(p, x, __ATOMIC_RELEASE);
+  }
+#else
+  // Lock-free std::atomic<X> has the same representation as X on every
+  // platform we target, so we view the plain word through it.
+  template<class X>
+  inline X bitatomic_or(X* p, X m) {
+    static_assert(sizeof(std::atomic<X>) == sizeof(X), "atomic size");
+    return reinterpret_cast<std::atomic<X>*>(p)->fetch_or(m, std::memory_order_relaxed);
+  }
+  template<class X>
+  inline X bitatomic_and(X* p, X m) {
+    static_assert(sizeof(std::atomic<X>) == sizeof(X), "atomic size");
+    return reinterpret_cast<std::atomic<X>*>(p)->fetch_and(m, std::memory_order_relaxed);
+  }
+  template<class X>
+  inline X bitatomic_load(const X* p) {
+    return reinterpret_cast<const std::atomic<X>*>(p)->load(std::memory_order_acquire);
+  }
+  template<class X>
+  inline void bitatomic_store(X* p, X x) {
+    reinterpret_cast<std::atomic<X>*>(p)->store(x, std::memory_order_release);
+  }
+#endif
+
   /** returns the greatest power of 2 less-or-equal to x, and 0 if x=0 */
   inline unsigned glb_pow2(unsigned x) {
     // should unroll
@@ -111,5 +163,135 @@ namespace bittree {
     return x + 1;
   }
 
+  /** Spreads the low bits of x apart, leaving k-1 zero bits between
+   *  consecutive ones (k = 1, 2 or 3). Input beyond 32/21 bits is dropped
+   *  for k = 2/3. */
+  template<unsigned k>
+  inline std::uint64_t bitspread(std::uint64_t x);
+  template<>
+  inline std::uint64_t bitspread<1>(std::uint64_t x) {
+    return x;
+  }
+  template<>
+  inline std::uint64_t bitspread<2>(std::uint64_t x) {
+    x &= 0xffffffffull;
+    x = (x | x<<16) & 0x0000ffff0000ffffull;
+    x = (x | x<<8)  & 0x00ff00ff00ff00ffull;
+    x = (x | x<<4)  & 0x0f0f0f0f0f0f0f0full;
+    x = (x | x<<2)  & 0x3333333333333333ull;
+    x = (x | x<<1)  & 0x5555555555555555ull;
+    return x;
+  }
+  template<>
+  inline std::uint64_t bitspread<3>(std::uint64_t x) {
+    x &= 0x1fffffull;
+    x = (x | x<<32) & 0x001f00000000ffffull;
+    x = (x | x<<16) & 0x001f0000ff0000ffull;
+    x = (x | x<<8)  & 0x100f00f00f00f00full;
+    x = (x | x<<4)  & 0x10c30c30c30c30c3ull;
+    x = (x | x<<2)  & 0x1249249249249249ull;
+    return x;
+  }
+
+  /** Inverse of bitspread<k>: gathers every k-th bit of x to the bottom */
+  template<unsigned k>
+  inline std::uint64_t bitcompact(std::uint64_t x);
+  template<>
+  inline std::uint64_t bitcompact<1>(std::uint64_t x) {
+    return x;
+  }
+  template<>
+  inline std::uint64_t bitcompact<2>(std::uint64_t x) {
+    x &= 0x5555555555555555ull;
+    x = (x ^ x>>1)  & 0x3333333333333333ull;
+    x = (x ^ x>>2)  & 0x0f0f0f0f0f0f0f0full;
+    x = (x ^ x>>4)  & 0x00ff00ff00ff00ffull;
+    x = (x ^ x>>8)  & 0x0000ffff0000ffffull;
+    x = (x ^ x>>16) & 0x00000000ffffffffull;
+    return x;
+  }
+  template<>
+  inline std::uint64_t bitcompact<3>(std::uint64_t x) {
+    x &= 0x1249249249249249ull;
+    x = (x ^ x>>2)  & 0x10c30c30c30c30c3ull;
+    x = (x ^ x>>4)  & 0x100f00f00f00f00full;
+    x = (x ^ x>>8)  & 0x001f0000ff0000ffull;
+    x = (x ^ x>>16) & 0x001f00000000ffffull;
+    x = (x ^ x>>32) & 0x00000000001fffffull;
+    return x;
+  }
+
+  /** Scatters the low bits of x to the positions of the 1s in mask, in
+   *  order (PDEP). Uses the BMI2 instruction when compiled for it. */
+  inline unsigned bitdeposit(unsigned x, unsigned mask) {
+#if defined(__BMI2__)
+    return _pdep_u32(x, mask);
+#else
+    unsigned r = 0u;
+    for(unsigned b=1u; mask != 0u; b += b) {
+      if(x & b) r |= mask & (0u-mask);
+      mask &= mask-1u;
+    }
+    return r;
+#endif
+  }
+
+  /** Gathers the bits of x at the positions of the 1s in mask to the
+   *  bottom, in order (PEXT). Inverse of bitdeposit. */
+  inline unsigned bitextract(unsigned x, unsigned mask) {
+#if defined(__BMI2__)
+    return _pext_u32(x, mask);
+#else
+    unsigned r = 0u;
+    for(unsigned b=1u; mask != 0u; b += b) {
+      if(x & mask & (0u-mask)) r |= b;
+      mask &= mask-1u;
+    }
+    return r;
+#endif
+  }
+
+  /** Reverses the byte order of x */
+  inline std::uint32_t byteswap(std::uint32_t x) {
+    return (x>>24) | ((x>>8) & 0xff00u) | ((x<<8) & 0xff0000u) | (x<<24);
+  }
+  inline std::uint64_t byteswap(std::uint64_t x) {
+    return (std::uint64_t(byteswap(std::uint32_t(x))) << 32) |
+           byteswap(std::uint32_t(x>>32));
+  }
+
+  /** 64-bit hash of n 32-bit words, continuing from seed. The words are
+   *  taken in pairs by four independent multiply-rotate lanes (the
+   *  xxHash64 round), so the main loop keeps four multiplies in flight and
+   *  vectorizes where the target has 64-bit vector multiplies. Not meant
+   *  to resist deliberate collisions. */
+  inline std::uint64_t bithash(const std::uint32_t* w, std::size_t n, std::uint64_t seed) {
+    const std::uint64_t p1 = 0x9e3779b185ebca87ull, p2 = 0xc2b2ae3d27d4eb4full,
+                        p3 = 0x165667b19e3779f9ull, p4 = 0x85ebca77c2b2ae63ull;
+    struct Mix {
+      static std::uint64_t rotl(std::uint64_t x, unsigned r) { return (x << r) | (x >> (64u - r)); }
+      static std::uint64_t round(std::uint64_t acc, std::uint64_t x) {
+        return rotl(acc + x*0xc2b2ae3d27d4eb4full, 31)*0x9e3779b185ebca87ull;
+      }
+    };
+    std::uint64_t v[4] = {seed + p1 + p2, seed + p2, seed, seed - p1};
+    std::size_t i = 0;
+    for(; i + 8u <= n; i += 8u)
+      for(unsigned l=0; l < 4u; l++)
+        v[l] = Mix::round(v[l], std::uint64_t(w[i+2u*l]) | std::uint64_t(w[i+2u*l+1u]) << 32);
+    std::uint64_t h = Mix::rotl(v[0], 1) + Mix::rotl(v[1], 7) + Mix::rotl(v[2], 12) + Mix::rotl(v[3], 18);
+    for(unsigned l=0; l < 4u; l++)
+      h = (h ^ Mix::round(0u, v[l]))*p1 + p4;
+    h += std::uint64_t(n)*4u;
+    for(; i < n; i++)
+      h = Mix::rotl(h ^ std::uint64_t(w[i])*p1, 23)*p2 + p3;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+  }
+
 }
 #endif
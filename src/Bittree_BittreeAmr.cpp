@@ -12,25 +12,88 @@
    limitations under the License.
 */
 #include "Bittree_BittreeAmr.h"
+#include "Bittree_Bits.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <sstream>
 #include <iostream>
 
 namespace bittree {
 
+namespace {
+  /** Broadcast size bytes in chunks of at most chunk bytes, keeping a few
+    * chunks in flight so that large trees are pipelined down the
+    * broadcast tree instead of being sent as one message. */
+  void bcast_bytes(char* buf, std::uint64_t size, int root, MPI_Comm comm,
+                   std::size_t chunk) {
+    const unsigned window = 4;
+    std::vector<MPI_Request> reqs;
+    chunk = std::max<std::size_t>(1, std::min<std::size_t>(chunk, INT_MAX));
+    for(std::uint64_t off=0; off < size; off += chunk) {
+      if(reqs.size() == window) {
+        MPI_Waitall(static_cast<int>(reqs.size()), reqs.data(), MPI_STATUSES_IGNORE);
+        reqs.clear();
+      }
+      int count = static_cast<int>(std::min<std::uint64_t>(chunk, size - off));
+      reqs.push_back(MPI_REQUEST_NULL);
+      MPI_Ibcast(buf + off, count, MPI_BYTE, root, comm, &reqs.back());
+    }
+    if(!reqs.empty())
+      MPI_Waitall(static_cast<int>(reqs.size()), reqs.data(), MPI_STATUSES_IGNORE);
+  }
+
+  /** In-place Allreduce of count words, split into calls of at most
+    * INT_MAX words since a 64-bit id tree can have more */
+  void allreduce_words(BitArray::WType* buf, IdType count, MPI_Op op, MPI_Comm comm) {
+    do {
+      int n = static_cast<int>(std::min<IdType>(count, INT_MAX));
+      MPI_Allreduce(MPI_IN_PLACE, buf, n, MPI_UNSIGNED, op, comm);
+      buf += n;
+      count -= IdType(n);
+    } while(count > 0);
+  }
+}
+
 /** Constructor for BittreeAmr */
-BittreeAmr::BittreeAmr(const int top[], const int includes[]):
-  tree_(std::make_shared<MortonTree>(top, includes)),
+template<unsigned D>
+BittreeAmrT<D>::BittreeAmrT(const int top[], const int includes[], Curve curve):
+  tree_(std::make_shared<MortonTree>(top, includes, curve)),
   is_reduced_(false),
   is_updated_(false),
-  in_refine_(false)  {
+  in_refine_(false),
+  epochs_(new TreeEpochs),
+  pending_regrid_(),
+  identify0_(0),
+  locate0_(0) {
+  reset_stats();
+  epochs_->publish(TreeEpochs::ORIGINAL, tree_);
+}
+
+/** Constructor for BittreeAmr around an existing tree, e.g. one
+  * restored with MortonTree::load. The tree may be null on ranks that
+  * receive theirs through broadcast_from. */
+template<unsigned D>
+BittreeAmrT<D>::BittreeAmrT(std::shared_ptr<MortonTree> tree):
+  tree_(tree),
+  is_reduced_(false),
+  is_updated_(false),
+  in_refine_(false),
+  epochs_(new TreeEpochs),
+  pending_regrid_(),
+  identify0_(0),
+  locate0_(0) {
+  reset_stats();
+  epochs_->publish(TreeEpochs::ORIGINAL, tree_);
 }
 
 /** Get shared_ptr to the actual Bittree.
   * If in the middle of refinement, can also get the updated tree.
   */
-std::shared_ptr<MortonTree> BittreeAmr::getTree(bool updated) {
+template<unsigned D>
+std::shared_ptr<MortonTreeT<D>> BittreeAmrT<D>::getTree(bool updated) {
   if(updated && in_refine_) {
-    if (not is_updated_) refine_update();
+    ensure_updated();
     return tree_updated_;
   }
   else {
@@ -38,14 +101,62 @@ std::shared_ptr<MortonTree> BittreeAmr::getTree(bool updated) {
   }
 }
 
+/** Get raw pointer to the actual Bittree, without touching the shared_ptr
+  * reference count. The pointer stays valid until the next refine_apply
+  * (or, if updated, until the next refine_update).
+  */
+template<unsigned D>
+MortonTreeT<D>* BittreeAmrT<D>::getTreePtr(bool updated) {
+  if(updated && in_refine_) {
+    ensure_updated();
+    return tree_updated_.get();
+  }
+  else {
+    return tree_.get();
+  }
+}
+
+/** Get a pinned, read-only snapshot of the actual (or updated) Bittree.
+  * Any number of threads may hold views while refinement proceeds;
+  * refine_apply defers freeing a tree until all views of it are gone.
+  */
+template<unsigned D>
+TreeViewT<D> BittreeAmrT<D>::view(bool updated) {
+  if(updated && in_refine_) {
+    ensure_updated();
+    return TreeView(epochs_.get(), TreeEpochs::UPDATED);
+  }
+  else {
+    return TreeView(epochs_.get(), TreeEpochs::ORIGINAL);
+  }
+}
+
+/** Free trees retired by refinement that no TreeView can still see.
+  * Called by refine_apply; returns the number still held back. */
+template<unsigned D>
+unsigned BittreeAmrT<D>::reclaim() {
+  return epochs_->reclaim();
+}
+
+/** Lazily generate the updated tree. Safe to call from several threads:
+  * only the first caller runs refine_update, the others wait for it. */
+template<unsigned D>
+void BittreeAmrT<D>::ensure_updated() {
+  if(bitatomic_load(&is_updated_)) return;
+  std::lock_guard<std::mutex> lock(epochs_->update_mutex());
+  if(not is_updated_) refine_update();
+}
+
 /** Check number of blocks marked for nodetype change */
-unsigned BittreeAmr::delta_count() const {
+template<unsigned D>
+IdType BittreeAmrT<D>::delta_count() const {
   if(in_refine_) return refine_delta_->count();
   else return 0;
 }
 
 /** Check refinement bit. Wrapper for BitArray's get() */
-bool BittreeAmr::check_refine_bit(unsigned bitid) const {
+template<unsigned D>
+bool BittreeAmrT<D>::check_refine_bit(IdType bitid) const {
   if(in_refine_) return bool(refine_delta_->get(bitid));
   else return 0;
 }
@@ -54,8 +165,10 @@ bool BittreeAmr::check_refine_bit(unsigned bitid) const {
 
 /** Creates refine_delta_, and initializes all values to False.
   * First step of refinement. */
-void BittreeAmr::refine_init() {
-  unsigned nbits = tree_->id_upper_bound();
+template<unsigned D>
+void BittreeAmrT<D>::refine_init() {
+  BITTREE_TIME_PHASE(stats_.init);
+  IdType nbits = tree_->id_upper_bound();
   refine_delta_ = std::make_shared<BitArray>(nbits);
   refine_delta_->fill(false);
   is_reduced_ = true;
@@ -64,8 +177,9 @@ void BittreeAmr::refine_init() {
 }
 
 /** Mark a bit on refine_delta_ */
-void BittreeAmr::refine_mark(
-    unsigned bitid,   // in
+template<unsigned D>
+void BittreeAmrT<D>::refine_mark(
+    IdType bitid,     // in
     bool value   // in
   ) {
   if(in_refine_) {
@@ -75,56 +189,227 @@ void BittreeAmr::refine_mark(
   is_updated_ = false;
 }
 
+/** Thread-safe version of refine_mark. Any number of threads may call this
+ *  concurrently (but not concurrently with refine_mark or other refinement
+ *  functions). The word update is an atomic fetch_or/fetch_and, and the
+ *  flags are only written by the first mark after a reduce or update,
+ *  so threads do not keep invalidating the cache line holding them. */
+template<unsigned D>
+void BittreeAmrT<D>::refine_mark_atomic(
+    IdType bitid,     // in
+    bool value   // in
+  ) {
+  if(in_refine_) {
+      refine_delta_->set_atomic(bitid, value);
+  }
+  if(bitatomic_load(&is_reduced_)) bitatomic_store(&is_reduced_, false);
+  if(bitatomic_load(&is_updated_)) bitatomic_store(&is_updated_, false);
+}
 
 /** Reduce refine_delta_ across all processors by ORing. This means
  *  any blocks marked on one processor will be marked on all. */
-void BittreeAmr::refine_reduce(MPI_Comm comm) {
-  int count = static_cast<int>(refine_delta_->word_count());
-  MPI_Allreduce(
-    MPI_IN_PLACE,
-    refine_delta_->word_buf(),
-    count,
-    MPI_UNSIGNED,
-    MPI_BOR,
-    comm
-  );
+template<unsigned D>
+void BittreeAmrT<D>::refine_reduce(MPI_Comm comm) {
+  BITTREE_TIME_PHASE(stats_.reduce);
+  IdType count = refine_delta_->word_count();
+#ifdef BITTREE_INSTRUMENT
+  stats_.bytes_reduced += std::uint64_t(count) * sizeof(BitArray::WType);
+#endif
+  allreduce_words(refine_delta_->word_buf(), count, MPI_BOR, comm);
   is_reduced_ = true;
 }
 
 /** Reduce refine_delta_ across all processors by ANDing. This means
  *  any blocks unmarked on one processor will be unmarked on all. */
-void BittreeAmr::refine_reduce_and(MPI_Comm comm) {
-  int count = static_cast<int>(refine_delta_->word_count());
-  MPI_Allreduce(
-    MPI_IN_PLACE,
-    refine_delta_->word_buf(),
-    count,
-    MPI_UNSIGNED,
-    MPI_BAND,
-    comm
-  );
+template<unsigned D>
+void BittreeAmrT<D>::refine_reduce_and(MPI_Comm comm) {
+  BITTREE_TIME_PHASE(stats_.reduce);
+  IdType count = refine_delta_->word_count();
+#ifdef BITTREE_INSTRUMENT
+  stats_.bytes_reduced += std::uint64_t(count) * sizeof(BitArray::WType);
+#endif
+  allreduce_words(refine_delta_->word_buf(), count, MPI_BAND, comm);
   is_reduced_ = true;
 }
 
 /** Generates the updated tree from the original tree + refine_delta_.
   * After call, both original and updated exist simultaneously. */
-void BittreeAmr::refine_update() {
+template<unsigned D>
+void BittreeAmrT<D>::refine_update() {
+  BITTREE_TIME_PHASE(stats_.update);
   if (not is_reduced_) {
     std::cout << "Bittree updating before reducing. Possible error." << std::endl;
   }
+#ifdef BITTREE_INSTRUMENT
+  // marked parents are derefined, marked leaves refined
+  IdType marked = refine_delta_->count();
+  IdType parents = BitArray::count_and(*refine_delta_, *tree_->bits_,
+                                         tree_->level_id0(0), tree_->bits_->length());
+  pending_regrid_.derefined = parents;
+  pending_regrid_.refined = marked - parents;
+#endif
   tree_updated_ = tree_->refine(refine_delta_);
-  is_updated_ = true;
+  if(!data_.empty()) {
+    BlockRemap remap = block_remap<D>(*tree_, refine_delta_);
+    for(auto& d : data_) d->stage(remap);
+  }
+  epochs_->publish(TreeEpochs::UPDATED, tree_updated_);
+  bitatomic_store(&is_updated_, true);
 }
 
 /** Makes the updated tree the original tree. Final step of refinement. */
-void BittreeAmr::refine_apply() {
+template<unsigned D>
+void BittreeAmrT<D>::refine_apply() {
+  BITTREE_TIME_PHASE(stats_.apply);
   if (not is_updated_) {
     refine_update();
   }
+  if(history_) history_->record(*tree_, *refine_delta_, *tree_updated_);
   tree_ = tree_updated_;
+  for(auto& d : data_) d->commit();
+#ifdef BITTREE_INSTRUMENT
+  pending_regrid_.blocks = tree_->blocks();
+  pending_regrid_.leaves = tree_->leaves();
+  pending_regrid_.levels = tree_->levels();
+  stats_.blocks_refined += pending_regrid_.refined;
+  stats_.blocks_derefined += pending_regrid_.derefined;
+  stats_.regrids.push_back(pending_regrid_);
+#endif
   refine_delta_ = nullptr;
   tree_updated_ = nullptr;
   in_refine_ = false;
+  epochs_->publish(TreeEpochs::ORIGINAL, tree_);
+  epochs_->publish(TreeEpochs::UPDATED, nullptr);
+  epochs_->reclaim();
+}
+
+/** Register a per-block container. It is sized to the current tree, and
+  * from then on remapped by every refine_update and swapped in by
+  * refine_apply. Must not be called during refinement. */
+template<unsigned D>
+void BittreeAmrT<D>::register_data(std::shared_ptr<BlockDataBase> data) {
+  if(in_refine_)
+    throw std::logic_error("BittreeAmr::register_data called during refinement");
+  data->resize(tree_->id_upper_bound());
+  data_.push_back(data);
+}
+
+/** Stop remapping a registered container */
+template<unsigned D>
+void BittreeAmrT<D>::unregister_data(std::shared_ptr<BlockDataBase> data) {
+  data_.erase(std::remove(data_.begin(), data_.end(), data), data_.end());
+}
+
+/** Record every refinement applied from now on in history, or stop
+  * recording if history is null */
+template<unsigned D>
+void BittreeAmrT<D>::attach_history(std::shared_ptr<TreeHistoryWriter> history) {
+  history_ = history;
+}
+
+/** Replace the tree on every rank of comm by the tree on rank root.
+  * The root sends its tree image (word buffer, rank checkpoints and level
+  * table); the other ranks use the received buffer in place, so nothing
+  * is rebuilt. Must not be called during refinement. Throws
+  * std::logic_error on every rank if the root has no tree. Collective. */
+template<unsigned D>
+void BittreeAmrT<D>::broadcast_from(int root, MPI_Comm comm, std::size_t chunk_bytes) {
+  if(in_refine_)
+    throw std::logic_error("BittreeAmr::broadcast_from called during refinement");
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  // a size of zero tells every rank that the root has no tree
+  std::uint64_t size = rank == root && tree_ ? tree_->image_size() : 0;
+  MPI_Bcast(&size, 1, MPI_UINT64_T, root, comm);
+  if(size == 0)
+    throw std::logic_error("BittreeAmr::broadcast_from: the root has no tree");
+
+  std::shared_ptr<std::vector<char>> image =
+      std::make_shared<std::vector<char>>(static_cast<std::size_t>(size));
+  if(rank == root) tree_->write_image(image->data());
+  bcast_bytes(image->data(), size, root, comm, chunk_bytes);
+
+  if(rank != root) {
+    tree_ = MortonTree::from_image(image, image->data(), image->size());
+    epochs_->publish(TreeEpochs::ORIGINAL, tree_);
+    epochs_->reclaim();
+    for(auto& d : data_) d->resize(tree_->id_upper_bound());
+  }
+  is_reduced_ = false;
+  is_updated_ = false;
+}
+
+/** Check that every rank of comm holds a tree byte-identical to the one
+  * on rank root. Returns the same answer on all ranks. Collective. */
+template<unsigned D>
+bool BittreeAmrT<D>::check_identical(int root, MPI_Comm comm, std::size_t chunk_bytes) {
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  std::vector<char> mine(tree_ ? tree_->image_size() : 0);
+  if(tree_) tree_->write_image(mine.data());
+
+  std::uint64_t size = mine.size();
+  MPI_Bcast(&size, 1, MPI_UINT64_T, root, comm);
+  std::vector<char> theirs(rank == root ? 0 : static_cast<std::size_t>(size));
+  char* buf = rank == root ? mine.data() : theirs.data();
+  bcast_bytes(buf, size, root, comm, chunk_bytes);
+
+  int same = rank == root ||
+             (mine.size() == size && std::memcmp(mine.data(), theirs.data(), mine.size()) == 0);
+  MPI_Allreduce(MPI_IN_PLACE, &same, 1, MPI_INT, MPI_LAND, comm);
+  return same != 0;
+}
+
+/** Check that every rank of comm holds the same tree, by comparing
+  * MortonTree::hash across ranks in one 16-byte allreduce of the hash and
+  * its complement under MPI_MAX; the replicas agree when the maximum of
+  * one is the complement of the other. During refinement the marks are
+  * hashed too, so call it after refine_reduce there. Cheap enough to run
+  * at every regrid; returns the same answer on all ranks. Collective. */
+template<unsigned D>
+bool BittreeAmrT<D>::verify_consistent(MPI_Comm comm) const {
+  std::uint64_t h = tree_ ? tree_->hash() : 0u;
+  if(in_refine_) {
+    const std::uint32_t flag = 1u;
+    h = bithash(&flag, 1u, h);
+    h = bithash(refine_delta_->word_buf(), std::size_t(refine_delta_->word_count()), h);
+  }
+  std::uint64_t x[2] = {h, ~h};
+  MPI_Allreduce(MPI_IN_PLACE, x, 2, MPI_UINT64_T, MPI_MAX, comm);
+  return x[0] == ~x[1];
+}
+
+/** Heap bytes held by the tree, the updated tree and the refinement
+  * marks on this rank. Trees held only by TreeViews are not counted. */
+template<unsigned D>
+AmrMemory BittreeAmrT<D>::memory_bytes() const {
+  AmrMemory m;
+  std::memset(&m, 0, sizeof(m));
+  if(tree_) m.tree = tree_->memory_bytes();
+  if(tree_updated_) m.updated = tree_updated_->memory_bytes();
+  if(refine_delta_) m.delta = refine_delta_->word_alloc() * sizeof(BitArray::WType);
+  return m;
+}
+
+/** Snapshot of the instrumentation counters. The identify/locate counts
+  * cover every tree in the process since the last reset_stats. */
+template<unsigned D>
+BittreeStats BittreeAmrT<D>::stats() const {
+  BittreeStats s = stats_;
+  s.dim = D;
+  s.identify_calls = query_counters.identify.load(std::memory_order_relaxed) - identify0_;
+  s.locate_calls = query_counters.locate.load(std::memory_order_relaxed) - locate0_;
+  return s;
+}
+
+/** Zero the instrumentation counters */
+template<unsigned D>
+void BittreeAmrT<D>::reset_stats() {
+  stats_ = BittreeStats();
+  identify0_ = query_counters.identify.load(std::memory_order_relaxed);
+  locate0_ = query_counters.locate.load(std::memory_order_relaxed);
 }
 
 /** Wrapper function to MortonTree::print_slice, which print a nice
@@ -132,7 +417,8 @@ void BittreeAmr::refine_apply() {
   * If tree has been updated, print both original and updated version.
   * Can be passed a datatype to change what number prints at each block loc.
   * (0=bitid, 1=morton number, 2=parentage) */
-std::string BittreeAmr::slice_to_string(unsigned datatype, unsigned slice) const {
+template<unsigned D>
+std::string BittreeAmrT<D>::slice_to_string(unsigned datatype, unsigned slice) const {
   std::ostringstream buffer;
   if (datatype==0 || datatype==1 || datatype==2) {
     buffer << "printing original tree:\n";
@@ -140,8 +426,8 @@ std::string BittreeAmr::slice_to_string(unsigned datatype, unsigned slice) const
 
     if(in_refine_) {
     buffer << "printing refine_delta_ (indexed by bitid):\n";
-    unsigned id0 = tree_->level_id0(0);
-    for (unsigned j=id0; j<refine_delta_->length() ; j++){
+    IdType id0 = tree_->level_id0(0);
+    for (IdType j=id0; j<refine_delta_->length() ; j++){
       buffer << j << ": " << refine_delta_->get(j) << ";  " ;
     }
     buffer << "\n\n";
@@ -158,7 +444,8 @@ std::string BittreeAmr::slice_to_string(unsigned datatype, unsigned slice) const
   return buffer.str();
 }
 
-}
-
-
+template class BittreeAmrT<1>;
+template class BittreeAmrT<2>;
+template class BittreeAmrT<3>;
 
+}
@@ -15,32 +15,72 @@
 #define BITTREE_AMR_H__
 
 #include "Bittree_BitArray.h"
+#include "Bittree_BlockData.h"
+#include "Bittree_History.h"
 #include "Bittree_MortonTree.h"
+#include "Bittree_Stats.h"
+#include "Bittree_TreeView.h"
 #include "mpi.h"
 
 namespace bittree {
-  
-class BittreeAmr  {
+
+/** Distributed refinement on top of a MortonTreeT<D>. The library
+  * instantiates D=1,2,3; BittreeAmr is the BTDIM one. */
+template<unsigned D>
+class BittreeAmrT  {
   public:
-    BittreeAmr(const int top[], const int includes[]);
+    typedef MortonTreeT<D> MortonTree;
+    typedef TreeEpochsT<D> TreeEpochs;
+    typedef TreeViewT<D> TreeView;
+    typedef TreeHistoryWriterT<D> TreeHistoryWriter;
+
+    BittreeAmrT(const int top[], const int includes[], Curve curve=Curve::morton);
+    BittreeAmrT(std::shared_ptr<MortonTree> tree);
 
     std::shared_ptr<MortonTree> getTree(bool updated=false);
+    MortonTree* getTreePtr(bool updated=false);
+    TreeView view(bool updated=false);
+    unsigned reclaim();
 
     // Get refinement info
-    unsigned delta_count() const;
-    bool check_refine_bit(unsigned bitid) const;
+    IdType delta_count() const;
+    bool check_refine_bit(IdType bitid) const;
 
     // Refinement functions
     void refine_init();
-    void refine_mark(unsigned bitid, bool value);
+    void refine_mark(IdType bitid, bool value);
+    void refine_mark_atomic(IdType bitid, bool value);
     void refine_reduce(MPI_Comm comm);
     void refine_reduce_and(MPI_Comm comm);
     void refine_update();
     void refine_apply();
 
+    // Per-block data remapped by refinement
+    void register_data(std::shared_ptr<BlockDataBase> data);
+    void unregister_data(std::shared_ptr<BlockDataBase> data);
+
+    // Refinements recorded for a tree history
+    void attach_history(std::shared_ptr<TreeHistoryWriter> history);
+
+    // Distribution across ranks
+    void broadcast_from(int root, MPI_Comm comm,
+                        std::size_t chunk_bytes=bcast_chunk_bytes);
+    bool check_identical(int root, MPI_Comm comm,
+                         std::size_t chunk_bytes=bcast_chunk_bytes);
+    bool verify_consistent(MPI_Comm comm) const;
+    static const std::size_t bcast_chunk_bytes = std::size_t(1)<<24; //!< 16 MiB
+
+    // Instrumentation (counters stay zero unless BITTREE_INSTRUMENT is defined)
+    BittreeStats stats() const;
+    void reset_stats();
+    AmrMemory memory_bytes() const;
+
     // Other functions
     std::string slice_to_string(unsigned datatype, unsigned slice=0) const;
 
+  private:
+    void ensure_updated();
+
   private:
     std::shared_ptr<MortonTree> tree_;            //!<Actual Bittree
     std::shared_ptr<MortonTree> tree_updated_;    //!<Updated Bittree, before refinement is applied
@@ -48,8 +88,24 @@ class BittreeAmr  {
     bool is_reduced_;  //!<Flag to track whether refine_delta is up to date across processors
     bool is_updated_;  //!<Flag to track whether tree_updated matches latest refine_delta
     bool in_refine_;   //!<If in_refine=false, tree_updated and refine_delta should not exist
+    std::vector<std::shared_ptr<BlockDataBase>> data_; //!<Registered per-block data
+    std::shared_ptr<TreeHistoryWriter> history_; //!<Records every applied refinement, if set
+    std::unique_ptr<TreeEpochs> epochs_; //!<Publishes trees to TreeViews and defers their release
+    BittreeStats stats_;        //!<Instrumentation counters
+    RegridStats pending_regrid_; //!<Marks counted by refine_update, recorded by refine_apply
+    std::uint64_t identify0_;   //!<query_counters.identify at the last reset_stats
+    std::uint64_t locate0_;     //!<query_counters.locate at the last reset_stats
   };
 
+template<unsigned D> const std::size_t BittreeAmrT<D>::bcast_chunk_bytes;
+
+extern template class BittreeAmrT<1>;
+extern template class BittreeAmrT<2>;
+extern template class BittreeAmrT<3>;
+
+/** Refinement driver with the dimensionality chosen at setup (BTDIM) */
+typedef BittreeAmrT<BTDIM> BittreeAmr;
+
 }
 
 #endif
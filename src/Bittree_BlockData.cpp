@@ -0,0 +1,78 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_BlockData.h"
+#include "Bittree_MortonTree.h"
+
+namespace bittree {
+
+  /** Block ids of tree before and after refining it with delta. Follows
+    * MortonTreeT::refine: blocks are visited in id order, which is level
+    * order, and the children of each one are found at a cursor in the old
+    * and the new tree. Removed blocks must be leaves, as refine assumes. */
+  template<unsigned D>
+  BlockRemap block_remap(const MortonTreeT<D>& tree, std::shared_ptr<const BitArray> delta) {
+    const unsigned nkids = MortonTreeT<D>::nkids;
+    const IdType id0 = tree.level_id0(0);
+    const IdType id1 = tree.id_upper_bound();
+    const IdType nbits = tree.levels() > 1 ? tree.level_id1(tree.levels()-2) : id0;
+
+    BlockRemap m;
+    m.nkids = nkids;
+    m.old_size = id1;
+    m.runs.push_back(BlockRemap::Run{id0, id0, tree.level_id1(0) - id0});
+
+    std::shared_ptr<const BitArray> bits = tree.bits_;
+    BitArray::Reader a_r(bits, id0), del_r(delta, id0);
+    IdType a_kids = tree.level_id1(0);    // old id of the next child
+    IdType b_kids = tree.level_id1(0);    // new id of the next child
+    std::size_t run = 0;                  // run holding the current block
+    for(IdType id=id0; id < id1; id++) {
+      const bool parent = id < nbits && a_r.read<1>() != 0;
+      const bool flip = del_r.read<1>() != 0;
+      if(!parent && !flip) continue;
+
+      // new id of this block; marks on removed blocks are ignored
+      while(run+1 < m.runs.size() && m.runs[run].a + m.runs[run].n <= id) run++;
+      if(id < m.runs[run].a || id >= m.runs[run].a + m.runs[run].n) {
+        if(parent) a_kids += nkids;
+        continue;
+      }
+      const IdType b_id = m.runs[run].b + (id - m.runs[run].a);
+
+      if(parent && !flip) {
+        BlockRemap::Run& last = m.runs.back();
+        if(last.a + last.n == a_kids && last.b + last.n == b_kids)
+          last.n += nkids;
+        else
+          m.runs.push_back(BlockRemap::Run{a_kids, b_kids, nkids});
+        a_kids += nkids;
+        b_kids += nkids;
+      }
+      else if(parent) {
+        m.derefined.push_back(BlockRemap::Group{b_id, a_kids});
+        a_kids += nkids;
+      }
+      else {
+        m.refined.push_back(BlockRemap::Group{b_id, b_kids});
+        b_kids += nkids;
+      }
+    }
+    m.new_size = b_kids;
+    return m;
+  }
+
+  template BlockRemap block_remap<1>(const MortonTreeT<1>&, std::shared_ptr<const BitArray>);
+  template BlockRemap block_remap<2>(const MortonTreeT<2>&, std::shared_ptr<const BitArray>);
+  template BlockRemap block_remap<3>(const MortonTreeT<3>&, std::shared_ptr<const BitArray>);
+}
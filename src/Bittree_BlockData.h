@@ -0,0 +1,140 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_BLOCKDATA_H__
+#define BITTREE_BLOCKDATA_H__
+
+#include "Bittree_BitArray.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace bittree {
+
+  template<unsigned D> class MortonTreeT;
+
+  /** How the block ids of a tree move under one refinement.
+   *
+   *  Between two structural changes all ids shift by the same amount, so
+   *  the surviving blocks are described by a few runs of consecutive ids.
+   *  Refined and derefined parents are listed with the first id of their
+   *  children. Everything is in increasing id order.
+   */
+  struct BlockRemap {
+    /** Old ids [a, a+n) become new ids [b, b+n) */
+    struct Run {
+      IdType a, b, n;
+    };
+    /** Parent (new id) and the first id of its nkids children: new ids
+      * for a refined parent, old ids for a derefined one */
+    struct Group {
+      IdType parent, kids;
+    };
+
+    unsigned nkids;                 //!< Children per parent
+    IdType old_size;                //!< id_upper_bound of the old tree
+    IdType new_size;                //!< id_upper_bound of the new tree
+    std::vector<Run> runs;          //!< Surviving blocks
+    std::vector<Group> refined;     //!< Parents whose children were created
+    std::vector<Group> derefined;   //!< Parents whose children were removed
+  };
+
+  template<unsigned D>
+  BlockRemap block_remap(const MortonTreeT<D>& tree, std::shared_ptr<const BitArray> delta);
+
+  /** Type-erased per-block container, as registered with a BittreeAmr.
+   *  stage builds the contents for the updated tree next to the current
+   *  ones, and commit makes them current. */
+  class BlockDataBase {
+  public:
+    virtual ~BlockDataBase() {}
+    virtual void resize(IdType size) = 0;
+    virtual void stage(const BlockRemap& remap) = 0;
+    virtual void commit() = 0;
+  };
+
+  /** Array of one value per block, indexed by bitid, that follows the tree
+   *  through refinement. Several of them (owner rank, work weight, bounds,
+   *  ...) registered with the same BittreeAmr form a structure of arrays.
+   *
+   *  When registered, refine_update remaps every container in one sweep
+   *  over the BlockRemap: surviving values are copied run by run, a new
+   *  child gets refine(parent, child, kid) (a copy of its parent by
+   *  default), and each removed child is passed to coarsen(parent, child,
+   *  kid) (nothing by default). refine_apply swaps the result in. Ids below
+   *  level_id0(0) are not blocks; their entries hold the fill value.
+   */
+  template<class T>
+  class BlockData : public BlockDataBase {
+  public:
+    typedef std::function<void(const T& parent, T& child, unsigned kid)> RefinePolicy;
+    typedef std::function<void(T& parent, const T& child, unsigned kid)> CoarsenPolicy;
+
+    explicit BlockData(const T& fill=T()): fill_(fill), staged_(false) {}
+
+    void on_refine(RefinePolicy fn) { refine_ = fn; }
+    void on_coarsen(CoarsenPolicy fn) { coarsen_ = fn; }
+
+    T& operator[](IdType id) { return data_[id]; }
+    const T& operator[](IdType id) const { return data_[id]; }
+    T* data() { return data_.data(); }
+    const T* data() const { return data_.data(); }
+    IdType size() const { return IdType(data_.size()); }
+
+    /** Values for the updated tree, between refine_update and refine_apply */
+    const std::vector<T>& updated() const { return staged_ ? next_ : data_; }
+
+    void resize(IdType size) override { data_.resize(size, fill_); }
+    void stage(const BlockRemap& remap) override;
+    void commit() override;
+
+  private:
+    T fill_;
+    std::vector<T> data_;   //!< Current values
+    std::vector<T> next_;   //!< Values for the updated tree
+    bool staged_;
+    RefinePolicy refine_;
+    CoarsenPolicy coarsen_;
+  };
+
+  template<class T>
+  void BlockData<T>::stage(const BlockRemap& remap) {
+    next_.assign(remap.new_size, fill_);
+    const T* a = data_.data();
+    T* b = next_.data();
+    for(const BlockRemap::Run& r : remap.runs)
+      std::copy(a + r.a, a + r.a + r.n, b + r.b);
+    if(coarsen_) {
+      for(const BlockRemap::Group& g : remap.derefined)
+        for(unsigned k=0; k < remap.nkids; k++)
+          coarsen_(b[g.parent], a[g.kids + k], k);
+    }
+    for(const BlockRemap::Group& g : remap.refined) {
+      for(unsigned k=0; k < remap.nkids; k++) {
+        if(refine_) refine_(b[g.parent], b[g.kids + k], k);
+        else b[g.kids + k] = b[g.parent];
+      }
+    }
+    staged_ = true;
+  }
+
+  template<class T>
+  void BlockData<T>::commit() {
+    if(!staged_) return;
+    data_.swap(next_);
+    next_.clear();
+    staged_ = false;
+  }
+
+}
+#endif
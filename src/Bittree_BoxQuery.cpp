@@ -0,0 +1,128 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_MortonTree.h"
+
+#include <algorithm>
+
+namespace bittree {
+
+  /** Leaves intersecting the box of blocks lo..hi (inclusive) on level lev,
+    * coarser ones containing part of it and finer ones inside it. Writes
+    * their ids to out in Morton order, unless out is null, and returns
+    * their count. The box is clipped to the domain.
+    *
+    * The tree is descended in curve order from the top-level blocks the
+    * box touches, skipping subtrees that miss it, so the box splits into
+    * the Morton ranges of the subtrees it contains plus the blocks along
+    * its boundary. The leaves of a contained subtree are listed without
+    * further tests, or when only counting, follow from its block count in
+    * O(levels). */
+  template<unsigned D>
+  IdType MortonTreeT<D>::query_box(unsigned lev, const unsigned lo[D], const unsigned hi[D],
+                                   IdType* out) const {
+    // top-level blocks the box touches, in Morton order
+    unsigned x1[D], t0[D], t1[D];
+    for(unsigned d=0; d < D; d++) {
+      x1[d] = std::min(hi[d], (lev0_blks_[d] << lev) - 1u);
+      if(lo[d] > x1[d]) return 0u;
+      t0[d] = lo[d] >> lev;
+      t1[d] = x1[d] >> lev;
+    }
+    std::vector<unsigned> tops;
+    unsigned t[D];
+    std::copy(t0, t0+D, t);
+    while(true) {
+      const unsigned tm = top_->coord_to_mort(t);
+      if(bits_->get(tm)) tops.push_back(tm);
+      unsigned d = 0u;
+      while(d < D && t[d] == t1[d]) { t[d] = t0[d]; d++; }
+      if(d == D) break;
+      t[d]++;
+    }
+    std::sort(tops.begin(), tops.end());
+
+    struct Node {
+      IdType ix;
+      unsigned coord[D];
+      unsigned lev;
+      unsigned char state;
+      bool inside;             //!< Subtree lies in the box
+    };
+    std::vector<Node> stack;
+    IdType count = 0u;
+    for(unsigned tm : tops) {
+      Node top;
+      top.ix = bits_->count(0u, tm);
+      top_->mort_to_coord(tm, top.coord);
+      top.lev = 0u;
+      top.state = 0u;
+      top.inside = false;
+      stack.push_back(top);
+      while(!stack.empty()) {
+        Node b = stack.back();
+        stack.pop_back();
+        if(!b.inside) {
+          // compare the block with the box on the finer of the two levels
+          bool inside = true, overlap = true;
+          for(unsigned d=0; d < D; d++) {
+            unsigned b0, b1, c0 = lo[d], c1 = x1[d];
+            if(b.lev <= lev) {
+              b0 = b.coord[d] << (lev - b.lev);
+              b1 = b0 + ((1u << (lev - b.lev)) - 1u);
+            }
+            else {
+              b0 = b1 = b.coord[d];
+              c0 = c0 << (b.lev - lev);
+              c1 = (c1 << (b.lev - lev)) + ((1u << (b.lev - lev)) - 1u);
+            }
+            overlap = overlap && b0 <= c1 && c0 <= b1;
+            inside = inside && c0 <= b0 && b1 <= c1;
+          }
+          if(!overlap) continue;
+          b.inside = inside;
+        }
+        const IdType id = level_id0(b.lev) + b.ix;
+        if(b.lev+1u >= levs_ || !bits_->get(id)) {
+          if(out) out[count] = id;
+          count++;
+          continue;
+        }
+        if(b.inside && !out) {
+          // a full subtree of n blocks has (n-1)/nkids parents
+          const IdType n = below(b.lev, b.ix+1u) - below(b.lev, b.ix);
+          count += n - (n - 1u)/nkids;
+          continue;
+        }
+        // children, pushed last to first so the first is visited next
+        const IdType ix0 = parents_before(b.lev, b.ix) << D;
+        for(unsigned slot=nkids; slot-- > 0u; ) {
+          const unsigned kid = ct_->kid[b.state][slot];
+          Node c;
+          c.ix = ix0 + slot;
+          for(unsigned d=0; d < D; d++)
+            c.coord[d] = (b.coord[d] << 1) | (kid >> d & 1u);
+          c.lev = b.lev + 1u;
+          c.state = ct_->next[b.state][slot];
+          c.inside = b.inside;
+          stack.push_back(c);
+        }
+      }
+    }
+    return count;
+  }
+
+  template IdType MortonTreeT<1>::query_box(unsigned, const unsigned*, const unsigned*, IdType*) const;
+  template IdType MortonTreeT<2>::query_box(unsigned, const unsigned*, const unsigned*, IdType*) const;
+  template IdType MortonTreeT<3>::query_box(unsigned, const unsigned*, const unsigned*, IdType*) const;
+}
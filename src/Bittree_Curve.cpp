@@ -0,0 +1,69 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_Curve.h"
+
+namespace bittree {
+  namespace {
+    /** Rotate the low D bits of x left by r */
+    template<unsigned D>
+    inline unsigned rotl(unsigned x, unsigned r) {
+      r %= D;
+      return ((x << r) | (x >> (D-r))) & ((1u<<D) - 1u);
+    }
+
+    inline unsigned gray(unsigned w) { return w ^ (w>>1); }
+
+    inline unsigned trailing_ones(unsigned w) {
+      unsigned n = 0u;
+      for(; w & 1u; w >>= 1) n++;
+      return n;
+    }
+
+    /** Hilbert tables follow Hamilton, "Compact Hilbert Indices" (2006):
+      * in state (e, d) the child of rank w is rotl(gray(w), d+1) ^ e, and
+      * its own curve enters at e ^ rotl(entry(w), d+1) heading along
+      * d + dir(w) + 1. */
+    template<unsigned D>
+    CurveTableT<D> make_table(Curve curve) {
+      CurveTableT<D> t;
+      for(unsigned s=0; s < CurveTableT<D>::nstates; s++) {
+        const unsigned e = s / D, dir = s % D;
+        for(unsigned w=0; w < CurveTableT<D>::nkids; w++) {
+          unsigned kid = w, next = 0u;
+          if(curve == Curve::hilbert) {
+            kid = rotl<D>(gray(w), dir+1u) ^ e;
+            const unsigned entry = w == 0u ? 0u : gray(2u*((w-1u)/2u));
+            const unsigned step = w == 0u ? 0u : trailing_ones(w & 1u ? w : w-1u) % D;
+            next = (e ^ rotl<D>(entry, dir+1u))*D + (dir + step + 1u) % D;
+          }
+          t.kid[s][w] = static_cast<unsigned char>(kid);
+          t.slot[s][kid] = static_cast<unsigned char>(w);
+          t.next[s][w] = static_cast<unsigned char>(next);
+        }
+      }
+      return t;
+    }
+  }
+
+  template<unsigned D>
+  const CurveTableT<D>& CurveTableT<D>::get(Curve curve) {
+    static const CurveTableT<D> morton = make_table<D>(Curve::morton);
+    static const CurveTableT<D> hilbert = make_table<D>(Curve::hilbert);
+    return curve == Curve::hilbert ? hilbert : morton;
+  }
+
+  template struct CurveTableT<1>;
+  template struct CurveTableT<2>;
+  template struct CurveTableT<3>;
+}
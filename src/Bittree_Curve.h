@@ -0,0 +1,60 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_CURVE_H__
+#define BITTREE_CURVE_H__
+
+#include "Bittree_Prelude.h"
+
+namespace bittree {
+
+  /** Space-filling curve ordering the children of every parent, and with
+    * them the blocks of a tree. The top-level blocks are in the Morton
+    * order of the rectangular domain for either curve. */
+  enum class Curve : unsigned { morton = 0u, hilbert = 1u };
+
+  /** Child order of a curve as a state machine.
+   *
+   *  The children of a parent sit at consecutive ids in curve order, so
+   *  ids and Morton (or Hilbert) indices only ever see a child's slot, its
+   *  position among its siblings. Which child (bit d set for the upper
+   *  half in dimension d) fills a slot depends on the orientation of the
+   *  parent. That state is not stored in the tree: every top-level block
+   *  has state 0, and the state of a block follows from its ancestors'
+   *  slots on the way down.
+   *
+   *  Morton order has the single state 0 with slot == child. Hilbert
+   *  states are (entry corner, direction) pairs of Hamilton's formulation,
+   *  of which only some are reachable from state 0.
+   */
+  template<unsigned D>
+  struct CurveTableT {
+    static constexpr unsigned nkids = 1u<<D;
+    static constexpr unsigned nstates = D<<D;
+
+    unsigned char kid[nstates][nkids];   //!< Child in each slot
+    unsigned char slot[nstates][nkids];  //!< Slot of each child
+    unsigned char next[nstates][nkids];  //!< State of the child in each slot
+
+    static const CurveTableT& get(Curve curve);
+  };
+
+  template<unsigned D> constexpr unsigned CurveTableT<D>::nkids;
+  template<unsigned D> constexpr unsigned CurveTableT<D>::nstates;
+
+  extern template struct CurveTableT<1>;
+  extern template struct CurveTableT<2>;
+  extern template struct CurveTableT<3>;
+
+}
+#endif
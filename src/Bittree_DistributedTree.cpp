@@ -0,0 +1,636 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_DistributedTree.h"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+namespace bittree {
+
+  namespace {
+    /** Appends the next n bits of r to w */
+    void copy_bits(BitArray::Reader& r, FastBitArray::Builder& w, IdType n) {
+      for(; n >= 8u; n -= 8u) w.write<8>(r.read<8>());
+      for(; n > 0u; n--) w.write<1>(r.read<1>());
+    }
+
+    /** Appends n zero bits to w */
+    void write_zeros(FastBitArray::Builder& w, IdType n) {
+      for(; n >= 8u; n -= 8u) w.write<8>(0u);
+      for(; n > 0u; n--) w.write<1>(0u);
+    }
+
+    MPI_Datatype id_datatype() {
+      return sizeof(IdType) == 8u ? MPI_UINT64_T : MPI_UNSIGNED;
+    }
+
+    /** Sends send[r] to rank r and returns what every rank sent here, in
+      * rank order; counts[r] is the number of items from rank r */
+    template<class T>
+    std::vector<T> exchange(const std::vector<std::vector<T>>& send,
+                            std::vector<int>& counts, MPI_Comm comm) {
+      const std::size_t nranks = send.size();
+      std::vector<int> scount(nranks), sdispl(nranks), rcount(nranks), rdispl(nranks);
+      std::vector<T> sbuf;
+      for(std::size_t r=0; r < nranks; r++) {
+        sdispl[r] = int(sbuf.size()*sizeof(T));
+        scount[r] = int(send[r].size()*sizeof(T));
+        sbuf.insert(sbuf.end(), send[r].begin(), send[r].end());
+      }
+      MPI_Alltoall(scount.data(), 1, MPI_INT, rcount.data(), 1, MPI_INT, comm);
+      int bytes = 0;
+      counts.resize(nranks);
+      for(std::size_t r=0; r < nranks; r++) {
+        rdispl[r] = bytes;
+        bytes += rcount[r];
+        counts[r] = rcount[r]/int(sizeof(T));
+      }
+      std::vector<T> rbuf(std::size_t(bytes)/sizeof(T));
+      MPI_Alltoallv(sbuf.data(), scount.data(), sdispl.data(), MPI_BYTE,
+                    rbuf.data(), rcount.data(), rdispl.data(), MPI_BYTE, comm);
+      return rbuf;
+    }
+  }
+
+  /** Tree of levels 0..levs-1 of this one, with the same block ids */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> MortonTreeT<D>::truncated(unsigned levs) const {
+    levs = std::max(1u, std::min(levs, levs_));
+    std::shared_ptr<MortonTreeT> t = std::make_shared<MortonTreeT>();
+    t->levs_ = levs;
+    std::copy(lev0_blks_, lev0_blks_+D, t->lev0_blks_);
+    t->top_ = top_;
+    t->curve_ = curve_;
+    t->ct_ = ct_;
+    t->id0_ = id0_;
+    t->level_.assign(level_.begin(), level_.begin()+levs);
+    // the finest level has no bits
+    const IdType len = levs == levs_ ? bits_->length() : level_id0(levs-1u);
+    BitArray::Reader r(bits_);
+    FastBitArray::Builder w(len);
+    copy_bits(r, w, len);
+    t->bits_ = w.finish();
+    return t;
+  }
+
+  /** Collective over comm. Every rank passes the same tree; the coarse
+    * levels and the subtrees of the rank's cut blocks and their halo are
+    * copied out of it, so it can be released afterwards. */
+  template<unsigned D>
+  DistributedTreeT<D>::DistributedTreeT(const MortonTree& tree, unsigned cut, MPI_Comm comm):
+    cut_(cut), nsub_(0u) {
+    if(cut >= tree.levels())
+      throw std::invalid_argument("DistributedTree: cut level is not in the tree");
+    MPI_Comm_dup(comm, &comm_);
+    MPI_Comm_rank(comm_, &rank_);
+    MPI_Comm_size(comm_, &nranks_);
+    ncut_ = tree.level_blocks(cut);
+
+    // contiguous ranges of cut blocks, balanced by subtree size: cut
+    // block j is preceded by j cut blocks and the subtrees before it
+    const unsigned nsub = tree.levels() - 1u - cut;
+    auto before = [&](IdType j) {
+      IdType n = j;
+      for(unsigned k=0; k < nsub; k++) {
+        j = tree.parents_before(cut+k, j) << D;
+        n += j;
+      }
+      return double(n);
+    };
+    const double total = before(ncut_);
+    part_.assign(std::size_t(nranks_)+1u, ncut_);
+    part_[0] = 0u;
+    for(int r=1; r < nranks_; r++) {
+      IdType lo = part_[r-1], hi = ncut_;
+      while(lo < hi) {
+        const IdType mid = lo + (hi - lo)/2u;
+        if(before(mid) < total*r/nranks_) lo = mid + 1u;
+        else hi = mid;
+      }
+      part_[r] = lo;
+    }
+
+    // the rank's cut blocks and their neighbours, as runs
+    local_ = tree.truncated(cut+1u);
+    std::vector<IdType> held, nbrs;
+    for(IdType j=cut_begin(); j < cut_end(); j++) {
+      cut_neighbors(j, nbrs);
+      held.push_back(j);
+      held.insert(held.end(), nbrs.begin(), nbrs.end());
+    }
+    std::sort(held.begin(), held.end());
+    held.erase(std::unique(held.begin(), held.end()), held.end());
+    for(IdType j : held) {
+      if(runs_.empty() || runs_.back().j1 != j) {
+        const Run run = {j, j+1u};
+        runs_.push_back(run);
+      }
+      else runs_.back().j1++;
+    }
+    runs_.shrink_to_fit();
+    if(nsub > 0u) build_local(tree);
+    sync();
+  }
+
+  /** Collective over comm. Builds the tree from its levels 0..cut alone,
+    * the last level of coarse being the cut; the subtrees start empty
+    * and grow with refine, so the whole tree is never replicated. */
+  template<unsigned D>
+  DistributedTreeT<D>::DistributedTreeT(const MortonTree& coarse, MPI_Comm comm):
+    DistributedTreeT(coarse, coarse.levels()-1u, comm) {
+  }
+
+  /** Copies the held subtrees out of the replicated tree into local_,
+    * which holds its levels 0..cut_. The cut blocks held elsewhere are
+    * leaves of the local tree. */
+  template<unsigned D>
+  void DistributedTreeT<D>::build_local(const MortonTree& tree) {
+    // blocks on each level below the cut, dropping empty levels
+    std::vector<IdType> nblk;
+    for(unsigned k=1; cut_+k < tree.levels(); k++) {
+      IdType n = 0u;
+      for(const Run& run : runs_)
+        n += first_below(tree, run.j1, k) - first_below(tree, run.j0, k);
+      if(n == 0u) break;
+      nblk.push_back(n);
+    }
+    MortonTree& t = *local_;
+    t.levs_ = cut_ + 1u + unsigned(nblk.size());
+    t.level_.resize(t.levs_);
+    IdType id1 = t.level_id1(cut_);
+    for(unsigned k=0; k < nblk.size(); k++) {
+      id1 += nblk[k];
+      t.level_[cut_+1u+k].id1 = id1;
+    }
+    const IdType c0 = tree.level_id0(cut_);
+    FastBitArray::Builder w(t.level_id0(t.levs_-1u));
+    BitArray::Reader coarse(tree.bits_);
+    copy_bits(coarse, w, c0);
+    if(t.levs_ > cut_+1u) {
+      IdType j = 0u;
+      for(const Run& run : runs_) {
+        write_zeros(w, run.j0 - j);
+        BitArray::Reader r(tree.bits_, c0 + run.j0);
+        copy_bits(r, w, run.j1 - run.j0);
+        j = run.j1;
+      }
+      write_zeros(w, ncut_ - j);
+    }
+    for(unsigned k=1; cut_+k+1u < t.levs_; k++) {
+      for(const Run& run : runs_) {
+        const IdType a = first_below(tree, run.j0, k);
+        BitArray::Reader r(tree.bits_, tree.level_id0(cut_+k) + a);
+        copy_bits(r, w, first_below(tree, run.j1, k) - a);
+      }
+    }
+    t.bits_ = w.finish();
+  }
+
+  template<unsigned D>
+  DistributedTreeT<D>::~DistributedTreeT() {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(!finalized) MPI_Comm_free(&comm_);
+  }
+
+  template<unsigned D>
+  IdType DistributedTreeT<D>::level_id0(unsigned lev) const {
+    if(lev <= cut_) return local_->level_id0(lev);
+    const std::size_t stride = std::size_t(nranks_) + 1u;
+    IdType id = local_->level_id1(cut_);
+    for(unsigned k=0; cut_+1u+k < lev; k++)
+      id += base_[k*stride+std::size_t(nranks_)];
+    return id;
+  }
+
+  template<unsigned D>
+  IdType DistributedTreeT<D>::blocks() const {
+    return level_id0(levels()) - local_->level_id0(0);
+  }
+
+  template<unsigned D>
+  IdType DistributedTreeT<D>::held_cut_blocks() const {
+    IdType n = 0u;
+    for(const Run& run : runs_) n += run.j1 - run.j0;
+    return n;
+  }
+
+  /** Heap bytes of the local tree and the tables */
+  template<unsigned D>
+  std::uint64_t DistributedTreeT<D>::memory_bytes() const {
+    std::uint64_t n = local_->memory_bytes().total();
+    n += (part_.capacity() + base_.capacity() + delta_.capacity())*sizeof(IdType);
+    n += runs_.capacity()*sizeof(Run);
+    return n + sizeof(*this);
+  }
+
+  template<unsigned D>
+  int DistributedTreeT<D>::cut_owner(IdType cut_ix) const {
+    return int(std::upper_bound(part_.begin(), part_.end()-1, cut_ix) - part_.begin()) - 1;
+  }
+
+  /** Rank owning block id. Blocks above the cut belong to the owner of
+    * the cut blocks following them in Morton order. */
+  template<unsigned D>
+  int DistributedTreeT<D>::owner(IdType id) const {
+    const IdType c0 = local_->level_id0(cut_);
+    if(id < c0) return cut_owner(position(local_->locate(id)));
+    if(id < local_->level_id1(cut_)) return cut_owner(id - c0);
+    IdType g;
+    const unsigned k = sub_level(id, g);
+    const IdType* row = &base_[(k-1u)*(std::size_t(nranks_)+1u)];
+    return int(std::upper_bound(row, row+nranks_+1, g) - row) - 1;
+  }
+
+  /** Level cut_+k, k > 0, of block id below the cut; g is its index in
+    * the level of the whole tree */
+  template<unsigned D>
+  unsigned DistributedTreeT<D>::sub_level(IdType id, IdType& g) const {
+    const std::size_t stride = std::size_t(nranks_) + 1u;
+    IdType lid0 = local_->level_id1(cut_);
+    for(unsigned k=1u; k <= nsub_; k++) {
+      const IdType n = base_[(k-1u)*stride+std::size_t(nranks_)];
+      if(id >= lid0 && id < lid0 + n) {
+        g = id - lid0;
+        return k;
+      }
+      lid0 += n;
+    }
+    throw std::out_of_range("DistributedTree: no such block");
+  }
+
+  /** Index on level cut_+k of t of the first block in the subtree of cut
+    * block j, or of the first after them for j = ncut_ */
+  template<unsigned D>
+  IdType DistributedTreeT<D>::first_below(const MortonTree& t, IdType j, unsigned k) const {
+    for(unsigned l=0; l < k; l++)
+      j = t.parents_before(cut_+l, j) << D;
+    return j;
+  }
+
+  /** Cut blocks whose subtrees precede block ix on coarse level lev in
+    * Morton order */
+  template<unsigned D>
+  IdType DistributedTreeT<D>::coarse_cut_before(unsigned lev, IdType ix, bool is_parent) const {
+    (void)is_parent;
+    for(unsigned l=lev; l < cut_; l++) {
+      ix = local_->parents_before(l, ix) << D;
+#ifdef ALT_MORTON_ORDER
+      if(l == lev && is_parent) ix += MortonTree::nkids/2u;
+#endif
+    }
+    return ix;
+  }
+
+  /** Cut index of a local block on the cut level, or for a coarser block
+    * the cut blocks preceding it */
+  template<unsigned D>
+  IdType DistributedTreeT<D>::position(const Block& b) const {
+    if(b.level == cut_) return b.id - local_->level_id0(cut_);
+    return coarse_cut_before(b.level, b.id - local_->level_id0(b.level), b.is_parent);
+  }
+
+  /** Run holding cut block j, or with closed, also the run ending at j.
+    * Returns runs_.size() if there is none. */
+  template<unsigned D>
+  std::size_t DistributedTreeT<D>::run_of(IdType j, bool closed) const {
+    std::size_t lo = 0u, hi = runs_.size();
+    while(lo < hi) {
+      const std::size_t mid = lo + (hi - lo)/2u;
+      if(runs_[mid].j0 <= j) lo = mid + 1u;
+      else hi = mid;
+    }
+    if(lo == 0u) return runs_.size();
+    const Run& run = runs_[lo-1u];
+    return j < run.j1 || (closed && j == run.j1) ? lo-1u : runs_.size();
+  }
+
+  /** Global minus local index on each level below the cut for the
+    * subtrees from cut position p on, if p is in or at the end of a
+    * held run or starts a rank's range; buf holds nsub_ values if
+    * needed. Returns null if p is not known here. */
+  template<unsigned D>
+  const IdType* DistributedTreeT<D>::deltas(IdType p, IdType* buf) const {
+    const std::size_t i = run_of(p, true);
+    if(i < runs_.size()) return nsub_ > 0u ? delta_.data() + i*nsub_ : buf;
+    const auto it = std::lower_bound(part_.begin(), part_.end(), p);
+    if(it == part_.end() || *it != p) return nullptr;
+    const std::size_t r = std::size_t(it - part_.begin());
+    for(unsigned k=0; k < nsub_; k++)
+      buf[k] = base_[k*(std::size_t(nranks_)+1u)+r] - first_below(*local_, p, k+1u);
+    return buf;
+  }
+
+  /** Local id lid of block id, on the cut level or below, and the deltas
+    * of its run. Returns false if its subtree is not held here. */
+  template<unsigned D>
+  bool DistributedTreeT<D>::local_id(IdType id, IdType& lid, const IdType*& delta) const {
+    const IdType c0 = local_->level_id0(cut_);
+    if(id < local_->level_id1(cut_)) {
+      const std::size_t i = run_of(id - c0, false);
+      if(i == runs_.size()) return false;
+      lid = id;
+      delta = delta_.data() + i*nsub_;
+      return true;
+    }
+    IdType g;
+    const unsigned k = sub_level(id, g);
+    // the last run starting at or before g on level cut_+k
+    std::size_t lo = 0u, hi = runs_.size();
+    while(lo < hi) {
+      const std::size_t mid = lo + (hi - lo)/2u;
+      if(delta_[mid*nsub_+k-1u] + first_below(*local_, runs_[mid].j0, k) <= g) lo = mid + 1u;
+      else hi = mid;
+    }
+    if(lo == 0u) return false;
+    delta = delta_.data() + (lo-1u)*nsub_;
+    const IdType ix = g - delta[k-1u];
+    if(ix >= first_below(*local_, runs_[lo-1u].j1, k)) return false;
+    lid = local_->level_id0(cut_+k) + ix;
+    return true;
+  }
+
+  /** Block of the whole tree from block b of the local tree, with the
+    * deltas of its subtree or, above the cut, of its position */
+  template<unsigned D>
+  typename DistributedTreeT<D>::Block
+  DistributedTreeT<D>::from_local(const Block& b, const IdType* delta) const {
+    Block g = b;
+    for(unsigned k=0; k < nsub_; k++)
+      g.mort += delta[k];
+    if(b.level > cut_)
+      g.id = level_id0(b.level) + (b.id - local_->level_id0(b.level)) + delta[b.level-cut_-1u];
+    return g;
+  }
+
+  /** Cut blocks sharing a face, edge or corner with cut block j */
+  template<unsigned D>
+  void DistributedTreeT<D>::cut_neighbors(IdType j, std::vector<IdType>& out) const {
+    out.clear();
+    const IdType c0 = local_->level_id0(cut_);
+    const Block b = local_->locate(c0 + j);
+    unsigned ndirs = 1u;
+    for(unsigned d=0; d < D; d++) ndirs *= 3u;
+    for(unsigned dir=0; dir < ndirs; dir++) {
+      if(dir == ndirs/2u) continue; // the block itself
+      unsigned x[D];
+      for(unsigned d=0, r=dir; d < D; d++, r /= 3u)
+        x[d] = b.coord[d] + r%3u - 1u; // wraps below zero, which inside rejects
+      if(!local_->inside(cut_, x)) continue;
+      const Block n = local_->identify(cut_, x);
+      if(n.level == cut_) out.push_back(n.id - c0);
+    }
+  }
+
+  /** Block containing coord on level lev, or the leaf covering it on a
+    * coarser level. Returns false if that block lies in a subtree not
+    * held here, or above the cut away from the held runs. coord must be
+    * inside the domain. */
+  template<unsigned D>
+  bool DistributedTreeT<D>::identify(unsigned lev, const unsigned coord[D], Block& out) const {
+    const unsigned lc = std::min(lev, cut_);
+    unsigned x[D];
+    for(unsigned d=0; d < D; d++)
+      x[d] = coord[d] >> (lev - lc);
+    Block b = local_->identify(lc, x);
+    IdType buf[max_sub];
+    const IdType* delta;
+    if(b.level < cut_) {
+      delta = deltas(position(b), buf);
+      if(!delta) return false;
+    }
+    else {
+      const std::size_t i = run_of(position(b), false);
+      if(i == runs_.size()) return false;
+      delta = delta_.data() + i*nsub_;
+      if(lev > cut_) b = local_->identify(lev, coord);
+    }
+    out = from_local(b, delta);
+    return true;
+  }
+
+  /** Block with the given id. Returns false if it lies in a subtree not
+    * held here, or above the cut away from the held runs. */
+  template<unsigned D>
+  bool DistributedTreeT<D>::locate(IdType id, Block& out) const {
+    IdType buf[max_sub];
+    const IdType* delta;
+    Block b;
+    if(id < local_->level_id0(cut_)) {
+      b = local_->locate(id);
+      delta = deltas(position(b), buf);
+      if(!delta) return false;
+    }
+    else {
+      IdType lid;
+      if(!local_id(id, lid, delta)) return false;
+      b = local_->locate(lid);
+    }
+    out = from_local(b, delta);
+    return true;
+  }
+
+  /** identify for n queries: levs[i] and coords[D*i..]. Queries not held
+    * locally are answered by the owner of their cut block. Collective. */
+  template<unsigned D>
+  void DistributedTreeT<D>::identify(std::size_t n, const unsigned* levs,
+                                     const unsigned* coords, Block* out) const {
+    std::vector<std::vector<unsigned>> send(static_cast<std::size_t>(nranks_));
+    std::vector<std::vector<std::size_t>> asked(static_cast<std::size_t>(nranks_));
+    for(std::size_t i=0; i < n; i++) {
+      const unsigned* x = coords + D*i;
+      if(identify(levs[i], x, out[i])) continue;
+      const unsigned lc = std::min(levs[i], cut_);
+      unsigned xc[D];
+      for(unsigned d=0; d < D; d++)
+        xc[d] = x[d] >> (levs[i] - lc);
+      const int r = cut_owner(position(local_->identify(lc, xc)));
+      send[r].push_back(levs[i]);
+      send[r].insert(send[r].end(), x, x+D);
+      asked[r].push_back(i);
+    }
+    std::vector<int> counts;
+    const std::vector<unsigned> q = exchange(send, counts, comm_);
+    std::vector<std::vector<Block>> reply(static_cast<std::size_t>(nranks_));
+    const unsigned* p = q.data();
+    for(int r=0; r < nranks_; r++) {
+      for(int c=0; c < counts[r]; c += int(D)+1, p += D+1u) {
+        Block b;
+        if(!identify(p[0], p+1, b))
+          throw std::logic_error("DistributedTree: forwarded block not held by its owner");
+        reply[r].push_back(b);
+      }
+    }
+    const std::vector<Block> ans = exchange(reply, counts, comm_);
+    std::size_t a = 0u;
+    for(int r=0; r < nranks_; r++)
+      for(std::size_t i : asked[r])
+        out[i] = ans[a++];
+  }
+
+  /** locate for n ids. Ids not held locally are answered by their
+    * owner. Collective. */
+  template<unsigned D>
+  void DistributedTreeT<D>::locate(std::size_t n, const IdType* ids, Block* out) const {
+    std::vector<std::vector<IdType>> send(static_cast<std::size_t>(nranks_));
+    std::vector<std::vector<std::size_t>> asked(static_cast<std::size_t>(nranks_));
+    for(std::size_t i=0; i < n; i++) {
+      if(locate(ids[i], out[i])) continue;
+      const int r = owner(ids[i]);
+      send[r].push_back(ids[i]);
+      asked[r].push_back(i);
+    }
+    std::vector<int> counts;
+    const std::vector<IdType> q = exchange(send, counts, comm_);
+    std::vector<std::vector<Block>> reply(static_cast<std::size_t>(nranks_));
+    const IdType* p = q.data();
+    for(int r=0; r < nranks_; r++) {
+      for(int c=0; c < counts[r]; c++, p++) {
+        Block b;
+        if(!locate(*p, b))
+          throw std::logic_error("DistributedTree: forwarded block not held by its owner");
+        reply[r].push_back(b);
+      }
+    }
+    const std::vector<Block> ans = exchange(reply, counts, comm_);
+    std::size_t a = 0u;
+    for(int r=0; r < nranks_; r++)
+      for(std::size_t i : asked[r])
+        out[i] = ans[a++];
+  }
+
+  /** Toggles the blocks of marks like MortonTreeT::refine: marked leaves
+    * are refined and marked parents of leaves derefined. Each rank may
+    * pass any marks; the union is applied. Marks in subtrees not held
+    * here go first to their owner. A mark then goes only to the ranks
+    * holding its subtree, the owner of its cut block and the owners of
+    * the neighbouring cut blocks. Collective. */
+  template<unsigned D>
+  void DistributedTreeT<D>::refine(const std::vector<IdType>& marks) {
+    const IdType c0 = local_->level_id0(cut_);
+    std::vector<std::vector<IdType>> ask(static_cast<std::size_t>(nranks_));
+    std::vector<std::vector<IdType>> send(static_cast<std::size_t>(nranks_));
+    std::map<IdType, std::vector<int>> holders;
+    std::vector<IdType> nbrs;
+    // sends held block id, local id lid, to the holders of its subtree
+    auto post = [&](IdType id, IdType lid) {
+      IdType j = lid - c0;
+      if(lid >= local_->level_id1(cut_)) {
+        const Block b = local_->locate(lid);
+        unsigned x[D];
+        for(unsigned d=0; d < D; d++)
+          x[d] = b.coord[d] >> (b.level - cut_);
+        j = local_->identify(cut_, x).id - c0;
+      }
+      std::vector<int>& to = holders[j];
+      if(to.empty()) {
+        cut_neighbors(j, nbrs);
+        nbrs.push_back(j);
+        for(IdType n : nbrs)
+          to.push_back(cut_owner(n));
+        std::sort(to.begin(), to.end());
+        to.erase(std::unique(to.begin(), to.end()), to.end());
+      }
+      for(int r : to)
+        send[r].push_back(id);
+    };
+    IdType lid;
+    const IdType* delta;
+    for(IdType id : marks) {
+      if(id < c0)
+        throw std::logic_error("DistributedTree::refine: levels above the cut are fixed");
+      if(local_id(id, lid, delta)) post(id, lid);
+      else ask[owner(id)].push_back(id);
+    }
+    std::vector<int> counts;
+    for(IdType id : exchange(ask, counts, comm_)) {
+      if(!local_id(id, lid, delta))
+        throw std::logic_error("DistributedTree: forwarded block not held by its owner");
+      post(id, lid);
+    }
+
+    // apply the marks to the local tree
+    std::shared_ptr<BitArray> bits = std::make_shared<BitArray>(local_->id_upper_bound());
+    bits->fill(false);
+    for(IdType id : exchange(send, counts, comm_))
+      if(local_id(id, lid, delta)) bits->set(lid, true);
+    local_ = local_->refine(bits);
+    sync();
+  }
+
+  /** Gathers the block counts of every rank's subtrees and sends each
+    * halo run the global offsets of its first subtree from its owner.
+    * Collective. */
+  template<unsigned D>
+  void DistributedTreeT<D>::sync() {
+    unsigned nsub = local_->levels() - 1u - cut_;
+    MPI_Allreduce(MPI_IN_PLACE, &nsub, 1, MPI_UNSIGNED, MPI_MAX, comm_);
+    nsub_ = nsub;
+    const std::size_t stride = std::size_t(nranks_) + 1u;
+    const IdType b0 = cut_begin(), b1 = cut_end();
+    std::vector<IdType> cnt(nsub), all(std::size_t(nsub)*std::size_t(nranks_));
+    for(unsigned k=0; k < nsub; k++)
+      cnt[k] = first_below(*local_, b1, k+1u) - first_below(*local_, b0, k+1u);
+    MPI_Allgather(cnt.data(), int(nsub), id_datatype(),
+                  all.data(), int(nsub), id_datatype(), comm_);
+    base_.assign(std::size_t(nsub)*stride, 0u);
+    for(unsigned k=0; k < nsub; k++)
+      for(std::size_t r=0; r < std::size_t(nranks_); r++)
+        base_[k*stride+r+1u] = base_[k*stride+r] + all[r*nsub+k];
+    delta_.assign(runs_.size()*nsub, 0u);
+    if(nsub == 0u) return;
+
+    // global index on level cut_+1+k of the first block of owned subtree j
+    auto global_first = [&](IdType j, unsigned k) {
+      return base_[k*stride+std::size_t(rank_)]
+           + first_below(*local_, j, k+1u) - first_below(*local_, b0, k+1u);
+    };
+    std::vector<std::vector<IdType>> ask(static_cast<std::size_t>(nranks_));
+    std::vector<std::vector<std::size_t>> asked(static_cast<std::size_t>(nranks_));
+    for(std::size_t i=0; i < runs_.size(); i++) {
+      const Run& run = runs_[i];
+      if(b0 < b1 && run.j0 <= b0 && b0 < run.j1) {
+        for(unsigned k=0; k < nsub; k++)
+          delta_[i*nsub+k] = global_first(b0, k) - first_below(*local_, b0, k+1u);
+        continue;
+      }
+      const int r = cut_owner(run.j0);
+      ask[r].push_back(run.j0);
+      asked[r].push_back(i);
+    }
+    std::vector<int> counts;
+    const std::vector<IdType> q = exchange(ask, counts, comm_);
+    std::vector<std::vector<IdType>> reply(static_cast<std::size_t>(nranks_));
+    const IdType* p = q.data();
+    for(int r=0; r < nranks_; r++)
+      for(int c=0; c < counts[r]; c++, p++)
+        for(unsigned k=0; k < nsub; k++)
+          reply[r].push_back(global_first(*p, k));
+    const std::vector<IdType> ans = exchange(reply, counts, comm_);
+    std::size_t a = 0u;
+    for(int r=0; r < nranks_; r++)
+      for(std::size_t i : asked[r])
+        for(unsigned k=0; k < nsub; k++)
+          delta_[i*nsub+k] = ans[a++] - first_below(*local_, runs_[i].j0, k+1u);
+  }
+
+  template class DistributedTreeT<1>;
+  template class DistributedTreeT<2>;
+  template class DistributedTreeT<3>;
+
+  template std::shared_ptr<MortonTreeT<1>> MortonTreeT<1>::truncated(unsigned) const;
+  template std::shared_ptr<MortonTreeT<2>> MortonTreeT<2>::truncated(unsigned) const;
+  template std::shared_ptr<MortonTreeT<3>> MortonTreeT<3>::truncated(unsigned) const;
+}
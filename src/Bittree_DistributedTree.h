@@ -0,0 +1,127 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_DISTRIBUTEDTREE_H__
+#define BITTREE_DISTRIBUTEDTREE_H__
+
+#include "Bittree_MortonTree.h"
+#include "mpi.h"
+#include <climits>
+
+namespace bittree {
+
+  /** A MortonTreeT partitioned across the ranks of a communicator, for
+   *  trees too large to replicate.
+   *
+   *  Each block on the cut level roots a subtree. The cut blocks are split
+   *  into contiguous ranges balanced by subtree size, and a rank holds the
+   *  subtrees of its range plus those of their neighbours on the cut level
+   *  (the halo). They are kept in one local tree that has every block on
+   *  levels 0..cut and below the cut only the held subtrees, so the coarse
+   *  blocks keep their ids and the held blocks their coordinates.
+   *
+   *  Block ids and Morton indices are those of the whole tree. The held
+   *  cut blocks form a few runs of consecutive indices, and within a run
+   *  the global and local index on each level below the cut differ by a
+   *  constant, stored per run. The only replicated table holds the block
+   *  count of each rank's subtrees on each level below the cut.
+   *
+   *  identify and locate answer from local data and return false for
+   *  blocks they cannot place, the blocks of subtrees held elsewhere and
+   *  coarse blocks away from the held runs; the batched versions forward
+   *  those to the owning rank. refine sends each mark only to the ranks
+   *  holding its subtree, and the owners send the halo runs their offsets.
+   *
+   *  The coarse levels and the partition are fixed at construction:
+   *  marks on levels above the cut throw std::logic_error.
+   */
+  template<unsigned D>
+  class DistributedTreeT {
+  public:
+    typedef MortonTreeT<D> MortonTree;
+    typedef typename MortonTree::Block Block;
+
+    DistributedTreeT(const MortonTree& tree, unsigned cut, MPI_Comm comm);
+    DistributedTreeT(const MortonTree& coarse, MPI_Comm comm);
+    ~DistributedTreeT();
+    DistributedTreeT(const DistributedTreeT&) = delete;
+    DistributedTreeT& operator=(const DistributedTreeT&) = delete;
+
+    // Getters
+    unsigned cut_level() const { return cut_; }
+    unsigned levels() const { return cut_ + 1u + nsub_; }
+    IdType blocks() const;
+    IdType level_id0(unsigned lev) const;
+    IdType level_id1(unsigned lev) const { return level_id0(lev+1u); }
+    IdType cut_blocks() const { return ncut_; }
+    IdType cut_begin() const { return part_[rank_]; }
+    IdType cut_end() const { return part_[rank_+1]; }
+    IdType held_cut_blocks() const;
+    std::uint64_t memory_bytes() const;
+
+    // Ownership
+    int cut_owner(IdType cut_ix) const;
+    int owner(IdType id) const;
+
+    // Queries answered from local data
+    bool identify(unsigned lev, const unsigned coord[D], Block& out) const;
+    bool locate(IdType id, Block& out) const;
+
+    // Collective queries, forwarded to the owner when not held locally
+    void identify(std::size_t n, const unsigned* levs, const unsigned* coords, Block* out) const;
+    void locate(std::size_t n, const IdType* ids, Block* out) const;
+
+    // Collective refinement
+    void refine(const std::vector<IdType>& marks);
+
+  private:
+    /** Held cut blocks [j0, j1) */
+    struct Run {
+      IdType j0, j1;
+    };
+    static const unsigned max_sub = CHAR_BIT*sizeof(unsigned); //!< Bound on nsub_
+
+    IdType first_below(const MortonTree& t, IdType j, unsigned k) const;
+    unsigned sub_level(IdType id, IdType& g) const;
+    IdType position(const Block& b) const;
+    std::size_t run_of(IdType j, bool closed) const;
+    const IdType* deltas(IdType p, IdType* buf) const;
+    bool local_id(IdType id, IdType& lid, const IdType*& delta) const;
+    Block from_local(const Block& b, const IdType* delta) const;
+    IdType coarse_cut_before(unsigned lev, IdType ix, bool is_parent) const;
+    void cut_neighbors(IdType j, std::vector<IdType>& out) const;
+    void build_local(const MortonTree& tree);
+    void sync();
+
+  private:
+    MPI_Comm comm_;                        //!< Duplicate of the constructing communicator
+    int rank_, nranks_;
+    unsigned cut_;                         //!< Last level of the coarse tree
+    unsigned nsub_;                        //!< Levels below the cut
+    IdType ncut_;                          //!< Blocks on the cut level
+    std::vector<IdType> part_;             //!< Rank r owns cut blocks [part_[r], part_[r+1])
+    std::vector<IdType> base_;             //!< Blocks on level cut_+1+k of ranks before r, at k*(nranks_+1)+r
+    std::vector<Run> runs_;                //!< Held cut blocks, increasing
+    std::vector<IdType> delta_;            //!< Global minus local index on level cut_+1+k in run i, at i*nsub_+k
+    std::shared_ptr<MortonTree> local_;    //!< Levels 0..cut_ and the held subtrees
+  };
+
+  extern template class DistributedTreeT<1>;
+  extern template class DistributedTreeT<2>;
+  extern template class DistributedTreeT<3>;
+
+  /** Distributed tree with the dimensionality chosen at setup (BTDIM) */
+  typedef DistributedTreeT<BTDIM> DistributedTree;
+
+}
+#endif
@@ -0,0 +1,343 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_MortonTree.h"
+#include "Bittree_Bits.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bittree {
+
+  namespace {
+    /** Layout of a block file, as written by export_blocks. Each column
+     *  holds one field of every block, in Morton order, and starts on a
+     *  64-byte boundary. Fields are in the byte order of the writer, which
+     *  is recorded in endian. */
+    struct BlockFileHeader {
+      char          magic[8];      //!< "BTBLOCK"
+      std::uint32_t endian;        //!< 0x01020304, as seen by the writer
+      std::uint32_t version;       //!< 1
+      std::uint32_t dim;           //!< D
+      std::uint32_t id_bytes;      //!< sizeof of the bitid and mort columns' entries
+      std::uint32_t levs;          //!< Number of levels of the tree
+      std::uint32_t lev0_blks[3];  //!< Top-level blocks per dimension, padded with 1s
+      std::uint32_t curve;         //!< Curve of the sibling order
+      std::uint32_t parents;       //!< 1 if parents are listed, 0 for leaves only
+      std::uint64_t count;         //!< Blocks listed
+      std::uint64_t level_off;     //!< offset of the levels, one byte each
+      std::uint64_t coord_off[3];  //!< offsets of the coordinates, 32-bit, 0 beyond dim
+      std::uint64_t id_off;        //!< offset of the bitids
+      std::uint64_t mort_off;      //!< offset of the Morton indices
+      std::uint64_t parent_off;    //!< offset of the parent flags, one byte each, or 0
+      std::uint64_t size;          //!< total size of the file
+    };
+    const char block_file_magic[8] = "BTBLOCK";
+
+    inline std::uint64_t align64(std::uint64_t x) { return (x + 63u) & ~std::uint64_t(63u); }
+
+    /** File written at explicit offsets, so that several columns can be
+      * streamed into it at once */
+    class FileSink {
+    public:
+      explicit FileSink(const std::string& path): path_(path) {
+        fd_ = ::open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if(fd_ < 0)
+          throw std::runtime_error("Could not open " + path + " for writing");
+      }
+      ~FileSink() { if(fd_ >= 0) ::close(fd_); }
+
+      void write(std::uint64_t off, const char* p, std::size_t n) {
+        while(n > 0u) {
+          const ssize_t w = ::pwrite(fd_, p, n, static_cast<off_t>(off));
+          if(w < 0 && errno == EINTR) continue;
+          if(w <= 0)
+            throw std::runtime_error("Could not write " + path_);
+          p += w;
+          n -= static_cast<std::size_t>(w);
+          off += static_cast<std::uint64_t>(w);
+        }
+      }
+
+      /** Sets the file's size and closes it */
+      void close(std::uint64_t size) {
+        const bool ok = ::ftruncate(fd_, static_cast<off_t>(size)) == 0;
+        const bool closed = ::close(fd_) == 0;
+        fd_ = -1;
+        if(!ok || !closed)
+          throw std::runtime_error("Could not write " + path_);
+      }
+
+    private:
+      std::string path_;
+      int fd_;
+    };
+
+    /** One field of every block, buffered and written to its section of
+      * the file in pieces of up to 1 MiB */
+    class Column {
+    public:
+      Column(FileSink* f, std::uint64_t off, std::uint64_t bytes):
+        f_(f), off_(off), buf_(std::size_t(std::min(bytes, std::uint64_t(1) << 20)) + 8u), used_(0u) {}
+
+      template<class X>
+      void put(X x) {
+        if(used_ + sizeof(X) > buf_.size()) flush();
+        std::memcpy(buf_.data() + used_, &x, sizeof(X));
+        used_ += sizeof(X);
+      }
+
+      void flush() {
+        f_->write(off_, buf_.data(), used_);
+        off_ += used_;
+        used_ = 0u;
+      }
+
+    private:
+      FileSink* f_;
+      std::uint64_t off_;        //!< File offset of buf_[0]
+      std::vector<char> buf_;
+      std::size_t used_;
+    };
+
+    // Legacy VTK binary data is big-endian
+    inline bool host_big_endian() {
+      const std::uint32_t one = 1u;
+      char c;
+      std::memcpy(&c, &one, 1u);
+      return c == 0;
+    }
+    inline std::uint8_t big_endian(std::uint8_t x) { return x; }
+    inline std::uint32_t big_endian(std::uint32_t x) { return host_big_endian() ? x : byteswap(x); }
+    inline std::uint64_t big_endian(std::uint64_t x) { return host_big_endian() ? x : byteswap(x); }
+    inline std::uint32_t big_endian(float x) {
+      std::uint32_t u;
+      std::memcpy(&u, &x, sizeof(u));
+      return big_endian(u);
+    }
+  }
+
+  /** Calls fn(const Block&) on every block, or only the leaves, in Morton
+    * order. The tree is descended depth first from each top-level block,
+    * with Morton indices counted along the way. */
+  template<unsigned D>
+  template<class Fn>
+  void MortonTreeT<D>::visit_blocks(bool parents, Fn&& fn) const {
+    struct Node {
+      IdType ix;
+      unsigned coord[D];
+      unsigned lev;
+      unsigned char state;
+      bool visit;              //!< Parent whose children are already on the stack
+    };
+    std::vector<Node> stack;
+    Block b;
+    IdType mort = 0u, ix0 = 0u;
+    unsigned ntop = 1u;
+    for(unsigned d=0; d < D; d++) ntop *= lev0_blks_[d];
+    for(unsigned tm=0; tm < ntop; tm++) {
+      if(!bits_->get(tm)) continue;
+      Node top;
+      top.ix = ix0++;
+      top_->mort_to_coord(tm, top.coord);
+      top.lev = 0u;
+      top.state = 0u;
+      top.visit = false;
+      stack.push_back(top);
+      while(!stack.empty()) {
+        Node n = stack.back();
+        stack.pop_back();
+        b.id = level_id0(n.lev) + n.ix;
+        b.level = n.lev;
+        b.is_parent = n.visit || (n.lev+1u < levs_ && bits_->get(b.id));
+        if(n.visit || !b.is_parent) {
+          b.mort = mort++;
+          if(parents || !b.is_parent) {
+            std::copy(n.coord, n.coord+D, b.coord);
+            fn(static_cast<const Block&>(b));
+          }
+          continue;
+        }
+        // children, pushed last to first; the parent comes before them,
+        // or between the halves in the alternative order
+        const IdType c0 = parents_before(n.lev, n.ix) << D;
+        for(unsigned slot=nkids; slot-- > 0u; ) {
+#ifdef ALT_MORTON_ORDER
+          if(slot+1u == nkids/2u) {
+            n.visit = true;
+            stack.push_back(n);
+          }
+#endif
+          const unsigned kid = ct_->kid[n.state][slot];
+          Node c;
+          c.ix = c0 + slot;
+          for(unsigned d=0; d < D; d++)
+            c.coord[d] = (n.coord[d] << 1) | (kid >> d & 1u);
+          c.lev = n.lev + 1u;
+          c.state = ct_->next[n.state][slot];
+          c.visit = false;
+          stack.push_back(c);
+        }
+#ifndef ALT_MORTON_ORDER
+        n.visit = true;
+        stack.push_back(n);
+#endif
+      }
+    }
+  }
+
+  /** Write the level, coordinates, bitid and Morton index of every leaf,
+    * or every block if parents is set, to a columnar binary file (see
+    * BlockFileHeader). The tree is traversed once and each column is
+    * streamed to its place in the file through its own buffer, so the
+    * cost is linear in the number of blocks and the memory use is fixed. */
+  template<unsigned D>
+  void MortonTreeT<D>::export_blocks(const std::string& path, bool parents) const {
+    const std::uint64_t n = parents ? blocks() : leaves();
+    BlockFileHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, block_file_magic, sizeof(h.magic));
+    h.endian = 0x01020304u;
+    h.version = 1u;
+    h.dim = D;
+    h.id_bytes = sizeof(IdType);
+    h.levs = levs_;
+    for(unsigned d=0; d < 3; d++)
+      h.lev0_blks[d] = d < D ? lev0_blks_[d] : 1u;
+    h.curve = static_cast<std::uint32_t>(curve_);
+    h.parents = parents ? 1u : 0u;
+    h.count = n;
+    std::uint64_t off = align64(sizeof(h));
+    auto section = [&](std::uint64_t bytes) {
+      const std::uint64_t at = off;
+      off = align64(off + bytes);
+      return at;
+    };
+    h.level_off = section(n);
+    for(unsigned d=0; d < D; d++)
+      h.coord_off[d] = section(n*sizeof(std::uint32_t));
+    h.id_off = section(n*sizeof(IdType));
+    h.mort_off = section(n*sizeof(IdType));
+    if(parents) h.parent_off = section(n);
+    h.size = off;
+
+    FileSink f(path);
+    f.write(0u, reinterpret_cast<const char*>(&h), sizeof(h));
+    std::vector<Column> cols;
+    cols.reserve(D + 4u);
+    cols.emplace_back(&f, h.level_off, n);
+    for(unsigned d=0; d < D; d++)
+      cols.emplace_back(&f, h.coord_off[d], n*sizeof(std::uint32_t));
+    cols.emplace_back(&f, h.id_off, n*sizeof(IdType));
+    cols.emplace_back(&f, h.mort_off, n*sizeof(IdType));
+    if(parents) cols.emplace_back(&f, h.parent_off, n);
+    visit_blocks(parents, [&](const Block& b) {
+      cols[0].put(std::uint8_t(b.level));
+      for(unsigned d=0; d < D; d++)
+        cols[1u+d].put(std::uint32_t(b.coord[d]));
+      cols[D+1u].put(b.id);
+      cols[D+2u].put(b.mort);
+      if(parents) cols[D+3u].put(std::uint8_t(b.is_parent));
+    });
+    for(Column& c : cols) c.flush();
+    f.close(h.size);
+  }
+
+  /** Write the leaves, or every block if parents is set, as the cells of
+    * a legacy binary VTK unstructured grid for a domain spanning [lo, hi].
+    * Cells are lines, pixels or voxels with their own corner points, and
+    * carry level, bitid and mort (and is_parent) as cell data, so a
+    * threshold on level or is_parent selects one level of the overlapping
+    * hierarchy. Written in one traversal, like export_blocks. */
+  template<unsigned D>
+  void MortonTreeT<D>::export_vtk(const std::string& path, const double lo[D], const double hi[D],
+                                  bool parents) const {
+    const std::uint64_t n = parents ? blocks() : leaves();
+    if(n*nkids > 0x7fffffffu)
+      throw std::runtime_error("Too many blocks for a legacy VTK file");
+    const std::string nstr = std::to_string(n);
+    const std::string idtype = sizeof(IdType) == 4u ? "unsigned_int" : "vtktypeuint64";
+    const std::string table = " 1\nLOOKUP_TABLE default\n";
+    std::vector<std::string> heads;
+    std::vector<std::uint64_t> bytes;
+    heads.push_back("# vtk DataFile Version 3.0\nBittree blocks\nBINARY\nDATASET UNSTRUCTURED_GRID\n"
+                    "POINTS " + std::to_string(n*nkids) + " float\n");
+    bytes.push_back(n*nkids*3u*sizeof(float));
+    heads.push_back("\nCELLS " + nstr + " " + std::to_string(n*(nkids+1u)) + "\n");
+    bytes.push_back(n*(nkids+1u)*sizeof(std::uint32_t));
+    heads.push_back("\nCELL_TYPES " + nstr + "\n");
+    bytes.push_back(n*sizeof(std::uint32_t));
+    heads.push_back("\nCELL_DATA " + nstr + "\nSCALARS level unsigned_char" + table);
+    bytes.push_back(n);
+    heads.push_back("\nSCALARS bitid " + idtype + table);
+    bytes.push_back(n*sizeof(IdType));
+    heads.push_back("\nSCALARS mort " + idtype + table);
+    bytes.push_back(n*sizeof(IdType));
+    if(parents) {
+      heads.push_back("\nSCALARS is_parent unsigned_char" + table);
+      bytes.push_back(n);
+    }
+    heads.push_back("\n");
+    bytes.push_back(0u);
+
+    FileSink f(path);
+    std::vector<Column> cols;
+    cols.reserve(heads.size());
+    std::uint64_t off = 0u;
+    for(std::size_t s=0; s < heads.size(); s++) {
+      f.write(off, heads[s].data(), heads[s].size());
+      off += heads[s].size();
+      cols.emplace_back(&f, off, bytes[s]);
+      off += bytes[s];
+    }
+
+    // cell widths on each level
+    std::vector<double> width(std::size_t(levs_)*D);
+    for(unsigned lev=0; lev < levs_; lev++)
+      for(unsigned d=0; d < D; d++)
+        width[lev*D+d] = (hi[d] - lo[d]) / double(lev0_blks_[d] << lev);
+    const std::uint32_t cell_type = D == 1u ? 3u : D == 2u ? 8u : 11u; // line, pixel, voxel
+    std::uint32_t point = 0u;
+    visit_blocks(parents, [&](const Block& b) {
+      const double* w = &width[b.level*D];
+      for(unsigned p=0; p < nkids; p++)
+        for(unsigned d=0; d < 3u; d++) {
+          float x = 0.0f;
+          if(d < D) x = float(lo[d] + double(b.coord[d] + (p >> d & 1u))*w[d]);
+          cols[0].put(big_endian(x));
+        }
+      cols[1].put(big_endian(std::uint32_t(nkids)));
+      for(unsigned p=0; p < nkids; p++)
+        cols[1].put(big_endian(point++));
+      cols[2].put(big_endian(cell_type));
+      cols[3].put(big_endian(std::uint8_t(b.level)));
+      cols[4].put(big_endian(b.id));
+      cols[5].put(big_endian(b.mort));
+      if(parents) cols[6].put(big_endian(std::uint8_t(b.is_parent)));
+    });
+    for(Column& c : cols) c.flush();
+    f.close(off);
+  }
+
+  template void MortonTreeT<1>::export_blocks(const std::string&, bool) const;
+  template void MortonTreeT<2>::export_blocks(const std::string&, bool) const;
+  template void MortonTreeT<3>::export_blocks(const std::string&, bool) const;
+  template void MortonTreeT<1>::export_vtk(const std::string&, const double*, const double*, bool) const;
+  template void MortonTreeT<2>::export_vtk(const std::string&, const double*, const double*, bool) const;
+  template void MortonTreeT<3>::export_vtk(const std::string&, const double*, const double*, bool) const;
+}
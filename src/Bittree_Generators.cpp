@@ -0,0 +1,364 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_Generators.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <unordered_map>
+
+namespace bittree {
+  namespace {
+    // Random numbers come from splitmix64 rather than <random> distributions,
+    // whose output differs between standard libraries. A given seed then
+    // gives the same tree with every compiler.
+    inline std::uint64_t mix(std::uint64_t x) {
+      x += 0x9e3779b97f4a7c15ull;
+      x = (x ^ (x>>30)) * 0xbf58476d1ce4e5b9ull;
+      x = (x ^ (x>>27)) * 0x94d049bb133111ebull;
+      return x ^ (x>>31);
+    }
+
+    /** Uniform in [0,1) from 53 bits of h */
+    inline double unit(std::uint64_t h) {
+      return double(h>>11) * (1.0/9007199254740992.0);
+    }
+
+    /** Stateful stream on top of mix */
+    class Stream {
+    public:
+      explicit Stream(std::uint64_t seed): s_(seed) {}
+      double uniform() { return unit(mix(s_++)); }
+      double normal() { // Box-Muller
+        double u = uniform(), v = uniform();
+        return std::sqrt(-2.0*std::log(1.0-u)) * std::cos(6.283185307179586*v);
+      }
+    private:
+      std::uint64_t s_;
+    };
+
+    /** Hash of a block, independent of visiting order */
+    template<unsigned D>
+    inline std::uint64_t block_hash(std::uint64_t seed, unsigned lev,
+                                    const unsigned x[D]) {
+      std::uint64_t h = mix(seed ^ lev);
+      for(unsigned d=0; d < D; d++)
+        h = mix(h ^ x[d]);
+      return h;
+    }
+
+    /** Hash of integer block coordinates, as an unordered_map key */
+    template<unsigned D>
+    struct CoordHash {
+      std::size_t operator()(const std::array<unsigned,D>& x) const {
+        std::uint64_t h = 0;
+        for(unsigned d=0; d < D; d++)
+          h = mix(h ^ x[d]);
+        return static_cast<std::size_t>(h);
+      }
+    };
+
+    /** Integer coordinates of a block back from its normalized bounds */
+    template<unsigned D>
+    inline void block_coord(const double lo[D], const double hi[D],
+                            unsigned x[D]) {
+      for(unsigned d=0; d < D; d++)
+        x[d] = static_cast<unsigned>(std::lround(lo[d] / (hi[d]-lo[d])));
+    }
+
+    template<unsigned D>
+    unsigned longest_side(const GeneratorParams& p) {
+      unsigned m = 1;
+      for(unsigned d=0; d < D; d++) m = std::max(m, p.top[d]);
+      return m;
+    }
+  }
+
+  GeneratorParams::GeneratorParams():
+    include_fraction(1.0),
+    target_blocks(~std::uint64_t(0)),
+    max_levels(20),
+    seed(0),
+    curve(Curve::morton) {
+    for(unsigned d=0; d < 3; d++) top[d] = 1;
+  }
+
+  /** Top-level includes mask, indexed like the includes argument of the
+    * MortonTree constructor. With include_fraction < 1 the kept blocks form
+    * a blob around a seeded center with a noisy boundary, rather than
+    * scattered holes. At least one block is always kept. */
+  template<unsigned D>
+  std::vector<int> generate_includes(const GeneratorParams& p) {
+    unsigned ntop = 1;
+    for(unsigned d=0; d < D; d++) ntop *= p.top[d];
+    std::vector<int> includes(ntop, 1);
+    if(p.include_fraction >= 1.0) return includes;
+
+    Stream rng(mix(p.seed ^ 0x1a2b3c4dull));
+    double c[D];
+    for(unsigned d=0; d < D; d++) c[d] = rng.uniform() * p.top[d];
+    std::vector<std::pair<double,unsigned>> score(ntop);
+    for(unsigned ix=0; ix < ntop; ix++) {
+      unsigned rest = ix;
+      double r2 = 0.0;
+      for(unsigned d=0; d < D; d++) {
+        double dx = (double(rest % p.top[d]) + 0.5 - c[d]) / p.top[d];
+        rest /= p.top[d];
+        r2 += dx*dx;
+      }
+      score[ix] = std::make_pair(std::sqrt(r2) + 0.25*rng.uniform(), ix);
+    }
+    unsigned keep = static_cast<unsigned>(std::max(1.0, std::floor(p.include_fraction*ntop + 0.5)));
+    keep = std::min(keep, ntop);
+    std::nth_element(score.begin(), score.begin() + (keep-1), score.end());
+    std::fill(includes.begin(), includes.end(), 0);
+    for(unsigned i=0; i < keep; i++) includes[score[i].second] = 1;
+    return includes;
+  }
+
+  /** Grow a tree from a refinement pattern. See GeneratorParams. */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> generate_tree(const GeneratorParams& p,
+                                                const RefinePattern& pattern) {
+    std::vector<int> includes = generate_includes<D>(p);
+    int top[D];
+    unsigned ntop = 1;
+    for(unsigned d=0; d < D; d++) {
+      top[d] = static_cast<int>(p.top[d]);
+      ntop *= p.top[d];
+    }
+    const double width0 = 1.0 / longest_side<D>(p);
+    auto tree = std::make_shared<MortonTreeT<D>>(top, includes.data(), p.curve);
+    const CurveTableT<D>& ct = tree->curve_table();
+
+    // coordinates and curve states of the blocks on the finest level, in id order
+    std::vector<unsigned> xs;
+    std::vector<unsigned char> ss;
+    xs.reserve(ntop*D);
+    for(unsigned mort=0; mort < ntop; mort++) {
+      if(!tree->bits_->get(mort)) continue;
+      unsigned x[D];
+      tree->top_grid().mort_to_coord(mort, x);
+      xs.insert(xs.end(), x, x+D);
+      ss.push_back(0u);
+    }
+
+    std::vector<IdType> flagged;
+    for(unsigned lev=0; lev+1 < p.max_levels; lev++) {
+      const IdType nlev = IdType(xs.size() / D);
+      const double width = std::ldexp(width0, -int(lev));
+      double lo[D], hi[D];
+      auto priority = [&](IdType i) {
+        for(unsigned d=0; d < D; d++) {
+          lo[d] = xs[std::size_t(D)*i+d] * width;
+          hi[d] = lo[d] + width;
+        }
+        return pattern(lev, lo, hi);
+      };
+
+      flagged.clear();
+      for(IdType i=0; i < nlev; i++)
+        if(priority(i) >= 0.0) flagged.push_back(i);
+      if(flagged.empty()) break;
+
+      // only refine as many blocks as the target leaves room for
+      std::uint64_t blocks = tree->blocks();
+      std::uint64_t room = p.target_blocks > blocks ? (p.target_blocks - blocks) >> D : 0;
+      if(room == 0) break;
+      if(flagged.size() > room) {
+        std::vector<std::pair<double,IdType>> ranked(flagged.size());
+        for(std::size_t k=0; k < flagged.size(); k++)
+          ranked[k] = std::make_pair(-priority(flagged[k]), flagged[k]);
+        std::nth_element(ranked.begin(), ranked.begin() + std::ptrdiff_t(room-1), ranked.end());
+        flagged.resize(room);
+        for(std::size_t k=0; k < room; k++) flagged[k] = ranked[k].second;
+        std::sort(flagged.begin(), flagged.end());
+      }
+
+      auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+      delta->fill(false);
+      const IdType id0 = tree->level_id0(lev);
+      for(IdType i : flagged) delta->set(id0 + i, true);
+      tree = tree->refine(delta);
+
+      // children of each refined block, in slot order
+      std::vector<unsigned> next;
+      std::vector<unsigned char> next_ss;
+      next.reserve((flagged.size() << D) * D);
+      next_ss.reserve(flagged.size() << D);
+      for(IdType i : flagged) {
+        for(unsigned c=0; c < MortonTreeT<D>::nkids; c++) {
+          const unsigned kid = ct.kid[ss[i]][c];
+          for(unsigned d=0; d < D; d++)
+            next.push_back(2u*xs[std::size_t(D)*i+d] + (kid>>d & 1u));
+          next_ss.push_back(ct.next[ss[i]][c]);
+        }
+      }
+      xs.swap(next);
+      ss.swap(next_ss);
+    }
+    return tree;
+  }
+
+  /** Refine everything, to max_levels or until target_blocks */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> generate_uniform(const GeneratorParams& p) {
+    return generate_tree<D>(p, [](unsigned, const double*, const double*) {
+      return 0.0;
+    });
+  }
+
+  /** Refine blocks crossing a spherical shell of the given radius and
+    * (full) thickness, closest to the mid-surface first */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> generate_shell(const GeneratorParams& p,
+                                                 const double center[],
+                                                 double radius, double thickness) {
+    std::vector<double> c(center, center+D);
+    const double r0 = radius - 0.5*thickness, r1 = radius + 0.5*thickness;
+    return generate_tree<D>(p, [c,radius,r0,r1](unsigned, const double lo[D],
+                                                  const double hi[D]) {
+      double dmin = 0.0, dmax = 0.0, dmid = 0.0;
+      for(unsigned d=0; d < D; d++) {
+        double a = lo[d] - c[d], b = hi[d] - c[d];
+        double near = (a > 0.0) ? a : (b < 0.0 ? -b : 0.0);
+        double far = std::max(std::fabs(a), std::fabs(b));
+        double mid = 0.5*(a+b);
+        dmin += near*near;
+        dmax += far*far;
+        dmid += mid*mid;
+      }
+      if(std::sqrt(dmin) > r1 || std::sqrt(dmax) < r0) return -1.0;
+      return 1.0 / (1.0 + std::fabs(std::sqrt(dmid) - radius));
+    });
+  }
+
+  /** Refine blocks crossing the plane normal.x = offset, closest first */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> generate_shock(const GeneratorParams& p,
+                                                 const double normal[],
+                                                 double offset) {
+    std::vector<double> n(normal, normal+D);
+    double norm = 0.0;
+    for(double x : n) norm += x*x;
+    norm = std::sqrt(norm);
+    if(norm == 0.0) throw std::invalid_argument("generate_shock: zero normal");
+    for(double& x : n) x /= norm;
+    return generate_tree<D>(p, [n,offset](unsigned, const double lo[D],
+                                          const double hi[D]) {
+      double dist = -offset, reach = 0.0;
+      for(unsigned d=0; d < D; d++) {
+        dist += n[d] * 0.5*(lo[d]+hi[d]);
+        reach += std::fabs(n[d]) * 0.5*(hi[d]-lo[d]);
+      }
+      dist = std::fabs(dist);
+      if(dist > reach) return -1.0;
+      return 1.0 / (1.0 + dist);
+    });
+  }
+
+  /** Refine each block independently with probability prob. The outcome
+    * of a block depends only on the seed and its position. */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> generate_bernoulli(const GeneratorParams& p,
+                                                     double prob) {
+    const std::uint64_t seed = mix(p.seed ^ 0x5eedb10cull);
+    return generate_tree<D>(p, [seed,prob](unsigned lev, const double lo[D],
+                                           const double hi[D]) {
+      unsigned x[D];
+      block_coord<D>(lo, hi, x);
+      std::uint64_t h = block_hash<D>(seed, lev, x);
+      if(unit(h) >= prob) return -1.0;
+      return unit(mix(h));
+    });
+  }
+
+  /** Refine blocks containing any of nclusters*points_per_cluster points,
+    * drawn from Gaussians (std. dev. spread) around random centers.
+    * Blocks holding more points go first. */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> generate_clusters(const GeneratorParams& p,
+                                                    unsigned nclusters,
+                                                    unsigned points_per_cluster,
+                                                    double spread) {
+    const double width0 = 1.0 / longest_side<D>(p);
+    double extent[D];
+    for(unsigned d=0; d < D; d++) extent[d] = p.top[d] * width0;
+
+    auto points = std::make_shared<std::vector<double>>();
+    points->reserve(std::size_t(nclusters)*points_per_cluster*D);
+    Stream rng(mix(p.seed ^ 0xc1057e7ull));
+    for(unsigned k=0; k < nclusters; k++) {
+      double c[D];
+      for(unsigned d=0; d < D; d++) c[d] = rng.uniform() * extent[d];
+      for(unsigned i=0; i < points_per_cluster; i++)
+        for(unsigned d=0; d < D; d++) {
+          double x = c[d] + spread*rng.normal();
+          points->push_back(std::min(std::max(x, 0.0), std::nextafter(extent[d], 0.0)));
+        }
+    }
+
+    // points per occupied block, built once per level
+    typedef std::unordered_map<std::array<unsigned,D>,unsigned,CoordHash<D>> Counts;
+    auto counts = std::make_shared<std::map<unsigned,Counts>>();
+    auto key = [](const unsigned x[D]) {
+      std::array<unsigned,D> k;
+      std::copy(x, x+D, k.begin());
+      return k;
+    };
+    return generate_tree<D>(p, [=](unsigned lev, const double lo[D],
+                                   const double hi[D]) {
+      auto it = counts->find(lev);
+      if(it == counts->end()) {
+        Counts& level_counts = (*counts)[lev];
+        const double scale = std::ldexp(1.0/width0, int(lev));
+        for(std::size_t i=0; i < points->size(); i += D) {
+          unsigned x[D];
+          for(unsigned d=0; d < D; d++)
+            x[d] = static_cast<unsigned>((*points)[i+d] * scale);
+          level_counts[key(x)] += 1;
+        }
+        it = counts->find(lev);
+      }
+      unsigned x[D];
+      block_coord<D>(lo, hi, x);
+      auto c = it->second.find(key(x));
+      return c == it->second.end() ? -1.0 : double(c->second);
+    });
+  }
+
+  template std::vector<int> generate_includes<1>(const GeneratorParams&);
+  template std::shared_ptr<MortonTreeT<1>> generate_tree<1>(const GeneratorParams&, const RefinePattern&);
+  template std::shared_ptr<MortonTreeT<1>> generate_uniform<1>(const GeneratorParams&);
+  template std::shared_ptr<MortonTreeT<1>> generate_shell<1>(const GeneratorParams&, const double[], double, double);
+  template std::shared_ptr<MortonTreeT<1>> generate_shock<1>(const GeneratorParams&, const double[], double);
+  template std::shared_ptr<MortonTreeT<1>> generate_bernoulli<1>(const GeneratorParams&, double);
+  template std::shared_ptr<MortonTreeT<1>> generate_clusters<1>(const GeneratorParams&, unsigned, unsigned, double);
+  template std::vector<int> generate_includes<2>(const GeneratorParams&);
+  template std::shared_ptr<MortonTreeT<2>> generate_tree<2>(const GeneratorParams&, const RefinePattern&);
+  template std::shared_ptr<MortonTreeT<2>> generate_uniform<2>(const GeneratorParams&);
+  template std::shared_ptr<MortonTreeT<2>> generate_shell<2>(const GeneratorParams&, const double[], double, double);
+  template std::shared_ptr<MortonTreeT<2>> generate_shock<2>(const GeneratorParams&, const double[], double);
+  template std::shared_ptr<MortonTreeT<2>> generate_bernoulli<2>(const GeneratorParams&, double);
+  template std::shared_ptr<MortonTreeT<2>> generate_clusters<2>(const GeneratorParams&, unsigned, unsigned, double);
+  template std::vector<int> generate_includes<3>(const GeneratorParams&);
+  template std::shared_ptr<MortonTreeT<3>> generate_tree<3>(const GeneratorParams&, const RefinePattern&);
+  template std::shared_ptr<MortonTreeT<3>> generate_uniform<3>(const GeneratorParams&);
+  template std::shared_ptr<MortonTreeT<3>> generate_shell<3>(const GeneratorParams&, const double[], double, double);
+  template std::shared_ptr<MortonTreeT<3>> generate_shock<3>(const GeneratorParams&, const double[], double);
+  template std::shared_ptr<MortonTreeT<3>> generate_bernoulli<3>(const GeneratorParams&, double);
+  template std::shared_ptr<MortonTreeT<3>> generate_clusters<3>(const GeneratorParams&, unsigned, unsigned, double);
+
+}
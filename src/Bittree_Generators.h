@@ -0,0 +1,81 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_GENERATORS_H__
+#define BITTREE_GENERATORS_H__
+
+#include "Bittree_MortonTree.h"
+
+#include <cstdint>
+#include <functional>
+
+namespace bittree {
+
+  /** Parameters shared by all tree generators.
+   *
+   *  Trees are grown level by level. On each level every block the pattern
+   *  asks for is refined at once with a single MortonTree::refine, until
+   *  max_levels is reached or the next level would exceed target_blocks.
+   *  The level that crosses the target is refined only partially, highest
+   *  priority blocks first, so the final count lands just under the target.
+   *
+   *  Block positions are given to patterns in normalized coordinates: the
+   *  longest side of the top-level grid spans [0,1].
+   *
+   *  The generators take the dimensionality as a template argument, which
+   *  defaults to BTDIM; only the first D entries of top are used.
+   */
+  struct GeneratorParams {
+    GeneratorParams();
+
+    unsigned top[3];             //!< Top-level grid (default 1 in every dim)
+    double include_fraction;     //!< Fraction of top-level blocks kept (1 = all)
+    std::uint64_t target_blocks; //!< Stop refining once this many blocks exist
+    unsigned max_levels;         //!< Maximum number of levels in the tree
+    std::uint64_t seed;          //!< Seed for the mask and random patterns
+    Curve curve;                 //!< Sibling order of the tree (default Morton)
+  };
+
+  /** Refinement criterion. Given a block's level and normalized bounds,
+    * return its priority, or a negative value to leave it a leaf.
+    * lo and hi have one entry per dimension. */
+  typedef std::function<double(unsigned lev, const double lo[],
+                               const double hi[])> RefinePattern;
+
+  template<unsigned D=BTDIM>
+  std::vector<int> generate_includes(const GeneratorParams& p);
+  template<unsigned D=BTDIM>
+  std::shared_ptr<MortonTreeT<D>> generate_tree(const GeneratorParams& p,
+                                                const RefinePattern& pattern);
+
+  // Patterns
+  template<unsigned D=BTDIM>
+  std::shared_ptr<MortonTreeT<D>> generate_uniform(const GeneratorParams& p);
+  template<unsigned D=BTDIM>
+  std::shared_ptr<MortonTreeT<D>> generate_shell(const GeneratorParams& p,
+                                                 const double center[],
+                                                 double radius, double thickness);
+  template<unsigned D=BTDIM>
+  std::shared_ptr<MortonTreeT<D>> generate_shock(const GeneratorParams& p,
+                                                 const double normal[],
+                                                 double offset);
+  template<unsigned D=BTDIM>
+  std::shared_ptr<MortonTreeT<D>> generate_bernoulli(const GeneratorParams& p,
+                                                     double prob);
+  template<unsigned D=BTDIM>
+  std::shared_ptr<MortonTreeT<D>> generate_clusters(const GeneratorParams& p,
+                                                    unsigned nclusters,
+                                                    unsigned points_per_cluster,
+                                                    double spread);
+}
+#endif
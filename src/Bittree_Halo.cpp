@@ -0,0 +1,442 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_Halo.h"
+#include "Bittree_MortonTree.h"
+
+#include <algorithm>
+
+namespace bittree {
+
+  /** One sweep over the leaves of a Morton range, top down in curve order.
+   *
+   *  Every visited block carries a table of what lies across each of its
+   *  3^D-1 faces, edges and corners: the same-level block there, or the
+   *  coarser leaf covering it, or nothing outside the domain. A child's table
+   *  follows from its parent's: a direction either stays among the
+   *  siblings or crosses into the parent's neighbor, which is refined
+   *  (take its child) or a leaf (coarser for the child). Each step is one
+   *  rank query, so no neighbor is searched for from the top. Subtrees
+   *  outside the range are skipped.
+   *
+   *  Directions are sums of (s_d+1)*3^d over steps s_d in {-1,0,1}.
+   */
+  template<unsigned D>
+  class NeighborSweepT {
+  public:
+    static constexpr unsigned nkids = 1u<<D;
+    static constexpr unsigned ndir = D==1 ? 3u : D==2 ? 9u : 27u;
+    static constexpr unsigned center = ndir/2u;   //!< Direction with no step
+    static constexpr unsigned ncells = 1u<<(2u*D); //!< Children of a block and its neighbors
+    static const unsigned none = ~0u;
+
+    /** Block on a level, with the Morton index contributed by its
+      * ancestors so that a leaf's Morton index is pre + below(lev, ix) */
+    struct Node {
+      IdType ix;
+      IdType pre;
+      unsigned lev;          //!< none if outside the domain
+      unsigned char state;
+      bool parent;
+    };
+
+    NeighborSweepT(const MortonTreeT<D>& tree, IdType mort0, IdType mort1);
+
+    /** Calls leaf(n, nbr) on every leaf of the range in curve order, with
+      * nbr[dir] what lies across each direction */
+    template<class Fn> void run(Fn&& leaf);
+
+    /** Calls fn on the leaves below the refined block p that touch, across
+      * dir, the block p is seen from */
+    template<class Fn> void finer(const Node& p, unsigned dir, Fn&& fn) const;
+
+    IdType id(const Node& n) const { return t_.level_id0(n.lev) + n.ix; }
+    IdType mort(const Node& leaf) const { return leaf.pre + t_.below(leaf.lev, leaf.ix); }
+    bool local(const Node& leaf) const {
+      return leaf.lev < lo_.size() && leaf.ix >= lo_[leaf.lev] && leaf.ix < hi_[leaf.lev];
+    }
+    /** Id of the child of the refined block p with child bits kid */
+    IdType child_id(const Node& p, unsigned kid) const {
+      return t_.level_id0(p.lev+1u) + (t_.parents_before(p.lev, p.ix) << D) + ct_.slot[p.state][kid];
+    }
+    /** Ancestor on level lev of the leaf passed to the run callback */
+    const Node& ancestor(unsigned lev) const { return path_[lev]; }
+    unsigned kind(unsigned dir) const { return kind_[dir]; }
+
+  private:
+    IdType start(unsigned lev, IdType ix) const;
+    IdType first_at(unsigned lev, IdType mort) const;
+    Node top(IdType ix, unsigned x[D]) const;
+    Node child(const Node& p, IdType c0, unsigned slot) const;
+    template<class Fn> void visit(const Node& n, const Node* nbr, bool inside, Fn& leaf);
+
+    const MortonTreeT<D>& t_;
+    const CurveTableT<D>& ct_;
+    IdType m0_, m1_;                    //!< Morton range
+    std::vector<IdType> lo_, hi_;       //!< Index range of its leaves on each level
+    std::vector<Node> path_;            //!< Block being visited on each level
+
+    unsigned char cell_[nkids][ndir];   //!< Cell holding the neighbor of a child
+    unsigned char cdir_[ncells];        //!< Neighbor of the parent holding a cell
+    unsigned char ckid_[ncells];        //!< Which child of that neighbor it is
+    unsigned char adj_[ndir];           //!< Children touching the block across dir
+    unsigned char kind_[ndir];          //!< Nonzero steps of dir
+  };
+
+  template<unsigned D> constexpr unsigned NeighborSweepT<D>::nkids;
+  template<unsigned D> constexpr unsigned NeighborSweepT<D>::ndir;
+  template<unsigned D> constexpr unsigned NeighborSweepT<D>::center;
+  template<unsigned D> constexpr unsigned NeighborSweepT<D>::ncells;
+
+  template<unsigned D>
+  NeighborSweepT<D>::NeighborSweepT(const MortonTreeT<D>& tree, IdType mort0, IdType mort1):
+    t_(tree), ct_(tree.curve_table()), m0_(mort0), m1_(std::min(mort1, tree.blocks())) {
+    // cells are the 4^D children of a block and its neighbors, at child
+    // positions -1..2 in each dimension
+    for(unsigned q=0; q < ncells; q++) {
+      unsigned pd = 0u, kid = 0u, pow3 = 1u;
+      for(unsigned d=0; d < D; d++, pow3 *= 3u) {
+        const unsigned x = q >> (2u*d) & 3u;         // position + 1
+        pd += (x == 0u ? 0u : x == 3u ? 2u : 1u)*pow3;
+        kid |= ((x + 1u) & 1u) << d;
+      }
+      cdir_[q] = static_cast<unsigned char>(pd);
+      ckid_[q] = static_cast<unsigned char>(kid);
+    }
+    for(unsigned dir=0; dir < ndir; dir++) {
+      unsigned pow3 = 1u, nz = 0u;
+      unsigned adj = (1u<<nkids) - 1u;
+      for(unsigned k=0; k < nkids; k++) cell_[k][dir] = 0u;
+      for(unsigned d=0; d < D; d++, pow3 *= 3u) {
+        const unsigned s = dir/pow3 % 3u;            // step + 1
+        if(s != 1u) nz++;
+        for(unsigned k=0; k < nkids; k++) {
+          const unsigned x = (k>>d & 1u) + s;          // position + 1
+          cell_[k][dir] = static_cast<unsigned char>(cell_[k][dir] | x << (2u*d));
+          // across +d only the lower children touch, across -d the upper
+          if((s == 2u && (k>>d & 1u)) || (s == 0u && !(k>>d & 1u)))
+            adj &= ~(1u<<k);
+        }
+      }
+      adj_[dir] = static_cast<unsigned char>(adj);
+      kind_[dir] = static_cast<unsigned char>(nz);
+    }
+
+    if(m0_ < m1_) {
+      for(unsigned lev=0; lev < t_.levels(); lev++) {
+        lo_.push_back(first_at(lev, m0_));
+        hi_.push_back(first_at(lev, m1_));
+      }
+    }
+    path_.resize(t_.levels());
+  }
+
+  /** Morton index of the first block in the subtree of block ix on level
+    * lev, by walking up to its ancestors */
+  template<unsigned D>
+  IdType NeighborSweepT<D>::start(unsigned lev, IdType ix) const {
+    IdType pre = 0u, a = ix;
+    for(unsigned l=lev; l > 0u; l--) {
+      const IdType p = t_.parent_find(l-1u, a >> D) - t_.level_id0(l-1u);
+#ifdef ALT_MORTON_ORDER
+      pre += p + ((a & (nkids-1u)) >= nkids/2u ? 1u : 0u);
+#else
+      pre += p + 1u;
+#endif
+      a = p;
+    }
+    return pre + t_.below(lev, ix);
+  }
+
+  /** First index on level lev whose subtree starts at or after mort. Starts
+    * increase along a level, so the leaves of the range on a level are the
+    * indices [first_at(m0), first_at(m1)). */
+  template<unsigned D>
+  IdType NeighborSweepT<D>::first_at(unsigned lev, IdType mort) const {
+    IdType lo = 0u, hi = t_.level_blocks(lev);
+    while(lo < hi) {
+      const IdType mid = lo + (hi - lo)/2u;
+      if(start(lev, mid) < mort) lo = mid + 1u;
+      else hi = mid;
+    }
+    return lo;
+  }
+
+  template<unsigned D>
+  typename NeighborSweepT<D>::Node NeighborSweepT<D>::top(IdType ix, unsigned x[D]) const {
+    Node n;
+    n.ix = ix;
+    n.pre = 0u;
+    n.lev = 0u;
+    n.state = 0u;
+    n.parent = t_.block_is_parent(t_.level_id0(0) + ix);
+    t_.top_grid().mort_to_coord(unsigned(t_.bits_->find(0u, ix)), x);
+    return n;
+  }
+
+  template<unsigned D>
+  typename NeighborSweepT<D>::Node NeighborSweepT<D>::child(const Node& p, IdType c0,
+                                                            unsigned slot) const {
+    Node c;
+    c.ix = c0 + slot;
+#ifdef ALT_MORTON_ORDER
+    c.pre = p.pre + p.ix + (slot >= nkids/2u ? 1u : 0u);
+#else
+    c.pre = p.pre + p.ix + 1u;
+#endif
+    c.lev = p.lev + 1u;
+    c.state = ct_.next[p.state][slot];
+    c.parent = t_.block_is_parent(t_.level_id0(c.lev) + c.ix);
+    return c;
+  }
+
+  template<unsigned D>
+  template<class Fn>
+  void NeighborSweepT<D>::run(Fn&& leaf) {
+    if(m0_ >= m1_) return;
+    // first top-level block whose subtree reaches m0, as in the leaf iterator
+    const IdType ntop = t_.level_blocks(0);
+    IdType lo = 0u, hi = ntop;
+    while(hi - lo > 1u) {
+      IdType mid = (lo + hi) >> 1;
+      if(t_.below(0u, mid) <= m0_) lo = mid;
+      else hi = mid;
+    }
+    for(IdType ix=lo; ix < ntop && t_.below(0u, ix) < m1_; ix++) {
+      unsigned x[D];
+      const Node n = top(ix, x);
+      Node nbr[ndir];
+      for(unsigned dir=0; dir < ndir; dir++) {
+        unsigned y[D];
+        bool in = true;
+        unsigned pow3 = 1u;
+        for(unsigned d=0; d < D; d++, pow3 *= 3u) {
+          y[d] = x[d] + (dir/pow3 % 3u) - 1u;    // wraps below 0
+          in = in && y[d] < t_.top_size(d);
+        }
+        nbr[dir].lev = none;
+        if(!in || dir == center) continue;
+        const unsigned m = t_.top_grid().coord_to_mort(y);
+        if(!t_.bits_->get(m)) continue;
+        nbr[dir] = n;
+        nbr[dir].ix = t_.bits_->count(0u, m);
+        nbr[dir].parent = t_.block_is_parent(t_.level_id0(0) + nbr[dir].ix);
+      }
+      visit(n, nbr, false, leaf);
+    }
+  }
+
+  /** Visits the subtree of n, whose neighbors are nbr. inside is set once
+    * the whole subtree is known to lie in the range. */
+  template<unsigned D>
+  template<class Fn>
+  void NeighborSweepT<D>::visit(const Node& n, const Node* nbr, bool inside, Fn& leaf) {
+    if(!inside) {
+      const IdType a = n.pre + t_.below(n.lev, n.ix);
+      const IdType b = n.pre + t_.below(n.lev, n.ix + 1u);
+      if(b <= m0_ || a >= m1_) return;
+      inside = a >= m0_ && b <= m1_;
+    }
+    path_[n.lev] = n;
+    if(!n.parent) {
+      leaf(n, nbr);
+      return;
+    }
+
+    // first child of the block and of every refined same-level neighbor
+    IdType c0[ndir] = {};
+    c0[center] = t_.parents_before(n.lev, n.ix) << D;
+    for(unsigned dir=0; dir < ndir; dir++)
+      if(dir != center && nbr[dir].lev == n.lev && nbr[dir].parent)
+        c0[dir] = t_.parents_before(n.lev, nbr[dir].ix) << D;
+
+    // each cell once, shared by the children that see it
+    Node cell[ncells];
+    for(unsigned q=0; q < ncells; q++) {
+      const Node& p = cdir_[q] == center ? n : nbr[cdir_[q]];
+      if(p.lev == n.lev && p.parent)
+        cell[q] = child(p, c0[cdir_[q]], ct_.slot[p.state][ckid_[q]]);
+      else
+        cell[q] = p;
+    }
+
+    Node cn[ndir];
+    for(unsigned s=0; s < nkids; s++) {
+      const unsigned k = ct_.kid[n.state][s];
+      for(unsigned dir=0; dir < ndir; dir++)
+        cn[dir] = cell[cell_[k][dir]];
+      visit(cn[center], cn, inside, leaf);
+    }
+  }
+
+  template<unsigned D>
+  template<class Fn>
+  void NeighborSweepT<D>::finer(const Node& p, unsigned dir, Fn&& fn) const {
+    const IdType c0 = t_.parents_before(p.lev, p.ix) << D;
+    for(unsigned s=0; s < nkids; s++) {
+      if(!(adj_[dir] >> ct_.kid[p.state][s] & 1u)) continue;
+      const Node c = child(p, c0, s);
+      if(c.parent) finer(c, dir, fn);
+      else fn(c);
+    }
+  }
+
+  /** Guard-cell exchange graph of rank under a Morton partition: rank r
+    * owns the leaves with Morton index in [partition[r], partition[r+1]),
+    * so partition holds nranks+1 nondecreasing bounds. Lists, per other
+    * rank, every remote leaf overlapping a guard region of a local leaf
+    * (see HaloGraph). Costs one sweep over the rank's subtrees. */
+  template<unsigned D>
+  HaloGraph MortonTreeT<D>::halo_graph(const std::vector<IdType>& partition, int rank) const {
+    typedef NeighborSweepT<D> Sweep;
+    typedef typename Sweep::Node Node;
+    if(partition.size() < 2u || rank < 0 || std::size_t(rank)+1u >= partition.size())
+      throw std::invalid_argument("halo_graph: rank outside the partition");
+    const std::size_t nranks = partition.size() - 1u;
+    Sweep sweep(*this, partition[std::size_t(rank)], partition[std::size_t(rank)+1u]);
+
+    std::vector<HaloGraph::Edge> edges;
+    std::vector<int> owner;
+    auto add = [&](const Node& n, IdType id, const Node& r, unsigned dir) {
+      if(sweep.local(r)) return;
+      const IdType mort = sweep.mort(r);
+      const std::size_t o = std::size_t(std::upper_bound(partition.begin(), partition.end(), mort)
+                                        - partition.begin());
+      if(o == 0u || o > nranks) return;
+      HaloGraph::Edge e;
+      e.local = id;
+      e.remote = sweep.id(r);
+      e.dir = static_cast<unsigned char>(dir);
+      e.kind = static_cast<unsigned char>(sweep.kind(dir));
+      e.rel = static_cast<signed char>(int(r.lev) - int(n.lev));
+      edges.push_back(e);
+      owner.push_back(int(o) - 1);
+    };
+    sweep.run([&](const Node& n, const Node* nbr) {
+      const IdType id = sweep.id(n);
+      for(unsigned dir=0; dir < Sweep::ndir; dir++) {
+        const Node& p = nbr[dir];
+        if(dir == Sweep::center || p.lev == Sweep::none) continue;
+        if(p.lev == n.lev && p.parent)
+          sweep.finer(p, dir, [&](const Node& r) { add(n, id, r, dir); });
+        else
+          add(n, id, p, dir);
+      }
+    });
+
+    // group by rank, keeping the sweep order within each
+    HaloGraph g;
+    std::vector<IdType> start(nranks + 1u, 0u);
+    for(int r : owner) start[std::size_t(r)+1u]++;
+    for(std::size_t r=0; r < nranks; r++) {
+      if(start[r+1u] != 0u) {
+        g.ranks.push_back(int(r));
+        g.offsets.push_back(start[r]);
+      }
+      start[r+1u] += start[r];
+    }
+    g.offsets.push_back(start[nranks]);
+    g.edges.resize(edges.size());
+    for(std::size_t e=0; e < edges.size(); e++)
+      g.edges[start[std::size_t(owner[e])]++] = edges[e];
+    return g;
+  }
+
+  /** Faces between a leaf and finer blocks, for every such face with a
+    * leaf of [mort0, mort1) on either side, sorted by coarse id and face.
+    * A call sweeps the range's leaves once. The tree never changes, so
+    * the results for the faces_cached most recently used ranges are kept
+    * with it, and later calls for those return them. The sweep runs
+    * outside the cache lock. */
+  template<unsigned D>
+  typename MortonTreeT<D>::CoarseFineFaces
+  MortonTreeT<D>::coarse_fine_faces(IdType mort0, IdType mort1) const {
+    const std::pair<IdType,IdType> range(mort0, mort1);
+    // moves the entry of range, if cached, to the front
+    auto lookup = [&]() {
+      auto it = std::find_if(faces_.begin(), faces_.end(),
+                             [&](const typename decltype(faces_)::value_type& f) { return f.first == range; });
+      if(it == faces_.end()) return CoarseFineFaces();
+      std::rotate(faces_.begin(), it, it+1);
+      return faces_.front().second;
+    };
+    {
+      std::lock_guard<std::mutex> lock(faces_mtx_);
+      CoarseFineFaces cached = lookup();
+      if(cached) return cached;
+    }
+
+    typedef NeighborSweepT<D> Sweep;
+    typedef typename Sweep::Node Node;
+    Sweep sweep(*this, mort0, mort1);
+    std::vector<CoarseFineFace> faces;
+    // blocks across face 2d+side of coarse leaf c: children of q on side
+    // 1-side of dimension d
+    auto add = [&](const Node& c, const Node& q, unsigned d, unsigned side) {
+      CoarseFineFace f;
+      f.coarse = sweep.id(c);
+      f.face = 2u*d + side;
+      unsigned i = 0;
+      for(unsigned kid=0; kid < nkids; kid++)
+        if((kid>>d & 1u) != side) f.fine[i++] = sweep.child_id(q, kid);
+      faces.push_back(f);
+    };
+    sweep.run([&](const Node& n, const Node* nbr) {
+      unsigned pow3 = 1u;
+      for(unsigned d=0; d < D; d++, pow3 *= 3u) {
+        for(unsigned side=0; side < 2u; side++) {
+          const Node& p = nbr[side ? Sweep::center + pow3 : Sweep::center - pow3];
+          if(p.lev == Sweep::none) continue;
+          if(p.lev == n.lev && p.parent) add(n, p, d, side);
+          else if(p.lev < n.lev) add(p, sweep.ancestor(p.lev), d, 1u-side);
+        }
+      }
+    });
+
+    // the finer side finds a face once per leaf along it
+    std::sort(faces.begin(), faces.end(), [](const CoarseFineFace& a, const CoarseFineFace& b) {
+      return a.coarse < b.coarse || (a.coarse == b.coarse && a.face < b.face);
+    });
+    faces.erase(std::unique(faces.begin(), faces.end(),
+                            [](const CoarseFineFace& a, const CoarseFineFace& b) {
+                              return a.coarse == b.coarse && a.face == b.face;
+                            }), faces.end());
+
+    std::lock_guard<std::mutex> lock(faces_mtx_);
+    CoarseFineFaces cached = lookup(); // another thread may have been faster
+    if(cached) return cached;
+    CoarseFineFaces result = std::make_shared<const std::vector<CoarseFineFace>>(std::move(faces));
+    faces_.insert(faces_.begin(), std::make_pair(range, result));
+    if(faces_.size() > faces_cached) faces_.pop_back();
+    return result;
+  }
+
+  /** Copies coarse_fine_faces(mort0, mort1) to out, if not null, and
+    * returns their number */
+  template<unsigned D>
+  IdType MortonTreeT<D>::coarse_fine_faces(IdType mort0, IdType mort1, CoarseFineFace* out) const {
+    const CoarseFineFaces faces = coarse_fine_faces(mort0, mort1);
+    if(out) std::copy(faces->begin(), faces->end(), out);
+    return IdType(faces->size());
+  }
+
+  template HaloGraph MortonTreeT<1>::halo_graph(const std::vector<IdType>&, int) const;
+  template HaloGraph MortonTreeT<2>::halo_graph(const std::vector<IdType>&, int) const;
+  template HaloGraph MortonTreeT<3>::halo_graph(const std::vector<IdType>&, int) const;
+  template MortonTreeT<1>::CoarseFineFaces MortonTreeT<1>::coarse_fine_faces(IdType, IdType) const;
+  template MortonTreeT<2>::CoarseFineFaces MortonTreeT<2>::coarse_fine_faces(IdType, IdType) const;
+  template MortonTreeT<3>::CoarseFineFaces MortonTreeT<3>::coarse_fine_faces(IdType, IdType) const;
+  template IdType MortonTreeT<1>::coarse_fine_faces(IdType, IdType, CoarseFineFace*) const;
+  template IdType MortonTreeT<2>::coarse_fine_faces(IdType, IdType, CoarseFineFace*) const;
+  template IdType MortonTreeT<3>::coarse_fine_faces(IdType, IdType, CoarseFineFace*) const;
+}
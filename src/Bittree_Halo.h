@@ -0,0 +1,49 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_HALO_H__
+#define BITTREE_HALO_H__
+
+#include "Bittree_Prelude.h"
+
+namespace bittree {
+
+  /** Guard-cell exchange graph of one rank, from MortonTreeT::halo_graph.
+   *
+   *  The edges with neighbor rank ranks[i] are edges[offsets[i],
+   *  offsets[i+1]), in Morton order of the local leaf. ranks is sorted and
+   *  never holds the rank itself. The graph is symmetric across ranks, so
+   *  ranks serves as both sources and destinations of
+   *  MPI_Dist_graph_create_adjacent, with the edge counts as weights.
+   */
+  struct HaloGraph {
+    /** Remote leaf overlapping one guard region of a local leaf. A local
+      * leaf has 3^D-1 guard regions, one per direction; a region is
+      * covered by one coarser or same-level leaf, or by several finer
+      * ones, and a coarser leaf can cover several regions of the same
+      * local leaf. */
+    struct Edge {
+      IdType local;        //!< Local leaf
+      IdType remote;       //!< Remote leaf
+      unsigned char dir;   //!< Direction, sum of (s_d+1)*3^d for steps s_d in {-1,0,1}
+      unsigned char kind;  //!< Nonzero steps in dir: 1 face, 2 edge, 3 corner
+      signed char rel;     //!< Level of remote minus level of local
+    };
+
+    std::vector<int> ranks;        //!< Neighbor ranks, increasing
+    std::vector<IdType> offsets;   //!< Edges of ranks[i] start at offsets[i]
+    std::vector<Edge> edges;
+  };
+
+}
+#endif
@@ -0,0 +1,307 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_History.h"
+#include "Bittree_MortonTree.h"
+#include "Bittree_Bits.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace bittree {
+
+  namespace {
+    /** Header of one snapshot in a history file. The payload follows it
+     *  and is padded to a multiple of 64 bytes, so a keyframe's image is
+     *  aligned like a saved tree. A keyframe's payload is the image
+     *  written by write_image; a delta's is a sequence of encoded refine
+     *  deltas (see encode_delta). Fields are in the byte order of the
+     *  writer, which is recorded in endian. */
+    struct RecordHeader {
+      char          magic[8];      //!< "BTHIST"
+      std::uint32_t endian;        //!< 0x01020304, as seen by the writer
+      std::uint32_t version;       //!< 1
+      std::uint32_t dim;           //!< D
+      std::uint32_t id_bytes;      //!< sizeof(IdType) of the writer
+      std::uint32_t keyframe;      //!< 1 for a full image, 0 for deltas
+      std::uint32_t pad;
+      std::uint64_t index;         //!< Snapshot number, from 0
+      std::uint64_t hash;          //!< MortonTreeT::hash of the snapshot's tree
+      std::uint64_t steps;         //!< Refine deltas in the payload
+      std::uint64_t size;          //!< Payload bytes, padded
+    };
+    const char history_magic[8] = "BTHIST";
+    const std::uint32_t history_endian = 0x01020304u;
+    const std::uint32_t history_version = 1u;
+    const std::uint64_t raw_code = ~std::uint64_t(0);
+
+    inline std::uint64_t align64(std::uint64_t x) { return (x + 63u) & ~std::uint64_t(63u); }
+
+    /** Appends delta to out as four words, its length, the number of
+      * marks n, the code and the number of data words, then the data.
+      *
+      * The Elias-Fano code of the marked bitids x_i in a universe of u
+      * stores the low l = floor(log2(u/n)) bits of each in n*l bits, and
+      * the high parts as a unary bitmap with bit (x_i >> l) + i set, about
+      * n*(2 + log2(u/n)) bits in all. Deltas marking more than about a
+      * quarter of the blocks are smaller as the delta's own words, which
+      * are stored instead with code raw_code. */
+    void encode_delta(const BitArray& delta, std::vector<std::uint64_t>& out) {
+      // marks, read off the words; past u/4 of them the bitmap is smaller
+      const std::uint64_t u = delta.length();
+      const BitArray::WType* w = delta.word_buf();
+      const IdType nw = delta.word_count();
+      std::vector<IdType> ids;
+      bool raw = false;
+      for(IdType iw=0; iw < nw && !raw; iw++)
+        for(BitArray::WType x = w[iw]; x; x &= x - 1u) {
+          const IdType ix = (iw << BitArray::logw) + IdType(bitffs(x) - 1);
+          if(ix < u) ids.push_back(ix);
+          raw = ids.size() > u/4u;
+        }
+      const std::uint64_t n = raw ? delta.count() : ids.size();
+      unsigned l = 0u;
+      if(n > 0u)
+        while((u/n) >> (l+1u)) l++;
+      const std::uint64_t nlow = (n*l + 63u)/64u;
+      const std::uint64_t nhigh = (n + (u >> l) + 1u + 63u)/64u;
+      const std::size_t raw_bytes = std::size_t(nw)*sizeof(BitArray::WType);
+      const std::uint64_t nraw = (raw_bytes + 7u)/8u;
+      raw = raw || nraw < nlow + nhigh;
+      out.push_back(u);
+      out.push_back(n);
+      out.push_back(raw ? raw_code : l);
+      out.push_back(raw ? nraw : nlow + nhigh);
+      const std::size_t pos = out.size();
+      out.resize(pos + (raw ? nraw : nlow + nhigh), 0u);
+      if(raw) {
+        std::memcpy(&out[pos], w, raw_bytes);
+        return;
+      }
+      std::uint64_t* low = &out[pos];
+      std::uint64_t* high = low + nlow;
+      const std::uint64_t lmask = (std::uint64_t(1) << l) - 1u;
+      for(std::uint64_t i=0; i < n; i++) {
+        const std::uint64_t x = ids[i];
+        if(l > 0u) {
+          const std::uint64_t off = i*l, v = x & lmask;
+          low[off >> 6] |= v << (off & 63u);
+          if((off & 63u) + l > 64u)
+            low[(off >> 6) + 1u] |= v >> (64u - (off & 63u));
+        }
+        const std::uint64_t h = (x >> l) + i;
+        high[h >> 6] |= std::uint64_t(1) << (h & 63u);
+      }
+    }
+
+    /** Decodes the delta at p, which must be for a tree with len block
+      * ids, and advances p past it */
+    std::shared_ptr<BitArray> decode_delta(const std::uint64_t*& p, const std::uint64_t* end,
+                                           IdType len) {
+      if(end - p < 4 || std::uint64_t(end - p - 4) < p[3] || p[0] != len)
+        throw std::runtime_error("Tree history is corrupt");
+      const std::uint64_t n = p[1], code = p[2], nwords = p[3];
+      const std::uint64_t* data = p + 4;
+      p = data + nwords;
+      std::shared_ptr<BitArray> delta = std::make_shared<BitArray>(len);
+      delta->fill(false);
+      if(code == raw_code) {
+        const std::size_t raw_bytes = std::size_t(delta->word_count())*sizeof(BitArray::WType);
+        if(nwords*8u < raw_bytes)
+          throw std::runtime_error("Tree history is corrupt");
+        std::memcpy(delta->word_buf(), data, raw_bytes);
+        return delta;
+      }
+      const unsigned l = unsigned(code);
+      const std::uint64_t nlow = (n*l + 63u)/64u;
+      if(code >= 64u || nlow > nwords)
+        throw std::runtime_error("Tree history is corrupt");
+      const std::uint64_t lmask = (std::uint64_t(1) << l) - 1u;
+      std::uint64_t i = 0u;
+      for(std::uint64_t w=nlow; w < nwords && i < n; w++) {
+        std::uint64_t bits = data[w];
+        while(bits && i < n) {
+          const std::uint64_t h = ((w - nlow) << 6) + std::uint64_t(bitffs(bits) - 1) - i;
+          std::uint64_t x = h << l;
+          if(l > 0u) {
+            const std::uint64_t off = i*l;
+            std::uint64_t v = data[off >> 6] >> (off & 63u);
+            if((off & 63u) + l > 64u)
+              v |= data[(off >> 6) + 1u] << (64u - (off & 63u));
+            x |= v & lmask;
+          }
+          if(x >= len)
+            throw std::runtime_error("Tree history is corrupt");
+          delta->set(IdType(x), true);
+          bits &= bits - 1u;
+          i++;
+        }
+      }
+      if(i < n)
+        throw std::runtime_error("Tree history is corrupt");
+      return delta;
+    }
+  }
+
+  /** Writer of a new history file at path. Nothing is written before the
+    * first snapshot, which is always a keyframe. */
+  template<unsigned D>
+  TreeHistoryWriterT<D>::TreeHistoryWriterT(const std::string& path, unsigned keyframe_every):
+    path_(path),
+    keyframe_every_(std::max(keyframe_every, 1u)),
+    count_(0u),
+    since_key_(0u),
+    steps_(0u),
+    hash_(0u),
+    chained_(false) {}
+
+  /** Record the refinement of tree by delta into refined. Refinements that
+    * do not start from the last snapshot or recorded tree break the chain,
+    * and the next snapshot becomes a keyframe; so do deltas adding up to
+    * more than a keyframe, which are dropped rather than kept. */
+  template<unsigned D>
+  void TreeHistoryWriterT<D>::record(const MortonTree& tree, const BitArray& delta,
+                                     const MortonTree& refined) {
+    if(chained_ && tree.hash() == hash_) {
+      encode_delta(delta, pending_);
+      steps_++;
+      hash_ = refined.hash();
+      if(pending_bytes() < refined.image_size()) return;
+    }
+    chained_ = false;
+    steps_ = 0u;
+    pending_.clear();
+  }
+
+  /** Append a snapshot of tree to the file: the deltas recorded since the
+    * last snapshot, or the full tree image. Returns the bytes written. */
+  template<unsigned D>
+  std::uint64_t TreeHistoryWriterT<D>::snapshot(const MortonTree& tree) {
+    const std::uint64_t h = tree.hash();
+    const bool keyframe = count_ == 0u || !chained_ || h != hash_ ||
+                          since_key_ + 1u >= keyframe_every_;
+    RecordHeader r;
+    std::memset(&r, 0, sizeof(r));
+    std::memcpy(r.magic, history_magic, sizeof(r.magic));
+    r.endian = history_endian;
+    r.version = history_version;
+    r.dim = D;
+    r.id_bytes = sizeof(IdType);
+    r.keyframe = keyframe ? 1u : 0u;
+    r.index = count_;
+    r.hash = h;
+    r.steps = keyframe ? 0u : steps_;
+    std::vector<char> payload;
+    if(keyframe) {
+      payload.resize(align64(tree.image_size()));
+      tree.write_image(payload.data());
+    }
+    else {
+      payload.resize(align64(pending_bytes()));
+      std::memcpy(payload.data(), pending_.data(), pending_bytes());
+    }
+    r.size = payload.size();
+
+    std::FILE* f = std::fopen(path_.c_str(), count_ == 0u ? "wb" : "ab");
+    if(!f)
+      throw std::runtime_error("Could not open " + path_ + " for writing");
+    std::size_t written = std::fwrite(&r, 1, sizeof(r), f);
+    written += std::fwrite(payload.data(), 1, payload.size(), f);
+    if(std::fclose(f) != 0 || written != sizeof(r) + payload.size())
+      throw std::runtime_error("Could not write " + path_);
+
+    count_++;
+    since_key_ = keyframe ? 0u : since_key_ + 1u;
+    steps_ = 0u;
+    hash_ = h;
+    chained_ = true;
+    pending_.clear();
+    return written;
+  }
+
+  /** Read the history file at path and index its snapshots. A snapshot
+    * cut short, as by a run that stopped while writing it, ends the
+    * history. */
+  template<unsigned D>
+  TreeHistoryReaderT<D>::TreeHistoryReaderT(const std::string& path):
+    data_(std::make_shared<std::vector<char>>()) {
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    if(!f)
+      throw std::runtime_error("Could not open " + path);
+    char buf[1<<16];
+    std::size_t m;
+    while((m = std::fread(buf, 1, sizeof(buf), f)) > 0u)
+      data_->insert(data_->end(), buf, buf + m);
+    std::fclose(f);
+
+    const std::uint64_t size = data_->size();
+    std::uint64_t off = 0u;
+    while(off + sizeof(RecordHeader) <= size) {
+      RecordHeader r;
+      std::memcpy(&r, data_->data() + off, sizeof(r));
+      if(std::memcmp(r.magic, history_magic, sizeof(r.magic)) != 0)
+        throw std::runtime_error("Not a Bittree history: " + path);
+      if(r.endian != history_endian)
+        throw std::runtime_error("Bittree history has foreign byte order");
+      if(r.version != history_version)
+        throw std::runtime_error("Unsupported Bittree history version");
+      if(r.dim != D)
+        throw std::runtime_error("Bittree history has a different dimensionality");
+      if(r.id_bytes != sizeof(IdType))
+        throw std::runtime_error("Bittree history has a different id size");
+      if(r.index != index_.size() || (index_.empty() && !r.keyframe) || r.size % 64u != 0u)
+        throw std::runtime_error("Bittree history is corrupt");
+      off += sizeof(RecordHeader);
+      if(r.size > size - off) break;
+      Entry e;
+      e.offset = off;
+      e.size = r.size;
+      e.steps = r.steps;
+      e.hash = r.hash;
+      e.keyframe = r.keyframe != 0u;
+      index_.push_back(e);
+      off += r.size;
+    }
+  }
+
+  /** Tree of snapshot i: the last keyframe at or before i, with the deltas
+    * after it replayed. The keyframe's image is used in place. Throws if
+    * a replayed tree does not match its snapshot's hash. */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> TreeHistoryReaderT<D>::tree(std::uint64_t i) const {
+    if(i >= index_.size())
+      throw std::out_of_range("No such snapshot in Bittree history");
+    std::uint64_t k = i;
+    while(!index_[k].keyframe) k--;
+    std::shared_ptr<MortonTree> tree = MortonTree::from_image(
+        data_, data_->data() + index_[k].offset, std::size_t(index_[k].size));
+    for(std::uint64_t j=k; j <= i; j++) {
+      const Entry& e = index_[j];
+      const std::uint64_t* p = reinterpret_cast<const std::uint64_t*>(data_->data() + e.offset);
+      const std::uint64_t* end = p + e.size/8u;
+      for(std::uint64_t s=0; s < e.steps; s++)
+        tree = tree->refine(decode_delta(p, end, tree->id_upper_bound()));
+      if(tree->hash() != e.hash)
+        throw std::runtime_error("Bittree history does not replay to its snapshot");
+    }
+    return tree;
+  }
+
+  template class TreeHistoryWriterT<1>;
+  template class TreeHistoryWriterT<2>;
+  template class TreeHistoryWriterT<3>;
+  template class TreeHistoryReaderT<1>;
+  template class TreeHistoryReaderT<2>;
+  template class TreeHistoryReaderT<3>;
+}
@@ -0,0 +1,100 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_HISTORY_H__
+#define BITTREE_HISTORY_H__
+
+#include "Bittree_BitArray.h"
+#include "Bittree_constants.h"
+
+#include <cstdint>
+#include <string>
+
+namespace bittree {
+
+  template<unsigned D> class MortonTreeT;
+
+  /** Writes the trees of a run to a history file, one snapshot per output.
+   *
+   *  Every refinement applied between two snapshots is recorded as its
+   *  refine delta, the set of marked bitids, in an Elias-Fano code (or as
+   *  a plain bitmap when that is smaller). A snapshot appends those deltas
+   *  to the file, so it costs O(changes) rather than O(tree). Every
+   *  keyframe_every-th snapshot, and whenever the recorded deltas would
+   *  not replay to the tree passed to snapshot, the full tree image is
+   *  written instead. Each snapshot carries the tree's hash, which the
+   *  reader checks after replaying.
+   *
+   *  Attached to a BittreeAmr (attach_history), record is called by every
+   *  refine_apply. Only the rank that writes the file needs one.
+   */
+  template<unsigned D>
+  class TreeHistoryWriterT {
+    typedef MortonTreeT<D> MortonTree;
+  public:
+    TreeHistoryWriterT(const std::string& path, unsigned keyframe_every=16);
+
+    void record(const MortonTree& tree, const BitArray& delta, const MortonTree& refined);
+    std::uint64_t snapshot(const MortonTree& tree);
+
+    std::uint64_t snapshots() const { return count_; }
+    std::size_t pending_bytes() const { return pending_.size()*sizeof(std::uint64_t); }
+
+  private:
+    std::string path_;
+    unsigned keyframe_every_;
+    std::uint64_t count_;                 //!< Snapshots written
+    std::uint64_t since_key_;             //!< Snapshots since the last keyframe
+    std::uint64_t steps_;                 //!< Refinements in pending_
+    std::uint64_t hash_;                  //!< Hash of the tree pending_ leads to
+    bool chained_;                        //!< pending_ leads from the last snapshot to hash_
+    std::vector<std::uint64_t> pending_;  //!< Encoded deltas since the last snapshot
+  };
+
+  /** Reads a history file written by TreeHistoryWriterT. tree(i) loads the
+   *  last keyframe at or before snapshot i and replays the deltas after
+   *  it through MortonTreeT::refine. */
+  template<unsigned D>
+  class TreeHistoryReaderT {
+    typedef MortonTreeT<D> MortonTree;
+  public:
+    explicit TreeHistoryReaderT(const std::string& path);
+
+    std::uint64_t snapshots() const { return index_.size(); }
+    bool is_keyframe(std::uint64_t i) const { return index_[i].keyframe; }
+    std::shared_ptr<MortonTree> tree(std::uint64_t i) const;
+
+  private:
+    struct Entry {
+      std::uint64_t offset;    //!< Payload offset in data_
+      std::uint64_t size;      //!< Payload bytes
+      std::uint64_t steps;     //!< Refinements, 0 for a keyframe
+      std::uint64_t hash;      //!< Hash of the snapshot's tree
+      bool keyframe;
+    };
+    std::shared_ptr<std::vector<char>> data_; //!< File contents, shared with keyframe trees
+    std::vector<Entry> index_;
+  };
+
+  extern template class TreeHistoryWriterT<1>;
+  extern template class TreeHistoryWriterT<2>;
+  extern template class TreeHistoryWriterT<3>;
+  extern template class TreeHistoryReaderT<1>;
+  extern template class TreeHistoryReaderT<2>;
+  extern template class TreeHistoryReaderT<3>;
+
+  typedef TreeHistoryWriterT<BTDIM> TreeHistoryWriter;
+  typedef TreeHistoryReaderT<BTDIM> TreeHistoryReader;
+
+}
+#endif
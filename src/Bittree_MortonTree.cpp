@@ -14,15 +14,113 @@
 #include "Bittree_MortonTree.h"
 
 #include "Bittree_Bits.h"
+#include "Bittree_Stats.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iomanip>
+#include <limits>
 #include <sstream>
 #include <iostream>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace bittree {
-  unsigned rect_coord_to_mort(const unsigned domain[BTDIM], const unsigned coord[BTDIM]) {
-    unsigned x[BTDIM], box[BTDIM];
-    for(unsigned d=0; d < BTDIM; d++) {
+  namespace {
+    /** Layout of a MortonTree image, as written by save and write_image.
+     *  All sections start on a 64-byte boundary so a mapped image can be
+     *  used in place. Fields are in the byte order of the writer, which
+     *  is recorded in endian. */
+    struct ImageHeader {
+      char          magic[8];      //!< "BITTREE"
+      std::uint32_t endian;        //!< image_endian, as seen by the writer
+      std::uint32_t version;       //!< image_version
+      std::uint32_t dim;           //!< D
+      std::uint32_t id_bytes;      //!< sizeof of ids, counts and checkpoints
+      std::uint32_t word_bytes;    //!< sizeof(BitArray::WType)
+      std::uint32_t levs;          //!< levs_
+      std::uint32_t lev0_blks[3];  //!< lev0_blks_, padded with 1s
+      std::uint32_t curve;         //!< Curve of the sibling order
+      std::uint64_t id0;           //!< id0_
+      std::uint64_t bit_len;       //!< length of the bit array
+      std::uint64_t nwords;        //!< words stored (BitArray::word_alloc)
+      std::uint64_t nchks;         //!< rank checkpoints stored
+      std::uint64_t level_off;     //!< offset of level_[].id1
+      std::uint64_t words_off;     //!< offset of word buffer
+      std::uint64_t chks_off;      //!< offset of rank checkpoints
+      std::uint64_t size;          //!< total size of the image
+    };
+    const char image_magic[8] = "BITTREE";
+    const std::uint32_t image_endian = 0x01020304u;
+    const std::uint32_t image_version = 2u;
+
+    inline std::uint64_t align64(std::uint64_t x) { return (x + 63u) & ~std::uint64_t(63u); }
+
+    /** True if n items of item bytes fit between off and end, without
+      * overflowing */
+    inline bool fits(std::uint64_t off, std::uint64_t n, std::uint64_t item, std::uint64_t end) {
+      return off <= end && n <= (end - off)/item;
+    }
+
+    /** True if the sections of h lie in order inside an image of size bytes */
+    bool image_sections_ok(const ImageHeader& h, std::size_t size) {
+      return h.size <= size && h.id_bytes > 0u && h.word_bytes > 0u &&
+             h.level_off >= sizeof(ImageHeader) &&
+             fits(h.level_off, h.levs, h.id_bytes, h.words_off) &&
+             fits(h.words_off, h.nwords, h.word_bytes, h.chks_off) &&
+             fits(h.chks_off, h.nchks, h.id_bytes, h.size);
+    }
+
+    template<class X>
+    inline void byteswap_array(char* p, std::uint64_t n) {
+      for(std::uint64_t i=0; i < n; i++) {
+        X x;
+        std::memcpy(&x, p + i*sizeof(X), sizeof(X));
+        x = byteswap(x);
+        std::memcpy(p + i*sizeof(X), &x, sizeof(X));
+      }
+    }
+
+    /** Convert an image written on a machine of the other byte order */
+    void byteswap_image(char* data, std::size_t size) {
+      if(size < sizeof(ImageHeader))
+        throw std::runtime_error("Bittree image truncated");
+      ImageHeader h;
+      std::memcpy(&h, data, sizeof(h));
+      std::uint32_t* u32[] = {&h.endian, &h.version, &h.dim, &h.id_bytes,
+                              &h.word_bytes, &h.levs, &h.lev0_blks[0],
+                              &h.lev0_blks[1], &h.lev0_blks[2], &h.curve};
+      for(std::uint32_t* f : u32) *f = byteswap(*f);
+      std::uint64_t* u64[] = {&h.id0, &h.bit_len, &h.nwords, &h.nchks,
+                              &h.level_off, &h.words_off, &h.chks_off, &h.size};
+      for(std::uint64_t* f : u64) *f = byteswap(*f);
+      if((h.id_bytes != 4 && h.id_bytes != 8) || h.word_bytes != 4)
+        throw std::runtime_error("Bittree image has an unsupported layout");
+      if(!image_sections_ok(h, size))
+        throw std::runtime_error("Bittree image is corrupt");
+      std::memcpy(data, &h, sizeof(h));
+      if(h.id_bytes == 8) {
+        byteswap_array<std::uint64_t>(data + h.level_off, h.levs);
+        byteswap_array<std::uint64_t>(data + h.chks_off, h.nchks);
+      }
+      else {
+        byteswap_array<std::uint32_t>(data + h.level_off, h.levs);
+        byteswap_array<std::uint32_t>(data + h.chks_off, h.nchks);
+      }
+      byteswap_array<std::uint32_t>(data + h.words_off, h.nwords);
+    }
+  }
+
+  template<unsigned D>
+  unsigned rect_coord_to_mort(const unsigned domain[], const unsigned coord[]) {
+    unsigned x[D], box[D];
+    for(unsigned d=0; d < D; d++) {
       x[d] = coord[d];
       box[d] = domain[d];
     }
@@ -32,7 +130,7 @@ namespace bittree {
       // find dim that can fit biggest pow2 strictly inside box
       unsigned max_pow2 = 0u;
       unsigned max_d;
-      for(unsigned d=0; d < BTDIM; d++) {
+      for(unsigned d=0; d < D; d++) {
         unsigned p2 = glb_pow2(box[d]-1u);
         if(p2 >= max_pow2) {
           max_pow2 = p2;
@@ -45,7 +143,7 @@ namespace bittree {
         box[max_d] = max_pow2;
       else {
         unsigned pop = 1u;
-        for(unsigned d=0; d < BTDIM; d++)
+        for(unsigned d=0; d < D; d++)
           pop *= d == max_d ? max_pow2 : box[d];
         mort += pop;
         x[max_d] -= max_pow2;
@@ -54,9 +152,10 @@ namespace bittree {
     }
   }
   
-  void rect_mort_to_coord(const unsigned domain[BTDIM], unsigned mort, unsigned coord[BTDIM]) {
-    unsigned box[BTDIM];
-    for(unsigned d=0; d < BTDIM; d++) {
+  template<unsigned D>
+  void rect_mort_to_coord(const unsigned domain[], unsigned mort, unsigned coord[]) {
+    unsigned box[D];
+    for(unsigned d=0; d < D; d++) {
       coord[d] = 0u;
       box[d] = domain[d];
     }
@@ -65,7 +164,7 @@ namespace bittree {
       // find dim that can fit biggest pow2 strictly inside box
       unsigned max_pow2 = 0u;
       unsigned max_d;
-      for(unsigned d=0; d < BTDIM; d++) {
+      for(unsigned d=0; d < D; d++) {
         unsigned p2 = glb_pow2(box[d]-1u);
         if(p2 >= max_pow2) {
           max_pow2 = p2;
@@ -75,7 +174,7 @@ namespace bittree {
       if(max_pow2 == 0u)
         return; // the box is just one, we're done
       unsigned pop = 1u; // left sub-box population
-      for(unsigned d=0; d < BTDIM; d++)
+      for(unsigned d=0; d < D; d++)
         pop *= d == max_d ? max_pow2 : box[d];
       if(mort < pop)
         box[max_d] = max_pow2;
@@ -87,12 +186,14 @@ namespace bittree {
     }
   }
   
-  MortonTree::MortonTree(const int size_in[BTDIM], const int includes[]) {
+  template<unsigned D>
+  MortonTreeT<D>::MortonTreeT(const int size_in[D], const int includes[], Curve curve):
+    curve_(curve), ct_(&CurveTableT<D>::get(curve)) {
 
     
     unsigned blkpop = 1;
-    unsigned size[BTDIM];
-    for(unsigned d=0; d < BTDIM; d++) {
+    unsigned size[D];
+    for(unsigned d=0; d < D; d++) {
       size[d] = static_cast<unsigned>(size_in[d]);
       lev0_blks_[d] = size[d];
       blkpop *= size[d];
@@ -102,69 +203,137 @@ namespace bittree {
     // the first blkpop bits of our bitarray are 'inclusion' bits
     // after that come the actual block bits for all but the last level, which has no bits
     id0_ = blkpop;
-    unsigned lev0_id1 = id0_;
+    IdType lev0_id1 = id0_;
+    top_ = std::make_shared<TopGridT<D>>(size);
     FastBitArray::Builder bldr(blkpop);
-    // generate inclusion bits
-    for(unsigned mort=0; mort < blkpop; mort++) {
-      unsigned x[BTDIM];
-      rect_mort_to_coord(size, mort, x);
-      unsigned ix = 0;
-      for(unsigned d=BTDIM; d--;) {
-        ix = size[d]*ix + x[d];
+    // generate inclusion bits, converting top-level coordinates in batches
+    const unsigned batch = 4096;
+    std::vector<unsigned> xs(D*std::min(blkpop, batch));
+    for(unsigned mort0=0; mort0 < blkpop; mort0 += batch) {
+      unsigned n = std::min(batch, blkpop - mort0);
+      top_->mort_to_coord(mort0, n, xs.data());
+      for(unsigned i=0; i < n; i++) {
+        const unsigned* x = &xs[D*i];
+        unsigned ix = 0;
+        for(unsigned d=D; d--;) {
+          ix = size[d]*ix + x[d];
+        }
+        unsigned include = (includes[ix]==0) ? 0 : 1;
+        lev0_id1 += include;
+        bldr.write<1>(include);
       }
-      unsigned include = (includes[ix]==0) ? 0 : 1;
-      lev0_id1 += include;
-      bldr.write<1>(include);
     }
     // ok bitarray done.  since there's only one level, we dont store any block bits
     bits_ = bldr.finish();
     level_.push_back(LevelStruct{.id1 = lev0_id1});
   }
 
-  unsigned MortonTree::levels() const {
+  template<unsigned D>
+  unsigned MortonTreeT<D>::levels() const {
     return levs_;
   }
 
-  unsigned MortonTree::blocks() const {
+  template<unsigned D>
+  IdType MortonTreeT<D>::blocks() const {
     return level_[levs_-1].id1 - id0_;
   }
 
-  unsigned MortonTree::leaves() const {
-    unsigned pars = bits_->count( id0_, level_[levs_-1].id1) ;
+  template<unsigned D>
+  IdType MortonTreeT<D>::leaves() const {
+    IdType pars = bits_->count( id0_, level_[levs_-1].id1) ;
     return blocks() - pars ;
   }
 
-  unsigned MortonTree::top_size(unsigned dim) const {
-    if(dim<BTDIM) return lev0_blks_[dim];
+  template<unsigned D>
+  unsigned MortonTreeT<D>::top_size(unsigned dim) const {
+    if(dim<D) return lev0_blks_[dim];
     return 0;
   }
   
-  unsigned MortonTree::id_upper_bound() const {
+  template<unsigned D>
+  IdType MortonTreeT<D>::id_upper_bound() const {
     return level_[levs_-1].id1;
   }
 
   /**
     * \todo Inline this function?
     */
-  unsigned MortonTree::level_id0(unsigned lev) const {
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_id0(unsigned lev) const {
     return lev == 0 ? id0_ : level_[lev-1].id1;
   }
 
   /** \todo Inline this function? */
-  unsigned MortonTree::level_id1(unsigned lev) const {
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_id1(unsigned lev) const {
     return level_[lev].id1;
   }
 
-  unsigned MortonTree::level_blocks(unsigned lev) const {
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_blocks(unsigned lev) const {
     return level_[lev].id1 - (lev == 0 ? id0_ : level_[lev-1].id1);
   }
 
-  unsigned MortonTree::getParentId(unsigned id) const {
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_parent_count(unsigned lev) const {
+    if(lev+1u >= levs_) return 0; // finest level has no bits
+    return bits_->count(level_id0(lev), level_id1(lev));
+  }
+
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_leaf_count(unsigned lev) const {
+    return level_blocks(lev) - level_parent_count(lev);
+  }
+
+  /** Block, leaf and parent counts of every level, and the fraction of
+    * the domain covered by the leaves of each. The counts come from the
+    * rank checkpoints, so this costs O(levels) plus a popcount over at
+    * most a checkpoint interval per level. */
+  template<unsigned D>
+  TreeStats MortonTreeT<D>::stats() const {
+    TreeStats s;
+    s.dim = D;
+    s.blocks = blocks();
+    s.leaves = 0u;
+    s.levels.resize(levs_);
+    const double top = double(level_blocks(0));
+    for(unsigned lev=0; lev < levs_; lev++) {
+      LevelStats& l = s.levels[lev];
+      l.blocks = level_blocks(lev);
+      l.parents = level_parent_count(lev);
+      l.leaves = l.blocks - l.parents;
+      l.coverage = std::ldexp(double(l.leaves) / top, -int(D*lev));
+      s.leaves += l.leaves;
+    }
+    return s;
+  }
+
+  /** Heap bytes held by the tree, by part */
+  template<unsigned D>
+  TreeMemory MortonTreeT<D>::memory_bytes() const {
+    TreeMemory m;
+    m.words = bits_->word_alloc() * sizeof(BitArray::WType);
+    m.checkpoints = FastBitArray::chk_count(bits_->length()) * sizeof(IdType);
+    m.levels = level_.capacity() * sizeof(LevelStruct);
+    m.caches = 0u;
+    {
+      std::lock_guard<std::mutex> lock(faces_mtx_);
+      m.caches += faces_.capacity()*sizeof(faces_[0]);
+      for(const auto& f : faces_) // shared_ptr control block and vector
+        m.caches += 2u*sizeof(void*) + sizeof(*f.second) + f.second->capacity()*sizeof(CoarseFineFace);
+    }
+    m.top_grid = top_->memory_bytes();
+    m.object = sizeof(*this) + sizeof(FastBitArray);
+    return m;
+  }
+
+  template<unsigned D>
+  IdType MortonTreeT<D>::getParentId(IdType id) const {
     unsigned lev = block_level(id);
     if(lev>0) {
-      unsigned levIdx = id - level_id0(lev);
-      unsigned parIdx = levIdx / (1u<<BTDIM);
-      for(unsigned pid=level_id0(lev-1); pid<level_id1(lev-1); ++pid) {
+      IdType levIdx = id - level_id0(lev);
+      IdType parIdx = levIdx / nkids;
+      for(IdType pid=level_id0(lev-1); pid<level_id1(lev-1); ++pid) {
         if(block_is_parent(pid)) {
           if(parIdx == bits_->count(level_id0(lev-1), pid)) return pid;
         }
@@ -173,50 +342,56 @@ namespace bittree {
     return id;
   }
 
-  bool MortonTree::block_is_parent(unsigned id) const {
+  template<unsigned D>
+  bool MortonTreeT<D>::block_is_parent(IdType id) const {
     if(levs_>1) return id < level_[levs_-2].id1 && bits_->get(id);
     else return false;
   }
 
-  unsigned MortonTree::block_level(unsigned id) const {
+  template<unsigned D>
+  unsigned MortonTreeT<D>::block_level(IdType id) const {
     unsigned lev = 0;
     while(level_[lev].id1 <= id)
       lev += 1;
     return lev;
   }
 
-  bool MortonTree::inside(unsigned lev, const unsigned x[BTDIM]) const {
-    unsigned x0[BTDIM];
-    for(unsigned d=0; d < BTDIM; d++) {
+  template<unsigned D>
+  bool MortonTreeT<D>::inside(unsigned lev, const unsigned x[D]) const {
+    unsigned x0[D];
+    for(unsigned d=0; d < D; d++) {
       x0[d] = x[d] >> lev;
       if(x0[d] >= lev0_blks_[d])
         return false;
     }
-    return bits_->get(rect_coord_to_mort(lev0_blks_, x0));
+    return bits_->get(top_->coord_to_mort(x0));
   }
   
   /** Identifies morton number of a block corresponding to given coords
    *  on the current tree.*
    *  \todo error check block is inside domain */
-  MortonTree::Block
-  MortonTree::identify(unsigned lev, const unsigned x[BTDIM]) const {
+  template<unsigned D>
+  typename MortonTreeT<D>::Block
+  MortonTreeT<D>::identify(unsigned lev, const unsigned x[D]) const {
+    BITTREE_COUNT_QUERY(identify);
     const std::shared_ptr<BitArray> bits_a = bits_; // use this for bit access
     Block ans;
-    unsigned ix; // index of current block in current level
+    IdType ix; // index of current block in current level
+    unsigned state = 0u; // curve state of the current block
     { // top level=0
-      unsigned x0[BTDIM];
-      for(unsigned d=0; d < BTDIM; d++) {
+      unsigned x0[D];
+      for(unsigned d=0; d < D; d++) {
         x0[d] = unsigned(x[d] >> lev); // coarsen x to top level
         ans.coord[d] = unsigned(x0[d]);
       }
-      ix = rect_coord_to_mort(lev0_blks_, x0);
+      ix = top_->coord_to_mort(x0);
       ix = bits_->count(0, ix); // discount excluded blocks
     }
     ans.mort = 0;
     // bisection iteration
     for(unsigned a_lev=0; a_lev < levs_; a_lev++) {
-      unsigned a_id0 = a_lev==0 ? id0_ : level_[a_lev-1].id1;
-      unsigned a_id = a_id0 + ix;
+      IdType a_id0 = a_lev==0 ? id0_ : level_[a_lev-1].id1;
+      IdType a_id = a_id0 + ix;
       ans.mort += ix;
       unsigned inside = 0u;
       bool is_par = a_lev+1u < levs_ && bits_a->get(a_id);
@@ -224,17 +399,20 @@ namespace bittree {
 #ifndef ALT_MORTON_ORDER
         ans.mort += 1;
 #endif
-        for(unsigned d=0; d < BTDIM; d++) {
+        unsigned kid = 0u;
+        for(unsigned d=0; d < D; d++) {
           unsigned xd = x[d] >> (lev-a_lev-1u);
           ans.coord[d] <<= 1;
           if(xd >= ans.coord[d]+1u) {
             ans.coord[d] += 1u;
-            inside += 1u << d;
-#ifdef ALT_MORTON_ORDER
-            ans.mort += d == BTDIM-1 ? 1 : 0;
-#endif
+            kid += 1u << d;
           }
         }
+        inside = ct_->slot[state][kid];
+        state = ct_->next[state][inside];
+#ifdef ALT_MORTON_ORDER
+        ans.mort += inside >= nkids/2u ? 1 : 0;
+#endif
       }
       else if(a_lev <= lev) { // we have the result block
         lev = a_lev; // stop this from running again
@@ -242,17 +420,19 @@ namespace bittree {
         ans.level = a_lev;
         ans.is_parent = is_par;
 #ifdef ALT_MORTON_ORDER
-        if(is_par) inside = 1u<<(BTDIM-1); //include first half of children
+        if(is_par) inside = 1u<<(D-1); //include first half of children
 #endif
       }
-      unsigned parbef = parents_before(a_lev, ix);
-      ix = (parbef<<BTDIM) + inside;
+      IdType parbef = parents_before(a_lev, ix);
+      ix = (parbef<<D) + inside;
     }
     return ans;
   }
 
-  MortonTree::Block
-  MortonTree::locate(unsigned id) const {
+  template<unsigned D>
+  typename MortonTreeT<D>::Block
+  MortonTreeT<D>::locate(IdType id) const {
+    BITTREE_COUNT_QUERY(locate);
     Block ans;
     ans.id = id;
     ans.mort = 0;
@@ -261,70 +441,82 @@ namespace bittree {
     while(level_[lev].id1 <= id)
       lev += 1;
     ans.level = lev;
-    for(unsigned d=0; d < BTDIM; d++)
+    for(unsigned d=0; d < D; d++)
       ans.coord[d] = unsigned(0u);
     // index on this level
-    unsigned ix = id - (lev == 0 ? id0_ : level_[lev-1].id1);
+    IdType ix = id - (lev == 0 ? id0_ : level_[lev-1].id1);
     { // count children of all preceeding parents in morton index
-      unsigned down = ix;
+      IdType down = ix;
       for(unsigned lev1=lev; lev1 < levs_; lev1++) {
-        down = parents_before(lev1, down) << BTDIM;
+        down = parents_before(lev1, down) << D;
 #ifdef ALT_MORTON_ORDER
         if(lev1 == lev && ans.is_parent)
-          down += 1u<<(BTDIM-1);
+          down += 1u<<(D-1);
 #endif
         ans.mort += down;
       }
     }
-    // walk up the levels
+    // walk up the levels, keeping the slot of each ancestor
+    unsigned char slot[CHAR_BIT*sizeof(unsigned)];
     while(0 < lev) {
-      for(unsigned d=0; d < BTDIM; d++)
-        ans.coord[d] += unsigned(ix>>d & 1u) << (ans.level-lev);
+      slot[lev] = static_cast<unsigned char>(ix & (nkids-1u));
 #ifdef ALT_MORTON_ORDER
-      ans.mort += ix + (ix>>(BTDIM-1) & 1u);
+      ans.mort += ix + (ix>>(D-1) & 1u);
 #else
       ans.mort += ix + 1;
 #endif
-      ix = parent_find(lev-1, ix>>BTDIM) - (lev-1==0 ? id0_ : level_[lev-2].id1);
+      ix = parent_find(lev-1, ix>>D) - (lev-1==0 ? id0_ : level_[lev-2].id1);
       lev -= 1;
     }
     ans.mort += ix;
     { // top level=0
-      unsigned x0[BTDIM];
+      unsigned x0[D];
       ix = bits_->find(0, ix); // account for excluded blocks
-      rect_mort_to_coord(lev0_blks_, ix, x0);
-      for(unsigned d=0; d < BTDIM; d++)
+      top_->mort_to_coord(unsigned(ix), x0);
+      for(unsigned d=0; d < D; d++)
         ans.coord[d] += unsigned(x0[d]) << ans.level;
     }
+    // walk back down, turning slots into children along the curve
+    unsigned state = 0u;
+    for(lev=1; lev <= ans.level; lev++) {
+      const unsigned kid = ct_->kid[state][slot[lev]];
+      for(unsigned d=0; d < D; d++)
+        ans.coord[d] += (kid>>d & 1u) << (ans.level-lev);
+      state = ct_->next[state][slot[lev]];
+    }
     return ans;
   }
 
-  std::shared_ptr<MortonTree > MortonTree::refine(std::shared_ptr<const BitArray> delta) const {
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> MortonTreeT<D>::refine(std::shared_ptr<const BitArray> delta) const {
     
     const std::shared_ptr<BitArray> a_bits = bits_;
     
     // count the new number of levels, blocks, and bits
-    unsigned b_id1 = level_[0].id1;
-    unsigned b_bitlen = id0_;
+    IdType b_id1 = level_[0].id1;
+    IdType b_bitlen = id0_;
     unsigned b_levs = 1;
     for(unsigned lev=0; lev < levs_; lev++) {
-      unsigned lev_id0 = lev == 0 ? id0_ : level_[lev-1].id1;
-      unsigned lev_id1 = level_[lev].id1;
-      unsigned b_pars = BitArray::count_xor(*bits_, *delta, lev_id0, lev_id1);
+      IdType lev_id0 = lev == 0 ? id0_ : level_[lev-1].id1;
+      IdType lev_id1 = level_[lev].id1;
+      IdType b_pars = BitArray::count_xor(*bits_, *delta, lev_id0, lev_id1);
       if(b_pars != 0) b_bitlen = b_id1;
-      b_id1 += b_pars << BTDIM;
+      b_id1 += b_pars << D;
       if(b_pars == 0) break;
       b_levs += 1;
     }
     
     // new bit tree
-    std::shared_ptr<MortonTree> b_tree = std::make_shared<MortonTree>();
+    std::shared_ptr<MortonTreeT<D>> b_tree = std::make_shared<MortonTreeT<D>>();
     {
       b_tree->levs_ = b_levs;
       b_tree->id0_ = id0_;
       b_tree->level_.resize(b_levs);
-      for(unsigned d=0; d < BTDIM; d++)
+      for(unsigned d=0; d < D; d++)
         b_tree->lev0_blks_[d] = lev0_blks_[d];
+      b_tree->top_ = top_;
+      b_tree->curve_ = curve_;
+      b_tree->ct_ = ct_;
       // still must initialize b_tree->bits
     }
     
@@ -352,14 +544,14 @@ namespace bittree {
       if(a_rp.read<1>()) { // it was a parent
         bool still_a_parent = !del_rp.read<1>();
         // read kids, apply delta
-        BitArray::WType b_kids = a_r.read<(1<<BTDIM)>() ^ del_r.read<(1<<BTDIM)>();
+        BitArray::WType b_kids = a_r.read<nkids>() ^ del_r.read<nkids>();
         // if it became a leaf then we just dont write out the kids
         if(still_a_parent)
-          b_w.write<(1<<BTDIM)>(b_kids);
+          b_w.write<nkids>(b_kids);
       }
       else { // it was a leaf
         if(del_rp.read<1>()) {
-          b_w.write<(1<<BTDIM)>(0); // and it became a parent!
+          b_w.write<nkids>(0); // and it became a parent!
         }
       }
       if(a_rp.index() == level_[lev-1].id1 || b_w.index() == b_bitlen) {
@@ -374,25 +566,90 @@ namespace bittree {
     return b_tree;
   }
 
-  unsigned MortonTree::parents_before(unsigned lev, unsigned ix) const {
+  template<unsigned D>
+  IdType MortonTreeT<D>::parents_before(unsigned lev, IdType ix) const {
     if(lev >= levs_-1) return 0;
     return bits_->count(level_id0(lev), level_id0(lev) + ix);
   }
 
-  unsigned MortonTree::parent_find(unsigned lev, unsigned par_ix) const {
+  /** Number of blocks on levels lev and below that precede, in Morton
+    * order, the subtree of block ix on level lev */
+  template<unsigned D>
+  IdType MortonTreeT<D>::below(unsigned lev, IdType ix) const {
+    IdType n = ix;
+    for(; lev+1u < levs_; lev++) {
+      ix = parents_before(lev, ix) << D;
+      n += ix;
+    }
+    return n;
+  }
+
+  template<unsigned D>
+  IdType MortonTreeT<D>::parent_find(unsigned lev, IdType par_ix) const {
     return bits_->find(level_id0(lev), par_ix);
   }
 
+  /** Write the ids of the leaves on level lev to out, which must hold
+    * level_leaf_count(lev) of them, and return the count */
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_leaves(unsigned lev, IdType* out) const {
+    return level_list(false, lev, out);
+  }
+
+  /** Write the ids of the parents on level lev to out, which must hold
+    * level_parent_count(lev) of them, and return the count */
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_parents(unsigned lev, IdType* out) const {
+    return level_list(true, lev, out);
+  }
+
+  /** Lists the set (parents) or clear (leaves) bits of a level's id range.
+    * With OpenMP, big levels are split into fixed word-aligned chunks that
+    * are counted, offset by a prefix sum, and listed in parallel. */
+  template<unsigned D>
+  IdType MortonTreeT<D>::level_list(bool parents, unsigned lev, IdType* out) const {
+    const IdType id0 = level_id0(lev), id1 = level_id1(lev);
+    if(lev+1u >= levs_) { // finest level: all leaves
+      if(parents) return 0;
+      for(IdType id=id0; id < id1; id++)
+        *out++ = id;
+      return id1 - id0;
+    }
+#ifdef _OPENMP
+    const IdType chunk = 1u<<16;
+    if(id1 - id0 >= 2u*chunk) {
+      const IdType c0 = id0 / chunk, nchunks = (id1-1u)/chunk + 1u - c0;
+      std::vector<IdType> off(nchunks+1u, 0u);
+#pragma omp parallel for schedule(static)
+      for(IdType c=0; c < nchunks; c++) {
+        IdType a = std::max(id0, (c0+c)*chunk), b = std::min(id1, (c0+c+1u)*chunk);
+        IdType pars = bits_->count(a, b);
+        off[c+1u] = parents ? pars : (b-a) - pars;
+      }
+      for(IdType c=0; c < nchunks; c++)
+        off[c+1u] += off[c];
+#pragma omp parallel for schedule(static)
+      for(IdType c=0; c < nchunks; c++) {
+        IdType a = std::max(id0, (c0+c)*chunk), b = std::min(id1, (c0+c+1u)*chunk);
+        bits_->list(parents, a, b, out + off[c]);
+      }
+      return off[nchunks];
+    }
+#endif
+    return bits_->list(parents, id0, id1, out);
+  }
+
   /**
     * \todo error check on mort min, max
     */
-  void MortonTree::bitid_list(unsigned mort_min, unsigned mort_max, int *out ) const {
+  template<unsigned D>
+  void MortonTreeT<D>::bitid_list(IdType mort_min, IdType mort_max, IdType *out) const {
     bool is_par; 
-    unsigned ix = id0_;           //current scan index
+    IdType ix = id0_;           //current scan index
     unsigned lev = 0;          //current scanning level
     bool childrenDone[levs_];
-    unsigned pos[levs_]; //location on each level (increases monotonically)
-    unsigned mort = 0;
+    IdType pos[levs_]; //location on each level (increases monotonically)
+    IdType mort = 0;
     //DBG_ASSERT(mort_max <= blocks());
     //DBG_ASSERT(mort_min <= mort_max);
 
@@ -407,11 +664,11 @@ namespace bittree {
 
       //if scanning a parent and children have not been scanned, move down a level
       if(is_par && !childrenDone[lev]) {
-        ix = level_[lev].id1 + ((1u<<BTDIM) * parents_before(lev,pos[lev]));
+        ix = level_[lev].id1 + (nkids * parents_before(lev,pos[lev]));
         childrenDone[lev+1]=false;
        
 #ifndef ALT_MORTON_ORDER
-        if(mort<mort_max && mort>=mort_min) out[mort-mort_min] = int(pos[lev] + level_id0(lev)) ;
+        if(mort<mort_max && mort>=mort_min) out[mort-mort_min] = pos[lev] + level_id0(lev);
         mort++;
 #endif
 
@@ -420,20 +677,20 @@ namespace bittree {
       else {
         //if leaf, store its bitid
         if (!is_par) {
-          if(mort<mort_max && mort>=mort_min) out[mort-mort_min] = int(ix);
+          if(mort<mort_max && mort>=mort_min) out[mort-mort_min] = ix;
           mort++;
         }
 
 #ifdef ALT_MORTON_ORDER
         //if middle child, store parent's bitid
-        if (lev>0 && (((pos[lev]+1) % (1u<<BTDIM)) == (1u<<(BTDIM-1))) ){
-          if(mort<mort_max && mort>=mort_min) out[mort-mort_min] = int(pos[lev-1] + level_id0(lev-1)) ;
+        if (lev>0 && (((pos[lev]+1) % nkids) == (1u<<(D-1))) ){
+          if(mort<mort_max && mort>=mort_min) out[mort-mort_min] = pos[lev-1] + level_id0(lev-1);
           mort++;
         }
 #endif
 
         //if last child
-        if (lev>0 && (((pos[lev]+1) % (1u<<BTDIM)) == 0) ) {
+        if (lev>0 && (((pos[lev]+1) % nkids) == 0) ) {
           pos[lev]++;
           childrenDone[lev-1] = true;
           ix = pos[lev-1] + level_id0(lev-1);
@@ -453,17 +710,76 @@ namespace bittree {
     }
   }
 
+  /** Seeks to the first leaf with Morton index at least mort0. The Morton
+    * index of a subtree's first block is what precedes it on its own and
+    * deeper levels (below) plus its ancestors and their predecessors, so
+    * the seek picks, level by level, the last subtree starting at or
+    * before mort0. */
+  template<unsigned D>
+  LeafIteratorT<D>::LeafIteratorT(const MortonTreeT<D>* tree, IdType mort0, IdType mort1):
+    tree_(tree), mort_end_(std::min(mort1, tree->blocks())), top_(0u) {
+    const unsigned nkids = MortonTreeT<D>::nkids;
+    blk_.mort = end_mort;
+    if(mort0 >= mort_end_) return;
+    ix_.assign(tree->levs_, 0u);
+    st_.assign(tree->levs_, 0u);
+
+    // top level: binary search, below(0,.) is nondecreasing
+    IdType lo = 0u, hi = tree->level_blocks(0);
+    while(hi - lo > 1u) {
+      IdType mid = (lo + hi) >> 1;
+      if(below(0u, mid) <= mort0) lo = mid;
+      else hi = mid;
+    }
+    ix_[0] = lo;
+    top_ = tree->bits_->find(0u, lo);
+    tree->top_->mort_to_coord(unsigned(top_), blk_.coord);
+
+    // descend to the leaf holding mort0, or the last one before it
+    unsigned lev = 0u;
+    IdType prefix = 0u;
+    while(lev+1u < tree->levs_ && tree->bits_->get(tree->level_id0(lev) + ix_[lev])) {
+      const IdType c0 = tree->parents_before(lev, ix_[lev]) << D;
+      unsigned c = 0u;
+      IdType pre = prefix + ix_[lev];
+      for(unsigned k=1u; k < nkids; k++) {
+#ifdef ALT_MORTON_ORDER
+        IdType pre_k = pre + (k >= nkids/2u ? 1u : 0u);
+#else
+        IdType pre_k = pre + 1u;
+#endif
+        if(pre_k + below(lev+1u, c0+k) > mort0) break;
+        c = k;
+      }
+#ifdef ALT_MORTON_ORDER
+      prefix = pre + (c >= nkids/2u ? 1u : 0u);
+#else
+      prefix = pre + 1u;
+#endif
+      ix_[lev+1u] = c0 + c;
+      const unsigned kid = tree->ct_->kid[st_[lev]][c];
+      st_[lev+1u] = tree->ct_->next[st_[lev]][c];
+      for(unsigned d=0; d < D; d++)
+        blk_.coord[d] = (blk_.coord[d] << 1) | (kid>>d & 1u);
+      lev += 1u;
+    }
+    descend(lev, prefix + below(lev, ix_[lev]));
+    if(blk_.mort != end_mort && blk_.mort < mort0)
+      next();
+  }
+
   /**
     * \todo implement a verify method to replace the error checking here?
     */
-  std::string MortonTree::print_slice(unsigned datatype, unsigned slice) const {
+  template<unsigned D>
+  std::string MortonTreeT<D>::print_slice(unsigned datatype, unsigned slice) const {
     static const std::vector<std::string> dtypes { "bitid", "mort", "parent" };
 
-    unsigned k = BTDIM>=3 ? slice : 0;
+    unsigned k = D>=3 ? slice : 0;
 
     std::ostringstream buffer;
     buffer << "Bittree, datatype=" << dtypes[datatype];
-    if(BTDIM==3) buffer << " (slice k=" << k << ")";
+    if(D==3) buffer << " (slice k=" << k << ")";
     buffer << ":\n";
 
     unsigned levs = levels();
@@ -471,22 +787,21 @@ namespace bittree {
       buffer << "lev=" << lev <<'\n';
       
       unsigned xlim = top_size(0)<<lev;
-      unsigned ylim = 1 + (BTDIM>=2 ? (top_size(1)<<lev) - 1 : 0);
-      std::vector<unsigned> coord(BTDIM);
-      coord[2] = k; //slice
+      unsigned ylim = 1 + (D>=2 ? (top_size(1)<<lev) - 1 : 0);
+      unsigned coord[3] = {0u, 0u, k}; // k only used in 3D
       for(  unsigned j=0; j < ylim; ++j) {
-        if(BTDIM>=2) coord[1] = ylim - j - 1;
+        if(D>=2) coord[1] = ylim - j - 1;
         for(unsigned i=0; i < xlim; ++i) {
-          if(BTDIM>=1) coord[0] = i;
+          if(D>=1) coord[0] = i;
 
-          if(inside(lev, coord.data())) {
-            MortonTree::Block b0 = identify(lev, coord.data());
-            //MortonTree::Block b1 = locate(b0.id);
+          if(inside(lev, coord)) {
+            Block b0 = identify(lev, coord);
+            //MortonTreeT<D>::Block b1 = locate(b0.id);
 
             //DBG_ASSERT(b0.id == b1.id);
             //DBG_ASSERT(b0.level == b1.level);
             //DBG_ASSERT(b0.mort == b1.mort);
-            //for(unsigned n=0; n<BTDIM; ++n) {
+            //for(unsigned n=0; n<D; ++n) {
             //  DBG_ASSERT(b0.coord[n] == b1.coord[n]);
             //}
 
@@ -515,4 +830,201 @@ namespace bittree {
     return buffer.str();
   }
 
+  /** Size in bytes of the image written by write_image */
+  template<unsigned D>
+  std::size_t MortonTreeT<D>::image_size() const {
+    std::uint64_t off = align64(sizeof(ImageHeader));
+    off = align64(off + levs_*sizeof(IdType));
+    off = align64(off + bits_->word_alloc()*sizeof(BitArray::WType));
+    off += FastBitArray::chk_count(bits_->length())*sizeof(IdType);
+    return static_cast<std::size_t>(off);
+  }
+
+  /** Serialize the tree into buf, which must hold image_size() bytes.
+    * The image holds the level table, the word buffer and the rank
+    * checkpoints, so it can be used without rebuilding anything. */
+  template<unsigned D>
+  void MortonTreeT<D>::write_image(char* buf) const {
+    ImageHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, image_magic, sizeof(h.magic));
+    h.endian = image_endian;
+    h.version = image_version;
+    h.dim = D;
+    h.id_bytes = sizeof(IdType);
+    h.word_bytes = sizeof(BitArray::WType);
+    h.levs = levs_;
+    h.curve = static_cast<std::uint32_t>(curve_);
+    h.id0 = id0_;
+    for(unsigned d=0; d < 3; d++)
+      h.lev0_blks[d] = d < D ? lev0_blks_[d] : 1u;
+    h.bit_len = bits_->length();
+    h.nwords = bits_->word_alloc();
+    h.nchks = FastBitArray::chk_count(bits_->length());
+    h.level_off = align64(sizeof(ImageHeader));
+    h.words_off = align64(h.level_off + h.levs*sizeof(IdType));
+    h.chks_off = align64(h.words_off + h.nwords*sizeof(BitArray::WType));
+    h.size = h.chks_off + h.nchks*sizeof(IdType);
+
+    std::memset(buf, 0, static_cast<std::size_t>(h.size));
+    std::memcpy(buf, &h, sizeof(h));
+    for(unsigned lev=0; lev < levs_; lev++)
+      std::memcpy(buf + h.level_off + lev*sizeof(IdType), &level_[lev].id1, sizeof(IdType));
+    std::memcpy(buf + h.words_off, bits_->word_buf(), h.nwords*sizeof(BitArray::WType));
+    std::memcpy(buf + h.chks_off, bits_->chk_buf(), h.nchks*sizeof(IdType));
+  }
+
+  /** Build a tree on top of an image produced by write_image. The word
+    * buffer and checkpoints are used in place (not copied); storage is
+    * held by the tree to keep data alive. */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> MortonTreeT<D>::from_image(std::shared_ptr<void> storage,
+                                                     char* data, std::size_t size) {
+    ImageHeader h;
+    if(size < sizeof(h))
+      throw std::runtime_error("Bittree image truncated");
+    std::memcpy(&h, data, sizeof(h));
+    if(std::memcmp(h.magic, image_magic, sizeof(h.magic)) != 0)
+      throw std::runtime_error("Not a Bittree image");
+    if(h.endian != image_endian)
+      throw std::runtime_error("Bittree image has foreign byte order");
+    if(h.version != image_version)
+      throw std::runtime_error("Unsupported Bittree image version");
+    if(h.dim != D)
+      throw std::runtime_error("Bittree image has a different dimensionality");
+    if(h.id_bytes != sizeof(IdType) || h.word_bytes != sizeof(BitArray::WType))
+      throw std::runtime_error("Bittree image has a different id or word size");
+    if(!image_sections_ok(h, size) || h.levs == 0 || h.curve > 1u ||
+       h.bit_len > std::numeric_limits<IdType>::max() - BitArray::bitw ||
+       h.nwords != ((h.bit_len + BitArray::bitw)>>BitArray::logw) ||
+       h.nchks != FastBitArray::chk_count(static_cast<IdType>(h.bit_len)) ||
+       h.words_off % 64 != 0 || h.chks_off % 64 != 0)
+      throw std::runtime_error("Bittree image is corrupt");
+    // the inclusion bits of the top-level grid come first
+    std::uint64_t npop = 1u;
+    for(unsigned d=0; d < D; d++) {
+      if(h.lev0_blks[d] == 0u || npop > h.bit_len)
+        throw std::runtime_error("Bittree image is corrupt");
+      npop *= h.lev0_blks[d];
+    }
+    if(h.id0 != npop || npop > h.bit_len)
+      throw std::runtime_error("Bittree image is corrupt");
+
+    std::shared_ptr<MortonTreeT<D>> tree = std::make_shared<MortonTreeT<D>>();
+    tree->levs_ = h.levs;
+    tree->curve_ = static_cast<Curve>(h.curve);
+    tree->ct_ = &CurveTableT<D>::get(tree->curve_);
+    tree->id0_ = static_cast<IdType>(h.id0);
+    for(unsigned d=0; d < D; d++)
+      tree->lev0_blks_[d] = h.lev0_blks[d];
+    tree->top_ = std::make_shared<TopGridT<D>>(tree->lev0_blks_);
+    tree->level_.resize(h.levs);
+    // levels are contiguous id ranges; all but the finest have bits
+    IdType id1 = tree->id0_;
+    for(unsigned lev=0; lev < h.levs; lev++) {
+      if(lev > 0u && id1 > h.bit_len)
+        throw std::runtime_error("Bittree image is corrupt");
+      std::memcpy(&tree->level_[lev].id1, data + h.level_off + lev*sizeof(IdType), sizeof(IdType));
+      if(tree->level_[lev].id1 < id1)
+        throw std::runtime_error("Bittree image is corrupt");
+      id1 = tree->level_[lev].id1;
+    }
+    tree->bits_ = std::make_shared<FastBitArray>(
+        static_cast<IdType>(h.bit_len),
+        reinterpret_cast<BitArray::WType*>(data + h.words_off),
+        reinterpret_cast<IdType*>(data + h.chks_off),
+        storage);
+    return tree;
+  }
+
+  /** Write the tree to a binary file (see write_image for the layout) */
+  template<unsigned D>
+  void MortonTreeT<D>::save(const std::string& path) const {
+    std::vector<char> buf(image_size());
+    write_image(buf.data());
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if(!f)
+      throw std::runtime_error("Could not open " + path + " for writing");
+    std::size_t written = std::fwrite(buf.data(), 1, buf.size(), f);
+    if(std::fclose(f) != 0 || written != buf.size())
+      throw std::runtime_error("Could not write " + path);
+  }
+
+  /** Read a tree written by save. The file is memory-mapped, so the bit
+    * array is paged in on demand rather than read up front. Files written
+    * with the other byte order are read and converted instead. */
+  template<unsigned D>
+  std::shared_ptr<MortonTreeT<D>> MortonTreeT<D>::load(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+      throw std::runtime_error("Could not open " + path);
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(ImageHeader))) {
+      ::close(fd);
+      throw std::runtime_error("Bittree image truncated: " + path);
+    }
+    std::size_t size = static_cast<std::size_t>(st.st_size);
+    // Private writable mapping: pages are shared with the page cache
+    // until (if ever) something writes to them.
+    void* addr = ::mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(addr == MAP_FAILED)
+      throw std::runtime_error("Could not map " + path);
+    std::shared_ptr<void> mapping(addr, [size](void* p) { ::munmap(p, size); });
+    char* data = static_cast<char*>(addr);
+
+    std::uint32_t endian;
+    std::memcpy(&endian, data + offsetof(ImageHeader, endian), sizeof(endian));
+    if(endian == byteswap(image_endian)) {
+      std::shared_ptr<std::vector<char>> copy =
+          std::make_shared<std::vector<char>>(data, data + size);
+      byteswap_image(copy->data(), size);
+      return from_image(copy, copy->data(), size);
+    }
+    return from_image(mapping, data, size);
+  }
+
+  /** 64-bit hash of the tree's structure: dimension, curve, top-level
+    * grid, level bounds and bit array. Equal trees hash equally whatever
+    * their history or storage, so ranks can compare replicas by exchanging
+    * hashes instead of images. */
+  template<unsigned D>
+  std::uint64_t MortonTreeT<D>::hash() const {
+    static_assert(sizeof(BitArray::WType) == sizeof(std::uint32_t), "bithash reads 32-bit words");
+    std::vector<std::uint32_t> head = {D, std::uint32_t(curve_), levs_};
+    head.insert(head.end(), lev0_blks_, lev0_blks_+D);
+    auto add = [&head](std::uint64_t x) {
+      head.push_back(std::uint32_t(x));
+      head.push_back(std::uint32_t(x >> 32));
+    };
+    add(id0_);
+    for(const LevelStruct& l : level_) add(l.id1);
+    add(bits_->length());
+    std::uint64_t h = bithash(head.data(), head.size(), 0u);
+
+    // full words, then the last one without the bits past the end
+    const IdType nfull = bits_->length() >> BitArray::logw;
+    h = bithash(bits_->word_buf(), std::size_t(nfull), h);
+    const unsigned tail = unsigned(bits_->length() & (BitArray::bitw - 1u));
+    if(tail != 0u) {
+      const std::uint32_t last = bits_->word_buf()[nfull] & ((1u << tail) - 1u);
+      h = bithash(&last, 1u, h);
+    }
+    return h;
+  }
+
+  template unsigned rect_coord_to_mort<1>(const unsigned[], const unsigned[]);
+  template unsigned rect_coord_to_mort<2>(const unsigned[], const unsigned[]);
+  template unsigned rect_coord_to_mort<3>(const unsigned[], const unsigned[]);
+  template void rect_mort_to_coord<1>(const unsigned[], unsigned, unsigned[]);
+  template void rect_mort_to_coord<2>(const unsigned[], unsigned, unsigned[]);
+  template void rect_mort_to_coord<3>(const unsigned[], unsigned, unsigned[]);
+  template class LeafIteratorT<1>;
+  template class LeafIteratorT<2>;
+  template class LeafIteratorT<3>;
+
+  template class MortonTreeT<1>;
+  template class MortonTreeT<2>;
+  template class MortonTreeT<3>;
+
 }
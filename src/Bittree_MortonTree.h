@@ -15,72 +15,352 @@
 #define BITTREE_MORTONTREE_H__
 
 #include "Bittree_BitArray.h"
+#include "Bittree_Curve.h"
+#include "Bittree_Halo.h"
+#include "Bittree_Stats.h"
+#include "Bittree_TopGrid.h"
 #include "Bittree_constants.h"
 
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+
 namespace bittree {
-  unsigned rect_coord_to_mort(const unsigned domain[BTDIM], const unsigned coord[BTDIM]);
-  void rect_mort_to_coord(const unsigned domain[BTDIM], unsigned mort, unsigned coord[BTDIM]);
+  template<unsigned D> class DistributedTreeT;
+  template<unsigned D> class LeafIteratorT;
+  template<unsigned D> class LeafRangeT;
+  template<unsigned D> class NeighborSweepT;
+
+  /** Morton order of the top-level blocks of a rectangular domain, by
+    * bisection. TopGridT gives the same order from precomputed tables. */
+  template<unsigned D>
+  unsigned rect_coord_to_mort(const unsigned domain[], const unsigned coord[]);
+  template<unsigned D>
+  void rect_mort_to_coord(const unsigned domain[], unsigned mort, unsigned coord[]);
+
+  inline unsigned rect_coord_to_mort(const unsigned domain[BTDIM], const unsigned coord[BTDIM]) {
+    return rect_coord_to_mort<BTDIM>(domain, coord);
+  }
+  inline void rect_mort_to_coord(const unsigned domain[BTDIM], unsigned mort, unsigned coord[BTDIM]) {
+    rect_mort_to_coord<BTDIM>(domain, mort, coord);
+  }
 
   /** MortonTree is a bitmap with metadata to make it a properly defined mesh.
    *
+   *  The dimensionality D is a template parameter, so the per-dimension
+   *  loops have a constant trip count and are unrolled by the compiler.
+   *  The library instantiates D=1,2,3; MortonTree is the BTDIM one.
+   *
+   *  Siblings are stored in the order of the tree's curve, Morton by
+   *  default or Hilbert, so Block::mort and every Morton range are indices
+   *  along that curve. Only the conversions between slots and coordinates
+   *  (identify, locate, the leaf iterator) look at the curve.
    */
-  class MortonTree {
+  template<unsigned D>
+  class MortonTreeT {
+    static_assert(D >= 1 && D <= 3, "Bittree supports 1, 2 or 3 dimensions");
 
   public:
+    static constexpr unsigned dim = D;           //!< Dimensionality
+    static constexpr unsigned nkids = 1u<<D;     //!< Children per parent
+
     struct Block {
-      unsigned id;
-      unsigned mort;
+      IdType id;
+      IdType mort;
       unsigned level;
       bool is_parent;
-      unsigned coord[BTDIM];
+      unsigned coord[D];
     };
 
+    /** Face of leaf coarse bordering blocks one level finer, for flux
+      * correction. fine lists the blocks along the face in coordinate
+      * order (lowest dimension fastest); with 2:1 balance they are leaves. */
+    struct CoarseFineFace {
+      IdType coarse;
+      IdType fine[nkids/2u];
+      unsigned face;          //!< 2*dim, plus 1 for the upper side of coarse
+    };
+    typedef std::shared_ptr<const std::vector<CoarseFineFace>> CoarseFineFaces;
+
     struct LevelStruct {
-      unsigned id1; // exclusive upper bound on block ids for this level
+      IdType id1; // exclusive upper bound on block ids for this level
     };
 
 
   public:
-    MortonTree() {}
-    MortonTree(const int blks[BTDIM], const int includes[]);
-    ~MortonTree() = default;
+    MortonTreeT() {}
+    MortonTreeT(const int blks[D], const int includes[], Curve curve=Curve::morton);
+    ~MortonTreeT() = default;
 
     // Getters
     unsigned levels() const;
-    unsigned blocks() const;
-    unsigned leaves() const;
+    IdType blocks() const;
+    IdType leaves() const;
     unsigned top_size(unsigned dim) const;
-    unsigned id_upper_bound() const;
-    unsigned level_id0(unsigned lev) const;
-    unsigned level_id1(unsigned lev) const;
-    unsigned level_blocks(unsigned lev) const;
+    IdType id_upper_bound() const;
+    IdType level_id0(unsigned lev) const;
+    IdType level_id1(unsigned lev) const;
+    IdType level_blocks(unsigned lev) const;
+    IdType level_leaf_count(unsigned lev) const;
+    IdType level_parent_count(unsigned lev) const;
+    const TopGridT<D>& top_grid() const { return *top_; }
+    Curve curve() const { return curve_; }
+    const CurveTableT<D>& curve_table() const { return *ct_; }
+    TreeStats stats() const;
+    TreeMemory memory_bytes() const;
 
     // Other member functions
-    unsigned getParentId(unsigned id) const;
-    bool block_is_parent(unsigned id) const;
-    unsigned block_level(unsigned id) const;
-    Block locate(unsigned id) const;
-    bool inside(unsigned lev, const unsigned coord[BTDIM]) const;
-    Block identify(unsigned lev, const unsigned coord[BTDIM]) const;
+    IdType getParentId(IdType id) const;
+    bool block_is_parent(IdType id) const;
+    unsigned block_level(IdType id) const;
+    Block locate(IdType id) const;
+    bool inside(unsigned lev, const unsigned coord[D]) const;
+    Block identify(unsigned lev, const unsigned coord[D]) const;
+    IdType level_leaves(unsigned lev, IdType* out) const;
+    IdType level_parents(unsigned lev, IdType* out) const;
+    HaloGraph halo_graph(const std::vector<IdType>& partition, int rank) const;
+    CoarseFineFaces coarse_fine_faces(IdType mort0, IdType mort1) const;
+    IdType coarse_fine_faces(IdType mort0, IdType mort1, CoarseFineFace* out) const;
+    void locate_points(const double lo[D], const double hi[D], const double* xyz,
+                       std::size_t n, IdType* out) const;
+    IdType query_box(unsigned lev, const unsigned lo[D], const unsigned hi[D],
+                     IdType* out) const;
+
+    std::shared_ptr<MortonTreeT> refine(std::shared_ptr<const BitArray> delta) const;
+    void bitid_list(IdType mort_min, IdType mort_max, IdType *out) const;
 
-    std::shared_ptr<MortonTree> refine(std::shared_ptr<const BitArray> delta) const;
-    void bitid_list(unsigned mort_min,unsigned mort_max, int *out ) const;
+    // Leaf traversal in Morton order
+    typedef LeafIteratorT<D> LeafIterator;
+    typedef LeafRangeT<D> LeafRange;
+    LeafIterator begin_at(IdType mort) const;
+    LeafRange leaf_range(IdType mort0=0u, IdType mort1=~IdType(0)) const;
 
     std::string print_slice(unsigned datatype, unsigned slice=0) const;
 
+    // Checkpoint/restart
+    void save(const std::string& path) const;
+    static std::shared_ptr<MortonTreeT> load(const std::string& path);
+    std::size_t image_size() const;
+    void write_image(char* buf) const;
+    static std::shared_ptr<MortonTreeT> from_image(std::shared_ptr<void> storage,
+                                                   char* data, std::size_t size);
+    std::uint64_t hash() const;
+
+    // Export of the block topology
+    void export_blocks(const std::string& path, bool parents=false) const;
+    void export_vtk(const std::string& path, const double lo[D], const double hi[D],
+                    bool parents=false) const;
+
+    // Coarse levels of the tree, for DistributedTreeT
+    std::shared_ptr<MortonTreeT> truncated(unsigned levs) const;
+
   private:
-    unsigned parents_before(unsigned lev, unsigned ix) const;
-    unsigned parent_find(unsigned lev, unsigned par_ix) const;
+    friend class DistributedTreeT<D>;
+    friend class LeafIteratorT<D>;
+    friend class NeighborSweepT<D>;
+    IdType parents_before(unsigned lev, IdType ix) const;
+    IdType below(unsigned lev, IdType ix) const;
+    IdType parent_find(unsigned lev, IdType par_ix) const;
+    IdType level_list(bool parents, unsigned lev, IdType* out) const;
+    template<class Fn> void visit_blocks(bool parents, Fn&& fn) const;
 
   public:
     std::shared_ptr<FastBitArray> bits_;   //!< Data
   private:
     // Member variables
     unsigned levs_;                        //!< Current number of levels
-    unsigned lev0_blks_[BTDIM];             //!< Number of top level blocks
-    unsigned id0_;                         //!< id of first block
+    unsigned lev0_blks_[D];                //!< Number of top level blocks
+    std::shared_ptr<const TopGridT<D>> top_; //!< Top level Morton order, shared by refined trees
+    Curve curve_;                          //!< Order of siblings
+    const CurveTableT<D>* ct_;             //!< Child order tables of curve_
+    IdType id0_;                           //!< id of first block
     std::vector<LevelStruct> level_;       //!< Upper bound on ids for each level
+    static const unsigned faces_cached = 4; //!< Ranges kept by coarse_fine_faces
+    mutable std::mutex faces_mtx_;         //!< Guards faces_
+    mutable std::vector<std::pair<std::pair<IdType,IdType>, CoarseFineFaces>> faces_; //!< coarse_fine_faces of recent ranges, newest first
+  };
+
+  template<unsigned D> constexpr unsigned MortonTreeT<D>::dim;
+  template<unsigned D> constexpr unsigned MortonTreeT<D>::nkids;
+
+  extern template class MortonTreeT<1>;
+  extern template class MortonTreeT<2>;
+  extern template class MortonTreeT<3>;
+
+  /** Tree with the dimensionality chosen at setup (BTDIM) */
+  typedef MortonTreeT<BTDIM> MortonTree;
+
+  /** Forward iterator over the leaves of a MortonTreeT in Morton order.
+   *
+   *  The iterator keeps the index and curve state of the current block's
+   *  ancestor on every level, so stepping to the next leaf climbs and descends the tree
+   *  locally: one rank per level descended, and the coordinates are shifted
+   *  in place rather than recomputed by locate. Construction seeks to the
+   *  first leaf at or after mort0 from the top, and iteration stops before
+   *  mort1. The tree must outlive the iterator.
+   */
+  template<unsigned D>
+  class LeafIteratorT {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef typename MortonTreeT<D>::Block value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type* pointer;
+    typedef const value_type& reference;
+
+    LeafIteratorT(): tree_(nullptr), mort_end_(0u) { blk_.mort = end_mort; }
+    LeafIteratorT(const MortonTreeT<D>* tree, IdType mort0, IdType mort1=~IdType(0));
+
+    reference operator*() const { return blk_; }
+    pointer operator->() const { return &blk_; }
+    LeafIteratorT& operator++() { next(); return *this; }
+    LeafIteratorT operator++(int) { LeafIteratorT it(*this); next(); return it; }
+    bool operator==(const LeafIteratorT& o) const { return blk_.mort == o.blk_.mort; }
+    bool operator!=(const LeafIteratorT& o) const { return blk_.mort != o.blk_.mort; }
+
+  private:
+    static const IdType end_mort = ~IdType(0); //!< Morton index of the end iterator
+
+    void next();
+    void descend(unsigned lev, IdType mort);
+    IdType below(unsigned lev, IdType ix) const { return tree_->below(lev, ix); }
+
+  private:
+    const MortonTreeT<D>* tree_;
+    IdType mort_end_;            //!< Stop before this Morton index
+    IdType top_;                 //!< Top-level Morton index, counting excluded blocks
+    std::vector<IdType> ix_;     //!< Index within its level of the block or ancestor on each level
+    std::vector<unsigned char> st_; //!< Curve state of the same blocks
+    value_type blk_;             //!< Current leaf
+  };
+
+  /** Leaves with Morton index in [mort0, mort1) */
+  template<unsigned D>
+  class LeafRangeT {
+  public:
+    LeafRangeT(const MortonTreeT<D>* tree, IdType mort0, IdType mort1):
+      tree_(tree), mort0_(mort0), mort1_(mort1) {}
+
+    LeafIteratorT<D> begin() const { return LeafIteratorT<D>(tree_, mort0_, mort1_); }
+    LeafIteratorT<D> end() const { return LeafIteratorT<D>(); }
+
+    const MortonTreeT<D>* tree() const { return tree_; }
+    IdType mort0() const { return mort0_; }
+    IdType mort1() const { return mort1_; }
+
+  private:
+    const MortonTreeT<D>* tree_;
+    IdType mort0_, mort1_;
   };
 
+  template<unsigned D> const IdType LeafIteratorT<D>::end_mort;
+
+  extern template class LeafIteratorT<1>;
+  extern template class LeafIteratorT<2>;
+  extern template class LeafIteratorT<3>;
+
+  /** Calls fn(const Block&) on every leaf of the range in Morton order */
+  template<unsigned D, class Fn>
+  inline void for_each_leaf(const LeafRangeT<D>& range, Fn&& fn) {
+    const LeafIteratorT<D> end = range.end();
+    for(LeafIteratorT<D> it = range.begin(); it != end; ++it)
+      fn(*it);
+  }
+
+  /** Calls fn(const Block&) on every leaf of the range, in parallel under
+    * OpenMP. The Morton range is cut into chunks of `chunk` indices; each
+    * chunk seeks to its start (begin_at) and walks its leaves locally.
+    * Chunk boundaries depend only on the range, not on the thread count,
+    * so every run groups the same leaves together. fn must be safe to call
+    * concurrently. Without OpenMP the chunks run in order on one thread. */
+  template<unsigned D, class Fn>
+  inline void parallel_for_each_leaf(const LeafRangeT<D>& range, Fn&& fn,
+                                     unsigned chunk=4096u) {
+    const IdType mort0 = range.mort0();
+    const IdType mort1 = std::min(range.mort1(), range.tree()->blocks());
+    if(mort1 <= mort0) return;
+    const IdType nchunks = (mort1 - mort0 - 1u)/chunk + 1u;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(IdType c=0; c < nchunks; c++) {
+      const IdType a = mort0 + c*chunk;
+      const IdType b = mort1 - a > chunk ? a + chunk : mort1;
+      for_each_leaf(LeafRangeT<D>(range.tree(), a, b), fn);
+    }
+  }
+
+  /** First leaf at or after Morton index mort */
+  template<unsigned D>
+  inline LeafIteratorT<D> MortonTreeT<D>::begin_at(IdType mort) const {
+    return LeafIteratorT<D>(this, mort);
+  }
+
+  template<unsigned D>
+  inline LeafRangeT<D> MortonTreeT<D>::leaf_range(IdType mort0, IdType mort1) const {
+    return LeafRangeT<D>(this, mort0, mort1);
+  }
+
+  /** Moves to the next leaf: climb past last children, step to the next
+    * sibling (or top-level block), then descend to its first leaf. */
+  template<unsigned D>
+  inline void LeafIteratorT<D>::next() {
+    const unsigned nkids = MortonTreeT<D>::nkids;
+    unsigned lev = blk_.level;
+    IdType mort = blk_.mort + 1u;
+    while(lev > 0u && (ix_[lev] & (nkids-1u)) == nkids-1u) {
+      lev -= 1u;
+      for(unsigned d=0; d < D; d++)
+        blk_.coord[d] >>= 1;
+    }
+    ix_[lev] += 1u;
+    if(lev == 0u) {
+      if(ix_[0] >= tree_->level_blocks(0)) {
+        blk_.mort = end_mort;
+        return;
+      }
+      do { top_ += 1u; } while(!tree_->bits_->get(top_));
+      tree_->top_->mort_to_coord(unsigned(top_), blk_.coord);
+    }
+    else {
+      const CurveTableT<D>& ct = *tree_->ct_;
+      const unsigned k = unsigned(ix_[lev] & (nkids-1u));
+      const unsigned kid = ct.kid[st_[lev-1u]][k];
+      st_[lev] = ct.next[st_[lev-1u]][k];
+      for(unsigned d=0; d < D; d++)
+        blk_.coord[d] = (blk_.coord[d] & ~1u) | (kid>>d & 1u);
+#ifdef ALT_MORTON_ORDER
+      if(k == nkids/2u) mort += 1u; // the parent sits between the halves
+#endif
+    }
+    descend(lev, mort);
+  }
+
+  /** Follows first children from the block ix_[lev] down to a leaf */
+  template<unsigned D>
+  inline void LeafIteratorT<D>::descend(unsigned lev, IdType mort) {
+    const MortonTreeT<D>& t = *tree_;
+    while(true) {
+      const IdType id = t.level_id0(lev) + ix_[lev];
+      if(lev+1u >= t.levs_ || !t.bits_->get(id)) {
+        blk_.id = id;
+        blk_.level = lev;
+        blk_.is_parent = false;
+        break;
+      }
+#ifndef ALT_MORTON_ORDER
+      mort += 1u; // the parent comes before its children
+#endif
+      ix_[lev+1u] = t.parents_before(lev, ix_[lev]) << D;
+      const unsigned kid = t.ct_->kid[st_[lev]][0];
+      st_[lev+1u] = t.ct_->next[st_[lev]][0];
+      for(unsigned d=0; d < D; d++)
+        blk_.coord[d] = (blk_.coord[d] << 1) | (kid>>d & 1u);
+      lev += 1u;
+    }
+    blk_.mort = mort < mort_end_ ? mort : end_mort;
+  }
+
 }
 #endif
@@ -0,0 +1,208 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_MortonTree.h"
+#include "Bittree_Bits.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace bittree {
+
+  namespace {
+    /** Index of the most significant 1-bit of x, which must be nonzero */
+    inline unsigned highbit(std::uint64_t x) {
+      unsigned h = 0u;
+      for(unsigned s=32u; s > 0u; s >>= 1)
+        if(x >> s) { x >>= s; h += s; }
+      return h;
+    }
+
+    /** Sorts idx by key, least significant digit first, over the low nbits.
+      * Digits on which all keys agree are skipped. */
+    void radix_sort(std::vector<std::uint64_t>& key, std::vector<std::uint32_t>& idx,
+                    unsigned nbits) {
+      const unsigned width = 11u, nbins = 1u << width;
+      const unsigned npass = (nbits + width - 1u) / width;
+      const std::size_t n = key.size();
+      std::vector<std::size_t> count(std::size_t(npass) * nbins);
+      for(std::size_t i=0; i < n; i++)
+        for(unsigned p=0; p < npass; p++)
+          count[p*nbins + (key[i] >> (p*width) & (nbins - 1u))]++;
+      std::vector<std::uint64_t> key2;
+      std::vector<std::uint32_t> idx2;
+      for(unsigned p=0; p < npass; p++) {
+        std::size_t* c = &count[p*nbins];
+        if(c[key[0] >> (p*width) & (nbins - 1u)] == n) continue;
+        std::size_t sum = 0u;
+        for(unsigned b=0; b < nbins; b++) {
+          const std::size_t m = c[b];
+          c[b] = sum;
+          sum += m;
+        }
+        key2.resize(n);
+        idx2.resize(n);
+        for(std::size_t i=0; i < n; i++) {
+          const std::size_t j = c[key[i] >> (p*width) & (nbins - 1u)]++;
+          key2[j] = key[i];
+          idx2[j] = idx[i];
+        }
+        key.swap(key2);
+        idx.swap(idx2);
+      }
+    }
+  }
+
+  /** Leaf containing each of n points, for a domain spanning [lo, hi] in
+    * every dimension. xyz holds D coordinates per point; points outside
+    * the domain are clamped to its boundary, and points in an excluded
+    * top-level block or with a NaN coordinate get ~IdType(0). Throws
+    * std::invalid_argument unless lo < hi in every dimension.
+    *
+    * Points are scaled to integer coordinates on the finest level, a chunk
+    * at a time in a vectorizable loop, and sorted by Morton key (of the
+    * domain, whatever the tree's curve) with a radix sort. Walking them in
+    * that order, each point descends only from the deepest ancestor it
+    * shares with the previous one, so a cluster of points in one block
+    * walks its path once. */
+  template<unsigned D>
+  void MortonTreeT<D>::locate_points(const double lo[D], const double hi[D], const double* xyz,
+                                     std::size_t n, IdType* out) const {
+    for(unsigned d=0; d < D; d++)
+      if(!(lo[d] < hi[d]))
+        throw std::invalid_argument("locate_points: the domain is empty");
+    if(n == 0u) return;
+    const unsigned lmax = levs_ - 1u;
+    double scale[D], top[D];
+    for(unsigned d=0; d < D; d++) {
+      const double cells = double(lev0_blks_[d] << lmax);
+      scale[d] = cells / (hi[d] - lo[d]);
+      top[d] = cells - 1.0;
+    }
+    // finest-level coordinates of point i; NaN goes to 0 and the point
+    // is dropped after the walk
+    auto coord = [&](std::size_t i, unsigned d) {
+      const double v = (xyz[D*i+d] - lo[d]) * scale[d];
+      return unsigned(!(v >= 0.0) ? 0.0 : v > top[d] ? top[d] : v);
+    };
+
+    // keys: top-level Morton index, then the interleaved coordinates of
+    // as many levels as fit
+    unsigned ntop = 1u;
+    for(unsigned d=0; d < D; d++) ntop *= lev0_blks_[d];
+    unsigned topbits = 0u;
+    while((std::uint64_t(1) << topbits) < ntop) topbits++;
+    const unsigned klev = std::min(lmax, (64u - topbits)/D);
+    const unsigned kbits = D*klev;
+    std::vector<std::uint64_t> key(n);
+    std::vector<std::uint32_t> idx(n);
+    // top-level Morton indices by row-major coordinate, when there are
+    // fewer top-level blocks than points
+    std::vector<unsigned> topmort;
+    if(ntop <= n/4u) {
+      std::vector<unsigned> x(D*std::size_t(ntop));
+      top_->mort_to_coord(0u, ntop, x.data());
+      topmort.resize(ntop);
+      for(unsigned m=0; m < ntop; m++) {
+        unsigned r = 0u;
+        for(unsigned d=D; d-- > 0u; ) r = r*lev0_blks_[d] + x[D*m+d];
+        topmort[r] = m;
+      }
+    }
+    const std::size_t chunk = 256u;
+    unsigned c[D][chunk];
+    for(std::size_t i0=0; i0 < n; i0 += chunk) {
+      const std::size_t m = std::min(chunk, n - i0);
+      for(unsigned d=0; d < D; d++)
+        for(std::size_t j=0; j < m; j++)
+          c[d][j] = coord(i0+j, d);
+      for(std::size_t j=0; j < m; j++) {
+        unsigned t[D], r = 0u;
+        std::uint64_t k = 0u;
+        for(unsigned d=0; d < D; d++) {
+          t[d] = c[d][j] >> lmax;
+          const std::uint64_t local = (c[d][j] & ((1u << lmax) - 1u)) >> (lmax - klev);
+          k |= bitspread<D>(local) << d;
+        }
+        for(unsigned d=D; d-- > 0u; ) r = r*lev0_blks_[d] + t[d];
+        const unsigned tm = topmort.empty() ? top_->coord_to_mort(t) : topmort[r];
+        key[i0+j] = std::uint64_t(tm) << kbits | k;
+        idx[i0+j] = std::uint32_t(i0+j);
+      }
+    }
+    // more points than 32-bit indices can sort are walked as given
+    const bool sorted = n <= std::size_t(~std::uint32_t(0));
+    if(sorted) radix_sort(key, idx, topbits + kbits);
+
+    // walk in key order, keeping the path of the previous point; the
+    // coordinates are needed again only below the levels held in the key
+    const std::uint64_t kmask = (std::uint64_t(1) << kbits) - 1u;
+    std::vector<IdType> ix(levs_);
+    std::vector<unsigned char> st(levs_);
+    std::uint64_t prev = 0u;
+    unsigned depth = ~0u;            // level of the previous leaf, ~0u if excluded
+    for(std::size_t s=0; s < n; s++) {
+      const std::size_t i = sorted ? idx[s] : s;
+      const std::uint64_t k = key[s];
+      unsigned lev;
+      if(s > 0u && k >> kbits == prev >> kbits) {
+        if(depth == ~0u) {
+          out[i] = ~IdType(0);
+          continue;
+        }
+        // levels above the highest differing bit are shared
+        const std::uint64_t x = (k ^ prev) & kmask;
+        lev = std::min(depth, x ? klev - 1u - highbit(x)/D : klev);
+      }
+      else {
+        const IdType tm = IdType(k >> kbits);
+        prev = k;
+        if(!bits_->get(tm)) {
+          depth = ~0u;
+          out[i] = ~IdType(0);
+          continue;
+        }
+        ix[0] = bits_->count(0u, tm);
+        st[0] = 0u;
+        lev = 0u;
+      }
+      prev = k;
+
+      while(lev < lmax && bits_->get(level_id0(lev) + ix[lev])) {
+        unsigned kid = 0u;
+        if(lev < klev)
+          kid = unsigned(k >> D*(klev - lev - 1u)) & (nkids - 1u);
+        else
+          for(unsigned d=0; d < D; d++)
+            kid |= (coord(i, d) >> (lmax - lev - 1u) & 1u) << d;
+        const unsigned slot = ct_->slot[st[lev]][kid];
+        ix[lev+1u] = (parents_before(lev, ix[lev]) << D) + slot;
+        st[lev+1u] = ct_->next[st[lev]][slot];
+        lev++;
+      }
+      depth = lev;
+      out[i] = level_id0(lev) + ix[lev];
+    }
+    for(std::size_t i=0; i < n; i++)
+      for(unsigned d=0; d < D; d++)
+        if(std::isnan(xyz[D*i+d])) out[i] = ~IdType(0);
+  }
+
+  template void MortonTreeT<1>::locate_points(const double*, const double*, const double*,
+                                              std::size_t, IdType*) const;
+  template void MortonTreeT<2>::locate_points(const double*, const double*, const double*,
+                                              std::size_t, IdType*) const;
+  template void MortonTreeT<3>::locate_points(const double*, const double*, const double*,
+                                              std::size_t, IdType*) const;
+}
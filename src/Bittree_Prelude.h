@@ -20,7 +20,10 @@
 #ifndef BITTREE_PRELUDE_H__
 #define BITTREE_PRELUDE_H__
 
+#include "Bittree_constants.h"
+
 #include <cstddef>
+#include <cstdint>
 #include <climits>
 #include <stdexcept>
 #include <memory>
@@ -29,6 +32,15 @@
 
 namespace bittree {
 
+  /** Type of block ids, Morton indices and bit positions. 32-bit by default
+   *  for cache density; setup with --id64 (BITTREE_ID64) for trees of more
+   *  than 2^32 bits. */
+#ifdef BITTREE_ID64
+  typedef std::uint64_t IdType;
+#else
+  typedef unsigned IdType;
+#endif
+
   /** Arbitrary base logarithm that takes size_t as input and output */ 
   template<size_t b, size_t x>
   struct Log {
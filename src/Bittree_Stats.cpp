@@ -0,0 +1,78 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_Stats.h"
+
+#include <iomanip>
+#include <sstream>
+
+namespace bittree {
+
+  QueryCounters query_counters = {{0}, {0}};
+
+  BittreeStats::BittreeStats():
+    dim(0),
+    init{0, 0.0},
+    reduce{0, 0.0},
+    update{0, 0.0},
+    apply{0, 0.0},
+    bytes_reduced(0),
+    blocks_refined(0),
+    blocks_derefined(0),
+    identify_calls(0),
+    locate_calls(0) {
+  }
+
+  namespace {
+    void phase_json(std::ostream& os, const char* name, const PhaseStats& p) {
+      os << "    \"" << name << "\": {\"calls\": " << p.calls
+         << ", \"seconds\": " << p.seconds << "}";
+    }
+  }
+
+  /** Write the counters as a JSON object */
+  std::string BittreeStats::to_json() const {
+    std::ostringstream os;
+    os << std::setprecision(9);
+    os << "{\n";
+#ifdef BITTREE_INSTRUMENT
+    os << "  \"instrumented\": true,\n";
+#else
+    os << "  \"instrumented\": false,\n";
+#endif
+    os << "  \"dim\": " << dim << ",\n";
+    os << "  \"phases\": {\n";
+    phase_json(os, "init", init);     os << ",\n";
+    phase_json(os, "reduce", reduce); os << ",\n";
+    phase_json(os, "update", update); os << ",\n";
+    phase_json(os, "apply", apply);   os << "\n";
+    os << "  },\n";
+    os << "  \"bytes_reduced\": " << bytes_reduced << ",\n";
+    os << "  \"blocks_refined\": " << blocks_refined << ",\n";
+    os << "  \"blocks_derefined\": " << blocks_derefined << ",\n";
+    os << "  \"identify_calls\": " << identify_calls << ",\n";
+    os << "  \"locate_calls\": " << locate_calls << ",\n";
+    os << "  \"regrids\": [";
+    for(std::size_t i=0; i < regrids.size(); i++) {
+      const RegridStats& r = regrids[i];
+      os << (i ? ",\n" : "\n")
+         << "    {\"blocks\": " << r.blocks << ", \"leaves\": " << r.leaves
+         << ", \"levels\": " << r.levels << ", \"refined\": " << r.refined
+         << ", \"derefined\": " << r.derefined << "}";
+    }
+    os << (regrids.empty() ? "]\n" : "\n  ]\n");
+    os << "}\n";
+    return os.str();
+  }
+
+}
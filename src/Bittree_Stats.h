@@ -0,0 +1,142 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_STATS_H__
+#define BITTREE_STATS_H__
+
+#include "Bittree_Prelude.h"
+#include "Bittree_constants.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace bittree {
+
+  /** Time spent in one phase of the refinement cycle. Times are
+    * inclusive, e.g. refine_apply includes the refine_update it runs. */
+  struct PhaseStats {
+    std::uint64_t calls;
+    double seconds;
+  };
+
+  /** Shape of the tree after one regrid (refine_apply) */
+  struct RegridStats {
+    std::uint64_t blocks;
+    std::uint64_t leaves;
+    unsigned levels;
+    std::uint64_t refined;    //!< Leaves marked for refinement
+    std::uint64_t derefined;  //!< Parents marked for derefinement
+  };
+
+  /** Counters collected by BittreeAmr when built with BITTREE_INSTRUMENT
+   *  (setup.py --instrument). Without it everything stays zero.
+   */
+  struct BittreeStats {
+    BittreeStats();
+
+    unsigned dim;                   //!< Dimensionality of the tree
+    PhaseStats init;
+    PhaseStats reduce;              //!< refine_reduce and refine_reduce_and
+    PhaseStats update;
+    PhaseStats apply;
+    std::uint64_t bytes_reduced;    //!< Payload per rank over all reductions
+    std::uint64_t blocks_refined;   //!< Sum over regrids
+    std::uint64_t blocks_derefined; //!< Sum over regrids
+    std::uint64_t identify_calls;   //!< MortonTree::identify, process-wide
+    std::uint64_t locate_calls;     //!< MortonTree::locate, process-wide
+    std::vector<RegridStats> regrids;
+
+    std::string to_json() const;
+  };
+
+  /** Shape of one level of a tree, from MortonTreeT::stats */
+  struct LevelStats {
+    std::uint64_t blocks;
+    std::uint64_t leaves;
+    std::uint64_t parents;
+    double coverage;   //!< Fraction of the included domain covered by leaves of this level
+  };
+
+  /** Shape of a tree by level, from MortonTreeT::stats */
+  struct TreeStats {
+    unsigned dim;
+    std::uint64_t blocks;
+    std::uint64_t leaves;
+    std::vector<LevelStats> levels;
+  };
+
+  /** Heap bytes held by a tree, from MortonTreeT::memory_bytes. Bytes of
+    * a loaded tree's mapped image are counted as if they were owned. */
+  struct TreeMemory {
+    std::uint64_t words;        //!< Bit array words
+    std::uint64_t checkpoints;  //!< Rank checkpoints of the bit array
+    std::uint64_t levels;       //!< Level table
+    std::uint64_t caches;       //!< Cached coarse_fine_faces results
+    std::uint64_t top_grid;     //!< Top-level grid, shared by the trees refined from one another
+    std::uint64_t object;       //!< The tree object itself
+
+    std::uint64_t total() const {
+      return words + checkpoints + levels + caches + top_grid + object;
+    }
+  };
+
+  /** Heap bytes held by a BittreeAmr, from BittreeAmrT::memory_bytes. The
+    * updated tree shares the top-level grid of the tree, which total
+    * counts once. */
+  struct AmrMemory {
+    TreeMemory tree;
+    TreeMemory updated;      //!< All zero outside refine_update..refine_apply
+    std::uint64_t delta;     //!< Refinement marks, zero outside refinement
+
+    std::uint64_t total() const {
+      return tree.total() + updated.total() - updated.top_grid + delta;
+    }
+  };
+
+  /** Process-wide query counters bumped by MortonTree when instrumented */
+  struct QueryCounters {
+    std::atomic<std::uint64_t> identify;
+    std::atomic<std::uint64_t> locate;
+  };
+  extern QueryCounters query_counters;
+
+  /** Adds the lifetime of the object to a PhaseStats */
+  class PhaseTimer {
+  public:
+    explicit PhaseTimer(PhaseStats& phase):
+      phase_(phase), t0_(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+      std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0_;
+      phase_.calls += 1;
+      phase_.seconds += dt.count();
+    }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+  private:
+    PhaseStats& phase_;
+    std::chrono::steady_clock::time_point t0_;
+  };
+
+}
+
+#ifdef BITTREE_INSTRUMENT
+#define BITTREE_TIME_PHASE(phase) ::bittree::PhaseTimer bittree_phase_timer_(phase)
+#define BITTREE_COUNT_QUERY(name) \
+  ::bittree::query_counters.name.fetch_add(1, std::memory_order_relaxed)
+#else
+#define BITTREE_TIME_PHASE(phase)
+#define BITTREE_COUNT_QUERY(name)
+#endif
+
+#endif
@@ -0,0 +1,186 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_TopGrid.h"
+
+#include <algorithm>
+
+namespace bittree {
+
+  template<unsigned D>
+  TopGridT<D>::TopGridT(const unsigned domain[D]) {
+    unsigned org[D];
+    bool empty = false;
+    for(unsigned d=0; d < D; d++) {
+      domain_[d] = domain[d];
+      org[d] = 0u;
+      empty = empty || domain[d] == 0u;
+    }
+    if(empty) return;
+    decompose(org, domain_, 0u);
+
+    // slabs between consecutive box edges, per dimension
+    std::vector<unsigned> edges[D];
+    unsigned stride = 1u;
+    for(unsigned d=0; d < D; d++) {
+      for(const Box& b : box_) edges[d].push_back(b.org[d]);
+      std::sort(edges[d].begin(), edges[d].end());
+      edges[d].erase(std::unique(edges[d].begin(), edges[d].end()), edges[d].end());
+      slab_[d].resize(domain_[d]);
+      unsigned s = 0u;
+      for(unsigned x=0; x < domain_[d]; x++) {
+        if(s+1u < edges[d].size() && edges[d][s+1u] == x) s++;
+        slab_[d][x] = s * stride;
+      }
+      stride *= unsigned(edges[d].size());
+    }
+
+    // every slab cell lies in exactly one box
+    cell_.resize(stride);
+    for(unsigned ib=0; ib < box_.size(); ib++) {
+      const Box& b = box_[ib];
+      unsigned s0[D], s1[D], s[D];
+      for(unsigned d=0; d < D; d++) {
+        s0[d] = unsigned(std::lower_bound(edges[d].begin(), edges[d].end(), b.org[d]) - edges[d].begin());
+        unsigned hi = b.org[d] + (1u << bitpop(b.mask[d]));
+        s1[d] = unsigned(std::lower_bound(edges[d].begin(), edges[d].end(), hi) - edges[d].begin());
+        s[d] = s0[d];
+      }
+      while(true) {
+        unsigned cell = 0u;
+        for(unsigned d=0; d < D; d++)
+          cell += slab_[d][edges[d][s[d]]];
+        cell_[cell] = ib;
+        unsigned d = 0;
+        while(d < D && ++s[d] == s1[d]) {
+          s[d] = s0[d];
+          d++;
+        }
+        if(d == D) break;
+      }
+    }
+  }
+
+  /** The bisection of rect_coord_to_mort, stopped at power-of-two boxes */
+  template<unsigned D>
+  void TopGridT<D>::decompose(const unsigned org[D], const unsigned box[D], unsigned base) {
+    bool pow2 = true;
+    for(unsigned d=0; d < D; d++)
+      pow2 = pow2 && (box[d] & (box[d]-1u)) == 0u;
+    if(pow2) {
+      // Inside a power-of-two box the bisection takes the top remaining bit
+      // of the dimension with the most bits left, the highest dimension on
+      // ties. Bottom up, that is rounds of k-way interleaves of the k
+      // dimensions still having bits, lowest dimension in the lowest bit.
+      Box b;
+      unsigned lg[D];
+      for(unsigned d=0; d < D; d++) {
+        b.org[d] = org[d];
+        b.mask[d] = 0u;
+        b.npiece[d] = 0;
+        lg[d] = unsigned(bitffs(box[d])) - 1u;
+      }
+      unsigned prev = 0u, dst = 0u;
+      while(true) {
+        unsigned next = ~0u, k = 0u;
+        for(unsigned d=0; d < D; d++) {
+          if(lg[d] > prev) {
+            k += 1u;
+            next = std::min(next, lg[d]);
+          }
+        }
+        if(k == 0u) break;
+        unsigned j = 0u;
+        for(unsigned d=0; d < D; d++) {
+          if(lg[d] <= prev) continue;
+          Piece p;
+          p.src = static_cast<unsigned char>(prev);
+          p.width = static_cast<unsigned char>(next - prev);
+          p.k = static_cast<unsigned char>(k);
+          p.dst = static_cast<unsigned char>(dst + j);
+          b.piece[d][b.npiece[d]++] = p;
+          std::uint64_t ones = (std::uint64_t(1)<<p.width) - 1u;
+          ones = k == 1u ? ones : k == 2u ? bitspread<2>(ones) : bitspread<3>(ones);
+          b.mask[d] |= unsigned(ones << p.dst);
+          j += 1u;
+        }
+        dst += k*(next - prev);
+        prev = next;
+      }
+      box_.push_back(b);
+      base_.push_back(base);
+      return;
+    }
+
+    // split off the biggest power of 2 strictly inside the box
+    unsigned max_pow2 = 0u;
+    unsigned max_d = 0u;
+    for(unsigned d=0; d < D; d++) {
+      unsigned p2 = glb_pow2(box[d]-1u);
+      if(p2 >= max_pow2) {
+        max_pow2 = p2;
+        max_d = d;
+      }
+    }
+    unsigned pop = 1u; // left sub-box population
+    unsigned box1[D], org1[D];
+    for(unsigned d=0; d < D; d++) {
+      pop *= d == max_d ? max_pow2 : box[d];
+      box1[d] = d == max_d ? max_pow2 : box[d];
+      org1[d] = org[d];
+    }
+    decompose(org1, box1, base);
+    box1[max_d] = box[max_d] - max_pow2;
+    org1[max_d] = org[max_d] + max_pow2;
+    decompose(org1, box1, base + pop);
+  }
+
+  /** Morton indices of n top-level blocks */
+  template<unsigned D>
+  void TopGridT<D>::coord_to_mort(unsigned n, const unsigned* x, unsigned* mort) const {
+    for(unsigned i=0; i < n; i++)
+      mort[i] = coord_to_mort(x + D*i);
+  }
+
+  /** Coordinates of the n top-level blocks from Morton index mort0 on,
+    * walking the boxes in order instead of searching for each block */
+  template<unsigned D>
+  void TopGridT<D>::mort_to_coord(unsigned mort0, unsigned n, unsigned* x) const {
+    if(n == 0u) return;
+    unsigned ib = unsigned(std::upper_bound(base_.begin(), base_.end(), mort0) - base_.begin()) - 1u;
+    unsigned next = ib+1u < base_.size() ? base_[ib+1u] : ~0u;
+    for(unsigned mort=mort0; mort < mort0+n; mort++, x += D) {
+      if(mort == next) {
+        ib += 1u;
+        next = ib+1u < base_.size() ? base_[ib+1u] : ~0u;
+      }
+      const Box& b = box_[ib];
+      deinterleave(b, mort - base_[ib], x);
+      for(unsigned d=0; d < D; d++)
+        x[d] += b.org[d];
+    }
+  }
+
+  /** Heap bytes held by the grid's tables */
+  template<unsigned D>
+  std::size_t TopGridT<D>::memory_bytes() const {
+    std::size_t n = sizeof(*this) + box_.capacity()*sizeof(Box) +
+                    (base_.capacity() + cell_.capacity())*sizeof(unsigned);
+    for(unsigned d=0; d < D; d++) n += slab_[d].capacity()*sizeof(unsigned);
+    return n;
+  }
+
+  template class TopGridT<1>;
+  template class TopGridT<2>;
+  template class TopGridT<3>;
+}
@@ -0,0 +1,157 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_TOPGRID_H__
+#define BITTREE_TOPGRID_H__
+
+#include "Bittree_Bits.h"
+
+namespace bittree {
+
+  /** Morton order of the top-level blocks of a rectangular domain.
+   *
+   *  rect_coord_to_mort orders a non-power-of-two domain by bisecting it
+   *  repeatedly. Once a box has power-of-two extents in every dimension the
+   *  rest of the bisection is a fixed bit interleave, so TopGridT runs the
+   *  bisection once, down to those boxes, and keeps them. A conversion is
+   *  then a table lookup for the box plus a bit (de)interleave of the offset
+   *  inside it: PDEP/PEXT when compiled with BMI2 (e.g. -mbmi2), magic-number
+   *  spreading otherwise.
+   *
+   *  Coordinates find their box through one table per dimension, mapping a
+   *  coordinate to its slab between consecutive box edges, and a table from
+   *  slab cell to box. Morton indices find theirs by binary search over the
+   *  box bases.
+   */
+  template<unsigned D>
+  class TopGridT {
+  public:
+    TopGridT() {}
+    explicit TopGridT(const unsigned domain[D]);
+
+    unsigned coord_to_mort(const unsigned x[D]) const;
+    void mort_to_coord(unsigned mort, unsigned x[D]) const;
+
+    // Batch conversions; coordinates are packed D per block
+    void coord_to_mort(unsigned n, const unsigned* x, unsigned* mort) const;
+    void mort_to_coord(unsigned mort0, unsigned n, unsigned* x) const;
+
+    unsigned box_count() const { return unsigned(box_.size()); }
+    std::size_t memory_bytes() const;
+
+  private:
+    /** Run of coordinate bits interleaved into the local index with stride k */
+    struct Piece {
+      unsigned char src;    //!< First coordinate bit
+      unsigned char width;  //!< Number of bits
+      unsigned char k;      //!< Stride in the local index
+      unsigned char dst;    //!< Position of the first bit in the local index
+    };
+
+    /** Power-of-two box of the decomposition */
+    struct Box {
+      unsigned org[D];      //!< Lower corner
+      unsigned mask[D];     //!< Local index bits holding each coordinate (PDEP)
+      Piece piece[D][D];    //!< The same as runs, for the portable path
+      unsigned char npiece[D];
+    };
+
+    void decompose(const unsigned org[D], const unsigned box[D], unsigned base);
+    static unsigned interleave(const Box& b, const unsigned y[D]);
+    static void deinterleave(const Box& b, unsigned local, unsigned y[D]);
+
+  private:
+    unsigned domain_[D];
+    std::vector<Box> box_;               //!< Boxes in Morton order
+    std::vector<unsigned> base_;         //!< Morton index of each box's first block
+    std::vector<unsigned> slab_[D];      //!< Coordinate to slab, times the slab stride
+    std::vector<unsigned> cell_;         //!< Slab cell to box
+  };
+
+  extern template class TopGridT<1>;
+  extern template class TopGridT<2>;
+  extern template class TopGridT<3>;
+
+  template<unsigned D>
+  inline unsigned TopGridT<D>::interleave(const Box& b, const unsigned y[D]) {
+#if defined(__BMI2__)
+    unsigned r = 0u;
+    for(unsigned d=0; d < D; d++)
+      r |= bitdeposit(y[d], b.mask[d]);
+    return r;
+#else
+    std::uint64_t r = 0u;
+    for(unsigned d=0; d < D; d++) {
+      for(unsigned i=0; i < b.npiece[d]; i++) {
+        const Piece& p = b.piece[d][i];
+        std::uint64_t v = (std::uint64_t(y[d]) >> p.src) & ((std::uint64_t(1)<<p.width) - 1u);
+        v = p.k == 1 ? v : p.k == 2 ? bitspread<2>(v) : bitspread<3>(v);
+        r |= v << p.dst;
+      }
+    }
+    return unsigned(r);
+#endif
+  }
+
+  template<unsigned D>
+  inline void TopGridT<D>::deinterleave(const Box& b, unsigned local, unsigned y[D]) {
+#if defined(__BMI2__)
+    for(unsigned d=0; d < D; d++)
+      y[d] = bitextract(local, b.mask[d]);
+#else
+    for(unsigned d=0; d < D; d++) {
+      std::uint64_t r = 0u;
+      for(unsigned i=0; i < b.npiece[d]; i++) {
+        const Piece& p = b.piece[d][i];
+        std::uint64_t v = std::uint64_t(local) >> p.dst;
+        v = p.k == 1 ? v : p.k == 2 ? bitcompact<2>(v) : bitcompact<3>(v);
+        r |= (v & ((std::uint64_t(1)<<p.width) - 1u)) << p.src;
+      }
+      y[d] = unsigned(r);
+    }
+#endif
+  }
+
+  /** Morton index of the top-level block at x, which must be in the domain */
+  template<unsigned D>
+  inline unsigned TopGridT<D>::coord_to_mort(const unsigned x[D]) const {
+    unsigned cell = 0u;
+    for(unsigned d=0; d < D; d++)
+      cell += slab_[d][x[d]];
+    const unsigned ib = cell_[cell];
+    const Box& b = box_[ib];
+    unsigned y[D];
+    for(unsigned d=0; d < D; d++)
+      y[d] = x[d] - b.org[d];
+    return base_[ib] + interleave(b, y);
+  }
+
+  /** Coordinates of the top-level block with Morton index mort */
+  template<unsigned D>
+  inline void TopGridT<D>::mort_to_coord(unsigned mort, unsigned x[D]) const {
+    // last box with base <= mort, by a branchless binary search
+    const unsigned* p = base_.data();
+    for(unsigned len = unsigned(base_.size()); len > 1u; ) {
+      unsigned half = len >> 1;
+      p += p[half] <= mort ? half : 0u;
+      len -= half;
+    }
+    const unsigned ib = unsigned(p - base_.data());
+    const Box& b = box_[ib];
+    deinterleave(b, mort - base_[ib], x);
+    for(unsigned d=0; d < D; d++)
+      x[d] += b.org[d];
+  }
+
+}
+#endif
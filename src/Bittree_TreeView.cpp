@@ -0,0 +1,166 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "Bittree_TreeView.h"
+#include "Bittree_MortonTree.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+namespace bittree {
+
+  template<unsigned D> const unsigned TreeEpochsT<D>::max_readers;
+  template<unsigned D> const std::uint64_t TreeEpochsT<D>::FREE;
+
+  /** Constructor. All slots start out free. */
+  template<unsigned D>
+  TreeEpochsT<D>::TreeEpochsT():
+    epoch_(0) {
+    current_[ORIGINAL].store(nullptr);
+    current_[UPDATED].store(nullptr);
+    for(unsigned i=0; i < max_readers; i++)
+      slots_[i].epoch.store(FREE);
+  }
+
+  /** Claim a reader slot and pin the current epoch in it. Trees retired
+    * from now on are kept alive until unpin(slot). Returns max_readers
+    * if every slot is taken. */
+  template<unsigned D>
+  unsigned TreeEpochsT<D>::pin() {
+    // start the scan at a per-thread position to spread out the slots
+    unsigned start = static_cast<unsigned>(
+        std::hash<std::thread::id>()(std::this_thread::get_id()) % max_readers);
+    for(unsigned i=0; i < max_readers; i++) {
+      unsigned s = (start + i) % max_readers;
+      std::uint64_t expected = FREE;
+      // A stale epoch is fine here, it only delays reclamation.
+      std::uint64_t e = epoch_.load();
+      if(slots_[s].epoch.load(std::memory_order_relaxed) == FREE &&
+         slots_[s].epoch.compare_exchange_strong(expected, e))
+        return s;
+    }
+    return max_readers;
+  }
+
+  /** Release a slot claimed by pin */
+  template<unsigned D>
+  void TreeEpochsT<D>::unpin(unsigned slot) {
+    slots_[slot].epoch.store(FREE, std::memory_order_release);
+  }
+
+  /** Currently published tree (call between pin and unpin) */
+  template<unsigned D>
+  const MortonTreeT<D>* TreeEpochsT<D>::current(Which which) const {
+    return current_[which].load();
+  }
+
+  /** Shared owner of the currently published tree, for readers without
+    * a slot */
+  template<unsigned D>
+  std::shared_ptr<const MortonTreeT<D>> TreeEpochsT<D>::share(Which which) const {
+    std::lock_guard<std::mutex> lock(retire_mtx_);
+    return owned_[which];
+  }
+
+  /** Replace the published tree. The previous one is retired and freed
+    * by reclaim once no reader can still be looking at it. */
+  template<unsigned D>
+  void TreeEpochsT<D>::publish(Which which, std::shared_ptr<MortonTree> tree) {
+    std::lock_guard<std::mutex> lock(retire_mtx_);
+    current_[which].store(tree.get());
+    if(owned_[which]) {
+      std::uint64_t e = epoch_.fetch_add(1);
+      retired_.push_back(Retired{e, owned_[which]});
+    }
+    owned_[which] = tree;
+    // readers pinned from here on can only see the new tree
+  }
+
+  /** Release retired trees older than every pinned reader.
+    * Returns the number of trees still awaiting reclamation. */
+  template<unsigned D>
+  unsigned TreeEpochsT<D>::reclaim() {
+    std::lock_guard<std::mutex> lock(retire_mtx_);
+    std::uint64_t min_pinned = FREE;
+    for(unsigned i=0; i < max_readers; i++)
+      min_pinned = std::min(min_pinned, slots_[i].epoch.load());
+    retired_.erase(
+        std::remove_if(retired_.begin(), retired_.end(),
+                       [min_pinned](const Retired& r) { return r.epoch < min_pinned; }),
+        retired_.end());
+    return static_cast<unsigned>(retired_.size());
+  }
+
+  /** Number of trees awaiting reclamation */
+  template<unsigned D>
+  unsigned TreeEpochsT<D>::retired() const {
+    std::lock_guard<std::mutex> lock(retire_mtx_);
+    return static_cast<unsigned>(retired_.size());
+  }
+
+  /** Pin a snapshot of the given tree */
+  template<unsigned D>
+  TreeViewT<D>::TreeViewT(TreeEpochs* epochs, typename TreeEpochsT<D>::Which which):
+    epochs_(epochs),
+    tree_(nullptr),
+    slot_(epochs->pin()) {
+    if(slot_ == TreeEpochs::max_readers) {
+      held_ = epochs_->share(which);
+      tree_ = held_.get();
+    }
+    else
+      tree_ = epochs_->current(which);
+  }
+
+  template<unsigned D>
+  TreeViewT<D>::TreeViewT(TreeViewT&& that):
+    epochs_(that.epochs_),
+    tree_(that.tree_),
+    slot_(that.slot_),
+    held_(std::move(that.held_)) {
+    that.epochs_ = nullptr;
+    that.tree_ = nullptr;
+  }
+
+  template<unsigned D>
+  TreeViewT<D>& TreeViewT<D>::operator=(TreeViewT&& that) {
+    if(this != &that) {
+      release();
+      epochs_ = that.epochs_;
+      tree_ = that.tree_;
+      slot_ = that.slot_;
+      held_ = std::move(that.held_);
+      that.epochs_ = nullptr;
+      that.tree_ = nullptr;
+    }
+    return *this;
+  }
+
+  /** Unpin the snapshot. The view is empty afterwards. */
+  template<unsigned D>
+  void TreeViewT<D>::release() {
+    if(epochs_ && slot_ < TreeEpochs::max_readers) epochs_->unpin(slot_);
+    epochs_ = nullptr;
+    tree_ = nullptr;
+    held_.reset();
+  }
+
+  template class TreeEpochsT<1>;
+  template class TreeEpochsT<2>;
+  template class TreeEpochsT<3>;
+  template class TreeViewT<1>;
+  template class TreeViewT<2>;
+  template class TreeViewT<3>;
+
+}
@@ -0,0 +1,132 @@
+/*
+   Copyright 2022 UChicago Argonne, LLC and contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#ifndef BITTREE_TREEVIEW_H__
+#define BITTREE_TREEVIEW_H__
+
+#include "Bittree_Prelude.h"
+#include "Bittree_constants.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace bittree {
+
+  template<unsigned D> class MortonTreeT;
+
+  /** Epoch-based reclamation for the trees owned by a BittreeAmr.
+   *
+   *  Readers pin the current epoch in one of a fixed number of slots and
+   *  then read a raw tree pointer. Trees replaced by the writer are
+   *  retired with the epoch at which they were unpublished, and only
+   *  released once every pinned slot has moved past that epoch. Readers
+   *  beyond max_readers get no slot and hold a shared_ptr instead.
+   */
+  template<unsigned D>
+  class TreeEpochsT {
+    typedef MortonTreeT<D> MortonTree;
+  public:
+    static const unsigned max_readers = 256;  //!< Number of reader slots
+    enum Which : unsigned { ORIGINAL = 0, UPDATED = 1 };
+
+    TreeEpochsT();
+    ~TreeEpochsT() = default;
+    TreeEpochsT(const TreeEpochsT&) = delete;
+    TreeEpochsT& operator=(const TreeEpochsT&) = delete;
+
+    // Reader side
+    unsigned pin();
+    void unpin(unsigned slot);
+    const MortonTree* current(Which which) const;
+    std::shared_ptr<const MortonTree> share(Which which) const;
+
+    // Writer side
+    void publish(Which which, std::shared_ptr<MortonTree> tree);
+    unsigned reclaim();
+    unsigned retired() const;
+
+    /** Serializes lazy refine_update calls from concurrent readers */
+    std::mutex& update_mutex() { return update_mtx_; }
+
+  private:
+    static const std::uint64_t FREE = ~std::uint64_t(0);
+
+    /** One reader slot, padded to keep slots on separate cache lines */
+    struct Slot {
+      std::atomic<std::uint64_t> epoch;
+      char pad[64 - sizeof(std::atomic<std::uint64_t>)];
+    };
+
+    struct Retired {
+      std::uint64_t epoch;
+      std::shared_ptr<MortonTree> tree;
+    };
+
+    std::atomic<std::uint64_t> epoch_;             //!< Global epoch
+    std::atomic<const MortonTree*> current_[2];    //!< Published trees
+    std::shared_ptr<MortonTree> owned_[2];         //!< Owners of current_
+    Slot slots_[max_readers];                      //!< Reader slots
+    std::vector<Retired> retired_;                 //!< Awaiting reclamation
+    mutable std::mutex retire_mtx_;                //!< Guards retired_/owned_
+    std::mutex update_mtx_;
+  };
+
+  /** Read-only snapshot of a tree, pinned against reclamation.
+   *
+   *  A TreeView holds a raw pointer, so copying the tree out of it never
+   *  touches a shared reference count. The tree stays alive while the
+   *  view exists, even across refine_apply. Views are cheap to create but
+   *  each one occupies a reader slot, so keep them short-lived. Beyond
+   *  TreeEpochs::max_readers live views, new views fall back to holding a
+   *  shared_ptr to the tree, which costs a reference count update.
+   */
+  template<unsigned D>
+  class TreeViewT {
+    typedef MortonTreeT<D> MortonTree;
+    typedef TreeEpochsT<D> TreeEpochs;
+  public:
+    TreeViewT(): epochs_(nullptr), tree_(nullptr), slot_(0) {}
+    TreeViewT(TreeEpochs* epochs, typename TreeEpochs::Which which);
+    TreeViewT(TreeViewT&& that);
+    TreeViewT& operator=(TreeViewT&& that);
+    TreeViewT(const TreeViewT&) = delete;
+    TreeViewT& operator=(const TreeViewT&) = delete;
+    ~TreeViewT() { release(); }
+
+    const MortonTree* get() const { return tree_; }
+    const MortonTree* operator->() const { return tree_; }
+    const MortonTree& operator*() const { return *tree_; }
+    explicit operator bool() const { return tree_ != nullptr; }
+
+    void release();
+
+  private:
+    TreeEpochs* epochs_;
+    const MortonTree* tree_;
+    unsigned slot_;                          //!< Reader slot, max_readers if none
+    std::shared_ptr<const MortonTree> held_; //!< Owner of tree_ when there is no slot
+  };
+
+  extern template class TreeEpochsT<1>;
+  extern template class TreeEpochsT<2>;
+  extern template class TreeEpochsT<3>;
+  extern template class TreeViewT<1>;
+  extern template class TreeViewT<2>;
+  extern template class TreeViewT<3>;
+
+  typedef TreeEpochsT<BTDIM> TreeEpochs;
+  typedef TreeViewT<BTDIM> TreeView;
+
+}
+#endif
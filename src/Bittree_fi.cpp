@@ -13,6 +13,8 @@
 */
 #include "Bittree_fi.h"
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 
 /** Checks if the_tree has been created */
@@ -29,13 +31,190 @@ extern "C" void bittree_init(
   the_tree = std::make_shared<BittreeAmr>(topsize,includes);
 }
 
+/** bittree_init with the sibling order chosen by curve: 0 for Morton,
+  * 1 for Hilbert */
+extern "C" void bittree_init_curve(
+    int topsize[],  // in
+    int includes[], // in
+    int *curve      // in
+  ) {
+  the_tree = std::make_shared<BittreeAmr>(topsize, includes,
+      *curve == 1 ? Curve::hilbert : Curve::morton);
+}
+
+/** Write the (non-updated) tree to a binary checkpoint file */
+extern "C" void bittree_save(
+    const char *path,  // in: null-terminated file name
+    int *ierr          // out
+  ) {
+  *ierr = 1;
+  if(!!the_tree) {
+    try {
+      the_tree->getTree()->save(path);
+      *ierr = 0;
+    }
+    catch(const std::exception& e) {
+      std::cout << "bittree_save: " << e.what() << std::endl;
+    }
+  }
+}
+
+/** Replace the_tree with a tree read from a file written by bittree_save */
+extern "C" void bittree_load(
+    const char *path,  // in: null-terminated file name
+    int *ierr          // out
+  ) {
+  *ierr = 1;
+  try {
+    the_tree = std::make_shared<BittreeAmr>(MortonTree::load(path));
+    *ierr = 0;
+  }
+  catch(const std::exception& e) {
+    std::cout << "bittree_load: " << e.what() << std::endl;
+  }
+}
+
+/** Wrapper function for MortonTree's export_blocks */
+extern "C" void bittree_export_blocks(
+    bool *updated,     // in
+    const char *path,  // in: null-terminated file name
+    bool *parents,     // in
+    int *ierr          // out
+  ) {
+  *ierr = 1;
+  if(!!the_tree) {
+    try {
+      the_tree->getTreePtr(*updated)->export_blocks(path, *parents);
+      *ierr = 0;
+    }
+    catch(const std::exception& e) {
+      std::cout << "bittree_export_blocks: " << e.what() << std::endl;
+    }
+  }
+}
+
+/** Wrapper function for MortonTree's export_vtk */
+extern "C" void bittree_export_vtk(
+    bool *updated,     // in
+    const char *path,  // in: null-terminated file name
+    const double *lo,  // in
+    const double *hi,  // in
+    bool *parents,     // in
+    int *ierr          // out
+  ) {
+  *ierr = 1;
+  if(!!the_tree) {
+    try {
+      the_tree->getTreePtr(*updated)->export_vtk(path, lo, hi, *parents);
+      *ierr = 0;
+    }
+    catch(const std::exception& e) {
+      std::cout << "bittree_export_vtk: " << e.what() << std::endl;
+    }
+  }
+}
+
+/** Creates a TreeHistoryWriter and attaches it to the_tree */
+extern "C" void bittree_history_open(
+    const char *path,     // in: null-terminated file name
+    int *keyframe_every,  // in
+    int *ierr             // out
+  ) {
+  *ierr = 1;
+  if(!!the_tree) {
+    the_history = std::make_shared<TreeHistoryWriter>(
+        path, static_cast<unsigned>(std::max(*keyframe_every, 1)));
+    the_tree->attach_history(the_history);
+    *ierr = 0;
+  }
+}
+
+/** Wrapper function for TreeHistoryWriter's snapshot */
+extern "C" void bittree_history_snapshot(
+    double *bytes,        // out
+    int *ierr             // out
+  ) {
+  *ierr = 1;
+  *bytes = 0.0;
+  if(!!the_tree && !!the_history) {
+    try {
+      *bytes = static_cast<double>(the_history->snapshot(*the_tree->getTree()));
+      *ierr = 0;
+    }
+    catch(const std::exception& e) {
+      std::cout << "bittree_history_snapshot: " << e.what() << std::endl;
+    }
+  }
+}
+
+/** Replace the_tree with a tree read from a history file */
+extern "C" void bittree_history_load(
+    const char *path,     // in: null-terminated file name
+    bittree_int *snapshot, // in
+    int *ierr             // out
+  ) {
+  *ierr = 1;
+  try {
+    TreeHistoryReader history(path);
+    the_tree = std::make_shared<BittreeAmr>(history.tree(static_cast<std::uint64_t>(*snapshot)));
+    *ierr = 0;
+  }
+  catch(const std::exception& e) {
+    std::cout << "bittree_history_load: " << e.what() << std::endl;
+  }
+}
+
+/** Wrapper function for broadcast_from */
+extern "C" void bittree_broadcast(
+    int *root,         // in
+    int *comm_,        // in
+    int *ierr          // out
+  ) {
+  MPI_Comm comm = MPI_Comm_f2c(*comm_);
+  *ierr = 1;
+  if(!the_tree)
+    the_tree = std::make_shared<BittreeAmr>(std::shared_ptr<MortonTree>());
+  try {
+    the_tree->broadcast_from(*root, comm);
+    *ierr = 0;
+  }
+  catch(const std::exception& e) {
+    std::cout << "bittree_broadcast: " << e.what() << std::endl;
+  }
+}
+
+/** Wrapper function for check_identical */
+extern "C" void bittree_check_identical(
+    int *root,         // in
+    int *comm_,        // in
+    bool *identical    // out
+  ) {
+  MPI_Comm comm = MPI_Comm_f2c(*comm_);
+  if(!!the_tree)
+    *identical = the_tree->check_identical(*root, comm);
+  else // still take part in the collective
+    *identical = BittreeAmr(std::shared_ptr<MortonTree>()).check_identical(*root, comm);
+}
+
+/** Wrapper function for verify_consistent */
+extern "C" void bittree_verify_consistent(
+    int *comm_,        // in
+    bool *consistent   // out
+  ) {
+  MPI_Comm comm = MPI_Comm_f2c(*comm_);
+  if(!!the_tree)
+    *consistent = the_tree->verify_consistent(comm);
+  else // still take part in the collective
+    *consistent = BittreeAmr(std::shared_ptr<MortonTree>()).verify_consistent(comm);
+}
+
 /** Wrapper function for block_count */
 extern "C" void bittree_level_count(
     bool *updated,     //in: boolean
     int *count         //out
   ) {
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
+    auto tree = the_tree->getTreePtr(*updated);
     *count = static_cast<int>(tree->levels());
   }
 }
@@ -44,11 +223,11 @@ extern "C" void bittree_level_count(
 /** Wrapper function for block_count */
 extern "C" void bittree_block_count(
     bool *updated,     //in: boolean
-    int *count         //out
+    bittree_int *count //out
   ) {
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
-    *count = static_cast<int>(tree->blocks());
+    auto tree = the_tree->getTreePtr(*updated);
+    *count = static_cast<bittree_int>(tree->blocks());
   }
 }
 
@@ -56,43 +235,134 @@ extern "C" void bittree_block_count(
 /** Wrapper function for leaf_count */
 extern "C" void bittree_leaf_count(
     bool *updated,     //in: boolean
-    int *count         //out
+    bittree_int *count //out
   ) {
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
-    *count = static_cast<int>(tree->leaves());
+    auto tree = the_tree->getTreePtr(*updated);
+    *count = static_cast<bittree_int>(tree->leaves());
   }
 }
 
 /** Wrapper function for delta_count */
 extern "C" void bittree_delta_count(
-    int *count         //out
+    bittree_int *count //out
   ) {
   if(!!the_tree)
-    *count = static_cast<int>(the_tree->delta_count());
+    *count = static_cast<bittree_int>(the_tree->delta_count());
 }
 
 
+namespace {
+  /** Shared body of bittree_is_parent and its batched/handle variants */
+  inline void is_parent_one(const MortonTree* tree, const bittree_int *bitid,
+                            bool *parent_check) {
+    IdType bitid_u  = static_cast<IdType>(*bitid);
+    *parent_check = tree->block_is_parent(bitid_u);
+  }
+
+  /** Shared body of bittree_identify and its batched/handle variants */
+  inline void identify_one(const MortonTree* tree, int *lev, int *ijk,
+                           bittree_int *mort, bittree_int *bitid) {
+    unsigned coord[BTDIM];
+    for(unsigned d=0; d < BTDIM; d++)
+      coord[d] = static_cast<unsigned>( ijk[d]);
+    unsigned lev_u = static_cast<unsigned>(*lev);
+
+    if(tree->inside(lev_u, coord)) {
+      MortonTree::Block b = tree->identify(lev_u, coord);
+
+      *lev = static_cast<int>(b.level);
+      for(unsigned d=0; d < BTDIM; d++)
+        ijk[d] = static_cast<int>(b.coord[d]);
+      *mort = static_cast<bittree_int>(b.mort);
+      *bitid = static_cast<bittree_int>(b.id);
+    }
+    else {
+      *lev = -1;
+      for(unsigned d=0; d < BTDIM; d++)
+        ijk[d] = -1;
+      *mort = -1;
+      *bitid = -1;
+    }
+  }
+
+  /** Shared body of bittree_locate and its batched/handle variants */
+  inline void locate_one(const MortonTree* tree, const bittree_int *bitid, int *lev,
+                         int *ijk, bittree_int *mort) {
+    IdType bitid_u  = static_cast<IdType>(*bitid);
+    if(bitid_u < tree->id_upper_bound() ) {
+      MortonTree::Block b = tree->locate(bitid_u);
+
+      *lev = static_cast<int>(b.level);
+      for(unsigned d=0; d < BTDIM; d++)
+        ijk[d] = static_cast<int>(b.coord[d]);
+      *mort = static_cast<bittree_int>(b.mort);
+    }
+    else {
+      *lev = -1;
+      for(unsigned d=0; d < BTDIM; d++)
+        ijk[d] = -1;
+      *mort = -1;
+    }
+  }
+
+  /** Shared body of bittree_query_box and its count; negative bounds are
+    * clipped to 0 */
+  inline IdType query_box_one(const MortonTree* tree, int *lev, int *lo, int *hi,
+                              IdType *out) {
+    unsigned lo_u[BTDIM], hi_u[BTDIM];
+    for(unsigned d=0; d < BTDIM; d++) {
+      if(hi[d] < 0) return 0;
+      lo_u[d] = static_cast<unsigned>(std::max(lo[d], 0));
+      hi_u[d] = static_cast<unsigned>(hi[d]);
+    }
+    return tree->query_box(static_cast<unsigned>(*lev), lo_u, hi_u, out);
+  }
+}
+
 /** Wrapper function for check_refine_bit */
 extern "C" void bittree_check_refine_bit(
-    const int *bitid,   //in
+    const bittree_int *bitid, //in
     bool *bit_check     //out
   ) {
-  unsigned bitid_u  = static_cast<unsigned>(*bitid);
+  IdType bitid_u  = static_cast<IdType>(*bitid);
   if(!!the_tree)
     *bit_check = the_tree->check_refine_bit(bitid_u);
 }
 
+/** Batched check_refine_bit over bitid(1:n) */
+extern "C" void bittree_check_refine_bit_batch(
+    const int *n,       //in
+    const bittree_int *bitid, //in: bitid(n)
+    bool *bit_check     //out: bit_check(n)
+  ) {
+  if(!!the_tree) {
+    for(int i=0; i < *n; i++)
+      bit_check[i] = the_tree->check_refine_bit(static_cast<IdType>(bitid[i]));
+  }
+}
+
 /** Wrapper function for is_parent */
 extern "C" void bittree_is_parent(
     bool *updated,      //in
-    int *bitid,         //in
+    bittree_int *bitid, //in
     bool *parent_check  //out
   ) {
-  unsigned bitid_u  = static_cast<unsigned>(*bitid);
+  if(!!the_tree)
+    is_parent_one(the_tree->getTreePtr(*updated), bitid, parent_check);
+}
+
+/** Batched is_parent over bitid(1:n) */
+extern "C" void bittree_is_parent_batch(
+    bool *updated,      //in
+    const int *n,       //in
+    const bittree_int *bitid, //in: bitid(n)
+    bool *parent_check  //out: parent_check(n)
+  ) {
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
-    *parent_check = tree->block_is_parent(bitid_u);
+    const MortonTree* tree = the_tree->getTreePtr(*updated);
+    for(int i=0; i < *n; i++)
+      is_parent_one(tree, &bitid[i], &parent_check[i]);
   }
 }
 
@@ -101,73 +371,105 @@ extern "C" void bittree_identify(
     bool *updated,      //in
     int *lev,           //inout (0-based)
     int *ijk,           //inout
-    int *mort,          //out
-    int *bitid          //out
+    bittree_int *mort,  //out
+    bittree_int *bitid  //out
   ) {
-  unsigned coord[BTDIM];
-  for(unsigned d=0; d < BTDIM; d++)
-    coord[d] = static_cast<unsigned>( ijk[d]);
-  unsigned lev_u = static_cast<unsigned>(*lev);
+  if(!!the_tree)
+    identify_one(the_tree->getTreePtr(*updated), lev, ijk, mort, bitid);
+}
 
+/** Batched identify over n blocks */
+extern "C" void bittree_identify_batch(
+    bool *updated,      //in
+    const int *n,       //in
+    int *lev,           //inout: lev(n) (0-based)
+    int *ijk,           //inout: ijk(BTDIM,n)
+    bittree_int *mort,  //out: mort(n)
+    bittree_int *bitid  //out: bitid(n)
+  ) {
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
-    if(tree->inside(lev_u, coord)) {
-      MortonTree::Block b = tree->identify(lev_u, coord);
-
-      *lev = static_cast<int>(b.level);
-      for(unsigned d=0; d < BTDIM; d++)
-        ijk[d] = static_cast<int>(b.coord[d]);
-      *mort = static_cast<int>(b.mort);
-      *bitid = static_cast<int>(b.id);
-    }
-    else {
-      *lev = -1;
-      for(unsigned d=0; d < BTDIM; d++)
-        ijk[d] = -1;
-      *mort = -1;
-      *bitid = -1;
-    }
-
+    const MortonTree* tree = the_tree->getTreePtr(*updated);
+    for(int i=0; i < *n; i++)
+      identify_one(tree, &lev[i], &ijk[BTDIM*i], &mort[i], &bitid[i]);
   }
 }
 
 /** Wrapper function for MortonTree's locate */
 extern "C" void bittree_locate(
     bool *updated,      //in
-    int *bitid,         //in
+    bittree_int *bitid, //in
     int *lev,           //out (0-based)
     int *ijk,           //out
-    int *mort          //out
+    bittree_int *mort  //out
   ) {
-  unsigned bitid_u  = static_cast<unsigned>(*bitid);
+  if(!!the_tree)
+    locate_one(the_tree->getTreePtr(*updated), bitid, lev, ijk, mort);
+}
 
+/** Batched locate over bitid(1:n) */
+extern "C" void bittree_locate_batch(
+    bool *updated,      //in
+    const int *n,       //in
+    const bittree_int *bitid, //in: bitid(n)
+    int *lev,           //out: lev(n) (0-based)
+    int *ijk,           //out: ijk(BTDIM,n)
+    bittree_int *mort   //out: mort(n)
+  ) {
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
-    if(bitid_u < tree->id_upper_bound() ) {
-      MortonTree::Block b = tree->locate(bitid_u);
-
-      *lev = static_cast<int>(b.level);
-      for(unsigned d=0; d < BTDIM; d++)
-        ijk[d] = static_cast<int>(b.coord[d]);
-      *mort = static_cast<int>(b.mort);
-    }
-    else {
-      *lev = -1;
-      for(unsigned d=0; d < BTDIM; d++)
-        ijk[d] = -1;
-      *mort = -1;
-    }
+    const MortonTree* tree = the_tree->getTreePtr(*updated);
+    for(int i=0; i < *n; i++)
+      locate_one(tree, &bitid[i], &lev[i], &ijk[BTDIM*i], &mort[i]);
   }
 }
 
+/** Get a raw handle to the (updated) tree. The handle is valid until the
+  * next refine_apply, or for the updated tree until the next refine_update. */
+extern "C" void bittree_get_tree_handle(
+    bool *updated,      //in
+    void **handle       //out
+  ) {
+  *handle = !!the_tree ? the_tree->getTreePtr(*updated) : nullptr;
+}
+
+/** is_parent on a tree handle */
+extern "C" void bittree_handle_is_parent(
+    void *handle,       //in (by value)
+    bittree_int *bitid, //in
+    bool *parent_check  //out
+  ) {
+  is_parent_one(static_cast<const MortonTree*>(handle), bitid, parent_check);
+}
+
+/** identify on a tree handle */
+extern "C" void bittree_handle_identify(
+    void *handle,       //in (by value)
+    int *lev,           //inout (0-based)
+    int *ijk,           //inout
+    bittree_int *mort,  //out
+    bittree_int *bitid  //out
+  ) {
+  identify_one(static_cast<const MortonTree*>(handle), lev, ijk, mort, bitid);
+}
+
+/** locate on a tree handle */
+extern "C" void bittree_handle_locate(
+    void *handle,       //in (by value)
+    bittree_int *bitid, //in
+    int *lev,           //out (0-based)
+    int *ijk,           //out
+    bittree_int *mort   //out
+  ) {
+  locate_one(static_cast<const MortonTree*>(handle), bitid, lev, ijk, mort);
+}
+
 /** Get id0 */
 extern "C" void bittree_get_id0(
     bool *updated,      //in
-    int *idout          //out
+    bittree_int *idout  //out
   ) {
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
-    *idout = static_cast<int>(tree->level_id0(0));
+    auto tree = the_tree->getTreePtr(*updated);
+    *idout = static_cast<bittree_int>(tree->level_id0(0));
   }
 }
 
@@ -175,13 +477,13 @@ extern "C" void bittree_get_id0(
 extern "C" void bittree_level_bitid_limits(
     bool *updated, //in
     int *lev,      //in
-    int *ids       //out
+    bittree_int *ids //out
   ) {
   unsigned lev_u  = static_cast<unsigned>(*lev);
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
-    ids[0] = static_cast<int>(tree->level_id0(lev_u));
-    ids[1] = static_cast<int>(tree->level_id1(lev_u));
+    auto tree = the_tree->getTreePtr(*updated);
+    ids[0] = static_cast<bittree_int>(tree->level_id0(lev_u));
+    ids[1] = static_cast<bittree_int>(tree->level_id1(lev_u));
   }
 }
 
@@ -189,21 +491,124 @@ extern "C" void bittree_level_bitid_limits(
   * itself wraps MortonTree's bitid_list */
 extern "C" void bittree_get_bitid_list(
     bool *updated,      //in
-    int *mort_min,      //in, 0-based
-    int *mort_max,      //in, 0-based
-    int *idout          //out
+    bittree_int *mort_min, //in, 0-based
+    bittree_int *mort_max, //in, 0-based
+    bittree_int *idout  //out
   ) {
-  unsigned mort_min_u  = static_cast<unsigned>(*mort_min);
-  unsigned mort_max_u  = static_cast<unsigned>(*mort_max);
+  IdType mort_min_u  = static_cast<IdType>(*mort_min);
+  IdType mort_max_u  = static_cast<IdType>(*mort_max);
   if(!!the_tree) {
-    auto tree = the_tree->getTree(*updated);
+    auto tree = the_tree->getTreePtr(*updated);
 #ifndef BITTREE_SAFE
-    tree->bitid_list(mort_min_u, mort_max_u, idout);
+    // bittree_int is the signed type of IdType's width
+    tree->bitid_list(mort_min_u, mort_max_u, reinterpret_cast<IdType*>(idout));
 #else
-    int outlist[(mort_max_u - mort_min_u)];
-    tree->bitid_list(mort_min_u, mort_max_u, outlist);
-    for (unsigned i=0;i<(mort_max_u - mort_min_u);i++)
-      idout[i] = outlist[i];
+    std::vector<IdType> outlist(mort_max_u - mort_min_u);
+    tree->bitid_list(mort_min_u, mort_max_u, outlist.data());
+    for (IdType i=0;i<(mort_max_u - mort_min_u);i++)
+      idout[i] = static_cast<bittree_int>(outlist[i]);
+#endif
+  }
+}
+
+/** Wrapper function for the count of MortonTree's coarse_fine_faces */
+extern "C" void bittree_coarse_fine_face_count(
+    bool *updated,      //in
+    bittree_int *mort_min, //in, 0-based
+    bittree_int *mort_max, //in, 0-based
+    bittree_int *count  //out
+  ) {
+  if(!!the_tree) {
+    auto tree = the_tree->getTreePtr(*updated);
+    *count = static_cast<bittree_int>(tree->coarse_fine_faces(
+        static_cast<IdType>(*mort_min), static_cast<IdType>(*mort_max))->size());
+  }
+}
+
+/** Wrapper function for MortonTree's coarse_fine_faces */
+extern "C" void bittree_coarse_fine_faces(
+    bool *updated,      //in
+    bittree_int *mort_min, //in, 0-based
+    bittree_int *mort_max, //in, 0-based
+    bittree_int *coarse, //out
+    bittree_int *fine,  //out
+    int *face           //out
+  ) {
+  const unsigned nfine = MortonTree::nkids/2u;
+  if(!!the_tree) {
+    auto tree = the_tree->getTreePtr(*updated);
+    const std::vector<MortonTree::CoarseFineFace>& faces = *tree->coarse_fine_faces(
+        static_cast<IdType>(*mort_min), static_cast<IdType>(*mort_max));
+    for(std::size_t i=0; i < faces.size(); i++) {
+      coarse[i] = static_cast<bittree_int>(faces[i].coarse);
+      for(unsigned j=0; j < nfine; j++)
+        fine[nfine*i + j] = static_cast<bittree_int>(faces[i].fine[j]);
+      face[i] = static_cast<int>(faces[i].face);
+    }
+  }
+}
+
+/** Wrapper function for MortonTree's locate_points */
+extern "C" void bittree_locate_points(
+    bool *updated,      //in
+    const double *lo,   //in
+    const double *hi,   //in
+    const double *xyz,  //in
+    bittree_int *n,     //in
+    bittree_int *bitid  //out
+  ) {
+  const std::size_t n_u = static_cast<std::size_t>(*n);
+  if(!!the_tree) {
+    auto tree = the_tree->getTreePtr(*updated);
+    try {
+#ifndef BITTREE_SAFE
+      // bittree_int is the signed type of IdType's width, so ~0 reads as -1
+      tree->locate_points(lo, hi, xyz, n_u, reinterpret_cast<IdType*>(bitid));
+#else
+      std::vector<IdType> ids(n_u);
+      tree->locate_points(lo, hi, xyz, n_u, ids.data());
+      for(std::size_t i=0; i < n_u; i++)
+        bitid[i] = ids[i] == ~IdType(0) ? bittree_int(-1) : static_cast<bittree_int>(ids[i]);
+#endif
+    }
+    catch(const std::exception& e) {
+      std::cout << "bittree_locate_points: " << e.what() << std::endl;
+      std::fill(bitid, bitid+n_u, bittree_int(-1));
+    }
+  }
+}
+
+/** Wrapper function for the count of MortonTree's query_box */
+extern "C" void bittree_query_box_count(
+    bool *updated,      //in
+    int *lev,           //in
+    int *lo,            //in
+    int *hi,            //in
+    bittree_int *count  //out
+  ) {
+  if(!!the_tree)
+    *count = static_cast<bittree_int>(
+        query_box_one(the_tree->getTreePtr(*updated), lev, lo, hi, nullptr));
+}
+
+/** Wrapper function for MortonTree's query_box */
+extern "C" void bittree_query_box(
+    bool *updated,      //in
+    int *lev,           //in
+    int *lo,            //in
+    int *hi,            //in
+    bittree_int *bitid  //out
+  ) {
+  if(!!the_tree) {
+    auto tree = the_tree->getTreePtr(*updated);
+#ifndef BITTREE_SAFE
+    // bittree_int is the signed type of IdType's width
+    query_box_one(tree, lev, lo, hi, reinterpret_cast<IdType*>(bitid));
+#else
+    std::vector<IdType> ids(query_box_one(tree, lev, lo, hi, nullptr));
+    query_box_one(tree, lev, lo, hi, ids.data());
+    for(std::size_t i=0; i < ids.size(); i++)
+      bitid[i] = static_cast<bittree_int>(ids[i]);
 #endif
   }
 }
@@ -216,14 +621,24 @@ extern "C" void bittree_refine_init() {
 
 /** Wrapper funciton for refine_mark */
 extern "C" void bittree_refine_mark(
-    int *bitid,        // in
+    bittree_int *bitid, // in
     bool *value        // in
   ) {
-  unsigned bitid_u  = static_cast<unsigned>(*bitid);
+  IdType bitid_u  = static_cast<IdType>(*bitid);
   if(!!the_tree)
     the_tree->refine_mark(bitid_u, *value);
 }
 
+/** Wrapper funciton for refine_mark_atomic */
+extern "C" void bittree_refine_mark_atomic(
+    bittree_int *bitid, // in
+    bool *value        // in
+  ) {
+  IdType bitid_u  = static_cast<IdType>(*bitid);
+  if(!!the_tree)
+    the_tree->refine_mark_atomic(bitid_u, *value);
+}
+
 /** Wrapper function for refine_reduce */
 extern "C" void bittree_refine_reduce(int *comm_) {
   if(!!the_tree) {
@@ -260,3 +675,75 @@ extern "C" void bittree_print(int *datatype)
     std::cout << the_tree->slice_to_string(dtype_u);
   }
 }
+
+/** Instrumentation counters of the_tree, flattened (see Bittree_fi.h) */
+extern "C" void bittree_get_stats(
+    double *vals       // out: vals(BITTREE_NSTATS)
+  ) {
+  for(unsigned i=0; i < BITTREE_NSTATS; i++) vals[i] = 0.0;
+  if(!the_tree) return;
+  BittreeStats s = the_tree->stats();
+  const PhaseStats* phases[4] = {&s.init, &s.reduce, &s.update, &s.apply};
+  for(unsigned i=0; i < 4; i++) {
+    vals[i] = phases[i]->seconds;
+    vals[4+i] = double(phases[i]->calls);
+  }
+  vals[8] = double(s.bytes_reduced);
+  vals[9] = double(s.regrids.size());
+  vals[10] = double(s.blocks_refined);
+  vals[11] = double(s.blocks_derefined);
+  if(!s.regrids.empty()) {
+    vals[12] = double(s.regrids.back().blocks);
+    vals[13] = double(s.regrids.back().leaves);
+    vals[14] = double(s.regrids.back().levels);
+  }
+  vals[15] = double(s.identify_calls);
+  vals[16] = double(s.locate_calls);
+}
+
+/** Write the instrumentation counters of the_tree as JSON */
+extern "C" void bittree_write_stats(
+    const char *path,  // in: null-terminated file name
+    int *ierr          // out
+  ) {
+  *ierr = 1;
+  if(!the_tree) return;
+  std::ofstream f(path);
+  f << the_tree->stats().to_json();
+  if(f.good()) *ierr = 0;
+  else std::cout << "bittree_write_stats: cannot write " << path << std::endl;
+}
+
+/** Wrapper function for reset_stats */
+extern "C" void bittree_reset_stats() {
+  if(!!the_tree) the_tree->reset_stats();
+}
+
+/** Wrapper function for MortonTree's stats */
+extern "C" void bittree_level_stats(
+    bool *updated,     // in
+    double *vals       // out
+  ) {
+  if(!the_tree) return;
+  TreeStats s = the_tree->getTreePtr(*updated)->stats();
+  for(std::size_t lev=0; lev < s.levels.size(); lev++) {
+    vals[3*lev] = double(s.levels[lev].blocks);
+    vals[3*lev+1] = double(s.levels[lev].leaves);
+    vals[3*lev+2] = s.levels[lev].coverage;
+  }
+}
+
+/** Wrapper function for memory_bytes */
+extern "C" void bittree_memory_bytes(
+    double *vals       // out: vals(BITTREE_NMEMORY)
+  ) {
+  for(unsigned i=0; i < BITTREE_NMEMORY; i++) vals[i] = 0.0;
+  if(!the_tree) return;
+  AmrMemory m = the_tree->memory_bytes();
+  const std::uint64_t parts[6] = {m.tree.words, m.tree.checkpoints, m.tree.levels,
+                                  m.tree.caches, m.tree.top_grid, m.tree.object};
+  for(unsigned i=0; i < 6; i++) vals[i] = double(parts[i]);
+  vals[6] = double(m.updated.total() - m.updated.top_grid);
+  vals[7] = double(m.delta);
+  vals[8] = double(m.total());
+}
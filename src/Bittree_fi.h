@@ -18,8 +18,18 @@
 
 using namespace bittree;
 
+/** Integer type of block ids, Morton numbers and block counts in the
+  * Fortran interface: integer(c_int), or integer(c_int64_t) when set up
+  * with --id64. Levels, coordinates and error codes stay int. */
+#ifdef BITTREE_ID64
+typedef std::int64_t bittree_int;
+#else
+typedef int bittree_int;
+#endif
+
 namespace {
     std::shared_ptr<BittreeAmr> the_tree;
+    std::shared_ptr<TreeHistoryWriter> the_history;
 }
 
 /** Checks if the_tree has been created */
@@ -31,6 +41,100 @@ extern "C" void bittree_init(
     int includes[] // in: includes[topsize[ndim-1]]...[topsize[0]]
   );
 
+/** bittree_init with siblings in the order of a space-filling curve:
+  * 0 for Morton, 1 for Hilbert. Morton numbers reported by the other
+  * wrappers are then indices along that curve. */
+extern "C" void bittree_init_curve(
+    int topsize[],  // in
+    int includes[], // in
+    int *curve      // in
+  );
+
+/** Write the (non-updated) tree to a binary checkpoint file.
+  * ierr is 0 on success. */
+extern "C" void bittree_save(
+    const char *path,  // in: null-terminated file name
+    int *ierr          // out
+  );
+
+/** Replace the_tree with a tree read from a file written by bittree_save.
+  * The file is memory-mapped. ierr is 0 on success. */
+extern "C" void bittree_load(
+    const char *path,  // in: null-terminated file name
+    int *ierr          // out
+  );
+
+/** Write the leaves of the tree, or all blocks if parents, to a columnar
+  * binary file: level, coordinates, bitid and Morton index, each a
+  * contiguous array. ierr is 0 on success. */
+extern "C" void bittree_export_blocks(
+    bool *updated,     // in
+    const char *path,  // in: null-terminated file name
+    bool *parents,     // in
+    int *ierr          // out
+  );
+
+/** Write the leaves of the tree, or all blocks if parents, as a legacy
+  * binary VTK unstructured grid of the domain [lo, hi], with level, bitid
+  * and mort as cell data. ierr is 0 on success. */
+extern "C" void bittree_export_vtk(
+    bool *updated,     // in
+    const char *path,  // in: null-terminated file name
+    const double *lo,  // in: lo(BTDIM)
+    const double *hi,  // in: hi(BTDIM)
+    bool *parents,     // in
+    int *ierr          // out
+  );
+
+/** Start a tree history file at path, recording every refinement of
+  * the_tree applied from now on; every keyframe_every-th snapshot stores
+  * the full tree. Call on the rank that writes the file. ierr is 0 on
+  * success. */
+extern "C" void bittree_history_open(
+    const char *path,     // in: null-terminated file name
+    int *keyframe_every,  // in
+    int *ierr             // out
+  );
+
+/** Append a snapshot of the_tree to the history file: the refinements
+  * since the last snapshot, or a keyframe. bytes is the size written. */
+extern "C" void bittree_history_snapshot(
+    double *bytes,        // out
+    int *ierr             // out
+  );
+
+/** Replace the_tree with snapshot number snapshot (0-based) of a history
+  * file. ierr is 0 on success. */
+extern "C" void bittree_history_load(
+    const char *path,     // in: null-terminated file name
+    bittree_int *snapshot, // in
+    int *ierr             // out
+  );
+
+/** Copy the_tree from rank root to all ranks of comm, without rebuilding
+  * it. Ranks other than root need not have called bittree_init; if
+  * root has not, every rank gets ierr = 1. */
+extern "C" void bittree_broadcast(
+    int *root,         // in
+    int *comm_,        // in
+    int *ierr          // out
+  );
+
+/** Check that all ranks of comm hold the same tree as rank root */
+extern "C" void bittree_check_identical(
+    int *root,         // in
+    int *comm_,        // in
+    bool *identical    // out
+  );
+
+/** Check that all ranks of comm hold the same tree (and, during
+  * refinement, the same marks) by comparing 64-bit hashes. Cheap enough
+  * to call at every regrid. Collective. */
+extern "C" void bittree_verify_consistent(
+    int *comm_,        // in
+    bool *consistent   // out
+  );
+
 /** Wrapper function for block_count */
 extern "C" void bittree_level_count(
     bool *updated,     //in: boolean
@@ -41,75 +145,202 @@ extern "C" void bittree_level_count(
 /** Wrapper function for block_count */
 extern "C" void bittree_block_count(
     bool *updated,     //in: boolean
-    int *count         //out
+    bittree_int *count //out
   );
 
 
 /** Wrapper function for leaf_count */
 extern "C" void bittree_leaf_count(
     bool *updated,     //in: boolean
-    int *count         //out
+    bittree_int *count //out
   );
 
 /** Wrapper function for delta_count */
 extern "C" void bittree_delta_count(
-    int *count         //out
+    bittree_int *count //out
   );
 
 
 /** Wrapper function for check_refine_bit */
 extern "C" void bittree_check_refine_bit(
-    const int *bitid,   //in
+    const bittree_int *bitid, //in
     bool *bit_check     //out
   );
 
+/** Batched check_refine_bit over bitid(1:n) */
+extern "C" void bittree_check_refine_bit_batch(
+    const int *n,       //in
+    const bittree_int *bitid, //in: bitid(n)
+    bool *bit_check     //out: bit_check(n)
+  );
+
 /** Wrapper function for is_parent */
 extern "C" void bittree_is_parent(
     bool *updated,      //in
-    int *bitid,         //in
+    bittree_int *bitid, //in
     bool *parent_check  //out
   );
 
+/** Batched is_parent over bitid(1:n) */
+extern "C" void bittree_is_parent_batch(
+    bool *updated,      //in
+    const int *n,       //in
+    const bittree_int *bitid, //in: bitid(n)
+    bool *parent_check  //out: parent_check(n)
+  );
+
 /** Wrapper function for TheTree's identify, which 
   * itself wraps MortonTree's identify */
 extern "C" void bittree_identify(
     bool *updated,      //in
     int *lev,           //inout (0-based)
     int *ijk,           //inout
-    int *mort,          //out
-    int *bitid          //out
+    bittree_int *mort,  //out
+    bittree_int *bitid  //out
+  );
+
+/** Batched identify over n blocks */
+extern "C" void bittree_identify_batch(
+    bool *updated,      //in
+    const int *n,       //in
+    int *lev,           //inout: lev(n) (0-based)
+    int *ijk,           //inout: ijk(BTDIM,n)
+    bittree_int *mort,  //out: mort(n)
+    bittree_int *bitid  //out: bitid(n)
   );
 
 /** Wrapper function for TheTree's locate, which 
   * itself wraps MortonTree's locate */
 extern "C" void bittree_locate(
     bool *updated,      //in
-    int *bitid,         //in
+    bittree_int *bitid, //in
+    int *lev,           //out (0-based)
+    int *ijk,           //out
+    bittree_int *mort  //out
+  );
+
+/** Batched locate over bitid(1:n) */
+extern "C" void bittree_locate_batch(
+    bool *updated,      //in
+    const int *n,       //in
+    const bittree_int *bitid, //in: bitid(n)
+    int *lev,           //out: lev(n) (0-based)
+    int *ijk,           //out: ijk(BTDIM,n)
+    bittree_int *mort   //out: mort(n)
+  );
+
+/** Get a raw handle to the (updated) tree, for use with the
+  * bittree_handle_* functions below. The handle skips the lookup of
+  * the_tree on every call and is valid until the next refine_apply,
+  * or for the updated tree until the next refine_update. */
+extern "C" void bittree_get_tree_handle(
+    bool *updated,      //in
+    void **handle       //out
+  );
+
+/** is_parent on a tree handle */
+extern "C" void bittree_handle_is_parent(
+    void *handle,       //in (by value)
+    bittree_int *bitid, //in
+    bool *parent_check  //out
+  );
+
+/** identify on a tree handle */
+extern "C" void bittree_handle_identify(
+    void *handle,       //in (by value)
+    int *lev,           //inout (0-based)
+    int *ijk,           //inout
+    bittree_int *mort,  //out
+    bittree_int *bitid  //out
+  );
+
+/** locate on a tree handle */
+extern "C" void bittree_handle_locate(
+    void *handle,       //in (by value)
+    bittree_int *bitid, //in
     int *lev,           //out (0-based)
     int *ijk,           //out
-    int *mort          //out
+    bittree_int *mort   //out
   );
 
 /** Wrapper function for TheTree's get_id0 */
 extern "C" void bittree_get_id0(
     bool *updated,      //in
-    int *idout          //out
+    bittree_int *idout  //out
   );
 
 /** Wrapper function for TheTree's get_level_id_limits */
 extern "C" void bittree_level_bitid_limits(
     bool *updated, //in
     int *lev,      //in
-    int *ids       //out
+    bittree_int *ids //out
   );
 
 /** Wrapper function for TheTree's get_bitid_list, which 
   * itself wraps MortonTree's bitid_list */
 extern "C" void bittree_get_bitid_list(
     bool *updated,      //in
-    int *mort_min,      //in, 0-based
-    int *mort_max,      //in, 0-based
-    int *idout          //out
+    bittree_int *mort_min, //in, 0-based
+    bittree_int *mort_max, //in, 0-based
+    bittree_int *idout  //out
+  );
+
+/** Number of faces between a leaf and finer blocks with a leaf of
+  * [mort_min, mort_max) on either side. The faces are computed once per
+  * tree and range, so calling this and bittree_coarse_fine_faces every
+  * step costs a lookup until the next regrid. */
+extern "C" void bittree_coarse_fine_face_count(
+    bool *updated,      //in
+    bittree_int *mort_min, //in, 0-based
+    bittree_int *mort_max, //in, 0-based
+    bittree_int *count  //out
+  );
+
+/** The faces counted by bittree_coarse_fine_face_count: the coarse leaf,
+  * the 2^(BTDIM-1) finer blocks along the face and the face of the
+  * coarse leaf, 2*(dim-1) + 0 for its lower and 1 for its upper side */
+extern "C" void bittree_coarse_fine_faces(
+    bool *updated,      //in
+    bittree_int *mort_min, //in, 0-based
+    bittree_int *mort_max, //in, 0-based
+    bittree_int *coarse, //out: coarse(count)
+    bittree_int *fine,  //out: fine(2^(BTDIM-1),count)
+    int *face           //out: face(count), 0-based
+  );
+
+/** Leaf containing each of n points xyz(BTDIM,n) in the domain [lo, hi],
+  * clamping points outside it; bitid is -1 for points in an excluded
+  * top-level block or with a NaN coordinate, and for every point if
+  * lo < hi fails in some dimension. Points are grouped internally, so
+  * passing all of a rank's particles at once is much cheaper than one
+  * call each. */
+extern "C" void bittree_locate_points(
+    bool *updated,      //in
+    const double *lo,   //in: lo(BTDIM)
+    const double *hi,   //in: hi(BTDIM)
+    const double *xyz,  //in: xyz(BTDIM,n)
+    bittree_int *n,     //in
+    bittree_int *bitid  //out: bitid(n), 0-based
+  );
+
+/** Number of leaves intersecting the box of blocks lo..hi (inclusive,
+  * 0-based) on level lev, coarser ones containing part of it and finer
+  * ones inside it. Counting skips the leaves inside the box. */
+extern "C" void bittree_query_box_count(
+    bool *updated,      //in
+    int *lev,           //in (0-based)
+    int *lo,            //in: lo(BTDIM)
+    int *hi,            //in: hi(BTDIM)
+    bittree_int *count  //out
+  );
+
+/** The leaves counted by bittree_query_box_count, in Morton order */
+extern "C" void bittree_query_box(
+    bool *updated,      //in
+    int *lev,           //in (0-based)
+    int *lo,            //in: lo(BTDIM)
+    int *hi,            //in: hi(BTDIM)
+    bittree_int *bitid  //out: bitid(count), 0-based
   );
 
 /** Wrapper function for refine_init */
@@ -117,7 +348,14 @@ extern "C" void bittree_refine_init();
 
 /** Wrapper funciton for refine_mark */
 extern "C" void bittree_refine_mark(
-    int *bitid,        // in
+    bittree_int *bitid, // in
+    bool *value        // in
+  );
+
+/** Wrapper funciton for refine_mark_atomic, safe to call from
+  * several OpenMP threads at once */
+extern "C" void bittree_refine_mark_atomic(
+    bittree_int *bitid, // in
     bool *value        // in
   );
 
@@ -133,6 +371,53 @@ extern "C" void bittree_refine_update();
 /** Wrapper function for refine_apply */
 extern "C" void bittree_refine_apply();
 
+/** Number of values filled in by bittree_get_stats */
+#define BITTREE_NSTATS 17
+
+/** Instrumentation counters of the_tree (see BittreeStats), flattened:
+  *   vals(1:4)   seconds in refine_init, reduce, update, apply
+  *   vals(5:8)   calls to refine_init, reduce, update, apply
+  *   vals(9)     bytes reduced      vals(10) regrids
+  *   vals(11)    blocks refined     vals(12) blocks derefined
+  *   vals(13:15) blocks, leaves and levels after the last regrid
+  *   vals(16)    identify calls     vals(17) locate calls
+  * All zero unless built with setup.py --instrument. */
+extern "C" void bittree_get_stats(
+    double *vals       // out: vals(BITTREE_NSTATS)
+  );
+
+/** Write the instrumentation counters to a JSON file. ierr is 0 on success. */
+extern "C" void bittree_write_stats(
+    const char *path,  // in: null-terminated file name
+    int *ierr          // out
+  );
+
+/** Zero the instrumentation counters */
+extern "C" void bittree_reset_stats();
+
+/** Shape of the tree by level: for each level lev (0-based),
+  *   vals(1,lev+1) blocks   vals(2,lev+1) leaves
+  *   vals(3,lev+1) fraction of the domain covered by its leaves
+  * vals must hold 3 values per level (see bittree_level_count). */
+extern "C" void bittree_level_stats(
+    bool *updated,     // in
+    double *vals       // out: vals(3,levels)
+  );
+
+/** Number of values filled in by bittree_memory_bytes */
+#define BITTREE_NMEMORY 9
+
+/** Heap bytes held on this rank (see AmrMemory):
+  *   vals(1:6)   tree: bit array words, rank checkpoints, level table,
+  *               caches, top-level grid, tree object
+  *   vals(7)     updated tree, without the shared top-level grid
+  *   vals(8)     refinement marks
+  *   vals(9)     total
+  * Updated tree and marks are zero outside refinement. */
+extern "C" void bittree_memory_bytes(
+    double *vals       // out: vals(BITTREE_NMEMORY)
+  );
+
 /** print (slice=0) */
 extern "C" void bittree_print(int *datatype=0);
 
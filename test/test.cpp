@@ -1,9 +1,21 @@
 #include <gtest/gtest.h>
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <tuple>
+#include <limits>
 
 #include "macros.h"
 #include "Bittree_fi.h"
+#include "Bittree_DistributedTree.h"
+#include "Bittree_Generators.h"
 
 namespace {
 #if BTDIM==1
@@ -55,6 +67,43 @@ namespace {
         332, 333, 340, 341, 388, 389, 396, 397, 334, 335, 342, 343, 390, 391, 398, 399};
 #endif
 
+    /** Parameters of the shell test tree: a 3x2x2 top grid with some
+      * blocks left out, refined to about 1500 blocks */
+    GeneratorParams shell_params(Curve curve=Curve::morton) {
+        GeneratorParams p;
+        p.top[0] = 3; p.top[1] = 2; p.top[2] = 2;
+        p.include_fraction = 0.8;
+        p.target_blocks = 1500;
+        p.curve = curve;
+        return p;
+    }
+    const double shell_center[3] = {0.6, 0.4, 0.5};
+
+    /** Tree refined around a thin spherical shell about shell_center */
+    std::shared_ptr<MortonTree> shell_tree(const GeneratorParams& p) {
+        return generate_shell(p, shell_center, 0.35, 0.05);
+    }
+    std::shared_ptr<MortonTree> shell_tree(Curve curve=Curve::morton) {
+        return shell_tree(shell_params(curve));
+    }
+
+    /** Reproducible pseudo-random numbers: pick(n) is uniform in [0,n) */
+    class Lcg {
+    public:
+        explicit Lcg(std::uint64_t seed): r_(seed) {}
+        unsigned operator()(unsigned n) {
+            r_ = r_*6364136223846793005ull + 1442695040888963407ull;
+            return unsigned((r_ >> 33) % n);
+        }
+        /** Uniform in [0,1) */
+        double uniform() {
+            r_ = r_*6364136223846793005ull + 1442695040888963407ull;
+            return double(r_ >> 11) / double(1ull << 53);
+        }
+    private:
+        std::uint64_t r_;
+    };
+
 class BittreeUnitTest : public testing::Test {
 protected:
     BittreeUnitTest(void) {
@@ -75,7 +124,8 @@ TEST_F(BittreeUnitTest,RefinementTest){
     static constexpr int K3D = int(BTDIM>=3);
 
     // Declare some variables
-    int lev,mort,bitid,count;
+    int lev;
+    bittree_int mort,bitid,count;
     int ijk[3];
     bool updated, val;
     int xlim, ylim, zlim;
@@ -177,8 +227,9 @@ TEST_F(BittreeUnitTest,RefinementTest){
 
 // Test Bittree core functions
 TEST_F(BittreeUnitTest,BittreeCore){
-    int lev,mort,bitid,count,id0;
-    int id_lims[2];
+    int lev,nlev;
+    bittree_int mort,bitid,count,id0;
+    bittree_int id_lims[2];
     int ijk[3];
     bool updated, val;
 
@@ -204,11 +255,11 @@ TEST_F(BittreeUnitTest,BittreeCore){
 
     // Test level count
     updated = false;
-    bittree_level_count(&updated, &count);
-    ASSERT_EQ( count, 1);
+    bittree_level_count(&updated, &nlev);
+    ASSERT_EQ( nlev, 1);
     updated = true;
-    bittree_level_count(&updated, &count);
-    ASSERT_EQ( count, 2);
+    bittree_level_count(&updated, &nlev);
+    ASSERT_EQ( nlev, 2);
 
     // Test block count
     updated = false;
@@ -331,35 +382,35 @@ TEST_F(BittreeUnitTest,BittreeCore){
 
     // Test get_bitid_list
     updated = false;
-    int mmin = 1;
-    int mmax = SELECT_NDIM(2,4,19);
-    int bitid_list[mmax-mmin];
+    bittree_int mmin = 1;
+    bittree_int mmax = SELECT_NDIM(2,4,19);
+    bittree_int bitid_list[mmax-mmin];
 #if BTDIM==1
-    int true_list[2] = {2,3};
+    bittree_int true_list[2] = {2,3};
 #elif BTDIM==2
-    int true_list[6] = {6,7,8,9,10,11};
+    bittree_int true_list[6] = {6,7,8,9,10,11};
 #else
-    int true_list[24] = {24,25,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47};
+    bittree_int true_list[24] = {24,25,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47};
 #endif
     bittree_get_bitid_list(&updated, &mmin, &mmax, bitid_list);
-    for( int i=mmin; i<mmax; ++i) {
+    for( bittree_int i=mmin; i<mmax; ++i) {
         ASSERT_EQ( bitid_list[i-mmin], true_list[i] ); 
     }
 
     updated = true;
     mmin = 1;
     mmax = SELECT_NDIM(3,7,28);
-    int bitid_list_2[mmax-mmin];
+    bittree_int bitid_list_2[mmax-mmin];
 #if BTDIM==1
-    int true_list_2[4] = {2,4,5,3};
+    bittree_int true_list_2[4] = {2,4,5,3};
 #elif BTDIM==2
-    int true_list_2[10] = {6,12,13,14,15,7,8,9,10,11};
+    bittree_int true_list_2[10] = {6,12,13,14,15,7,8,9,10,11};
 #else
-    int true_list_2[32] = {24,48,49,50,51,52,53,54,55,25,26,27,28,29,30,31,32,33,34,35,36,
+    bittree_int true_list_2[32] = {24,48,49,50,51,52,53,54,55,25,26,27,28,29,30,31,32,33,34,35,36,
                            37,38,39,40,41,42,43,44,45,46,47};
 #endif
     bittree_get_bitid_list(&updated, &mmin, &mmax, bitid_list_2);
-    for( int i=mmin; i<mmax; ++i) {
+    for( bittree_int i=mmin; i<mmax; ++i) {
         ASSERT_EQ( bitid_list_2[i-mmin], true_list_2[i] ); 
     }
 
@@ -388,6 +439,1636 @@ TEST_F(BittreeUnitTest,BittreeCore){
 }
 
 
+// Test batched and handle-based Fortran interface against the scalar one
+TEST_F(BittreeUnitTest,BatchInterface){
+    bittree_int id0, count;
+    bool updated, val;
+
+    updated = false;
+    bittree_get_id0(&updated, &id0);
+
+    bittree_refine_init();
+    bittree_int bitid = id0;
+    val = true;
+    bittree_refine_mark(&bitid,&val);
+    bittree_refine_update();
+
+    updated = true;
+    bittree_block_count(&updated, &count);
+    int n = int(count);
+    std::vector<bittree_int> ids(n), mort(n);
+    std::vector<int> lev(n), ijk(BTDIM*n);
+    for(int i=0; i<n; ++i) ids[i] = id0 + i;
+
+    // check_refine_bit
+    {
+      std::unique_ptr<bool[]> bits(new bool[unsigned(n)]);
+      bittree_check_refine_bit_batch(&n, ids.data(), bits.get());
+      for(int i=0; i<n; ++i) {
+        bittree_check_refine_bit(&ids[i], &val);
+        ASSERT_EQ( bits[i], val );
+      }
+    }
+
+    // is_parent
+    {
+      std::unique_ptr<bool[]> pars(new bool[unsigned(n)]);
+      bittree_is_parent_batch(&updated, &n, ids.data(), pars.get());
+      for(int i=0; i<n; ++i) {
+        bittree_is_parent(&updated, &ids[i], &val);
+        ASSERT_EQ( pars[i], val );
+      }
+    }
+
+    // locate, then identify the located blocks
+    bittree_locate_batch(&updated, &n, ids.data(), lev.data(), ijk.data(), mort.data());
+    std::vector<bittree_int> bitids(n), morts(n);
+    bittree_identify_batch(&updated, &n, lev.data(), ijk.data(), morts.data(), bitids.data());
+    void *handle;
+    bittree_get_tree_handle(&updated, &handle);
+    for(int i=0; i<n; ++i) {
+      int l, c[3];
+      bittree_int m;
+      bittree_locate(&updated, &ids[i], &l, c, &m);
+      ASSERT_EQ( lev[i], l );
+      ASSERT_EQ( mort[i], m );
+      for(int d=0; d<BTDIM; ++d) ASSERT_EQ( ijk[BTDIM*i+d], c[d] );
+      ASSERT_EQ( bitids[i], ids[i] );
+      ASSERT_EQ( morts[i], m );
+
+      bittree_int hb;
+      bittree_handle_identify(handle, &l, c, &m, &hb);
+      ASSERT_EQ( hb, ids[i] );
+      bittree_handle_locate(handle, &ids[i], &l, c, &m);
+      ASSERT_EQ( mort[i], m );
+      bittree_handle_is_parent(handle, &ids[i], &val);
+      ASSERT_EQ( val, ids[i]==id0 );
+    }
+
+    bittree_refine_apply();
+}
+
+// Hammer refine_mark_atomic from many threads at once. Threads interleave
+// over bitids so that every word is written by all threads.
+TEST_F(BittreeUnitTest,ConcurrentRefineMark){
+    int top[BTDIM] = {LIST_NDIM(64,32,16)};
+    int nbase = CONCAT_NDIM(64,*32,*16);
+    std::vector<int> includes(nbase, 1);
+    BittreeAmr bt = BittreeAmr(top,includes.data());
+
+    const unsigned nthreads = 16;
+    const IdType id0 = bt.getTree()->level_id0(0);
+    const IdType id1 = bt.getTree()->level_id1(0);
+    for(unsigned rep=0; rep<4; ++rep) {
+      bt.refine_init();
+      std::vector<std::thread> threads;
+      for(unsigned t=0; t<nthreads; ++t) {
+        threads.emplace_back([&bt,t,nthreads,id0,id1]() {
+          // set every block, then clear the odd ones
+          for(IdType id=id0+t; id<id1; id+=nthreads)
+            bt.refine_mark_atomic(id, true);
+          for(IdType id=id0+t; id<id1; id+=nthreads)
+            if(id%2) bt.refine_mark_atomic(id, false);
+        });
+      }
+      for(auto& th : threads) th.join();
+
+      unsigned nmarked = 0;
+      for(IdType id=id0; id<id1; ++id) {
+        ASSERT_EQ( bt.check_refine_bit(id), id%2==0 );
+        if(id%2==0) nmarked++;
+      }
+      ASSERT_EQ( bt.delta_count(), nmarked );
+      bt.refine_reduce(MPI_COMM_WORLD);
+      bt.refine_apply();
+    }
+}
+
+// TreeViews keep their tree alive across refine_apply, and let several
+// threads read (and lazily update) the tree at once.
+TEST_F(BittreeUnitTest,TreeViewSnapshots){
+    int top[BTDIM] = {LIST_NDIM(4,4,4)};
+    int includes[CONCAT_NDIM(4,*4,*4)];
+    for(int &inc : includes) inc = 1;
+    BittreeAmr bt = BittreeAmr(top,includes);
+    const IdType id0 = bt.getTree()->level_id0(0);
+
+    // A pinned view outlives the tree it was taken from
+    std::weak_ptr<MortonTree> old_tree = bt.getTree();
+    TreeView v = bt.view();
+    IdType old_blocks = v->blocks();
+    bt.refine_init();
+    bt.refine_mark(id0, true);
+    bt.refine_reduce(MPI_COMM_WORLD);
+    bt.refine_apply();
+    ASSERT_FALSE( old_tree.expired() );
+    ASSERT_EQ( v->blocks(), old_blocks );
+    ASSERT_EQ( bt.view()->blocks(), old_blocks + (1u<<BTDIM) );
+    ASSERT_GE( bt.reclaim(), 1u );
+    v.release();
+    ASSERT_EQ( bt.reclaim(), 0u );
+    ASSERT_TRUE( old_tree.expired() );
+
+    // Views beyond the reader slots hold the tree by shared_ptr
+    std::vector<TreeView> many;
+    for(unsigned i=0; i < TreeEpochs::max_readers+8u; ++i)
+      many.push_back(bt.view());
+    old_tree = bt.getTree();
+    bt.refine_init();
+    bt.refine_mark(id0, true);
+    bt.refine_reduce(MPI_COMM_WORLD);
+    bt.refine_apply();
+    for(const TreeView& u : many)
+      ASSERT_EQ( u->blocks(), old_blocks + (1u<<BTDIM) );
+    many.clear();
+    ASSERT_EQ( bt.reclaim(), 0u );
+    ASSERT_TRUE( old_tree.expired() );
+    ASSERT_EQ( bt.view()->blocks(), old_blocks );
+    bt.refine_init();
+    bt.refine_mark(id0, true);
+    bt.refine_reduce(MPI_COMM_WORLD);
+    bt.refine_apply();
+
+    // Readers race on the lazy update of the updated tree
+    bt.refine_init();
+    bt.refine_mark(id0+1, true);
+    bt.refine_reduce(MPI_COMM_WORLD);
+    const unsigned nthreads = 8;
+    std::vector<IdType> seen(nthreads);
+    std::vector<std::thread> threads;
+    for(unsigned t=0; t<nthreads; ++t) {
+      threads.emplace_back([&bt,&seen,t]() {
+        TreeView u = bt.view(true);
+        seen[t] = u->blocks();
+      });
+    }
+    for(auto& th : threads) th.join();
+    for(unsigned t=0; t<nthreads; ++t)
+      ASSERT_EQ( seen[t], old_blocks + (2u<<BTDIM) );
+
+    // Readers walk the tree while it is refined underneath them
+    std::atomic<bool> done(false);
+    std::atomic<unsigned> errors(0);
+    threads.clear();
+    for(unsigned t=0; t<nthreads; ++t) {
+      threads.emplace_back([&bt,&done,&errors]() {
+        while(!done.load()) {
+          TreeView u = bt.view();
+          IdType nb = u->blocks();
+          for(IdType id=u->level_id0(0); id<u->id_upper_bound(); ++id)
+            if(u->locate(id).id != id) errors++;
+          if(u->blocks() != nb) errors++;
+        }
+      });
+    }
+    for(unsigned rep=0; rep<20; ++rep) {
+      bt.refine_init();
+      bt.refine_mark(id0+2+rep%2, true);
+      bt.refine_reduce(MPI_COMM_WORLD);
+      bt.refine_update();
+      bt.refine_apply();
+    }
+    done.store(true);
+    for(auto& th : threads) th.join();
+    ASSERT_EQ( errors.load(), 0u );
+    ASSERT_EQ( bt.reclaim(), 0u );
+}
+
+// Save a refined tree, load it back (memory-mapped) and compare
+TEST_F(BittreeUnitTest,CheckpointRestart){
+    int top[BTDIM] = {LIST_NDIM(3,2,2)};
+    int includes[CONCAT_NDIM(3,*2,*2)];
+    for(int &inc : includes) inc = 1;
+    includes[1] = 0;
+    BittreeAmr bt = BittreeAmr(top,includes);
+    for(unsigned rep=0; rep<3; ++rep) {
+      auto tree = bt.getTree();
+      bt.refine_init();
+      for(IdType id=tree->level_id0(tree->levels()-1); id<tree->id_upper_bound(); id+=3)
+        bt.refine_mark(id, true);
+      bt.refine_reduce(MPI_COMM_WORLD);
+      bt.refine_apply();
+    }
+    auto tree = bt.getTree();
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    const std::string path = "bittree_checkpoint_test_" + std::to_string(rank) + ".bin";
+    tree->save(path);
+    auto loaded = MortonTree::load(path);
+
+    ASSERT_EQ( loaded->levels(), tree->levels() );
+    ASSERT_EQ( loaded->blocks(), tree->blocks() );
+    ASSERT_EQ( loaded->leaves(), tree->leaves() );
+    for(unsigned d=0; d<BTDIM; ++d)
+      ASSERT_EQ( loaded->top_size(d), tree->top_size(d) );
+    for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id) {
+      MortonTree::Block a = tree->locate(id);
+      MortonTree::Block b = loaded->locate(id);
+      ASSERT_EQ( a.mort, b.mort );
+      ASSERT_EQ( a.level, b.level );
+      ASSERT_EQ( a.is_parent, b.is_parent );
+      for(unsigned d=0; d<BTDIM; ++d) ASSERT_EQ( a.coord[d], b.coord[d] );
+    }
+    // rank/select checkpoints came along
+    IdType len = tree->bits_->length();
+    IdType ones = tree->bits_->count(0, len);
+    ASSERT_EQ( loaded->bits_->count(0, len), ones );
+    ASSERT_EQ( loaded->bits_->find(0, ones/2), tree->bits_->find(0, ones/2) );
+
+    // images round-trip byte for byte
+    std::vector<char> img0(tree->image_size()), img1(loaded->image_size());
+    tree->write_image(img0.data());
+    loaded->write_image(img1.data());
+    ASSERT_TRUE( img0 == img1 );
+
+    // a loaded tree can be refined further
+    BittreeAmr restarted(loaded);
+    restarted.refine_init();
+    restarted.refine_mark(loaded->level_id0(loaded->levels()-1), true);
+    restarted.refine_reduce(MPI_COMM_WORLD);
+    restarted.refine_apply();
+    ASSERT_EQ( restarted.getTree()->blocks(), tree->blocks() + (1u<<BTDIM) );
+
+    // Fortran interface
+    int ierr;
+    bittree_save(path.c_str(), &ierr);
+    ASSERT_EQ( ierr, 0 );
+    bittree_load(path.c_str(), &ierr);
+    ASSERT_EQ( ierr, 0 );
+    bittree_load("no_such_bittree_file.bin", &ierr);
+    ASSERT_EQ( ierr, 1 );
+
+    // truncated files are rejected
+    {
+      std::FILE* f = std::fopen(path.c_str(), "wb");
+      std::fwrite(img0.data(), 1, 80, f);
+      std::fclose(f);
+    }
+    ASSERT_THROW( MortonTree::load(path), std::runtime_error );
+
+    // so are images with inconsistent headers or level bounds
+    auto corrupt = [&](std::size_t offset, const void* value, std::size_t n) {
+      std::vector<char> img = img0;
+      std::memcpy(img.data() + offset, value, n);
+      std::FILE* f = std::fopen(path.c_str(), "wb");
+      std::fwrite(img.data(), 1, img.size(), f);
+      std::fclose(f);
+    };
+    const std::uint64_t wrap = ~std::uint64_t(0) - 7u;
+    const std::uint32_t zero32 = 0u;
+    const IdType zero_id = 0u;
+    std::uint64_t level_off;
+    std::memcpy(&level_off, img0.data() + 80, sizeof(level_off));
+    corrupt(80, &wrap, sizeof(wrap));             // level_off wraps around
+    ASSERT_THROW( MortonTree::load(path), std::runtime_error );
+    corrupt(32, &zero32, sizeof(zero32));         // lev0_blks[0] == 0
+    ASSERT_THROW( MortonTree::load(path), std::runtime_error );
+    corrupt(48, &wrap, sizeof(wrap));             // id0 != top-level blocks
+    ASSERT_THROW( MortonTree::load(path), std::runtime_error );
+    corrupt(std::size_t(level_off), &zero_id, sizeof(zero_id)); // id1 < id0
+    ASSERT_THROW( MortonTree::load(path), std::runtime_error );
+    std::remove(path.c_str());
+}
+
+// Rank 0 refines a tree and hands it to the other ranks. With a single
+// rank this only exercises the root side; run under mpirun for the rest.
+TEST_F(BittreeUnitTest,BroadcastTree){
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, nranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+
+    int top[BTDIM] = {LIST_NDIM(3,3,2)};
+    int includes[CONCAT_NDIM(3,*3,*2)];
+    for(int &inc : includes) inc = 1;
+    BittreeAmr bt = BittreeAmr(top,includes);
+    if(rank == 0) {
+      for(unsigned rep=0; rep<3; ++rep) {
+        auto tree = bt.getTree();
+        bt.refine_init();
+        for(IdType id=tree->level_id0(tree->levels()-1); id<tree->id_upper_bound(); id+=2)
+          bt.refine_mark(id, true);
+        bt.refine_update();
+        bt.refine_apply();
+      }
+    }
+    ASSERT_EQ( bt.check_identical(0, comm), nranks==1 );
+
+    // tiny chunks to exercise the pipelined path
+    bt.broadcast_from(0, comm, 100);
+    ASSERT_TRUE( bt.check_identical(0, comm, 100) );
+    ASSERT_TRUE( bt.check_identical(0, comm) );
+
+    IdType blocks = bt.getTree()->blocks();
+    std::uint64_t blocks_max = blocks;
+    MPI_Allreduce(MPI_IN_PLACE, &blocks_max, 1, MPI_UINT64_T, MPI_MAX, comm);
+    ASSERT_EQ( blocks, blocks_max );
+    auto tree = bt.getTree();
+    for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id)
+      ASSERT_EQ( tree->locate(id).id, id );
+
+    // and the received tree can be refined
+    bt.refine_init();
+    bt.refine_mark(tree->level_id0(tree->levels()-1), true);
+    bt.refine_reduce(comm);
+    bt.refine_apply();
+    ASSERT_EQ( bt.getTree()->blocks(), blocks + (1u<<BTDIM) );
+    ASSERT_TRUE( bt.check_identical(0, comm) );
+
+    // Fortran interface
+    int root = 0;
+    int fcomm = static_cast<int>(MPI_Comm_c2f(comm));
+    bool same;
+    int ierr;
+    bittree_broadcast(&root, &fcomm, &ierr);
+    ASSERT_EQ( ierr, 0 );
+    bittree_check_identical(&root, &fcomm, &same);
+    ASSERT_TRUE( same );
+
+    // a root without a tree is an error on every rank
+    BittreeAmr empty{std::shared_ptr<MortonTree>()};
+    ASSERT_THROW( empty.broadcast_from(0, comm), std::logic_error );
+}
+
+TEST_F(BittreeUnitTest,Generators){
+    GeneratorParams p;
+    unsigned ntop = 1;
+    const unsigned top[3] = {3,2,2};
+    for(unsigned d=0; d<BTDIM; ++d) { p.top[d] = top[d]; ntop *= top[d]; }
+    const unsigned nkids = 1u<<BTDIM;
+
+    // uniform to level 2
+    p.max_levels = 3;
+    auto uni = generate_uniform(p);
+    ASSERT_EQ( uni->levels(), 3u );
+    ASSERT_EQ( uni->blocks(), ntop*(1 + nkids + nkids*nkids) );
+
+    // stops just short of the target
+    p.max_levels = 20;
+    p.target_blocks = 5000;
+    uni = generate_uniform(p);
+    ASSERT_LE( uni->blocks(), 5000u );
+    ASSERT_GT( uni->blocks() + nkids, 5000u );
+
+    // irregular mask
+    p.include_fraction = 0.5;
+    p.seed = 7;
+    std::vector<int> inc = generate_includes(p);
+    ASSERT_EQ( unsigned(std::count(inc.begin(), inc.end(), 1)), (ntop+1)/2 );
+
+    // shell: same seed gives the same tree, and every parent meets the shell
+    const double center[3] = {0.6, 0.4, 0.5};
+    const double radius = 0.3, thickness = 0.02;
+    auto a = generate_shell(p, center, radius, thickness);
+    auto b = generate_shell(p, center, radius, thickness);
+    ASSERT_EQ( a->level_blocks(0), (ntop+1)/2 );
+    ASSERT_LE( a->blocks(), 5000u );
+    ASSERT_GT( a->levels(), 2u );
+    ASSERT_EQ( a->bits_->length(), b->bits_->length() );
+    ASSERT_EQ( BitArray::count_xor(*a->bits_, *b->bits_, 0, a->bits_->length()), 0u );
+    for(IdType id=a->level_id0(0); id<a->id_upper_bound(); ++id) {
+      MortonTree::Block blk = a->locate(id);
+      if(!blk.is_parent) continue;
+      double w = 1.0 / double(3u << blk.level), dmin = 0, dmax = 0;
+      for(unsigned d=0; d<BTDIM; ++d) {
+        double lo = blk.coord[d]*w - center[d], hi = lo + w;
+        double n = lo > 0 ? lo : (hi < 0 ? -hi : 0);
+        double f = std::max(std::fabs(lo), std::fabs(hi));
+        dmin += n*n; dmax += f*f;
+      }
+      ASSERT_LE( std::sqrt(dmin), radius + thickness );
+      ASSERT_GE( std::sqrt(dmax), radius - thickness );
+    }
+
+    // the other patterns
+    p.include_fraction = 1.0;
+    const double normal[3] = {1.0, 2.0, -1.0};
+    auto s = generate_shock(p, normal, 0.4);
+    auto r = generate_bernoulli(p, 0.3);
+    auto c1 = generate_clusters(p, 3, 50, 0.05);
+    auto c2 = generate_clusters(p, 3, 50, 0.05);
+    for(auto t : {s, r, c1}) ASSERT_LE( t->blocks(), 5000u );
+    ASSERT_GT( s->blocks(), ntop );
+    ASSERT_GT( c1->blocks(), ntop );
+    ASSERT_EQ( generate_bernoulli(p, 1.0)->blocks(), generate_uniform(p)->blocks() );
+    ASSERT_EQ( generate_bernoulli(p, 0.0)->blocks(), ntop );
+    ASSERT_EQ( BitArray::count_xor(*c1->bits_, *c2->bits_, 0, c1->bits_->length()), 0u );
+
+    // a single point in a wide grid refines one block per level, even
+    // where the finest coordinates need more than 21 bits
+    GeneratorParams wide;
+    for(unsigned d=0; d<BTDIM; ++d) wide.top[d] = 16;
+    for(std::uint64_t seed : {5u, 6u, 8u, 12u}) {
+      wide.seed = seed;
+      auto one = generate_clusters(wide, 1, 1, 1e-12);
+      ASSERT_EQ( one->levels(), wide.max_levels );
+      for(unsigned lev=1; lev<one->levels(); ++lev) {
+        ASSERT_EQ( one->level_blocks(lev), IdType(nkids) ) << seed << " " << lev;
+      }
+    }
+
+    // generated trees can drive a BittreeAmr
+    BittreeAmr amr(s);
+    ASSERT_EQ( amr.getTree()->blocks(), s->blocks() );
+}
+
+TEST_F(BittreeUnitTest,MixedDimensions){
+    // every dimensionality is available regardless of BTDIM
+    ASSERT_EQ( MortonTree::dim, unsigned(BTDIM) );
+    ASSERT_EQ( MortonTreeT<3>::nkids, 8u );
+
+    const int top[3] = {2,1,1};
+    const int includes[2] = {1,1};
+    auto t2 = std::make_shared<MortonTreeT<2>>(top, includes);
+    auto t3 = std::make_shared<MortonTreeT<3>>(top, includes);
+    ASSERT_EQ( t2->blocks(), 2u );
+    ASSERT_EQ( t3->blocks(), 2u );
+
+    // refine the second top block in both and locate its last child
+    BittreeAmrT<2> a2(t2);
+    BittreeAmrT<3> a3(t3);
+    a2.refine_init(); a2.refine_mark(t2->level_id0(0)+1, true);
+    a2.refine_reduce(MPI_COMM_WORLD); a2.refine_apply();
+    a3.refine_init(); a3.refine_mark(t3->level_id0(0)+1, true);
+    a3.refine_reduce(MPI_COMM_WORLD); a3.refine_apply();
+    t2 = a2.getTree();
+    t3 = a3.getTree();
+    ASSERT_EQ( t2->blocks(), 2u + 4u );
+    ASSERT_EQ( t3->blocks(), 2u + 8u );
+    ASSERT_EQ( a3.stats().dim, 3u );
+
+    MortonTreeT<2>::Block b2 = t2->locate(t2->id_upper_bound()-1);
+    MortonTreeT<3>::Block b3 = t3->locate(t3->id_upper_bound()-1);
+    ASSERT_EQ( b2.level, 1u );
+    ASSERT_EQ( b2.coord[0], 3u );
+    ASSERT_EQ( b2.coord[1], 1u );
+    ASSERT_EQ( b3.coord[2], 1u );
+    ASSERT_EQ( t3->identify(1, b3.coord).id, b3.id );
+
+    // generators follow the requested dimensionality
+    GeneratorParams p;
+    p.max_levels = 2;
+    ASSERT_EQ( generate_uniform<1>(p)->blocks(), 3u );
+    ASSERT_EQ( generate_uniform<3>(p)->blocks(), 9u );
+}
+
+namespace {
+    // TopGridT must reproduce the bisection order of rect_*_to_* exactly
+    template<unsigned D>
+    void check_top_grid(const unsigned domain[D]) {
+        TopGridT<D> grid(domain);
+        unsigned n = 1;
+        for(unsigned d=0; d<D; ++d) n *= domain[d];
+        std::vector<unsigned> xs(D*n);
+        grid.mort_to_coord(0, n, xs.data());
+        std::vector<unsigned> morts(n);
+        grid.coord_to_mort(n, xs.data(), morts.data());
+        for(unsigned mort=0; mort<n; ++mort) {
+            unsigned x[D], y[D];
+            rect_mort_to_coord<D>(domain, mort, x);
+            grid.mort_to_coord(mort, y);
+            for(unsigned d=0; d<D; ++d) {
+                ASSERT_EQ( y[d], x[d] );
+                ASSERT_EQ( xs[D*mort+d], x[d] );
+            }
+            ASSERT_EQ( grid.coord_to_mort(x), mort );
+            ASSERT_EQ( morts[mort], mort );
+        }
+    }
+}
+
+TEST_F(BittreeUnitTest,TopGrid){
+    for(unsigned a=1; a<=40; ++a) {
+        const unsigned d1[1] = {a};
+        check_top_grid<1>(d1);
+    }
+    for(unsigned a=1; a<=13; ++a)
+      for(unsigned b=1; b<=13; ++b) {
+        const unsigned d2[2] = {a,b};
+        check_top_grid<2>(d2);
+      }
+    for(unsigned a=1; a<=7; ++a)
+      for(unsigned b=1; b<=7; ++b)
+        for(unsigned c=1; c<=7; ++c) {
+          const unsigned d3[3] = {a,b,c};
+          check_top_grid<3>(d3);
+        }
+    const unsigned big[3] = {48,5,33};
+    check_top_grid<3>(big);
+    const unsigned pow2[3] = {16,4,8};
+    ASSERT_EQ( TopGridT<3>(pow2).box_count(), 1u );
+}
+
+TEST_F(BittreeUnitTest,LeafIterator){
+    GeneratorParams p;
+    const unsigned top[3] = {3,2,5};
+    for(unsigned d=0; d<BTDIM; ++d) p.top[d] = top[d];
+    p.include_fraction = 0.8;
+    p.target_blocks = 3000;
+    p.seed = 7;
+    auto tree = generate_bernoulli(p, 0.4);
+    const IdType nblocks = tree->blocks();
+
+    // every leaf, in Morton order, as bitid_list and locate see it
+    std::vector<IdType> ids(nblocks);
+    tree->bitid_list(0, nblocks, ids.data());
+    std::vector<MortonTree::Block> expect;
+    for(unsigned mort=0; mort<nblocks; ++mort) {
+      MortonTree::Block b = tree->locate(ids[mort]);
+      ASSERT_EQ( b.mort, mort );
+      if(!b.is_parent) expect.push_back(b);
+    }
+    ASSERT_EQ( expect.size(), size_t(tree->leaves()) );
+
+    size_t n = 0;
+    for(const MortonTree::Block& b : tree->leaf_range()) {
+      ASSERT_LT( n, expect.size() );
+      ASSERT_EQ( b.id, expect[n].id );
+      ASSERT_EQ( b.mort, expect[n].mort );
+      ASSERT_EQ( b.level, expect[n].level );
+      ASSERT_FALSE( b.is_parent );
+      for(unsigned d=0; d<BTDIM; ++d) ASSERT_EQ( b.coord[d], expect[n].coord[d] );
+      n++;
+    }
+    ASSERT_EQ( n, expect.size() );
+
+    // seeking lands on the first leaf at or after any Morton index
+    size_t k = 0;
+    for(unsigned mort=0; mort<nblocks; ++mort) {
+      while(k < expect.size() && expect[k].mort < mort) k++;
+      MortonTree::LeafIterator it = tree->begin_at(mort);
+      if(k == expect.size()) {
+        ASSERT_TRUE( it == MortonTree::LeafIterator() );
+        continue;
+      }
+      ASSERT_EQ( it->id, expect[k].id );
+      for(unsigned d=0; d<BTDIM; ++d) ASSERT_EQ( it->coord[d], expect[k].coord[d] );
+    }
+
+    // ranges stop before their end
+    const IdType m0 = nblocks/3, m1 = 2*nblocks/3;
+    unsigned count = 0;
+    for_each_leaf(tree->leaf_range(m0, m1), [&](const MortonTree::Block& b) {
+      EXPECT_GE( b.mort, m0 );
+      EXPECT_LT( b.mort, m1 );
+      count++;
+    });
+    unsigned count_expect = 0;
+    for(const auto& b : expect) count_expect += (b.mort >= m0 && b.mort < m1) ? 1 : 0;
+    ASSERT_EQ( count, count_expect );
+}
+
+TEST_F(BittreeUnitTest,ParallelLeafTraversal){
+    GeneratorParams p;
+    const unsigned top[3] = {5,4,3};
+    for(unsigned d=0; d<BTDIM; ++d) p.top[d] = top[d];
+    p.seed = 3;
+    p.target_blocks = 50000;
+    auto tree = generate_bernoulli(p, 0.5);
+
+    // each leaf is visited once, with the same record as a serial walk
+    std::vector<MortonTree::Block> serial(tree->id_upper_bound());
+    std::vector<char> seen(tree->id_upper_bound(), 0);
+    for_each_leaf(tree->leaf_range(), [&](const MortonTree::Block& b) { serial[b.id] = b; });
+    std::atomic<unsigned> count(0);
+    const IdType m0 = 17, m1 = tree->blocks() - 17;
+    parallel_for_each_leaf(tree->leaf_range(m0, m1), [&](const MortonTree::Block& b) {
+      seen[b.id] += 1;
+      count.fetch_add(1);
+      EXPECT_EQ( b.mort, serial[b.id].mort );
+      EXPECT_EQ( b.coord[0], serial[b.id].coord[0] );
+    }, 1000u);
+
+    unsigned expect = 0;
+    for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id) {
+      bool in = !tree->block_is_parent(id) && serial[id].mort >= m0 && serial[id].mort < m1;
+      expect += in ? 1 : 0;
+      ASSERT_EQ( int(seen[id]), in ? 1 : 0 );
+    }
+    ASSERT_EQ( count.load(), expect );
+}
+
+TEST_F(BittreeUnitTest,LevelLists){
+    GeneratorParams p;
+    const unsigned top[3] = {7,3,2};
+    for(unsigned d=0; d<BTDIM; ++d) p.top[d] = top[d];
+    p.seed = 11;
+    // big enough for the chunked OpenMP path on the second finest level
+    p.target_blocks = 400000;
+    auto tree = generate_bernoulli(p, 0.6);
+
+    std::vector<IdType> leaves, parents;
+    for(unsigned lev=0; lev<tree->levels(); ++lev) {
+      std::vector<IdType> expect_leaves, expect_parents;
+      for(IdType id=tree->level_id0(lev); id<tree->level_id1(lev); ++id)
+        (tree->block_is_parent(id) ? expect_parents : expect_leaves).push_back(id);
+
+      leaves.assign(tree->level_leaf_count(lev), 0u);
+      parents.assign(tree->level_parent_count(lev), 0u);
+      ASSERT_EQ( leaves.size(), expect_leaves.size() );
+      ASSERT_EQ( parents.size(), expect_parents.size() );
+      ASSERT_EQ( tree->level_leaves(lev, leaves.data()), IdType(leaves.size()) );
+      ASSERT_EQ( tree->level_parents(lev, parents.data()), IdType(parents.size()) );
+      ASSERT_TRUE( leaves == expect_leaves );
+      ASSERT_TRUE( parents == expect_parents );
+    }
+}
+
+namespace {
+    struct BlockKey {
+        unsigned level;
+        unsigned coord[BTDIM];
+    };
+}
+
+TEST_F(BittreeUnitTest,BlockDataRemap){
+    GeneratorParams p;
+    const unsigned top[3] = {3,2,2};
+    for(unsigned d=0; d<BTDIM; ++d) p.top[d] = top[d];
+    p.seed = 5;
+    p.target_blocks = 20000;
+    BittreeAmr bt(generate_bernoulli(p, 0.5));
+    const unsigned nkids = MortonTree::nkids;
+
+    // every block carries its level and coordinates; children derive
+    // theirs from the parent, parents sum the weights of removed children
+    auto key = std::make_shared<BlockData<BlockKey>>();
+    auto weight = std::make_shared<BlockData<unsigned>>(1u);
+    key->on_refine([](const BlockKey& par, BlockKey& kid, unsigned k) {
+        kid.level = par.level + 1;
+        for(unsigned d=0; d<BTDIM; ++d) kid.coord[d] = 2*par.coord[d] + (k>>d & 1u);
+    });
+    weight->on_coarsen([](unsigned& par, const unsigned& kid, unsigned) { par += kid; });
+    bt.register_data(key);
+    bt.register_data(weight);
+    auto tree = bt.getTree();
+    for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id) {
+        MortonTree::Block b = tree->locate(id);
+        (*key)[id].level = b.level;
+        for(unsigned d=0; d<BTDIM; ++d) (*key)[id].coord[d] = b.coord[d];
+    }
+
+    for(unsigned round=0; round<2; ++round) {
+        tree = bt.getTree();
+        std::vector<char> removed(tree->id_upper_bound(), 0);
+        std::vector<unsigned> expect_weight;
+        bt.refine_init();
+        for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id) {
+            if(!tree->block_is_parent(id) || id%5 != round) continue;
+            MortonTree::Block b = tree->locate(id);
+            unsigned kc[BTDIM];
+            for(unsigned d=0; d<BTDIM; ++d) kc[d] = 2*b.coord[d];
+            IdType kid0 = tree->identify(b.level+1, kc).id;
+            bool leaves = true;
+            for(unsigned k=0; k<nkids; ++k) leaves = leaves && !tree->block_is_parent(kid0+k);
+            if(!leaves) continue;
+            bt.refine_mark(id, true);
+            for(unsigned k=0; k<nkids; ++k) removed[kid0+k] = 1;
+        }
+        for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id) {
+            if(!tree->block_is_parent(id) && !removed[id] && id%7 == round)
+                bt.refine_mark(id, true);
+        }
+        bt.refine_reduce(MPI_COMM_WORLD);
+        bt.refine_update();
+        ASSERT_EQ( key->updated().size(), size_t(bt.getTree(true)->id_upper_bound()) );
+        bt.refine_apply();
+
+        tree = bt.getTree();
+        ASSERT_EQ( key->size(), tree->id_upper_bound() );
+        for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id) {
+            MortonTree::Block b = tree->locate(id);
+            ASSERT_EQ( (*key)[id].level, b.level );
+            for(unsigned d=0; d<BTDIM; ++d)
+                ASSERT_EQ( (*key)[id].coord[d], b.coord[d] );
+        }
+    }
+
+    // one derefined parent's weight gained its children's
+    unsigned total = 0;
+    for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id)
+        total += (*weight)[id] > 1u ? 1u : 0u;
+    ASSERT_GT( total, 0u );
+    bt.unregister_data(key);
+    bt.unregister_data(weight);
+}
+
+// Siblings in Hilbert order: identify, locate, bitid_list and the leaf
+// iterator agree, and consecutive leaves of a top-level block share a face
+TEST_F(BittreeUnitTest,HilbertOrder){
+    GeneratorParams p;
+    p.target_blocks = 5000;
+    p.curve = Curve::hilbert;
+    const double center[3] = {0.4, 0.5, 0.55};
+    auto tree = generate_shell(p, center, 0.3, 0.02);
+    p.curve = Curve::morton;
+    auto ztree = generate_shell(p, center, 0.3, 0.02);
+    ASSERT_EQ( tree->curve(), Curve::hilbert );
+    ASSERT_EQ( tree->blocks(), ztree->blocks() );
+    ASSERT_GT( tree->levels(), 3u );
+
+    const IdType nblocks = tree->blocks();
+    std::vector<IdType> ids(nblocks);
+    tree->bitid_list(0, nblocks, ids.data());
+    std::vector<MortonTree::Block> leaves;
+    for(IdType mort=0; mort<nblocks; ++mort) {
+      MortonTree::Block b = tree->locate(ids[mort]);
+      ASSERT_EQ( b.mort, mort );
+      MortonTree::Block c = tree->identify(b.level, b.coord);
+      ASSERT_EQ( c.id, b.id );
+      ASSERT_EQ( c.mort, b.mort );
+      if(!b.is_parent) leaves.push_back(b);
+    }
+
+    size_t n = 0;
+    for(const MortonTree::Block& b : tree->leaf_range()) {
+      ASSERT_LT( n, leaves.size() );
+      ASSERT_EQ( b.id, leaves[n].id );
+      ASSERT_EQ( b.mort, leaves[n].mort );
+      for(unsigned d=0; d<BTDIM; ++d) ASSERT_EQ( b.coord[d], leaves[n].coord[d] );
+      n++;
+    }
+    ASSERT_EQ( n, leaves.size() );
+    const MortonTree::Block& mid = leaves[leaves.size()/2];
+    MortonTree::LeafIterator it = tree->begin_at(mid.mort);
+    ASSERT_EQ( it->id, mid.id );
+    for(unsigned d=0; d<BTDIM; ++d) ASSERT_EQ( it->coord[d], mid.coord[d] );
+
+    // in finest-level units, the boxes of consecutive leaves meet in one
+    // dimension and overlap in the others
+    const unsigned lmax = tree->levels()-1;
+    auto face_neighbors = [lmax](const MortonTree::Block& a, const MortonTree::Block& b) {
+      unsigned touch = 0, overlap = 0;
+      for(unsigned d=0; d<BTDIM; ++d) {
+        unsigned a0 = a.coord[d] << (lmax-a.level), a1 = a0 + (1u << (lmax-a.level));
+        unsigned b0 = b.coord[d] << (lmax-b.level), b1 = b0 + (1u << (lmax-b.level));
+        if(a1 == b0 || b1 == a0) touch++;
+        else if(std::max(a0,b0) < std::min(a1,b1)) overlap++;
+      }
+      return touch == 1u && overlap == BTDIM-1u;
+    };
+    for(size_t i=1; i<leaves.size(); ++i)
+      ASSERT_TRUE( face_neighbors(leaves[i-1], leaves[i]) ) << "leaf " << i;
+#if BTDIM > 1
+    // which Morton order does not manage
+    unsigned jumps = 0;
+    MortonTree::Block prev = *ztree->begin_at(0);
+    for(const MortonTree::Block& b : ztree->leaf_range()) {
+      if(b.mort != prev.mort && !face_neighbors(prev, b)) jumps++;
+      prev = b;
+    }
+    ASSERT_GT( jumps, 0u );
+#endif
+
+    // the curve survives refinement and checkpointing
+    auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+    delta->fill(false);
+    delta->set(mid.id, true);
+    auto refined = tree->refine(delta);
+    ASSERT_EQ( refined->curve(), Curve::hilbert );
+    std::vector<char> image(refined->image_size());
+    refined->write_image(image.data());
+    auto restored = MortonTree::from_image(std::shared_ptr<void>(), image.data(), image.size());
+    ASSERT_EQ( restored->curve(), Curve::hilbert );
+    for(IdType id=refined->level_id0(0); id<refined->id_upper_bound(); ++id) {
+      MortonTree::Block a = refined->locate(id), b = restored->locate(id);
+      ASSERT_EQ( a.mort, b.mort );
+      for(unsigned d=0; d<BTDIM; ++d) ASSERT_EQ( a.coord[d], b.coord[d] );
+      ASSERT_EQ( refined->identify(a.level, a.coord).id, id );
+    }
+}
+
+TEST_F(BittreeUnitTest,HaloGraph){
+    const unsigned ndir = BTDIM==1 ? 3u : BTDIM==2 ? 9u : 27u;
+    for(Curve curve : {Curve::morton, Curve::hilbert}) {
+      auto tree = shell_tree(curve);
+      ASSERT_GT( tree->levels(), 2u );
+      const unsigned lmax = tree->levels()-1;
+      std::vector<MortonTree::Block> leaves;
+      for(const MortonTree::Block& b : tree->leaf_range()) leaves.push_back(b);
+
+      const IdType n = tree->blocks();
+      const std::vector<IdType> part = {0, n/5, n/2, n/2, 3*n/4, n};
+      const int nranks = int(part.size()) - 1;
+      auto owner = [&part](IdType mort) {
+        return int(std::upper_bound(part.begin(), part.end(), mort) - part.begin()) - 1;
+      };
+      typedef std::tuple<IdType,IdType,unsigned,int> Entry;
+      std::vector<std::vector<int>> neighbors(nranks);
+      for(int rank=0; rank<nranks; ++rank) {
+        // every remote leaf overlapping a layer one finest cell thick around
+        // a local leaf, split by face, edge and corner
+        std::vector<std::vector<Entry>> expect(nranks);
+        for(const MortonTree::Block& a : leaves) {
+          if(owner(a.mort) != rank) continue;
+          for(unsigned dir=0; dir<ndir; ++dir) {
+            if(dir == ndir/2) continue;
+            unsigned g0[BTDIM], g1[BTDIM], pow3 = 1;
+            for(unsigned d=0; d<BTDIM; ++d, pow3 *= 3) {
+              const unsigned a0 = a.coord[d] << (lmax-a.level), a1 = a0 + (1u << (lmax-a.level));
+              const unsigned s = dir/pow3 % 3;
+              g0[d] = s == 0 ? a0-1 : s == 1 ? a0 : a1;
+              g1[d] = s == 0 ? a0 : s == 1 ? a1 : a1+1;
+            }
+            for(const MortonTree::Block& b : leaves) {
+              const int o = owner(b.mort);
+              if(o == rank) continue;
+              bool overlap = true;
+              for(unsigned d=0; d<BTDIM; ++d) {
+                unsigned b0 = b.coord[d] << (lmax-b.level), b1 = b0 + (1u << (lmax-b.level));
+                overlap = overlap && std::max(g0[d],b0) < std::min(g1[d],b1);
+              }
+              if(overlap) expect[o].push_back(Entry(a.id, b.id, dir, int(b.level)-int(a.level)));
+            }
+          }
+        }
+
+        HaloGraph g = tree->halo_graph(part, rank);
+        ASSERT_EQ( g.offsets.size(), g.ranks.size()+1 );
+        ASSERT_EQ( g.offsets.front(), 0u );
+        ASSERT_EQ( g.offsets.back(), IdType(g.edges.size()) );
+        std::vector<std::vector<Entry>> got(nranks);
+        for(size_t i=0; i<g.ranks.size(); ++i) {
+          ASSERT_NE( g.ranks[i], rank );
+          if(i > 0) { ASSERT_LT( g.ranks[i-1], g.ranks[i] ); }
+          ASSERT_LT( g.offsets[i], g.offsets[i+1] );
+          neighbors[size_t(rank)].push_back(g.ranks[i]);
+          for(IdType e=g.offsets[i]; e<g.offsets[i+1]; ++e) {
+            const HaloGraph::Edge& x = g.edges[e];
+            unsigned kind = 0, pow3 = 1;
+            for(unsigned d=0; d<BTDIM; ++d, pow3 *= 3) kind += x.dir/pow3 % 3 != 1;
+            ASSERT_EQ( x.kind, kind );
+            if(e > g.offsets[i]) {
+              ASSERT_LE( tree->locate(g.edges[e-1].local).mort, tree->locate(x.local).mort );
+            }
+            got[size_t(g.ranks[i])].push_back(Entry(x.local, x.remote, x.dir, x.rel));
+          }
+        }
+        for(int r=0; r<nranks; ++r) {
+          std::sort(expect[size_t(r)].begin(), expect[size_t(r)].end());
+          std::sort(got[size_t(r)].begin(), got[size_t(r)].end());
+          ASSERT_EQ( got[size_t(r)], expect[size_t(r)] ) << "rank " << rank << " to " << r;
+        }
+      }
+      ASSERT_TRUE( neighbors[2].empty() );
+      for(int a=0; a<nranks; ++a)
+        for(int b : neighbors[size_t(a)])
+          ASSERT_TRUE( std::count(neighbors[size_t(b)].begin(), neighbors[size_t(b)].end(), a) );
+    }
+}
+
+TEST_F(BittreeUnitTest,CoarseFineFaces){
+    auto tree = shell_tree(Curve::hilbert);
+    ASSERT_GT( tree->levels(), 2u );
+    const unsigned nfine = MortonTree::nkids/2;
+    const IdType n = tree->blocks();
+    const IdType m0 = n/3, m1 = 2*n/3;
+
+    // from identify: the finer blocks across each face of a leaf in range,
+    // or across the face of a coarser leaf next to it
+    typedef std::pair<IdType,unsigned> Key;
+    std::map<Key, std::vector<IdType>> expect;
+    auto add = [&](const MortonTree::Block& c, const unsigned* q, unsigned d, unsigned side) {
+      std::vector<IdType> fine;
+      for(unsigned k=0; k<MortonTree::nkids; ++k) {
+        if((k>>d & 1u) == side) continue;
+        unsigned x[BTDIM];
+        for(unsigned e=0; e<BTDIM; ++e) x[e] = 2*q[e] + (k>>e & 1u);
+        fine.push_back(tree->identify(c.level+1, x).id);
+      }
+      expect[Key(c.id, 2*d+side)] = fine;
+    };
+    for(const MortonTree::Block& b : tree->leaf_range(m0, m1)) {
+      for(unsigned d=0; d<BTDIM; ++d)
+        for(unsigned side=0; side<2; ++side) {
+          unsigned x[BTDIM];
+          std::copy(b.coord, b.coord+BTDIM, x);
+          x[d] = side ? x[d]+1 : x[d]-1;
+          if(!tree->inside(b.level, x)) continue;
+          MortonTree::Block nb = tree->identify(b.level, x);
+          if(nb.is_parent) add(b, x, d, side);
+          else if(nb.level < b.level) {
+            unsigned q[BTDIM];
+            for(unsigned e=0; e<BTDIM; ++e) q[e] = b.coord[e] >> (b.level-nb.level);
+            add(nb, q, d, 1-side);
+          }
+        }
+    }
+    ASSERT_FALSE( expect.empty() );
+
+    const MortonTree::CoarseFineFaces cached = tree->coarse_fine_faces(m0, m1);
+    const std::vector<MortonTree::CoarseFineFace>& faces = *cached;
+    ASSERT_EQ( faces.size(), expect.size() );
+    auto it = expect.begin();
+    for(const MortonTree::CoarseFineFace& f : faces) {
+      ASSERT_EQ( Key(f.coarse, f.face), it->first );
+      for(unsigned j=0; j<nfine; ++j) ASSERT_EQ( f.fine[j], it->second[j] );
+      ++it;
+    }
+    // cached with the tree, for the most recent ranges only
+    ASSERT_EQ( tree->coarse_fine_faces(m0, m1), cached );
+    for(IdType m=0; m < 8; ++m)
+      tree->coarse_fine_faces(m, m1);
+    ASSERT_NE( tree->coarse_fine_faces(m0, m1), cached );
+    ASSERT_EQ( tree->coarse_fine_faces(m0, m1)->size(), faces.size() );
+    std::vector<MortonTree::CoarseFineFace> copy(faces.size());
+    ASSERT_EQ( tree->coarse_fine_faces(m0, m1, copy.data()), IdType(faces.size()) );
+    ASSERT_EQ( copy.back().coarse, faces.back().coarse );
+
+    // Fortran interface, after refining the first block of the fixture tree
+    bittree_int id0, count, mmin = 0, mmax;
+    bool updated = false, val = true;
+    bittree_get_id0(&updated, &id0);
+    bittree_refine_init();
+    bittree_refine_mark(&id0, &val);
+    bittree_refine_update();
+    bittree_refine_apply();
+    bittree_block_count(&updated, &mmax);
+    bittree_coarse_fine_face_count(&updated, &mmin, &mmax, &count);
+    ASSERT_EQ( count, BTDIM==1 ? 1 : BTDIM==2 ? 2 : 3 );
+    const size_t nfaces = size_t(count);
+    std::vector<bittree_int> coarse(nfaces), fine(nfine*nfaces);
+    std::vector<int> face(nfaces);
+    bittree_coarse_fine_faces(&updated, &mmin, &mmax, coarse.data(), fine.data(), face.data());
+    void *handle;
+    bittree_get_tree_handle(&updated, &handle);
+    const MortonTree* ftree = static_cast<const MortonTree*>(handle);
+    for(size_t i=0; i<nfaces; ++i) {
+      ASSERT_FALSE( ftree->block_is_parent(IdType(coarse[i])) );
+      ASSERT_EQ( face[i] % 2, 0 );
+      for(unsigned j=0; j<nfine; ++j)
+        ASSERT_EQ( ftree->getParentId(IdType(fine[nfine*i+j])), IdType(id0) );
+    }
+}
+
+TEST_F(BittreeUnitTest,LocatePoints){
+    GeneratorParams p = shell_params();
+    const double* center = shell_center;
+    const double lo[3] = {-1.0, 0.0, 2.0};
+    double hi[3];
+    for(unsigned d=0; d<3; ++d) hi[d] = lo[d] + 1.5*p.top[d];
+    // uniform, clustered near the shell, outside the domain and on its faces
+    const size_t n = 20000;
+    std::vector<double> xyz(BTDIM*n);
+    Lcg rng(12345);
+    for(size_t i=0; i<n; ++i)
+      for(unsigned d=0; d<BTDIM; ++d) {
+        const double w = hi[d] - lo[d];
+        double& x = xyz[BTDIM*i+d];
+        switch(i % 4) {
+          case 0: x = lo[d] + w*rng.uniform(); break;
+          case 1: x = lo[d] + w*(center[d] + 0.01*rng.uniform()); break;
+          case 2: x = lo[d] + w*(2.4*rng.uniform() - 0.7); break;
+          default: x = rng.uniform() < 0.5 ? lo[d] : hi[d];
+        }
+      }
+
+    // a shell on either curve, and a tree refined 22 times around one
+    // point, deeper than the sort keys hold in 3D
+    p.max_levels = 23;
+    auto deep = [&center, &p](unsigned, const double blo[], const double bhi[]) {
+      // generator coordinates are scaled by the longest side, 3
+      for(unsigned d=0; d<BTDIM; ++d) {
+        const double q = center[d]*p.top[d]/3.0;
+        if(q < blo[d] || q >= bhi[d]) return -1.0;
+      }
+      return 1.0;
+    };
+    for(int t=0; t<3; ++t) {
+      p.curve = t == 1 ? Curve::hilbert : Curve::morton;
+      if(t == 2) p.include_fraction = 1.0;
+      auto tree = t < 2 ? shell_tree(p) : generate_tree(p, deep);
+      ASSERT_GT( tree->levels(), t < 2 ? 2u : 22u );
+      const unsigned lmax = tree->levels()-1;
+      if(t == 2)
+        for(size_t i=1; i<n; i+=4)
+          for(unsigned d=0; d<BTDIM; ++d)
+            xyz[BTDIM*i+d] = lo[d] + (hi[d]-lo[d])*(center[d] + 1e-6*rng.uniform());
+      std::vector<IdType> got(n), few(8);
+      tree->locate_points(lo, hi, xyz.data(), n, got.data());
+      tree->locate_points(lo, hi, xyz.data(), few.size(), few.data());
+      ASSERT_TRUE( std::equal(few.begin(), few.end(), got.begin()) );
+      size_t outside = 0;
+      for(size_t i=0; i<n; ++i) {
+        unsigned c[BTDIM];
+        for(unsigned d=0; d<BTDIM; ++d) {
+          const double cells = double(tree->top_size(d) << lmax);
+          const double v = (xyz[BTDIM*i+d] - lo[d]) * (cells / (hi[d] - lo[d]));
+          c[d] = unsigned(std::min(std::max(v, 0.0), cells - 1.0));
+        }
+        if(!tree->inside(lmax, c)) {
+          ASSERT_EQ( got[i], ~IdType(0) );
+          outside++;
+          continue;
+        }
+        MortonTree::Block b = tree->identify(lmax, c);
+        ASSERT_FALSE( b.is_parent );
+        ASSERT_EQ( got[i], b.id ) << "point " << i;
+      }
+      if(t < 2) { ASSERT_GT( outside, 0u ); }
+
+      // a NaN coordinate drops only its own point
+      std::vector<double> nan_xyz(xyz.begin(), xyz.begin() + BTDIM*8);
+      nan_xyz[BTDIM*3 + BTDIM-1] = std::numeric_limits<double>::quiet_NaN();
+      tree->locate_points(lo, hi, nan_xyz.data(), few.size(), few.data());
+      for(size_t i=0; i<few.size(); ++i) {
+        ASSERT_EQ( few[i], i == 3 ? ~IdType(0) : got[i] ) << "point " << i;
+      }
+    }
+    // an empty domain is rejected
+    {
+      auto tree = shell_tree(p);
+      double flat[3] = {hi[0], hi[1], hi[2]};
+      flat[0] = lo[0];
+      IdType id;
+      ASSERT_THROW( tree->locate_points(lo, flat, xyz.data(), 1, &id), std::invalid_argument );
+    }
+
+    // Fortran interface on the fixture tree, which includes every block
+    bool updated = false;
+    bittree_int nf = 4, bitid[4], id0;
+    const double flo[3] = {0.0, 0.0, 0.0}, fhi[3] = {2.0, 3.0, 4.0};
+    const double pts[12] = {0.5, 0.5, 0.5,  1.5, 2.5, 3.5,  -1.0, 9.0, 9.0,  0.0, 0.0, 0.0};
+    std::vector<double> fxyz;
+    for(unsigned i=0; i<4; ++i)
+      for(unsigned d=0; d<BTDIM; ++d) fxyz.push_back(pts[3*i+d]);
+    bittree_locate_points(&updated, flo, fhi, fxyz.data(), &nf, bitid);
+    bittree_get_id0(&updated, &id0);
+    void *handle;
+    bittree_get_tree_handle(&updated, &handle);
+    const MortonTree* ftree = static_cast<const MortonTree*>(handle);
+    for(unsigned i=0; i<4; ++i) {
+      unsigned c[BTDIM];
+      for(unsigned d=0; d<BTDIM; ++d)
+        c[d] = unsigned(std::min(std::max(pts[3*i+d], 0.0), fhi[d]-1.0));
+      ASSERT_EQ( IdType(bitid[i]), ftree->identify(0, c).id );
+    }
+    ASSERT_EQ( bitid[0], id0 );
+}
+
+TEST_F(BittreeUnitTest,QueryBox){
+    Lcg pick(777);
+    for(Curve curve : {Curve::morton, Curve::hilbert}) {
+      auto tree = shell_tree(curve);
+      const unsigned nlev = tree->levels();
+      std::vector<MortonTree::Block> leaves;
+      for(const MortonTree::Block& b : tree->leaf_range()) leaves.push_back(b);
+      for(int q=0; q<60; ++q) {
+        // boxes on levels above, at and below the finest, some past the
+        // domain's upper end and some empty
+        const unsigned lev = pick(nlev+1);
+        unsigned lo[BTDIM], hi[BTDIM];
+        for(unsigned d=0; d<BTDIM; ++d) {
+          const unsigned n = tree->top_size(d) << lev;
+          lo[d] = q % 10 == 1 ? 1 + pick(n-1) : pick(n);
+          hi[d] = q % 10 == 0 ? ~0u : q % 10 == 1 ? lo[d] - 1 : lo[d] + pick(n - lo[d]);
+        }
+        const unsigned fine = std::max(lev, nlev-1);
+        std::vector<IdType> expect;
+        for(const MortonTree::Block& b : leaves) {
+          bool overlap = true;
+          for(unsigned d=0; d<BTDIM; ++d) {
+            const unsigned b0 = b.coord[d] << (fine-b.level), b1 = (b.coord[d]+1) << (fine-b.level);
+            const unsigned x0 = lo[d] << (fine-lev);
+            const unsigned x1 = hi[d] == ~0u ? ~0u : (hi[d]+1) << (fine-lev);
+            overlap = overlap && q % 10 != 1 && std::max(b0,x0) < std::min(b1,x1);
+          }
+          if(overlap) expect.push_back(b.id);
+        }
+        ASSERT_EQ( tree->query_box(lev, lo, hi, nullptr), IdType(expect.size()) ) << "query " << q;
+        std::vector<IdType> got(expect.size());
+        ASSERT_EQ( tree->query_box(lev, lo, hi, got.data()), IdType(expect.size()) );
+        ASSERT_EQ( got, expect ) << "query " << q;
+      }
+    }
+
+    // Fortran interface: the whole fixture domain, and its first block
+    bool updated = false;
+    int lev = 0, lo[BTDIM], hi[BTDIM];
+    bittree_int count, leaves, id0;
+    for(unsigned d=0; d<BTDIM; ++d) { lo[d] = -5; hi[d] = 100; }
+    bittree_query_box_count(&updated, &lev, lo, hi, &count);
+    bittree_leaf_count(&updated, &leaves);
+    ASSERT_EQ( count, leaves );
+    for(unsigned d=0; d<BTDIM; ++d) hi[d] = 0;
+    bittree_query_box_count(&updated, &lev, lo, hi, &count);
+    ASSERT_EQ( count, 1 );
+    bittree_int bitid = -1;
+    bittree_query_box(&updated, &lev, lo, hi, &bitid);
+    bittree_get_id0(&updated, &id0);
+    ASSERT_EQ( bitid, id0 );
+}
+
+// Hashes of equal trees agree and of different ones differ; under mpirun,
+// a refinement on one rank only is caught by verify_consistent.
+TEST_F(BittreeUnitTest,ConsistencyHash){
+    auto tree = shell_tree();
+    ASSERT_EQ( shell_tree()->hash(), tree->hash() );
+    std::vector<char> image(tree->image_size());
+    tree->write_image(image.data());
+    ASSERT_EQ( MortonTree::from_image(std::shared_ptr<void>(), image.data(), image.size())->hash(),
+               tree->hash() );
+    ASSERT_NE( shell_tree(Curve::hilbert)->hash(), tree->hash() );
+    auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+    delta->fill(false);
+    delta->set(tree->leaf_range().begin()->id, true);
+    ASSERT_NE( tree->refine(delta)->hash(), tree->hash() );
+
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, nranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nranks);
+    int top[BTDIM] = {LIST_NDIM(3,3,2)};
+    int includes[CONCAT_NDIM(3,*3,*2)];
+    for(int &inc : includes) inc = 1;
+    BittreeAmr bt = BittreeAmr(top,includes);
+    ASSERT_TRUE( bt.verify_consistent(comm) );
+
+    // marks agree only once reduced
+    const IdType id0 = bt.getTree()->level_id0(0);
+    bt.refine_init();
+    ASSERT_TRUE( bt.verify_consistent(comm) );
+    if(rank == 0) bt.refine_mark(id0, true);
+    ASSERT_EQ( bt.verify_consistent(comm), nranks==1 );
+    bt.refine_reduce(comm);
+    ASSERT_TRUE( bt.verify_consistent(comm) );
+    bt.refine_update();
+    bt.refine_apply();
+    ASSERT_TRUE( bt.verify_consistent(comm) );
+
+    // a refinement skipping refine_reduce diverges
+    bt.refine_init();
+    if(rank == 0) bt.refine_mark(id0+1, true);
+    bt.refine_update();
+    bt.refine_apply();
+    ASSERT_EQ( bt.verify_consistent(comm), nranks==1 );
+    bool consistent;
+    int fcomm = int(MPI_Comm_c2f(comm));
+    bittree_verify_consistent(&fcomm, &consistent);
+    ASSERT_TRUE( consistent );
+    bt.broadcast_from(0, comm);
+    ASSERT_TRUE( bt.verify_consistent(comm) );
+}
+
+TEST_F(BittreeUnitTest,TreeStatsAndMemory){
+    auto tree = shell_tree();
+    TreeStats s = tree->stats();
+    ASSERT_EQ( s.dim, unsigned(BTDIM) );
+    ASSERT_EQ( s.levels.size(), size_t(tree->levels()) );
+    ASSERT_EQ( s.blocks, std::uint64_t(tree->blocks()) );
+    ASSERT_EQ( s.leaves, std::uint64_t(tree->leaves()) );
+    std::vector<std::uint64_t> leaves(tree->levels());
+    for(const MortonTree::Block& b : tree->leaf_range()) leaves[b.level]++;
+    double covered = 0.0;
+    for(unsigned lev=0; lev<tree->levels(); ++lev) {
+      ASSERT_EQ( s.levels[lev].blocks, std::uint64_t(tree->level_blocks(lev)) );
+      ASSERT_EQ( s.levels[lev].leaves, leaves[lev] );
+      ASSERT_EQ( s.levels[lev].parents + s.levels[lev].leaves, s.levels[lev].blocks );
+      covered += s.levels[lev].coverage;
+    }
+    ASSERT_NEAR( covered, 1.0, 1e-12 );
+
+    TreeMemory m = tree->memory_bytes();
+    ASSERT_EQ( m.words, std::uint64_t(tree->bits_->word_alloc()*sizeof(BitArray::WType)) );
+    ASSERT_GT( m.top_grid, 0u );
+    ASSERT_EQ( m.caches, 0u );
+    tree->coarse_fine_faces(0, tree->blocks());
+    ASSERT_GT( tree->memory_bytes().caches, 0u );
+    ASSERT_GT( tree->memory_bytes().total(), m.total() );
+
+    // the updated tree and marks only exist during refinement
+    int top[BTDIM] = {LIST_NDIM(3,3,2)};
+    int includes[CONCAT_NDIM(3,*3,*2)];
+    for(int &inc : includes) inc = 1;
+    BittreeAmr bt = BittreeAmr(top,includes);
+    AmrMemory a = bt.memory_bytes();
+    ASSERT_EQ( a.delta, 0u );
+    ASSERT_EQ( a.updated.total(), 0u );
+    ASSERT_EQ( a.total(), a.tree.total() );
+    bt.refine_init();
+    bt.refine_mark(bt.getTree()->level_id0(0), true);
+    bt.refine_update();
+    a = bt.memory_bytes();
+    ASSERT_GT( a.delta, 0u );
+    ASSERT_GT( a.updated.words, 0u );
+    ASSERT_EQ( a.total(), a.tree.total() + a.updated.total() - a.updated.top_grid + a.delta );
+    bt.refine_apply();
+    ASSERT_EQ( bt.memory_bytes().delta, 0u );
+
+    // Fortran interface, on the fixture tree after one refinement
+    bool updated = false, val = true;
+    bittree_int id0;
+    bittree_get_id0(&updated, &id0);
+    bittree_refine_init();
+    bittree_refine_mark(&id0, &val);
+    bittree_refine_update();
+    double mem[BITTREE_NMEMORY];
+    bittree_memory_bytes(mem);
+    double sum = 0.0;
+    for(unsigned i=0; i<8; ++i) sum += mem[i];
+    ASSERT_EQ( sum, mem[8] );
+    ASSERT_GT( mem[6], 0.0 );
+    ASSERT_GT( mem[7], 0.0 );
+    bittree_refine_apply();
+    int nlev;
+    bittree_level_count(&updated, &nlev);
+    ASSERT_EQ( nlev, 2 );
+    std::vector<double> vals(3*size_t(nlev));
+    bittree_level_stats(&updated, vals.data());
+    const double ntop = CONCAT_NDIM(2,*3,*4);
+    ASSERT_EQ( vals[0], ntop );
+    ASSERT_EQ( vals[1], ntop-1 );
+    ASSERT_EQ( vals[3], double(MortonTree::nkids) );
+    ASSERT_EQ( vals[4], double(MortonTree::nkids) );
+    ASSERT_NEAR( vals[2] + vals[5], 1.0, 1e-12 );
+}
+
+TEST_F(BittreeUnitTest,ExportBlocks){
+    auto tree = shell_tree();
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    const std::string path = "bittree_export_test_" + std::to_string(rank) + ".bin";
+    auto read_file = [](const std::string& name) {
+      std::vector<char> buf;
+      std::FILE* f = std::fopen(name.c_str(), "rb");
+      if(!f) return buf;
+      char tmp[4096];
+      std::size_t m;
+      while((m = std::fread(tmp, 1, sizeof(tmp), f)) > 0) buf.insert(buf.end(), tmp, tmp+m);
+      std::fclose(f);
+      return buf;
+    };
+    // header fields after magic, endian, version, dim, id_bytes, levs,
+    // lev0_blks, curve and parents
+    auto u64 = [](const std::vector<char>& buf, std::size_t off) {
+      std::uint64_t x;
+      std::memcpy(&x, buf.data() + off, sizeof(x));
+      return x;
+    };
+    for(bool parents : {false, true}) {
+      tree->export_blocks(path, parents);
+      std::vector<char> buf = read_file(path);
+      ASSERT_GE( buf.size(), size_t(48) );
+      ASSERT_EQ( std::string(buf.data()), "BTBLOCK" );
+      const std::uint64_t n = u64(buf, 48);
+      ASSERT_EQ( n, std::uint64_t(parents ? tree->blocks() : tree->leaves()) );
+      const std::uint64_t level_off = u64(buf, 56), id_off = u64(buf, 88),
+                          mort_off = u64(buf, 96), parent_off = u64(buf, 104);
+      ASSERT_EQ( u64(buf, 112), std::uint64_t(buf.size()) );
+      ASSERT_EQ( parent_off == 0u, !parents );
+      std::vector<IdType> leaves;
+      for(const MortonTree::Block& b : tree->leaf_range()) leaves.push_back(b.id);
+      std::size_t nleaf = 0u;
+      for(std::uint64_t i=0; i<n; ++i) {
+        IdType id, mort;
+        std::memcpy(&id, buf.data() + id_off + i*sizeof(IdType), sizeof(IdType));
+        std::memcpy(&mort, buf.data() + mort_off + i*sizeof(IdType), sizeof(IdType));
+        MortonTree::Block b = tree->locate(id);
+        ASSERT_EQ( mort, b.mort );
+        if(parents) {
+          ASSERT_EQ( mort, IdType(i) );
+        }
+        ASSERT_EQ( unsigned(std::uint8_t(buf[level_off + i])), b.level );
+        for(unsigned d=0; d<BTDIM; ++d) {
+          std::uint32_t c;
+          std::memcpy(&c, buf.data() + u64(buf, 64 + 8*d) + 4*i, sizeof(c));
+          ASSERT_EQ( c, b.coord[d] );
+        }
+        if(parents) {
+          ASSERT_EQ( bool(buf[parent_off + i]), b.is_parent );
+        }
+        if(!b.is_parent) {
+          ASSERT_EQ( id, leaves[nleaf++] );
+        }
+      }
+      ASSERT_EQ( nleaf, leaves.size() );
+
+      // VTK: sections sized by the block count, big-endian cell data
+      const double lo[3] = {0.0, 0.0, 0.0}, hi[3] = {3.0, 2.0, 2.0};
+      tree->export_vtk(path, lo, hi, parents);
+      buf = read_file(path);
+      const std::string text(buf.begin(), buf.end());
+      ASSERT_EQ( text.compare(0, 26, "# vtk DataFile Version 3.0"), 0 );
+      const std::string cells = "\nCELLS " + std::to_string(n) + " ";
+      ASSERT_NE( text.find(cells), std::string::npos );
+      ASSERT_EQ( text.find("is_parent") != std::string::npos, parents );
+      const std::string key = "SCALARS level unsigned_char 1\nLOOKUP_TABLE default\n";
+      const std::size_t at = text.find(key) + key.size();
+      std::uint64_t i = 0u;
+      if(!parents) {
+        for(const MortonTree::Block& b : tree->leaf_range()) {
+          ASSERT_EQ( unsigned(std::uint8_t(buf[at + i++])), b.level );
+        }
+      }
+      const std::size_t npt = std::size_t(n) << BTDIM;
+      std::size_t expect = text.find("float\n") + 6 + npt*12;
+      expect += cells.size() + std::to_string(npt + n).size() + 1 + npt*4 + n*4;
+      ASSERT_EQ( text.compare(expect, 12, "\nCELL_TYPES "), 0 );
+      ASSERT_EQ( buf.back(), '\n' );
+    }
+
+    // Fortran interface
+    bool updated = false, parents = true;
+    int ierr;
+    bittree_export_blocks(&updated, path.c_str(), &parents, &ierr);
+    ASSERT_EQ( ierr, 0 );
+    const double lo[3] = {0.0, 0.0, 0.0}, hi[3] = {1.0, 1.0, 1.0};
+    bittree_export_vtk(&updated, path.c_str(), lo, hi, &parents, &ierr);
+    ASSERT_EQ( ierr, 0 );
+    bittree_export_blocks(&updated, "no_such_dir/bittree_export.bin", &parents, &ierr);
+    ASSERT_EQ( ierr, 1 );
+    std::remove(path.c_str());
+}
+
+TEST_F(BittreeUnitTest,TreeHistory){
+    int top[BTDIM] = {LIST_NDIM(3,2,2)};
+    int includes[CONCAT_NDIM(3,*2,*2)];
+    for(int &inc : includes) inc = 1;
+    BittreeAmr bt = BittreeAmr(top,includes);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    const std::string path = "bittree_history_test_" + std::to_string(rank) + ".bin";
+    auto history = std::make_shared<TreeHistoryWriter>(path, 4);
+    bt.attach_history(history);
+
+    // refine a few leaves, or all of them, and derefine some parents of
+    // finest-level leaves
+    Lcg pick(7);
+    auto regrid = [&](bool all) {
+      auto tree = bt.getTree();
+      bt.refine_init();
+      const unsigned lmax = tree->levels()-1;
+      for(IdType id=tree->level_id0(0); id<tree->id_upper_bound(); ++id) {
+        const unsigned lev = tree->block_level(id);
+        const bool parent = tree->block_is_parent(id);
+        if(!parent && lev < 4 && (all || pick(25) == 0)) bt.refine_mark(id, true);
+        if(parent && lev+1 == lmax && !all && pick(5) == 0) bt.refine_mark(id, true);
+      }
+      bt.refine_reduce(MPI_COMM_WORLD);
+      bt.refine_apply();
+    };
+    std::vector<std::shared_ptr<MortonTree>> trees;
+    std::vector<std::uint64_t> bytes;
+    for(unsigned s=0; s<12; ++s) {
+      if(s == 1) regrid(true);
+      for(unsigned r=0; r<s%3; ++r) regrid(false);
+      if(s == 9) {
+        // a refinement the history did not see breaks the chain
+        bt.attach_history(nullptr);
+        regrid(false);
+        bt.attach_history(history);
+      }
+      trees.push_back(bt.getTree());
+      bytes.push_back(history->snapshot(*bt.getTree()));
+      ASSERT_EQ( history->pending_bytes(), 0u );
+    }
+    ASSERT_EQ( history->snapshots(), 12u );
+
+    TreeHistoryReader reader(path);
+    ASSERT_EQ( reader.snapshots(), 12u );
+    for(std::uint64_t i=0; i<12; ++i) {
+      // keyframes every 4 snapshots, and after the chain broke
+      ASSERT_EQ( reader.is_keyframe(i), i%4 == 0 || i == 9 ) << i;
+      if(!reader.is_keyframe(i)) {
+        ASSERT_LT( bytes[i], bytes[i - i%4] );
+      }
+      auto tree = reader.tree(i);
+      ASSERT_EQ( tree->hash(), trees[i]->hash() );
+      std::vector<char> img0(tree->image_size()), img1(trees[i]->image_size());
+      tree->write_image(img0.data());
+      trees[i]->write_image(img1.data());
+      ASSERT_TRUE( img0 == img1 );
+    }
+    ASSERT_THROW( reader.tree(12), std::out_of_range );
+
+    // a snapshot cut short ends the history
+    {
+      std::vector<char> buf;
+      std::FILE* f = std::fopen(path.c_str(), "rb");
+      char tmp[4096];
+      std::size_t m;
+      while((m = std::fread(tmp, 1, sizeof(tmp), f)) > 0) buf.insert(buf.end(), tmp, tmp+m);
+      std::fclose(f);
+      f = std::fopen(path.c_str(), "wb");
+      std::fwrite(buf.data(), 1, buf.size() - 8, f);
+      std::fclose(f);
+    }
+    ASSERT_EQ( TreeHistoryReader(path).snapshots(), 11u );
+
+    // Fortran interface, on the fixture tree
+    int ierr, every = 2;
+    double written;
+    bittree_history_open(path.c_str(), &every, &ierr);
+    ASSERT_EQ( ierr, 0 );
+    bittree_history_snapshot(&written, &ierr);
+    ASSERT_EQ( ierr, 0 );
+    ASSERT_GT( written, 0.0 );
+    bool updated = false, val = true;
+    bittree_int id0, blocks;
+    bittree_get_id0(&updated, &id0);
+    bittree_refine_init();
+    bittree_refine_mark(&id0, &val);
+    bittree_refine_update();
+    bittree_refine_apply();
+    bittree_history_snapshot(&written, &ierr);
+    ASSERT_EQ( ierr, 0 );
+    bittree_block_count(&updated, &blocks);
+    bittree_int snap = 1;
+    bittree_history_load(path.c_str(), &snap, &ierr);
+    ASSERT_EQ( ierr, 0 );
+    bittree_int loaded;
+    bittree_block_count(&updated, &loaded);
+    ASSERT_EQ( loaded, blocks );
+    snap = 2;
+    bittree_history_load(path.c_str(), &snap, &ierr);
+    ASSERT_EQ( ierr, 1 );
+    std::remove(path.c_str());
+}
+
+TEST_F(BittreeUnitTest,DistributedTree){
+    int rank, nranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+    typedef MortonTree::Block Block;
+    Lcg pick(11);
+    auto same = [](const Block& a, const Block& b) {
+      if(a.id != b.id || a.mort != b.mort || a.level != b.level || a.is_parent != b.is_parent)
+        return false;
+      for(unsigned d=0; d<BTDIM; ++d)
+        if(a.coord[d] != b.coord[d]) return false;
+      return true;
+    };
+
+    for(Curve curve : {Curve::morton, Curve::hilbert}) {
+      GeneratorParams p;
+      const unsigned top[3] = {3,2,2};
+      for(unsigned d=0; d<BTDIM; ++d) p.top[d] = top[d];
+      p.include_fraction = 0.8;
+      p.max_levels = 6;
+      p.target_blocks = 3000;
+      p.curve = curve;
+      const double center[3] = {0.6, 0.4, 0.5};
+      auto tree = generate_shell(p, center, 0.3, 0.05);
+      const unsigned cut = 2;
+      ASSERT_GT( tree->levels(), cut+1 );
+      DistributedTree dt(*tree, cut, MPI_COMM_WORLD);
+
+      // every block matches the replicated tree, locally when owned and
+      // through the batched queries everywhere
+      auto check = [&](const DistributedTree& d, const MortonTree& t) {
+        ASSERT_EQ( d.levels(), t.levels() );
+        ASSERT_EQ( d.blocks(), t.blocks() );
+        for(unsigned lev=0; lev<=t.levels(); ++lev) {
+          ASSERT_EQ( d.level_id0(lev), lev<t.levels() ? t.level_id0(lev) : t.id_upper_bound() );
+        }
+        std::vector<IdType> ids;
+        std::vector<unsigned> levs, coords;
+        std::vector<Block> want;
+        std::size_t nheld = 0;
+        for(IdType id=t.level_id0(0); id<t.id_upper_bound(); ++id) {
+          const Block b = t.locate(id);
+          Block got;
+          const bool held = d.locate(id, got);
+          if(d.owner(id) == rank) {
+            ASSERT_TRUE( held ) << id;
+          }
+          nheld += held ? 1 : 0;
+          if(held) {
+            ASSERT_TRUE( same(got, b) ) << id;
+          }
+          ids.push_back(id);
+          want.push_back(b);
+          // the block itself, and for leaves a point one level finer
+          levs.push_back(b.level + (b.is_parent ? 0u : 1u));
+          for(unsigned d=0; d<BTDIM; ++d)
+            coords.push_back(b.is_parent ? b.coord[d] : 2u*b.coord[d] + 1u);
+        }
+        std::vector<Block> out(ids.size());
+        d.locate(ids.size(), ids.data(), out.data());
+        for(std::size_t i=0; i<ids.size(); ++i) {
+          ASSERT_TRUE( same(out[i], want[i]) ) << ids[i];
+        }
+        d.identify(ids.size(), levs.data(), coords.data(), out.data());
+        for(std::size_t i=0; i<ids.size(); ++i) {
+          ASSERT_TRUE( same(out[i], want[i]) ) << ids[i];
+        }
+        // with several ranks, some rank did not hold every block
+        int partial = nheld < ids.size() ? 1 : 0;
+        MPI_Allreduce(MPI_IN_PLACE, &partial, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+        ASSERT_EQ( partial, nranks > 1 ? 1 : 0 );
+      };
+      check(dt, *tree);
+      ASSERT_GE( dt.cut_end(), dt.cut_begin() );
+      ASSERT_GT( dt.memory_bytes(), 0u );
+
+      // refine leaves and derefine parents of finest-level leaves below
+      // the cut, leaving the children of those alone; each rank passes a
+      // share of the marks
+      for(unsigned step=0; step<3; ++step) {
+        auto delta = std::make_shared<BitArray>(tree->id_upper_bound());
+        delta->fill(false);
+        std::vector<IdType> marks;
+        const unsigned lmax = tree->levels()-1;
+        for(IdType id=tree->level_id0(cut+1); id<tree->level_id0(lmax); ++id) {
+          if(tree->block_is_parent(id) && tree->block_level(id)+1 == lmax && pick(4) == 0) {
+            delta->set(id, true);
+            marks.push_back(id);
+          }
+        }
+        for(IdType id=tree->level_id0(cut); id<tree->id_upper_bound(); ++id) {
+          const unsigned lev = tree->block_level(id);
+          if(!tree->block_is_parent(id) && lev < 6 && pick(8) == 0 &&
+             !(lev == lmax && delta->get(tree->getParentId(id)))) {
+            delta->set(id, true);
+            marks.push_back(id);
+          }
+        }
+        std::vector<IdType> mine;
+        for(std::size_t i=0; i<marks.size(); ++i)
+          if(i % unsigned(nranks) == unsigned(rank)) mine.push_back(marks[i]);
+        tree = tree->refine(delta);
+        dt.refine(mine);
+        check(dt, *tree);
+      }
+      ASSERT_THROW( dt.refine(std::vector<IdType>(1, tree->level_id0(0))), std::logic_error );
+
+      // from the coarse levels alone, grown a level at a time by refining
+      // the cut blocks and their descendants that are parents in tree
+      DistributedTree grown(*tree->truncated(cut+1), MPI_COMM_WORLD);
+      ASSERT_EQ( grown.levels(), cut+1 );
+      for(unsigned lev=cut; lev+1<tree->levels(); ++lev) {
+        std::vector<IdType> mine;
+        for(IdType id=tree->level_id0(lev); id<tree->level_id1(lev); ++id)
+          if(tree->block_is_parent(id) && id % unsigned(nranks) == unsigned(rank))
+            mine.push_back(id);
+        grown.refine(mine);
+      }
+      check(grown, *tree);
+    }
+}
+
+TEST_F(BittreeUnitTest,Instrumentation){
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int top[BTDIM] = {LIST_NDIM(2,2,2)};
+    int includes[CONCAT_NDIM(2,*2,*2)];
+    for(int &inc : includes) inc = 1;
+    BittreeAmr bt = BittreeAmr(top,includes);
+    const unsigned ntop = CONCAT_NDIM(2,*2,*2);
+
+    // refine every top block, then derefine the first one again
+    auto tree = bt.getTree();
+    bt.refine_init();
+    for(IdType id=tree->level_id0(0); id<tree->level_id1(0); ++id)
+      bt.refine_mark(id, true);
+    bt.refine_reduce(comm);
+    bt.refine_apply();
+    tree = bt.getTree();
+    bt.refine_init();
+    bt.refine_mark(tree->level_id0(0), true);
+    bt.refine_reduce(comm);
+    bt.refine_update();
+    bt.refine_apply();
+    tree = bt.getTree();
+    unsigned x[3] = {0,0,0};
+    tree->identify(1, x);
+    tree->locate(tree->level_id0(0));
+
+    BittreeStats s = bt.stats();
+    std::string json = s.to_json();
+    ASSERT_NE( json.find("\"regrids\""), std::string::npos );
+#ifdef BITTREE_INSTRUMENT
+    ASSERT_EQ( s.init.calls, 2u );
+    ASSERT_EQ( s.reduce.calls, 2u );
+    ASSERT_EQ( s.update.calls, 2u );
+    ASSERT_EQ( s.apply.calls, 2u );
+    ASSERT_GT( s.apply.seconds, 0.0 );
+    ASSERT_GT( s.bytes_reduced, 0u );
+    ASSERT_EQ( s.regrids.size(), 2u );
+    ASSERT_EQ( s.regrids[0].refined, ntop );
+    ASSERT_EQ( s.regrids[0].levels, 2u );
+    ASSERT_EQ( s.regrids[1].derefined, 1u );
+    ASSERT_EQ( s.regrids[1].blocks, tree->blocks() );
+    ASSERT_EQ( s.blocks_refined, ntop );
+    ASSERT_EQ( s.blocks_derefined, 1u );
+    ASSERT_GE( s.identify_calls, 1u );
+    ASSERT_GE( s.locate_calls, 1u );
+#else
+    ASSERT_EQ( s.apply.calls, 0u );
+    ASSERT_TRUE( s.regrids.empty() );
+    (void)ntop;
+#endif
+
+    bt.reset_stats();
+    ASSERT_EQ( bt.stats().regrids.size(), 0u );
+    ASSERT_EQ( bt.stats().identify_calls, 0u );
+
+    double vals[BITTREE_NSTATS];
+    bittree_get_stats(vals);
+    ASSERT_GE( vals[0], 0.0 );
+}
+
 TEST_F(BittreeUnitTest,CppInterface){
     static constexpr unsigned K1D = unsigned(BTDIM>=1);
     static constexpr unsigned K2D = unsigned(BTDIM>=2);
@@ -551,13 +2232,13 @@ TEST_F(BittreeUnitTest,DomainWithHoles){
     // Check bitid_list
     unsigned mmin = 0;
     unsigned mmax = SELECT_NDIM(3,11,39);
-    int bitid_list[mmax-mmin];
+    IdType bitid_list[mmax-mmin];
 #if BTDIM==1
-    int true_list[3] = {2,3,4};
+    IdType true_list[3] = {2,3,4};
 #elif BTDIM==2
-    int true_list[11] = {4,7,8,9,10,5,11,12,13,14,6};
+    IdType true_list[11] = {4,7,8,9,10,5,11,12,13,14,6};
 #else
-    int true_list[39] = {8,15,16,17,18,19,20,21,22,9,23,24,25,26,27,28,29,30,10,11,31,32,33,34,35,36,37,38,12,39,40,41,42,43,44,45,46,13,14};
+    IdType true_list[39] = {8,15,16,17,18,19,20,21,22,9,23,24,25,26,27,28,29,30,10,11,31,32,33,34,35,36,37,38,12,39,40,41,42,43,44,45,46,13,14};
 #endif
     tree->bitid_list(mmin, mmax, bitid_list);
     for( unsigned i=mmin; i<mmax; ++i) {